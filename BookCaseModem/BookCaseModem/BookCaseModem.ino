@@ -7,10 +7,17 @@
     printed to Serial when the module is connected.
 */
 #include <serial_comms.h>
+#include <serial_proto.hpp>
+#include <led_pack.h>
 #include <ESP8266WiFi.h>
 #include <PubSubClient.h>
 #include <FS.h>
 
+/* The modem's half of the protocol: its parser, the on_*() below, and a send<>() only for what it sends */
+using proto = serial_proto::endpoint<serial_proto::role::modem, serial_proto::uart, serial_proto::c_handlers>;
+
+SERIAL_PROTO_C_API(proto)
+
 #define ESP_AS_MODEM
 
 #define NETCFG_FILE_NAME     "/net_config.txt"
@@ -43,6 +50,15 @@
 
 #define MQTT_TOPIC_SUB9       "bookcase/fan_set_pwm"
 
+#define MQTT_TOPIC_SUB10      "bookcase/stats_get"
+#define MQTT_TOPIC_SUB10_STR1 "RESET"
+
+/* Whole LED program, LED_BLOB_MAX bytes at most, one bulk transfer to the Pico */
+#define MQTT_TOPIC_SUB11      "bookcase/ledstrip_set_program"
+
+/* On demand query, "<method>[:<program>] [<token>]", method temp|fans|leds|stats. Answer on MQTT_TOPIC_PUB9 */
+#define MQTT_TOPIC_SUB12      "bookcase/rpc_request"
+
 #define MQTT_TOPIC_PUB1       "bookcase/debug"
 #define MQTT_TOPIC_PUB1_STR1  "RST"
 
@@ -52,6 +68,32 @@
 #define MQTT_TOPIC_PUB3       "bookcase/fan"
 #define MQTT_TOPIC_PUB3_STR0  "SPEED"
 
+/* SEND_TELEMETRY, one retained publish per report: temp=..;rpm=..;pwm=..;auto=..;link=..;age=.. (ms since the readings) */
+#define MQTT_TOPIC_PUB6       "bookcase/telemetry"
+
+/* Also feed bookcase/temp and bookcase/fan from SEND_TELEMETRY, two more publishes */
+#define TELEMETRY_LEGACY_TOPICS 0
+
+/* One message per command: type,count,bytes,queue max,handler max;queue hist;handler hist */
+#define MQTT_TOPIC_PUB4       "bookcase/stats/pico"
+#define MQTT_TOPIC_PUB5       "bookcase/stats/modem"
+
+/* Telemetry age at publish, over the last AGE_SAMPLES reports, us: n=..;p50=..;p99=..;max=..;rtt=..;offset=.. */
+#define MQTT_TOPIC_PUB7       "bookcase/stats/latency"
+#define AGE_SAMPLES           64
+
+/* Modem TX channels, highest priority first: frames,drops,peak depth;.. */
+#define MQTT_TOPIC_PUB8       "bookcase/stats/tx"
+
+/* RPC answer: token=..;method=..;status=..; then the records as on MQTT_TOPIC_PUB6 */
+#define MQTT_TOPIC_PUB9       "bookcase/rpc_reply"
+
+/*
+ * With SERIAL_BUS every Pico on the line has its own topics, the node's
+ * address after the first level: "bookcase/2/fan_set_pwm". Stats about
+ * the modem itself (MQTT_TOPIC_PUB5, MQTT_TOPIC_PUB8) stay as they are.
+ */
+
 #define PUB_QUEUE_DEPTH       4
 #define CHAR_ARRAY_LEN        128
 
@@ -59,6 +101,9 @@
 
 #define LOOP_DELAY            200 /* ms */
 
+/* Longest Serial goes undrained: tx_sleep()'s 1 ms plus a pass through loop() */
+#define RX_POLL_MS            20
+
 #define DEBUG_LEVEL   0
 
 #ifndef ESP_AS_MODEM
@@ -94,7 +139,6 @@ struct mqtt_queue {
 
 IPAddress ip_addr, gw(GW_ADDR), subnet(SUBNET_ADDR);
 char ssid[CHAR_ARRAY_LEN], password[CHAR_ARRAY_LEN];
-char double_rx_buf[CMD_LEN*NUM_ENTRIES];
 
 WiFiClient wifi_client;
 PubSubClient client(wifi_client);
@@ -127,17 +171,173 @@ void toggle_led(uint8_t pin, uint8_t times, uint16_t delta)
   digitalWrite(pin, initial_state);
 }
 
-void modem_reset()
+void on_modem_reset()
 {
   client.disconnect();
   delay(5000);
   ESP.restart();
 }
 
-void put_char(unsigned char ch)
+/* Fastest rate LINK_BAUD may move us to */
+constexpr uint32_t link_baud_max(void)
+{
+  const uint32_t rates[] = { LINK_BAUD_RATES };
+  uint32_t max = 0;
+
+  for (unsigned i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+    if ((LINK_BAUD_LOCAL & (1 << i)) && rates[i] > max) {
+      max = rates[i];
+    }
+  }
+  return max;
+}
+
+/* HardwareSerial RX buffer: RX_POLL_MS worth of 10 bit chars at that rate, 256 fills in ~3 ms at 921600 */
+#define RX_BUF_SIZE           (link_baud_max() / 10 * RX_POLL_MS / 1000)
+
+/* Take all that came in, before HardwareSerial's RX buffer runs over */
+void uart_rx_drain(void)
+{
+  char rx_chunk[64];
+  int n;
+
+  while ((n = Serial.available()) > 0) {
+    n = Serial.read(rx_chunk, min(n, (int)sizeof(rx_chunk)));
+    uart_rx_buf((const uint8_t *)rx_chunk, n);
+  }
+}
+
+/* Frame on its way out, serial_comms keeps it until uart_tx_done() */
+const uint8_t *tx_buf;
+int tx_left;
+
+/* As much of the frame as HardwareSerial takes right now, never waits for room */
+void uart_tx_pump(void)
+{
+  int n;
+
+  if (!tx_left) {
+    return;
+  }
+
+  n = min(tx_left, Serial.availableForWrite());
+  if (n > 0) {
+    Serial.write(tx_buf, n);
+    tx_buf += n;
+    tx_left -= n;
+  }
+
+  if (!tx_left) {
+    uart_tx_done();
+  }
+}
+
+/* The rest goes out from link_wait() and the loop's sleep */
+void uart_tx_start(const uint8_t *buf, int len)
+{
+  tx_buf = buf;
+  tx_left = len;
+  uart_tx_pump();
+}
+
+/* delay() that keeps feeding the TX FIFO and draining RX, frames go to the RX ring */
+void tx_sleep(uint32_t ms)
+{
+  uint32_t start = millis();
+
+  do {
+    uart_rx_drain();
+    uart_tx_pump();
+    delay(1);
+  } while (millis() - start < ms);
+}
+
+uint32_t link_time_ms(void)
+{
+  return millis();
+}
+
+uint32_t serial_time_us(void)
+{
+  return micros();
+}
+
+/* Everything queued goes out at the old rate first */
+void link_set_baud(uint32_t baud)
+{
+  while (!uart_tx_idle()) {
+    uart_tx_pump();
+    yield();
+  }
+  Serial.flush();
+  Serial.updateBaudRate(baud);
+}
+
+/* topic for node, "bookcase/x" -> "bookcase/<node>/x" on the bus. Good until the next call */
+const char *node_topic(const char *topic, uint8_t node)
+{
+#if SERIAL_BUS
+  static char buf[CHAR_ARRAY_LEN];
+  const char *rest = strchr(topic, '/');
+
+  snprintf(buf, sizeof(buf), "%.*s/%u%s", (int)(rest - topic), topic, node, rest);
+  return buf;
+#else
+  return topic;
+#endif
+}
+
+/* Link status every Pico wants, one node at a time on the bus */
+void send_to_all(int (*send)(void))
+{
+#if SERIAL_BUS
+  uint8_t node;
+
+  for (node = 0; node < BUS_NODES; node++) {
+    if (!bus_select(node) && send()) {
+      ERROR("Link status not sent to node %u\n", node);
+    }
+  }
+#else
+  if (send()) {
+    ERROR("Link status not sent\n");
+  }
+#endif
+}
+
+/* Run the LINK_BAUD exchange to the end, loop() is too slow for its timers */
+void negotiate_baud(void)
 {
-  Serial.write(ch);
+  uint32_t start = millis();
+
+  link_baud_negotiate();
+
+  while (link_baud_busy() && millis() - start < 4 * LINK_BAUD_TEST_MS) {
+    uart_rx_drain();
+    uart_tx_pump();
+    link_poll();
+    yield();
+  }
+}
+
+/*
+ * TX held back by the link window, the Pico's credit or the bus turn, or
+ * still going out: keep writing, and reading so its ACK / LINK_CREDIT /
+ * BUS_DONE can get in, or give up. Reads at least once, the bus code calls it in a loop while it waits for the
+ * line. MQTT commands that come in meanwhile wait in the client's TCP buffer.
+ */
+void link_wait(void)
+{
+  uint32_t start = millis();
+
+  do {
+    uart_rx_drain();
+    uart_tx_pump();
+    link_poll();
+    yield();
+  } while ((uart_tx_held() || !uart_tx_idle()) && millis() - start < 2 * LINK_RTO_MS);
 }
+
 void publish_msg(bool all)
 {
   bool ret;
@@ -169,7 +369,7 @@ int queue_publish(const char *topic, const uint8_t *payload, unsigned int len, b
     return -1;
   }
 
-  strcpy(mqtt_queue[pub_pidx].topic,topic);
+  strcpy(mqtt_queue[pub_pidx].topic, node_topic(topic, bus_node));
   strncpy(mqtt_queue[pub_pidx].str, (const char *)payload, len);
   mqtt_queue[pub_pidx].len = len;
   mqtt_queue[pub_pidx].retained = retained;
@@ -179,8 +379,87 @@ int queue_publish(const char *topic, const uint8_t *payload, unsigned int len, b
   return 0;
 }
 
+/* The Pico's channel stayed full for TX_WAIT_MS: the MQTT command is lost, say so */
+void check_sent(int ret, const char *topic)
+{
+  if (ret) {
+    ERROR("Not sent to the Pico: %s\n", topic);
+  }
+}
+
+/* These MQTT payloads are already in wire layout, send them as they are */
+#define SEND_PAYLOAD_AS(id) \
+  { \
+    using type = serial_proto::msg<id>::type; \
+    if (length < sizeof(type)) { \
+      ERROR("Short payload on %s: %d\n", topic, length); \
+      return; \
+    } \
+    check_sent(proto::send<id>(*(const type *)payload), topic); \
+  }
+
+struct led_pack_ctx led_pack;
+
+/* Steps come in whole over MQTT, pass them on packed when that's shorter. -1 if it didn't go */
+int send_led_step(const byte *payload, unsigned int length)
+{
+  const struct msg_led_color *step = (const struct msg_led_color *)payload;
+  struct msg_led_step_packed packed;
+  struct msg_led_palette pal;
+  uint32_t leds[NUM_LEDS_IN_STRIP];
+  int i, len;
+
+  if (length < sizeof(*step)) {
+    ERROR("Short LED step: %d\n", length);
+    return 0;
+  }
+
+  /* New program, new palette */
+  if (!step->step) {
+    led_pack_reset(&led_pack);
+  }
+
+  for (i = 0; i < NUM_LEDS_IN_STRIP; i++) {
+    leds[i] = LED_RGB(step->rgb[i][0], step->rgb[i][1], step->rgb[i][2]);
+  }
+
+  len = led_pack_palette(&led_pack, leds, &pal);
+  if (len && proto::send<SET_LED_PALETTE>(pal, len)) {
+    /* The Pico didn't get these colours, start over on the next step */
+    led_pack_reset(&led_pack);
+    return -1;
+  }
+
+  len = led_pack_step(&led_pack, step->step, leds, &packed);
+  if (len < 0 || len >= (int)sizeof(*step)) {
+    return proto::send<SET_LED_COLOR>(*step);
+  }
+
+  memcpy(packed.time, step->time, sizeof(packed.time));
+  return proto::send<SET_LED_STEP_PACKED>(packed, len);
+}
+
 void callback(char *topic, byte *payload, unsigned int length) {
+  struct msg_fan_power_state fan_state;
   int ret;
+#if SERIAL_BUS
+  char local[CHAR_ARRAY_LEN];
+  char *first, *rest = NULL;
+  unsigned long node = BUS_NODES;
+
+  /* "bookcase/<node>/x": talk to that node, then handle it as "bookcase/x" */
+  if ((first = strchr(topic, '/'))) {
+    node = strtoul(first + 1, &rest, 10);
+  }
+
+  if (!rest || *rest != '/' || node >= BUS_NODES || bus_select(node)) {
+    ERROR("No bus node in topic %s\n", topic);
+    return;
+  }
+
+  snprintf(local, sizeof(local), "%.*s%s", (int)(first - topic), topic, rest);
+  topic = local;
+#endif
 
   SERIAL_PRINTLN("Got message:");
   if (!strcmp(topic, MQTT_TOPIC_SUB1))
@@ -195,37 +474,37 @@ void callback(char *topic, byte *payload, unsigned int length) {
 
   if (!strcmp(topic, MQTT_TOPIC_SUB2))
   {
-    send_led_color(payload, length);
+    check_sent(send_led_step(payload, length), topic);
     return;
   } 
 
   if (!strcmp(topic, MQTT_TOPIC_SUB3))
   {
-    send_led_program_steps(payload[0]);
+    SEND_PAYLOAD_AS(SET_LED_PROGRAM_STEPS);
     return;
   }
 
   if (!strcmp(topic, MQTT_TOPIC_SUB4))
   {
-    send_led_program_switch();
+    check_sent(proto::send<SWITCH_PROGRAMS>(), topic);
     return;
   }
 
   if (!strcmp(topic, MQTT_TOPIC_SUB5))
   {
-    send_set_color(payload[0], payload[1], payload[2]);
+    SEND_PAYLOAD_AS(SET_COLOR_INTENSITY);
     return;
   }
 
   if (!strcmp(topic, MQTT_TOPIC_SUB6))
   {
-    send_resume_animation();
+    check_sent(proto::send<RESUME_ANIMATION>(), topic);
     return;
   }
 
   if (!strcmp(topic, MQTT_TOPIC_SUB7))
   {
-    send_light_drawer(payload[0], payload[1], payload[2], payload[3]);
+    SEND_PAYLOAD_AS(SET_DRAWER_LIGHT);
     return;
   }
  
@@ -233,20 +512,53 @@ void callback(char *topic, byte *payload, unsigned int length) {
   {
     if (!strncmp((char*)payload, MQTT_TOPIC_SUB8_STR1, strlen(MQTT_TOPIC_SUB8_STR1)))
     {
-      send_fan_state(true);
+      fan_state.state = 1;
+      check_sent(proto::send<SET_FAN_POWER_STATE>(fan_state), topic);
       return;
     }
 
     if (!strncmp((const char*)payload, MQTT_TOPIC_SUB8_STR2, strlen(MQTT_TOPIC_SUB8_STR2)))
     {
-      send_fan_state(false);
+      fan_state.state = 0;
+      check_sent(proto::send<SET_FAN_POWER_STATE>(fan_state), topic);
     }
     return;
   }
 
   if (!strcmp(topic, MQTT_TOPIC_SUB9))
   {
-    send_fan_pwm(payload[0], payload[1]);
+    SEND_PAYLOAD_AS(SET_FAN_PWM_PERC);
+    return;
+  }
+
+  if (!strcmp(topic, MQTT_TOPIC_SUB10))
+  {
+    struct msg_get_stats get_stats;
+
+    get_stats.flags = 0;
+    if (length == strlen(MQTT_TOPIC_SUB10_STR1) && !strncmp((char *)payload, MQTT_TOPIC_SUB10_STR1, length)) {
+      get_stats.flags = GET_STATS_RESET;
+    }
+
+    publish_modem_stats(get_stats.flags & GET_STATS_RESET);
+    publish_latency(get_stats.flags & GET_STATS_RESET);
+    publish_tx_channels(get_stats.flags & GET_STATS_RESET);
+    check_sent(proto::send<GET_STATS>(get_stats), topic);
+    return;
+  }
+
+  if (!strcmp(topic, MQTT_TOPIC_SUB11))
+  {
+    if (bulk_send(BULK_LED_PROGRAM, payload, length))
+    {
+      ERROR("LED program upload failed, status %d\n", bulk_tx_status);
+    }
+    return;
+  }
+
+  if (!strcmp(topic, MQTT_TOPIC_SUB12))
+  {
+    rpc_request((const char *)payload, length);
     return;
   }
 
@@ -284,7 +596,7 @@ void connect_to_wifi()
 
   if (WiFi.status() != WL_CONNECTED) {
     SERIAL_PRINTLN("Failed to connect to network, resetting");
-    send_wifi_status(false);
+    send_to_all(proto::send<WIFI_DISCONNECTED>);
     delay(500);
     ESP.restart();
   }
@@ -293,16 +605,24 @@ void connect_to_wifi()
 
   SERIAL_PRINT("**** IP = "); SERIAL_PRINT(ip_addr.toString().c_str()); SERIAL_PRINT(" ***\n");
 
-  send_wifi_status(true);
+  send_to_all(proto::send<WIFI_CONNECTED>);
+
+  /* Link is quiet now, good time to speed it up. Not on the bus, every node would have to follow */
+#if !SERIAL_BUS
+  negotiate_baud();
+#endif
 }
 
 void connect_to_mqtt()
 {
   IPAddress mqtt_broker(MQTT_SERVER);
   int tries = 0;
+  uint8_t node;
 
   client.setServer(mqtt_broker, MQTT_PORT);
   client.setCallback(callback);
+  /* Room for a whole program on MQTT_TOPIC_SUB11 */
+  client.setBufferSize(LED_BLOB_MAX + 64);
 
   while (!client.connected()) {
     SERIAL_PRINTLN("Connecting to mqtt broker.....");
@@ -325,19 +645,24 @@ void connect_to_mqtt()
     }
   }
 
-  client.subscribe(MQTT_TOPIC_SUB1);
-  client.subscribe(MQTT_TOPIC_SUB2);
-  client.subscribe(MQTT_TOPIC_SUB3);
-  client.subscribe(MQTT_TOPIC_SUB4);
-  client.subscribe(MQTT_TOPIC_SUB5);
-  client.subscribe(MQTT_TOPIC_SUB6);
-  client.subscribe(MQTT_TOPIC_SUB7);
-  client.subscribe(MQTT_TOPIC_SUB8);
-  client.subscribe(MQTT_TOPIC_SUB9);
+  for (node = 0; node < (SERIAL_BUS ? BUS_NODES : 1); node++) {
+    client.subscribe(node_topic(MQTT_TOPIC_SUB1, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB2, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB3, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB4, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB5, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB6, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB7, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB8, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB9, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB10, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB11, node));
+    client.subscribe(node_topic(MQTT_TOPIC_SUB12, node));
+  }
 
   queue_publish(MQTT_TOPIC_PUB1, (const uint8_t*)MQTT_TOPIC_PUB1_STR1, strlen(MQTT_TOPIC_PUB1_STR1), true);
 
-  send_mqtt_status(true);
+  send_to_all(proto::send<MQTT_CONNECTED>);
 }
 
 void assign_ip_addr()
@@ -353,8 +678,21 @@ void setup() {
        c, pos = 0, line = 0;
   File config_file;
 
+  /* Sized for the fastest rate, the buffer stays when LINK_BAUD switches */
+  Serial.setRxBufferSize(RX_BUF_SIZE);
   Serial.begin(115200, SERIAL_8N1);
 
+  /* Let the Pico know which frame checks we take, it answers with its own */
+#if SERIAL_BUS
+  bus_init(BUS_MASTER);
+  for (c = 0; c < BUS_NODES; c++) {
+    bus_select(c);
+    send_link_caps(true);
+  }
+#else
+  send_link_caps(true);
+#endif
+
   SPIFFS.begin();
 
   randomSeed(millis());
@@ -408,7 +746,7 @@ void loop() {
   }
 
   if (!client.connected()) {
-      send_mqtt_status(false);
+      send_to_all(proto::send<MQTT_DISCONNECTED>);
       connect_to_mqtt();
   }
 
@@ -418,46 +756,340 @@ void loop() {
   /* We send everything: when a button is pressed => 2 publish cmds */
   publish_msg(true);
 
-  while (Serial.available()) {
-        char x = Serial.read();
-        uart_rx(x);
-  }
+  uart_rx_drain();
 
-  if (serial_buf_pidx != serial_buf_cidx)
-  {
-    process_message(&double_rx_buf[CMD_LEN * serial_buf_cidx]);
-    serial_buf_cidx = (serial_buf_cidx + 1) % NUM_ENTRIES;
-  }
+  link_poll();
+  rpc_poll();
+
+  /* Turns for the nodes that have something for us */
+  bus_service();
+
+  /* Only every LOOP_DELAY, so take all that came in */
+  while (serial_process_next());
+
+  /* LOG() records from the RX path, as SEND_LOG_TOKENS */
+  log_flush();
 
 sleep:
-  delay(LOOP_DELAY);
+  tx_sleep(LOOP_DELAY);
 }
 
-void publish_mqtt_fan_pwm(uint8_t len, uint8_t *cmd)
+void on_tacho(const struct msg_tacho *m)
 {
-  char payload[64] = {0}, tmp[4];
+  char payload[64] = {0}, tmp[8];
   int i;
  
-  for (i = 0; i < len; i+=2)
+  for (i = 0; i < NUM_FANS; i++)
   {
-    sprintf(tmp,"%d,", (cmd[i] << 8) | cmd[i + 1]);
+    sprintf(tmp,"%d,", GET_BE16(m->rpm[i]));
     strcat(payload, tmp);
   }
   payload[strlen(payload) - 1] = 0;
   queue_publish(MQTT_TOPIC_PUB3, (const uint8_t *)payload, strlen(payload), true);
 }
 
-void publish_mqtt_temp(uint8_t len, uint8_t *cmd)
+void on_temperature(const struct msg_temperature *m)
 {
-  char payload[64] = {0}, tmp[4];
+  char payload[64] = {0}, tmp[8];
   int i;
 
-  for (i = 0; i < len; i+=2)
+  for (i = 0; i < NUM_TEMP_SENSORS; i++)
   {
-    sprintf(tmp,"%d,", (cmd[i] << 8) | cmd[i + 1]);
+    sprintf(tmp,"%d,", (int16_t)GET_BE16(m->temp[i]));
     strcat(payload, tmp);
   }
 
   payload[strlen(payload) - 1] = 0;
   queue_publish(MQTT_TOPIC_PUB2, (const uint8_t *)payload, strlen(payload), true);
 }
+
+/* Histogram up to its last used bucket, space separated */
+int format_hist(char *out, int len, const uint8_t hist[][2])
+{
+  int i, last = 0, n = 0;
+
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    if (GET_BE16(hist[i])) {
+      last = i;
+    }
+  }
+
+  for (i = 0; i <= last && n < len; i++) {
+    n += snprintf(out + n, len - n, i ? " %u" : "%u", GET_BE16(hist[i]));
+  }
+
+  return n < len ? n : len;
+}
+
+/* Straight out, these don't fit the publish queue */
+void publish_stats(const char *topic, const struct msg_stats *m)
+{
+  char payload[256];
+  int n, len = sizeof(payload);
+
+  n = snprintf(payload, len, "0x%02x,%lu,%lu,%lu,%lu;", m->cmd_type,
+               (unsigned long)GET_BE32(m->count), (unsigned long)GET_BE32(m->bytes),
+               (unsigned long)GET_BE32(m->queue_max), (unsigned long)GET_BE32(m->handler_max));
+  n += format_hist(payload + n, len - n, m->queue_hist);
+  if (n < len - 1) {
+    payload[n++] = ';';
+    n += format_hist(payload + n, len - n, m->handler_hist);
+  }
+  payload[min(n, len - 1)] = 0;
+
+  client.publish(topic, payload);
+}
+
+/* Our own side of the link: frames from the Pico */
+void publish_modem_stats(bool reset)
+{
+  struct msg_stats m;
+  int i;
+
+  for (i = 0; i < MSG_COUNT; i++) {
+    if (serial_stats_fill(i, &m)) {
+      publish_stats(MQTT_TOPIC_PUB5, &m);
+    }
+  }
+
+  if (reset) {
+    serial_stats_reset();
+  }
+}
+
+void on_stats(const struct msg_stats *m)
+{
+  publish_stats(node_topic(MQTT_TOPIC_PUB4, bus_node), m);
+}
+
+/* key=v,v,..; of count BE16 values */
+int format_be16_list(char *out, int len, const char *key, const uint8_t *p, int count, bool is_signed)
+{
+  int i, n;
+
+  n = snprintf(out, len, "%s=", key);
+  for (i = 0; i < count && n < len; i++) {
+    n += snprintf(out + n, len - n, i ? ",%d" : "%d",
+                  is_signed ? (int16_t)GET_BE16(p + 2 * i) : GET_BE16(p + 2 * i));
+  }
+  if (n < len) {
+    n += snprintf(out + n, len - n, ";");
+  }
+
+  return min(n, len - 1);
+}
+
+/* Sensor to publish, us, only once LINK_TIME has the Pico's clock */
+uint32_t telem_age[AGE_SAMPLES];
+uint32_t telem_ages, telem_age_max;
+
+void publish_latency(bool reset)
+{
+  uint32_t sorted[AGE_SAMPLES], v;
+  char payload[128];
+  int n = min(telem_ages, (uint32_t)AGE_SAMPLES), i, j;
+
+  for (i = 0; i < n; i++) {
+    v = telem_age[i];
+    for (j = i; j > 0 && sorted[j - 1] > v; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = v;
+  }
+
+  snprintf(payload, sizeof(payload), "n=%d;p50=%lu;p99=%lu;max=%lu;rtt=%lu;offset=%ld", n,
+           (unsigned long)(n ? sorted[(n - 1) * 50 / 100] : 0), (unsigned long)(n ? sorted[(n - 1) * 99 / 100] : 0),
+           (unsigned long)telem_age_max, (unsigned long)link_clock.rtt_us, (long)link_clock.offset_us);
+  client.publish(node_topic(MQTT_TOPIC_PUB7, bus_node), payload);
+
+  if (reset) {
+    telem_ages = telem_age_max = 0;
+  }
+}
+
+void publish_tx_channels(bool reset)
+{
+  char payload[128];
+  int i, n = 0;
+
+  for (i = 0; i < TX_CHANNELS && n < (int)sizeof(payload); i++) {
+    n += snprintf(payload + n, sizeof(payload) - n, "%lu,%lu,%u;", (unsigned long)tx_chan_stats[i].frames,
+                  (unsigned long)tx_chan_stats[i].drops, tx_chan_stats[i].peak);
+  }
+  client.publish(MQTT_TOPIC_PUB8, payload);
+
+  if (reset) {
+    for (i = 0; i < TX_CHANNELS; i++) {
+      tx_chan_stats[i].frames = tx_chan_stats[i].drops = 0;
+      tx_chan_stats[i].peak = tx_chan_stats[i].depth;
+    }
+  }
+}
+
+/* Telemetry records as key=..; pairs, for MQTT_TOPIC_PUB6 and RPC answers alike */
+int format_telemetry(char *payload, int plen, const uint8_t *rec, int len)
+{
+  const uint8_t *r;
+  const struct telem_fan_pwm *pwm;
+  const struct telem_link *link;
+  const struct telem_led *led;
+  uint32_t age;
+  int pos = 0, n = 0, size, i;
+  uint8_t type;
+
+  payload[0] = 0;
+  while ((r = telem_next(rec, len, &pos, &type, &size))) {
+    switch (type) {
+      case TELEM_TEMP:
+        n += format_be16_list(payload + n, plen - n, "temp", r, size / 2, true);
+        break;
+
+      case TELEM_RPM:
+        n += format_be16_list(payload + n, plen - n, "rpm", r, size / 2, false);
+        break;
+
+      case TELEM_FAN_PWM:
+        if (size < sizeof(*pwm)) {
+          break;
+        }
+        pwm = (const struct telem_fan_pwm *)r;
+        n += snprintf(payload + n, plen - n, "pwm=");
+        for (i = 0; i < NUM_FANS && n < plen; i++) {
+          n += snprintf(payload + n, plen - n, i ? ",%d" : "%d", pwm->pwm[i]);
+        }
+        if (n < plen) {
+          n += snprintf(payload + n, plen - n, ";auto=%d;", pwm->auto_mask);
+        }
+        break;
+
+      case TELEM_LINK:
+        if (size < sizeof(*link)) {
+          break;
+        }
+        link = (const struct telem_link *)r;
+        n += snprintf(payload + n, plen - n, "link=%lu,%lu,%lu,%lu,%lu;",
+                      (unsigned long)GET_BE32(link->rx_frames), (unsigned long)GET_BE32(link->rx_bad),
+                      (unsigned long)GET_BE32(link->rx_ring_full), (unsigned long)GET_BE32(link->tx_drops),
+                      (unsigned long)GET_BE32(link->retransmits));
+        break;
+
+      case TELEM_TIME:
+        if (size < sizeof(struct telem_time) || !link_clock.samples) {
+          break;
+        }
+        /* Published right after, so this is the age Node-RED gets it at */
+        age = serial_time_us() - link_peer_to_local_us(GET_BE32(((const struct telem_time *)r)->sampled_us));
+        telem_age[telem_ages++ % AGE_SAMPLES] = age;
+        telem_age_max = max(telem_age_max, age);
+        n += snprintf(payload + n, plen - n, "age=%lu;", (unsigned long)(age / 1000));
+        break;
+
+      case TELEM_LED:
+        if (size < sizeof(*led)) {
+          break;
+        }
+        led = (const struct telem_led *)r;
+        n += snprintf(payload + n, plen - n, "led=%d,%d,%d,%d;", led->displaying, led->program,
+                      led->step, led->num_steps);
+        break;
+
+      default:
+        /* Newer Pico, record we don't know yet */
+        break;
+    }
+
+    if (n >= plen) {
+      return plen - 1;
+    }
+  }
+
+  return n;
+}
+
+void on_telemetry(const struct msg_telemetry *m, int len)
+{
+  char payload[256];
+  int n;
+#if TELEMETRY_LEGACY_TOPICS
+  const uint8_t *r;
+  int pos = 0, size;
+  uint8_t type;
+
+  while ((r = telem_next(m->rec, len, &pos, &type, &size))) {
+    if (type == TELEM_TEMP && size >= sizeof(struct msg_temperature)) {
+      on_temperature((const struct msg_temperature *)r);
+    } else if (type == TELEM_RPM && size >= sizeof(struct msg_tacho)) {
+      on_tacho((const struct msg_tacho *)r);
+    }
+  }
+#endif
+
+  n = format_telemetry(payload, sizeof(payload), m->rec, len);
+  if (n) {
+    payload[n - 1] = 0;
+    client.publish(node_topic(MQTT_TOPIC_PUB6, bus_node), payload, true);
+  }
+}
+
+/* MQTT_TOPIC_SUB12 method names, by enum rpc_method */
+const char *const rpc_methods[] = { "", "temp", "fans", "leds", "stats" };
+
+void rpc_request(const char *payload, unsigned int length)
+{
+  char req[32], *arg, *token;
+  uint8_t method, prg = 0;
+  uint32_t cookie = 0;
+  int ret;
+
+  length = min(length, (unsigned int)sizeof(req) - 1);
+  memcpy(req, payload, length);
+  req[length] = 0;
+
+  if ((token = strchr(req, ' '))) {
+    *token++ = 0;
+    cookie = strtoul(token, NULL, 0);
+  }
+
+#if SERIAL_BUS
+  /* The reply may come in, or time out, with another node selected */
+  cookie = (cookie & 0xFFFFFF) | (uint32_t)bus_node << 24;
+#endif
+
+  if ((arg = strchr(req, ':'))) {
+    *arg++ = 0;
+    prg = atoi(arg);
+  }
+
+  for (method = 1; method < sizeof(rpc_methods) / sizeof(rpc_methods[0]); method++) {
+    if (!strcmp(req, rpc_methods[method])) {
+      break;
+    }
+  }
+
+  ret = rpc_call(method, &prg, arg ? 1 : 0, cookie);
+  if (ret != RPC_OK) {
+    /* Never went out, answer right away so the asker isn't left waiting */
+    rpc_done(method, ret, cookie, NULL, 0);
+  }
+}
+
+/* Every call ends here, answered, timed out or never sent */
+void rpc_done(uint8_t method, uint8_t status, uint32_t cookie, const uint8_t *rec, int len)
+{
+  char payload[256];
+  uint8_t node = bus_node;
+  int n;
+
+#if SERIAL_BUS
+  node = cookie >> 24;
+  cookie &= 0xFFFFFF;
+#endif
+
+  n = snprintf(payload, sizeof(payload), "token=%lu;method=%s;status=%d;", (unsigned long)cookie,
+               method < sizeof(rpc_methods) / sizeof(rpc_methods[0]) ? rpc_methods[method] : "?", status);
+  if (rec) {
+    n += format_telemetry(payload + n, sizeof(payload) - n, rec, len);
+  }
+  payload[n - 1] = 0;
+  client.publish(node_topic(MQTT_TOPIC_PUB9, node), payload);
+}
@@ -0,0 +1,1389 @@
+/*
+ * Host benchmark for serial_comms.c and serial_proto.hpp
+ *
+ * g++ -std=c++17 -O2 -c comms_host.cpp
+ * gcc -O2 -o comms_bench comms_bench.c serial_comms.c serial_link.c serial_stats.c serial_log.c serial_bulk.c serial_rpc.c serial_bus.c led_pack.c led_store.c comms_host.o
+ * ./comms_bench [results.csv]
+ *
+ * Besides the table on stdout every number goes to results.csv (default
+ * comms_bench.csv) as group,name,metric,value,unit rows, so runs from
+ * different commits can be diffed or joined.
+ */
+#include "macro_helpers.h"
+#include "serial_comms.h"
+#include "led_pack.h"
+#include "led_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BENCH_FRAMES		4096
+#define BENCH_PAYLOAD		(3 + NUM_LEDS_IN_STRIP * 3)	/* SET_LED_COLOR */
+#define BENCH_ROUNDS		20
+#define BENCH_CHUNK		256	/* what a DMA drain typically hands over */
+#define BENCH_BAUD		115200
+#define BENCH_MSG_FRAMES	2048	/* per command type */
+#define BENCH_DISPATCH		200000
+#define BENCH_VAR_MAX		(CMD_LEN - 4 - 2)	/* header, CRC */
+#define BENCH_LOGS		(LOG_RING_SIZE * 4096)
+#define BENCH_NOISE_HITS	64	/* corrupted bytes per noise run, one per frame at most */
+#define BENCH_BUS_MS		60000	/* simulated time per bus run */
+#define BENCH_BUS_LOOP_MS	200	/* the modem's LOOP_DELAY */
+#define BENCH_BUS_TURN_US	100	/* line handed over: RX path to the first byte back */
+#define BENCH_BUS_TELEM_MS	1000	/* SEND_TELEMETRY per node */
+#define BENCH_BUS_CMDS		5	/* MQTT commands per second, all nodes */
+#define BENCH_BUS_MAX		16
+#define BENCH_USB_BPS		1000000	/* full speed CDC, bytes/s a Linux host gets in practice */
+#define BENCH_STEPS		(2 * NUM_LEDS_IN_STRIP)	/* what node-red's programs have */
+#define BENCH_FIXED_STEP	(4 + 4 * NUM_LEDS_IN_STRIP)	/* time + uint32_t per LED, before led_store.c */
+#define BENCH_FIXED_RAM		(NUM_LED_PROGRAMS * (4 + BENCH_FIXED_STEP * BENCH_STEPS))
+
+#ifndef MIN
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#endif
+
+#ifndef MAX
+#define MAX(a, b)	((a) > (b) ? (a) : (b))
+#endif
+
+/* Wire image of BENCH_FRAMES frames */
+uint8_t stream[BENCH_FRAMES * (CMD_LEN + 4) * 2];
+int stream_len;
+
+/* Results the compiler must not optimise away */
+volatile uint32_t bench_sink;
+
+extern uint8_t rx_seq, tx_seq;
+extern bool credit_valid;
+
+/* Handlers that answer (BULK_OPEN) keep sending in bench_dispatch(), past the end is dropped */
+void put_char(unsigned char ch)
+{
+	if (stream_len < sizeof(stream))
+	{
+		stream[stream_len++] = ch;
+	}
+}
+
+/* 
+ * Transport: done right away like the default one, or with tx_async
+ * only when the bench says so, like TX DMA. control_at is where the
+ * first CHAN_CONTROL frame went out.
+ */
+bool tx_async;
+int control_at;
+uint32_t control_sent;
+
+void uart_tx_start(const uint8_t *buf, int len)
+{
+	int i;
+
+	if (tx_chan_stats[CHAN_CONTROL].frames != control_sent)
+	{
+		control_sent = tx_chan_stats[CHAN_CONTROL].frames;
+		control_at = stream_len;
+	}
+
+	for (i = 0; i < len; i++)
+	{
+		put_char(buf[i]);
+	}
+
+	if (!tx_async)
+	{
+		uart_tx_done();
+	}
+}
+
+/* Link timers run on line time in bench_credit() */
+uint32_t sim_ms;
+
+uint32_t link_time_ms(void)
+{
+	return sim_ms;
+}
+
+/* Pico side handlers process_message() links against */
+void set_fans_power_state(uint8_t state) {}
+void set_fan_pwm(uint8_t fan, uint8_t pwm) {}
+void switch_programs() {}
+void resume_animation() {}
+void set_strip_intensity(uint32_t color) {}
+void light_drawer(uint8_t drawer, uint32_t color) {}
+
+FILE *results;
+
+void report(const char *group, const char *name, const char *metric, double value, const char *unit)
+{
+	printf("%-12s %-20s %-14s %12.3f %s\n", group, name, metric, value, unit);
+
+	if (results)
+	{
+		fprintf(results, "%s,%s,%s,%.6g,%s\n", group, name, metric, value, unit);
+	}
+}
+
+/* Handlers and overflows printf, keep that out of the timings and the table */
+int saved_stdout = -1;
+
+void quiet(bool on)
+{
+	int fd;
+
+	fflush(stdout);
+	if (on)
+	{
+		saved_stdout = dup(1);
+		fd = open("/dev/null", O_WRONLY);
+		dup2(fd, 1);
+		close(fd);
+	}
+	else
+	{
+		dup2(saved_stdout, 1);
+		close(saved_stdout);
+	}
+}
+
+double now_s()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void build_stream()
+{
+	char frame[CMD_LEN + 4];
+	struct serial_cmd *cmd = (struct serial_cmd *)frame;
+	uint8_t calc_parity;
+	int i, j;
+
+	srand(1);
+	stream_len = 0;
+	tx_seq = 0;
+
+	for (i = 0; i < BENCH_FRAMES; i++)
+	{
+		cmd->cmd_type = SET_LED_COLOR;
+		cmd->cmd_len = BENCH_PAYLOAD;
+		cmd->seq = tx_seq++;
+		cmd->parity = calc_parity = 0;
+
+		for (j = 0; j < BENCH_PAYLOAD; j++)
+		{
+			cmd->cmd[j] = rand();
+		}
+
+		for (j = 0; j < cmd->cmd_len + 4; j++)
+		{
+			calc_parity += frame[j];
+		}
+		cmd->parity = calc_parity;
+
+		uart_tx(frame, cmd->cmd_len + 4);
+	}
+}
+
+double bench_byte_loop()
+{
+	double start;
+	int r, i;
+
+	start = now_s();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+	{
+		rx_seq = 0;
+		for (i = 0; i < stream_len; i++)
+		{
+			if (!uart_rx(stream[i]))
+			{
+				serial_ring_reset();
+			}
+		}
+	}
+
+	return now_s() - start;
+}
+
+double bench_batch()
+{
+	double start;
+	int r, i;
+
+	start = now_s();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+	{
+		rx_seq = 0;
+		for (i = 0; i < stream_len; i += BENCH_CHUNK)
+		{
+			uart_rx_buf(&stream[i], MIN(BENCH_CHUNK, stream_len - i));
+			serial_ring_reset();
+		}
+	}
+
+	return now_s() - start;
+}
+
+/* Today's frame check */
+double bench_sum()
+{
+	uint8_t sum;
+	double start;
+	int r, i;
+
+	start = now_s();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+	{
+		sum = 0;
+		for (i = 0; i < stream_len; i++)
+		{
+			sum += stream[i];
+		}
+		bench_sink = sum;
+	}
+
+	return now_s() - start;
+}
+
+/* One table lookup per byte, the classic way */
+double bench_crc16_bytewise()
+{
+	extern uint16_t crc16_table[4][256];
+	uint16_t crc;
+	double start;
+	int r, i;
+
+	crc16_update(CRC16_INIT, stream, 1);	/* fills the tables */
+
+	start = now_s();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+	{
+		crc = CRC16_INIT;
+		for (i = 0; i < stream_len; i++)
+		{
+			crc = (crc << 8) ^ crc16_table[0][(crc >> 8) ^ stream[i]];
+		}
+		bench_sink = crc;
+	}
+
+	return now_s() - start;
+}
+
+double bench_crc16()
+{
+	double start;
+	int r;
+
+	start = now_s();
+	for (r = 0; r < BENCH_ROUNDS; r++)
+	{
+		bench_sink = crc16_update(CRC16_INIT, stream, stream_len);
+	}
+
+	return now_s() - start;
+}
+
+/* LED programs like the ones node-red uploads, one step at a time */
+uint32_t prg[BENCH_STEPS][NUM_LEDS_IN_STRIP];
+
+/* One LED runs along the strip and back, with a trail */
+void prg_chase()
+{
+	int s, i, pos;
+
+	for (s = 0; s < BENCH_STEPS; s++)
+	{
+		pos = s < NUM_LEDS_IN_STRIP ? s : BENCH_STEPS - 1 - s;
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			prg[s][i] = 0;
+		}
+		prg[s][pos] = COLOR_RED;
+		if (pos)
+		{
+			prg[s][pos - 1] = 0x000040;
+		}
+	}
+}
+
+/* Drawers light up one after the other in their own color, then go off */
+void prg_drawers()
+{
+	const uint32_t colors[] = { COLOR_RED, COLOR_GREEN, COLOR_BLUE, 0xFFFF00, 0x00FFFF, 0xFF00FF, 0xFFFFFF };
+	int s, i, d;
+
+	for (s = 0; s < BENCH_STEPS; s++)
+	{
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			d = i / NUM_ICS_PER_DRAWER;
+			prg[s][i] = (s / 6) % (2 * MAX_DRAWERS) > d ? colors[d] : 0;
+		}
+	}
+}
+
+/* Whole strip fades, a new color every step */
+void prg_fade()
+{
+	int s, i, v;
+
+	for (s = 0; s < BENCH_STEPS; s++)
+	{
+		v = s < BENCH_STEPS / 2 ? s * 6 : (BENCH_STEPS - s) * 6;
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			prg[s][i] = LED_RGB(v, v / 2, 0);
+		}
+	}
+}
+
+/* Worst case, nothing repeats */
+void prg_noise()
+{
+	int s, i;
+
+	srand(2);
+	for (s = 0; s < BENCH_STEPS; s++)
+	{
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			prg[s][i] = rand() & 0xFFFFFF;
+		}
+	}
+}
+
+/* Wire bytes to upload prg as SET_LED_COLOR steps */
+int upload_raw()
+{
+	struct msg_led_color m;
+	int s, i;
+
+	stream_len = 0;
+	for (s = 0; s < BENCH_STEPS; s++)
+	{
+		m.step = s;
+		PUT_BE16(m.time, 100);
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			m.rgb[i][0] = prg[s][i] >> 16;
+			m.rgb[i][1] = prg[s][i] >> 8;
+			m.rgb[i][2] = prg[s][i];
+		}
+		msg_send_led_color(&m);
+	}
+
+	return stream_len;
+}
+
+/* Same, the way the modem does it: palette + packed steps, raw if shorter */
+int upload_packed()
+{
+	struct msg_led_step_packed packed;
+	struct msg_led_palette pal;
+	struct led_pack_ctx ctx;
+	struct msg_led_color m;
+	int s, i, len;
+
+	stream_len = 0;
+	led_pack_reset(&ctx);
+	for (s = 0; s < BENCH_STEPS; s++)
+	{
+		len = led_pack_palette(&ctx, prg[s], &pal);
+		if (len)
+		{
+			msg_send_led_palette(&pal, len);
+		}
+
+		len = led_pack_step(&ctx, s, prg[s], &packed);
+		if (len >= 0 && len < sizeof(m))
+		{
+			PUT_BE16(packed.time, 100);
+			msg_send_led_step_packed(&packed, len);
+			continue;
+		}
+
+		m.step = s;
+		PUT_BE16(m.time, 100);
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			m.rgb[i][0] = prg[s][i] >> 16;
+			m.rgb[i][1] = prg[s][i] >> 8;
+			m.rgb[i][2] = prg[s][i];
+		}
+		msg_send_led_color(&m);
+	}
+
+	return stream_len;
+}
+
+/* Same as one bulk transfer, in extended frames */
+int upload_bulk()
+{
+	static uint8_t blob[1 + BENCH_STEPS * LED_BLOB_STEP];
+	struct msg_bulk_open open = { BULK_LED_PROGRAM };
+	int s, i, n, chunk = SERIAL_EXT_MAX - 4;
+	uint8_t *p = blob;
+
+	*p++ = BENCH_STEPS;
+	for (s = 0; s < BENCH_STEPS; s++)
+	{
+		PUT_BE16(p, 100);
+		p += 2;
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			*p++ = prg[s][i] >> 16;
+			*p++ = prg[s][i] >> 8;
+			*p++ = prg[s][i];
+		}
+	}
+
+	stream_len = 0;
+	link_ext = true;
+	PUT_BE32(open.size, sizeof(blob));
+	PUT_BE16(open.crc, crc16_update(CRC16_INIT, blob, sizeof(blob)));
+	msg_send_bulk_open(&open);
+	for (i = 0; i < sizeof(blob); i += n)
+	{
+		n = MIN(chunk, (int)sizeof(blob) - i);
+		bulk_send_chunk(i, blob + i, n);
+	}
+	msg_send_bulk_commit();
+	link_ext = false;
+
+	return stream_len;
+}
+
+void bench_led_upload(const char *name, void (*gen)())
+{
+	int raw, packed, bulk;
+
+	gen();
+	raw = upload_raw();
+	packed = upload_packed();
+	bulk = upload_bulk();
+
+	/* 8N1, 10 bits per byte */
+	report("led_upload", name, "raw_bytes", raw, "B");
+	report("led_upload", name, "packed_bytes", packed, "B");
+	report("led_upload", name, "ratio", (double)raw / packed, "x");
+	report("led_upload", name, "raw_time", raw * 10e3 / BENCH_BAUD, "ms");
+	report("led_upload", name, "packed_time", packed * 10e3 / BENCH_BAUD, "ms");
+	report("led_upload", name, "bulk_bytes", bulk, "B");
+	report("led_upload", name, "bulk_time", bulk * 10e3 / BENCH_BAUD, "ms");
+}
+
+int ring_drain();
+
+/* upload_raw() of a program escaped and COBS framed: wire bytes, CPU per frame each way */
+void bench_cobs(const char *name, void (*gen)())
+{
+	const char *modes[] = { "escape", "cobs" };
+	double start, t_enc, t_dec;
+	int mode, r, i, wire, frames;
+	char metric[32];
+
+	gen();
+	for (mode = 0; mode < 2; mode++)
+	{
+		link_cobs = mode;
+		start = now_s();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+		{
+			wire = upload_raw();
+		}
+		t_enc = now_s() - start;
+		link_cobs = false;
+
+		frames = 0;
+		start = now_s();
+		for (r = 0; r < BENCH_ROUNDS; r++)
+		{
+			for (i = 0; i < wire; i += BENCH_CHUNK)
+			{
+				uart_rx_buf(&stream[i], MIN(BENCH_CHUNK, wire - i));
+				frames += ring_drain();
+			}
+		}
+		t_dec = now_s() - start;
+
+		snprintf(metric, sizeof(metric), "%s_bytes", modes[mode]);
+		report("framing", name, metric, wire, "B");
+		snprintf(metric, sizeof(metric), "%s_encode", modes[mode]);
+		report("framing", name, metric, t_enc * 1e9 / (BENCH_ROUNDS * BENCH_STEPS), "ns/frame");
+		snprintf(metric, sizeof(metric), "%s_decode", modes[mode]);
+		report("framing", name, metric, t_dec * 1e9 / (BENCH_ROUNDS * BENCH_STEPS), "ns/frame");
+
+		if (frames != BENCH_ROUNDS * BENCH_STEPS)
+		{
+			snprintf(metric, sizeof(metric), "%s_lost", modes[mode]);
+			report("framing", name, metric, BENCH_ROUNDS * BENCH_STEPS - frames, "frames");
+		}
+	}
+}
+
+/*
+ * prg in the compact store: bytes a step takes, steps that fit in the RAM
+ * the fixed layout took, and unpacking a step into a frame on the fly
+ */
+void bench_led_store(const char *name, void (*gen)())
+{
+	volatile struct led_programs *p = &led_programs[1];
+	uint32_t fb[NUM_LEDS_IN_STRIP];
+	double start, t;
+	int s, r, step;
+
+	gen();
+	led_prog_reset(&led_programs[0]);
+	led_prog_reset(p);
+	for (s = 0; s < BENCH_STEPS; s++)
+	{
+		led_step_set(p, s, 100, prg[s]);
+	}
+
+	start = now_s();
+	for (r = 0; r < BENCH_ROUNDS * 100; r++)
+	{
+		for (s = 0; s < BENCH_STEPS; s++)
+		{
+			led_step_colors(p, s, fb, 8);
+			bench_sink = fb[s % NUM_LEDS_IN_STRIP];
+		}
+	}
+	t = now_s() - start;
+
+	step = p->used / BENCH_STEPS;
+	report("led_store", name, "step_bytes", step, "B");
+	report("led_store", name, "fixed_step_bytes", BENCH_FIXED_STEP, "B");
+	report("led_store", name, "colors", p->palette_len, "");
+	report("led_store", name, "steps_in_ram", (BENCH_FIXED_RAM - (int)sizeof(led_programs)) / step, "steps");
+	report("led_store", name, "fixed_steps_in_ram", NUM_LED_PROGRAMS * BENCH_STEPS, "steps");
+	report("led_store", name, "unpack", t * 1e9 / (BENCH_ROUNDS * 100 * BENCH_STEPS), "ns/frame");
+
+	led_prog_reset(p);
+}
+
+/* What went out the USB port, only counted */
+long usb_bytes;
+
+int usb_tx_write(const uint8_t *buf, int len)
+{
+	usb_bytes += len;
+
+	return 0;
+}
+
+/* The bulk upload of bench_led_upload() from a host on the USB port */
+void bench_usb(const char *name, void (*gen)())
+{
+	double start, t;
+	int uart, usb, i;
+
+	gen();
+	uart = upload_bulk();
+
+	usb_bytes = 0;
+	serial_tx_port = PORT_USB;
+	start = now_s();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+	{
+		upload_bulk();
+	}
+	t = now_s() - start;
+	serial_tx_port = PORT_UART;
+	usb = usb_bytes / BENCH_ROUNDS;
+
+	report("usb", name, "bulk_bytes", usb, "B");
+	report("usb", name, "bulk_time", usb * 1e3 / BENCH_USB_BPS, "ms");
+	report("usb", name, "speedup", (uart * 10.0 / BENCH_BAUD) / ((double)usb / BENCH_USB_BPS), "x");
+	report("usb", name, "encode", usb_bytes / 1e6 / t, "MB/s");
+}
+
+/* Every data command from the message table, at its full payload size */
+struct bench_msg {
+	uint8_t id;
+	const char *name;
+	int len;
+	bool dispatched;	/* process_message() on this (Pico) side handles it */
+};
+
+#define BENCH_MIN(a, b)		((a) < (b) ? (a) : (b))
+#define BENCH_ON_TO_PICO(id, name, len)		{ id, name, len, true },
+#define BENCH_ON_TO_MODEM(id, name, len)	{ id, name, len, false },
+#define BENCH_ON_LINK(id, name, len)
+
+#define BENCH_MSG_EMPTY(id, name, dir)		BENCH_ON_##dir(id, #name, 0)
+#define BENCH_MSG_FIXED(id, name, dir, type)	BENCH_ON_##dir(id, #name, sizeof(type))
+#define BENCH_MSG_VAR(id, name, dir, type)	BENCH_ON_##dir(id, #name, BENCH_MIN(sizeof(type), BENCH_VAR_MAX))
+
+const struct bench_msg bench_msgs[] = {
+	SERIAL_MSGS(BENCH_MSG_EMPTY, BENCH_MSG_FIXED, BENCH_MSG_VAR)
+};
+
+#define NUM_BENCH_MSGS		(sizeof(bench_msgs) / sizeof(bench_msgs[0]))
+
+/* BENCH_MSG_FRAMES frames of one command into stream, returns the time taken */
+double encode_msgs(uint8_t id, const uint8_t *payload, int len)
+{
+	double start;
+	int i;
+
+	stream_len = 0;
+	tx_seq = 0;
+
+	start = now_s();
+	for (i = 0; i < BENCH_MSG_FRAMES; i++)
+	{
+		serial_send(id, payload, len);
+	}
+
+	return now_s() - start;
+}
+
+/* Frames waiting in the RX ring, emptying it */
+int ring_drain()
+{
+	int frames = 0;
+
+	while (serial_ring_peek())
+	{
+		serial_ring_pop();
+		frames++;
+	}
+
+	return frames;
+}
+
+/* Parse stream in DMA sized chunks, emptying the ring as we go. Returns frames seen */
+int decode_msgs(double *t)
+{
+	double start;
+	int i, frames = 0;
+
+	rx_seq = 0;
+
+	start = now_s();
+	for (i = 0; i < stream_len; i += BENCH_CHUNK)
+	{
+		uart_rx_buf(&stream[i], MIN(BENCH_CHUNK, stream_len - i));
+		frames += ring_drain();
+	}
+	*t = now_s() - start;
+
+	return frames;
+}
+
+/* Encode and decode throughput per command type */
+void bench_msgs_codec()
+{
+	uint8_t payload[CMD_LEN];
+	double t_enc, t_dec;
+	int m, i, frames;
+
+	srand(3);
+	for (i = 0; i < sizeof(payload); i++)
+	{
+		payload[i] = rand();
+	}
+
+	for (m = 0; m < NUM_BENCH_MSGS; m++)
+	{
+		t_enc = encode_msgs(bench_msgs[m].id, payload, bench_msgs[m].len);
+		frames = decode_msgs(&t_dec);
+
+		report("encode", bench_msgs[m].name, "frames", BENCH_MSG_FRAMES / t_enc, "frames/s");
+		report("encode", bench_msgs[m].name, "throughput", stream_len / t_enc / 1e6, "MB/s");
+		report("decode", bench_msgs[m].name, "frames", frames / t_dec, "frames/s");
+		report("decode", bench_msgs[m].name, "throughput", stream_len / t_dec / 1e6, "MB/s");
+
+		if (frames != BENCH_MSG_FRAMES)
+		{
+			report("decode", bench_msgs[m].name, "lost", BENCH_MSG_FRAMES - frames, "frames");
+		}
+	}
+}
+
+/* Cost of escaping: a LED step of plain bytes, random bytes, only framing chars */
+void bench_escapes()
+{
+	const uint8_t specials[] = { START_CHAR, END_CHAR, ESCAPE_CHAR };
+	const char *names[] = { "plain", "random", "all_special" };
+	uint8_t payload[sizeof(struct msg_led_color)];
+	double t_enc, t_dec;
+	int kind, i, wire;
+
+	srand(4);
+	for (kind = 0; kind < 3; kind++)
+	{
+		for (i = 0; i < sizeof(payload); i++)
+		{
+			payload[i] = kind == 0 ? 0x11 : kind == 1 ? rand() : specials[i % 3];
+		}
+
+		t_enc = encode_msgs(SET_LED_COLOR, payload, sizeof(payload));
+		wire = stream_len;
+		decode_msgs(&t_dec);
+
+		report("escape", names[kind], "expansion", (double)wire / (BENCH_MSG_FRAMES * (sizeof(payload) + 4)), "x");
+		report("escape", names[kind], "encode", BENCH_MSG_FRAMES * sizeof(payload) / t_enc / 1e6, "MB/s payload");
+		report("escape", names[kind], "decode", BENCH_MSG_FRAMES * sizeof(payload) / t_dec / 1e6, "MB/s payload");
+	}
+}
+
+/* process_message() on a ready frame: switch + decode + handler */
+void bench_dispatch()
+{
+	uint8_t payload[CMD_LEN] = { 0 };
+	char frame[CMD_LEN];
+	double start, t;
+	int m, i;
+
+	for (m = 0; m < NUM_BENCH_MSGS; m++)
+	{
+		if (!bench_msgs[m].dispatched)
+		{
+			continue;
+		}
+
+		/* Decoded once, the way the main loop gets it */
+		encode_msgs(bench_msgs[m].id, payload, bench_msgs[m].len);
+		stream_len = stream_len / BENCH_MSG_FRAMES;
+		rx_seq = 0;
+		uart_rx_buf(stream, stream_len);
+		memcpy(frame, serial_ring_peek(), stream_len);
+		ring_drain();
+
+		quiet(true);
+		start = now_s();
+		for (i = 0; i < BENCH_DISPATCH; i++)
+		{
+			process_message(frame);
+		}
+		t = now_s() - start;
+		quiet(false);
+
+		report("dispatch", bench_msgs[m].name, "call", t * 1e9 / BENCH_DISPATCH, "ns");
+
+		/* What SERIAL_STATS adds per frame in serial_process_next() */
+		start = now_s();
+		for (i = 0; i < BENCH_DISPATCH; i++)
+		{
+			serial_stats_record((struct serial_cmd *)frame, i, i >> 3);
+		}
+		t = now_s() - start;
+
+		report("dispatch", bench_msgs[m].name, "stats", t * 1e9 / BENCH_DISPATCH, "ns");
+	}
+	serial_stats_reset();
+}
+
+/* RX ring not drained: what gets in, what's dropped, does it recover */
+void bench_ring_overflow(const char *name, uint8_t id, int len)
+{
+	uint8_t payload[CMD_LEN] = { 1, 2 };
+	int one, i, n, accepted, dropped;
+	double start, t;
+
+	encode_msgs(id, payload, len);
+	one = stream_len / BENCH_MSG_FRAMES;
+	n = 2 * SERIAL_RING_SIZE / (len + 6);
+	ring_drain();
+	dropped = serial_rx_stats.ring_full;
+	rx_seq = 0;
+
+	quiet(true);
+	start = now_s();
+	for (i = 0; i < n; i++)
+	{
+		uart_rx_buf(&stream[i * one], one);
+	}
+	t = now_s() - start;
+	quiet(false);
+
+	dropped = serial_rx_stats.ring_full - dropped;
+	accepted = ring_drain();
+
+	/* Room again, the next frame must make it */
+	uart_rx_buf(&stream[i * one], one);
+
+	report("rx_ring", name, "accepted", accepted, "frames");
+	report("rx_ring", name, "dropped", dropped, "frames");
+	report("rx_ring", name, "recovered", ring_drain() == 1, "bool");
+	report("rx_ring", name, "frame", t * 1e9 / n, "ns");
+}
+
+/* LOG() vs send_log() of the same message: time on the caller and bytes on the wire */
+void bench_log()
+{
+	uint8_t buf[CMD_LEN];
+	double start, t_push = 0, t_format = 0, t_text;
+	long token_bytes = 0, text_bytes = 0;
+	int i, j, n, len;
+
+	quiet(true);
+	for (i = 0; i < BENCH_LOGS; i += LOG_RING_SIZE)
+	{
+		start = now_s();
+		for (j = 0; j < LOG_RING_SIZE; j++)
+		{
+			LOG(LOG_PARITY, (i + j) & 0xFF, j);
+		}
+		t_push += now_s() - start;
+
+		/* What the modem would send, one frame per ring full */
+		stream_len = 0;
+		len = log_pack(buf, sizeof(buf), &n);
+		msg_send_log_tokens((const struct msg_log_tokens *)buf, len);
+		token_bytes += stream_len;
+
+		/* What the Pico does later in the main loop */
+		start = now_s();
+		log_flush();
+		t_format += now_s() - start;
+	}
+
+	start = now_s();
+	for (i = 0; i < BENCH_LOGS; i++)
+	{
+		stream_len = 0;
+		send_log("Parity failed: expected 0x%02x, got 0x%02x\n", i & 0xFF, i % LOG_RING_SIZE);
+		text_bytes += stream_len;
+	}
+	t_text = now_s() - start;
+	quiet(false);
+
+	report("log", "token", "call", t_push * 1e9 / BENCH_LOGS, "ns");
+	report("log", "token", "deferred", t_format * 1e9 / BENCH_LOGS, "ns");
+	report("log", "token", "wire", (double)token_bytes / BENCH_LOGS, "B/record");
+	report("log", "send_log", "call", t_text * 1e9 / BENCH_LOGS, "ns");
+	report("log", "send_log", "wire", (double)text_bytes / BENCH_LOGS, "B/record");
+}
+
+/* A telemetry record of one reporting period */
+struct bench_rec {
+	uint8_t type;
+	int size;
+	const void *data;
+};
+
+/* Wire bytes of r[0] .. r[n - 1] as one SEND_TELEMETRY frame */
+int telemetry_wire(const struct bench_rec *r, int n)
+{
+	struct msg_telemetry m;
+	int i, len = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		memcpy(telem_add(&m, &len, r[i].type, r[i].size), r[i].data, r[i].size);
+	}
+
+	stream_len = 0;
+	msg_send_telemetry(&m, len);
+
+	return stream_len;
+}
+
+/* The same records batched and one frame each; legacy: the old SEND_* frames' bytes, 0 if there are none */
+void bench_telemetry_set(const char *name, const struct bench_rec *r, int n, int legacy)
+{
+	int i, separate = 0, batched;
+
+	for (i = 0; i < n; i++)
+	{
+		separate += telemetry_wire(&r[i], 1);
+	}
+	batched = telemetry_wire(r, n);
+
+	if (legacy)
+	{
+		report("telemetry", name, "legacy_wire", legacy, "B/period");
+	}
+	report("telemetry", name, "separate_wire", separate, "B/period");
+	report("telemetry", name, "batched_wire", batched, "B/period");
+	report("telemetry", name, "frames_saved", n - 1, "frames/period");
+	report("telemetry", name, "bytes_saved", (legacy ? legacy : separate) - batched, "B/period");
+}
+
+/*
+ * One reporting period, the same records each way: the old SEND_TEMP /
+ * SEND_TACHO frames where there is one, a SEND_TELEMETRY per record, and
+ * all of them in one SEND_TELEMETRY.
+ */
+void bench_telemetry()
+{
+	struct msg_temperature temp;
+	struct msg_tacho tacho;
+	struct telem_fan_pwm pwm;
+	struct telem_link link;
+	struct bench_rec r[4] = {
+		{ TELEM_TEMP, sizeof(temp), &temp },
+		{ TELEM_RPM, sizeof(tacho), &tacho },
+		{ TELEM_FAN_PWM, sizeof(pwm), &pwm },
+		{ TELEM_LINK, sizeof(link), &link },
+	};
+	int i, legacy_temp, legacy_tacho;
+
+	for (i = 0; i < NUM_FANS; i++)
+	{
+		PUT_BE16(temp.temp[i], 2450 + 37 * i);
+		PUT_BE16(tacho.rpm[i], 900 + 60 * i);
+	}
+	memset(&pwm, 60, sizeof(pwm));
+	memset(&link, 0, sizeof(link));
+
+	stream_len = 0;
+	msg_send_temperature(&temp);
+	legacy_temp = stream_len;
+
+	stream_len = 0;
+	msg_send_tacho(&tacho);
+	legacy_tacho = stream_len;
+
+	bench_telemetry_set("temp", r, 1, legacy_temp);
+	bench_telemetry_set("temp+tacho", r, 2, legacy_temp + legacy_tacho);
+	bench_telemetry_set("all", r, 4, 0);
+}
+
+void burst_logs()
+{
+	int i;
+
+	for (i = 0; i < TX_DEPTH_LOG + 1; i++)
+	{
+		send_log("Burst %d: padding the log line out to something realistic\n", i);
+	}
+}
+
+void burst_leds()
+{
+	struct msg_led_color m;
+	int i;
+
+	memset(&m, 0x42, sizeof(m));
+	for (i = 0; i < TX_DEPTH_BULK + 1; i++)
+	{
+		m.step = i;
+		msg_send_led_color(&m);
+	}
+}
+
+/* 
+ * A fan command queued behind a burst on a busy transport: wire time
+ * before it starts with the channel scheduler, and what a single FIFO
+ * would have had ahead of it (everything else that got queued).
+ */
+void bench_priority(const char *name, void (*burst)())
+{
+	struct msg_fan_pwm fan = { 1, 30 };
+	int control_len;
+
+	rx_seq = tx_seq = 0;
+	stream_len = 0;
+	control_at = -1;
+	control_sent = 0;
+	memset(tx_chan_stats, 0, sizeof(tx_chan_stats));
+	tx_async = true;
+
+	quiet(true);
+	burst();
+	msg_send_fan_pwm(&fan);
+	while (!uart_tx_idle())
+	{
+		uart_tx_done();
+	}
+	quiet(false);
+	tx_async = false;
+
+	/* Our fan frame is the only one without escapes in it */
+	control_len = 2 + sizeof(struct serial_cmd) + sizeof(fan);
+
+	report("priority", name, "control_wait", control_at * 10e3 / BENCH_BAUD, "ms");
+	report("priority", name, "fifo_wait", (stream_len - control_len) * 10e3 / BENCH_BAUD, "ms");
+	report("priority", name, "log_peak", tx_chan_stats[CHAN_LOG].peak, "frames");
+	report("priority", name, "bulk_peak", tx_chan_stats[CHAN_BULK].peak, "frames");
+}
+
+/* 
+ * One wire frame of bench_credit(): it lands in the receiver (the same
+ * serial_comms, looped back) and line time goes by. The receiver's main
+ * loop takes a frame off its ring every sim_period_us.
+ */
+int sim_pos;
+uint32_t sim_us, sim_pop_us, sim_period_us;
+
+void sim_step(bool credit)
+{
+	int len;
+
+	if (!uart_tx_idle())
+	{
+		uart_tx_done();
+	}
+
+	/* What the receiver sends back while taking it goes out next step */
+	len = stream_len - sim_pos;
+	uart_rx_buf(&stream[sim_pos], len);
+	sim_pos += len;
+	sim_us += (len ? len : 1) * 10000000ull / BENCH_BAUD;
+	sim_ms = sim_us / 1000;
+
+	while (sim_us >= sim_pop_us)
+	{
+		if (serial_ring_peek())
+		{
+			serial_ring_pop();
+		}
+		sim_pop_us += sim_period_us;
+	}
+
+	/* The old firmware: no LINK_CREDIT at all */
+	if (credit)
+	{
+		link_poll();
+	}
+}
+
+/* A sender waiting on a full channel in bench_credit(): line time goes by */
+bool sim_on, sim_credit;
+
+void link_wait(void)
+{
+	if (sim_on)
+	{
+		sim_step(sim_credit);
+	}
+}
+
+/* 
+ * An MQTT burst of SET_LED_COLOR into a receiver that handles one frame
+ * per slow frame times, the sender pushing as fast as the line goes:
+ * ring overflows without LINK_CREDIT, none with it.
+ */
+void bench_credit(const char *name, bool credit, int slow)
+{
+	struct msg_led_color m;
+	uint32_t dropped = serial_rx_stats.ring_full, burst_us;
+	int i;
+
+	memset(&m, 0x11, sizeof(m));
+	rx_seq = tx_seq = 0;
+	stream_len = sim_pos = 0;
+	sim_us = sim_ms = 0;
+	sim_period_us = slow * (6 + sizeof(m)) * 10000000ull / BENCH_BAUD;
+	sim_pop_us = sim_period_us;
+	credit_valid = false;
+	serial_ring_reset();
+	tx_async = true;
+	sim_on = true;
+	sim_credit = credit;
+
+	quiet(true);
+	for (i = 0; i < 64; i++)
+	{
+		m.step = i;
+		while (msg_send_led_color(&m))
+		{
+			sim_step(credit);
+		}
+	}
+	while (!uart_tx_idle() || uart_tx_held())
+	{
+		sim_step(credit);
+	}
+	burst_us = sim_us;
+
+	while (serial_ring_peek())
+	{
+		sim_step(credit);
+
+		/* Stream buffer is only so big, the frames in it are done with */
+		if (stream_len > sizeof(stream) / 2)
+		{
+			stream_len = sim_pos = 0;
+		}
+	}
+	quiet(false);
+	tx_async = false;
+	sim_on = false;
+	credit_valid = false;
+
+	report("credit", name, "dropped", serial_rx_stats.ring_full - dropped, "frames");
+	report("credit", name, "burst_time", burst_us / 1e3, "ms");
+}
+
+/* Frames lost per corrupted byte: a byte overwritten, a byte dropped, a frame's END dropped, a bare START put in */
+enum noise_kind { NOISE_FLIP, NOISE_DROP, NOISE_END, NOISE_START, NOISE_KINDS };
+
+/* END of a frame, not an escaped one: the next frame's START follows */
+static bool frame_end(int i)
+{
+	return stream[i] == END_CHAR && (i + 1 == stream_len || stream[i + 1] == START_CHAR);
+}
+
+void bench_noise()
+{
+	static const char *names[NOISE_KINDS] = { "flip", "drop", "drop_end", "start" };
+	static uint8_t noisy[sizeof(stream) + BENCH_NOISE_HITS];
+	struct serial_rx_stats before;
+	int kind, i, at, hit, len, good;
+
+	for (kind = 0; kind < NOISE_KINDS; kind++)
+	{
+		build_stream();
+		srand(3 + kind);
+
+		/* One hit somewhere in every stream_len / BENCH_NOISE_HITS bytes, framing bytes too */
+		at = rand() % (stream_len / BENCH_NOISE_HITS);
+		for (i = len = hit = 0; i < stream_len; i++)
+		{
+			if (i < at || (kind == NOISE_END && !frame_end(i)))
+			{
+				noisy[len++] = stream[i];
+				continue;
+			}
+			hit++;
+			at = hit * (stream_len / BENCH_NOISE_HITS) + rand() % (stream_len / BENCH_NOISE_HITS);
+
+			switch (kind)
+			{
+			case NOISE_FLIP:
+				noisy[len++] = stream[i] ^ (1 + rand() % 255);
+				break;
+			case NOISE_DROP:
+			case NOISE_END:
+				break;
+			case NOISE_START:
+				noisy[len++] = START_CHAR;
+				noisy[len++] = stream[i];
+				break;
+			}
+		}
+
+		before = serial_rx_stats;
+		quiet(true);
+		rx_seq = 0;
+		for (i = good = 0; i < len; i += BENCH_CHUNK)
+		{
+			uart_rx_buf(&noisy[i], MIN(BENCH_CHUNK, len - i));
+			good += ring_drain();
+		}
+		quiet(false);
+
+		/* Flips the 8 bit sum misses still come out, as good frames */
+		report("noise", names[kind], "lost", (double)(BENCH_FRAMES - good) / BENCH_NOISE_HITS, "frames/hit");
+		report("noise", names[kind], "bad", serial_rx_stats.bad_frames - before.bad_frames, "frames");
+		report("noise", names[kind], "resyncs", serial_rx_stats.resyncs - before.resyncs, "frames");
+		report("noise", names[kind], "noise", serial_rx_stats.noise - before.noise, "B");
+	}
+}
+
+/*
+ * Multi-drop bus, modelled rather than run: frame sizes are what
+ * serial_comms encodes plus the address byte, the rest is the modem's
+ * loop. Every LOOP_DELAY it takes the MQTT commands that came in (frame,
+ * BUS_POLL, the node's BUS_DONE) and then polls every node, which sends
+ * up to BUS_BURST telemetry frames. Link ACKs ride in the same turns and
+ * are left out. Latency is MQTT arrival to the command's last byte.
+ */
+struct bus_sim {
+	double t_us, busy_us;
+	int tele, cmd, turn;
+	uint32_t next_tele[BENCH_BUS_MAX];
+	int queued[BENCH_BUS_MAX];
+	double tele_age_us;
+	int tele_count;
+};
+
+static void bus_line(struct bus_sim *s, int bytes)
+{
+	double us = bytes * 10e6 / BENCH_BAUD;
+
+	s->t_us += us + BENCH_BUS_TURN_US;
+	s->busy_us += us;
+}
+
+/* Node has the line: its telemetry so far, then BUS_DONE */
+static void bus_node_turn(struct bus_sim *s, int node)
+{
+	int sent;
+
+	while (s->next_tele[node] * 1e3 <= s->t_us)
+	{
+		s->queued[node]++;
+		s->next_tele[node] += BENCH_BUS_TELEM_MS;
+	}
+
+	for (sent = 0; sent < BUS_BURST && s->queued[node]; sent++)
+	{
+		/* Oldest one: queued for how long it's been waiting since its period */
+		s->tele_age_us += s->t_us - (s->next_tele[node] - s->queued[node] * BENCH_BUS_TELEM_MS) * 1e3;
+		s->tele_count++;
+		s->queued[node]--;
+		s->t_us += s->tele * 10e6 / BENCH_BAUD;
+		s->busy_us += s->tele * 10e6 / BENCH_BAUD;
+	}
+
+	bus_line(s, s->turn);
+}
+
+/* Wire size of one frame around payload, address byte included */
+static int bus_frame_len(uint8_t cmd_type, const void *payload, int len)
+{
+	uint8_t buf[sizeof(struct serial_cmd) + sizeof(struct msg_telemetry)], wire[TX_FRAME_MAX];
+	struct serial_cmd *cmd = (struct serial_cmd *)buf;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->cmd_type = cmd_type;
+	cmd->cmd_len = len;
+	memcpy(cmd->cmd, payload, len);
+
+	return frame_encode(wire, (const char *)buf, sizeof(*cmd) + len) + 1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void bench_bus(int nodes)
+{
+	static double lat[BENCH_BUS_MS / 1000 * BENCH_BUS_CMDS * 2];
+	struct msg_fan_pwm fan = { 1, 30 };
+	struct msg_bus_turn turn = { BUS_BURST };
+	struct msg_telemetry m;
+	struct bus_sim s;
+	double loop_us, next_cmd_us, lat_sum = 0;
+	char name[16];
+	int node, n = 0, len = 0;
+
+	memset(&s, 0, sizeof(s));
+	srand(21);
+
+	memset(telem_add(&m, &len, TELEM_TEMP, sizeof(struct msg_temperature)), 0x09, sizeof(struct msg_temperature));
+	memset(telem_add(&m, &len, TELEM_RPM, sizeof(struct msg_tacho)), 0x03, sizeof(struct msg_tacho));
+	memset(telem_add(&m, &len, TELEM_FAN_PWM, sizeof(struct telem_fan_pwm)), 60, sizeof(struct telem_fan_pwm));
+	memset(telem_add(&m, &len, TELEM_LINK, sizeof(struct telem_link)), 0, sizeof(struct telem_link));
+
+	s.tele = bus_frame_len(SEND_TELEMETRY, &m, len);
+	s.cmd = bus_frame_len(SET_FAN_PWM_PERC, &fan, sizeof(fan));
+	s.turn = bus_frame_len(BUS_POLL, &turn, sizeof(turn));
+
+	/* Nodes boot at different times */
+	for (node = 0; node < nodes; node++)
+	{
+		s.next_tele[node] = rand() % BENCH_BUS_TELEM_MS;
+	}
+
+	next_cmd_us = 1e6 / BENCH_BUS_CMDS;
+	for (loop_us = 0; loop_us < BENCH_BUS_MS * 1e3; loop_us = MAX(loop_us + BENCH_BUS_LOOP_MS * 1e3, s.t_us))
+	{
+		if (s.t_us < loop_us)
+		{
+			s.t_us = loop_us;
+		}
+
+		/* MQTT commands that came in since the last loop, evenly spread gaps around the mean */
+		while (next_cmd_us <= loop_us && n < sizeof(lat) / sizeof(lat[0]))
+		{
+			node = rand() % nodes;
+			bus_line(&s, s.cmd);
+			lat[n] = s.t_us - next_cmd_us;
+			lat_sum += lat[n++];
+			bus_line(&s, s.turn);
+			bus_node_turn(&s, node);
+
+			next_cmd_us += 1e6 / BENCH_BUS_CMDS * (rand() % 2000 + 1) / 1000;
+		}
+
+		/* bus_service() */
+		for (node = 0; node < nodes; node++)
+		{
+			bus_line(&s, s.turn);
+			bus_node_turn(&s, node);
+		}
+	}
+
+	qsort(lat, n, sizeof(lat[0]), cmp_double);
+
+	snprintf(name, sizeof(name), "%d_nodes", nodes);
+	report("bus", name, "utilisation", s.busy_us * 100 / s.t_us, "%");
+	report("bus", name, "cmd_latency", n ? lat_sum / n / 1e3 : 0, "ms");
+	report("bus", name, "cmd_p99", n ? lat[(n - 1) * 99 / 100] / 1e3 : 0, "ms");
+	report("bus", name, "telemetry_age", s.tele_count ? s.tele_age_us / s.tele_count / 1e3 : 0, "ms");
+}
+
+int main(int argc, char **argv)
+{
+	double t_byte, t_batch, mb;
+	const char *path = argc > 1 ? argv[1] : "comms_bench.csv";
+
+	results = fopen(path, "w");
+	if (!results)
+	{
+		perror(path);
+		return 1;
+	}
+	fprintf(results, "group,name,metric,value,unit\n");
+
+	build_stream();
+	mb = (double)stream_len * BENCH_ROUNDS / 1e6;
+
+	t_byte = bench_byte_loop();
+	t_batch = bench_batch();
+
+	report("decode", "uart_rx", "throughput", mb / t_byte, "MB/s");
+	report("decode", "uart_rx_buf", "throughput", mb / t_batch, "MB/s");
+
+	t_byte = bench_sum();
+	report("check", "sum8", "cost", t_byte * 1e3 / mb, "ns/B");
+	report("check", "crc16_bytewise", "cost", bench_crc16_bytewise() * 1e3 / mb, "ns/B");
+	report("check", "crc16_slice4", "cost", bench_crc16() * 1e3 / mb, "ns/B");
+
+	bench_msgs_codec();
+	bench_escapes();
+	bench_dispatch();
+	bench_ring_overflow("empty", WIFI_CONNECTED, 0);
+	bench_ring_overflow("fan_pwm", SET_FAN_PWM_PERC, sizeof(struct msg_fan_pwm));
+	bench_ring_overflow("led_color", SET_LED_COLOR, sizeof(struct msg_led_color));
+
+	bench_led_upload("chase", prg_chase);
+	bench_led_upload("drawers", prg_drawers);
+	bench_led_upload("fade", prg_fade);
+	bench_led_upload("noise", prg_noise);
+	bench_cobs("chase", prg_chase);
+	bench_cobs("drawers", prg_drawers);
+	bench_cobs("fade", prg_fade);
+	bench_cobs("noise", prg_noise);
+	bench_usb("chase", prg_chase);
+	bench_usb("noise", prg_noise);
+	bench_led_store("chase", prg_chase);
+	bench_led_store("drawers", prg_drawers);
+	bench_led_store("fade", prg_fade);
+	bench_led_store("noise", prg_noise);
+
+	bench_log();
+	bench_telemetry();
+	bench_noise();
+	bench_priority("log_burst", burst_logs);
+	bench_priority("led_upload", burst_leds);
+	bench_credit("off", false, 3);
+	bench_credit("on", true, 3);
+	bench_bus(1);
+	bench_bus(2);
+	bench_bus(4);
+	bench_bus(8);
+	bench_bus(16);
+
+	fclose(results);
+	printf("Results in %s\n", path);
+
+	return 0;
+}
@@ -0,0 +1,11 @@
+/*
+ * The receive side and dispatch for the host builds, which play the Pico:
+ *
+ * g++ -std=c++17 -O2 -c comms_host.cpp
+ * gcc -O2 -o comms_unit_test comms_unit_test.c serial_comms.c ... comms_host.o
+ */
+#include "serial_proto.hpp"
+
+using proto = serial_proto::endpoint<serial_proto::role::pico, serial_proto::uart, serial_proto::pico_handlers>;
+
+SERIAL_PROTO_C_API(proto)
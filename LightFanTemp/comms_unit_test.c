@@ -1,5 +1,7 @@
 #include "macro_helpers.h"
 #include "serial_comms.h"
+#include "led_pack.h"
+#include "led_store.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,15 +14,43 @@
 		exit(-1); \
 	}
 
-uint8_t test_rx_buf[255], rx_pos;
-char double_rx_buf[CMD_LEN*NUM_ENTRIES];
+uint8_t test_rx_buf[2048];
+int rx_pos;
 
 void put_char(unsigned char ch)
 {
 	test_rx_buf[rx_pos++] = ch;
 }
 
-extern uint8_t rx_seq;
+extern uint8_t rx_seq, tx_seq, tx_check;
+extern bool credit_valid;
+
+/* Pico side handlers process_message() links against */
+uint8_t test_fan, test_pwm;
+
+void set_fan_pwm(uint8_t fan, uint8_t pwm)
+{
+	test_fan = fan;
+	test_pwm = pwm;
+}
+
+void set_fans_power_state(uint8_t state) {}
+int test_switches;
+
+void switch_programs()
+{
+	test_switches++;
+}
+
+void resume_animation() {}
+void set_strip_intensity(uint32_t color) {}
+void light_drawer(uint8_t drawer, uint32_t color) {}
+
+/* Run the oldest frame in the ring, 1 if there was none */
+int process_next()
+{
+	return !serial_process_next();
+}
 
 void parse_log(uint8_t *cmd)
 {
@@ -39,15 +69,12 @@ int test1()
 		uart_rx(msg[i]);
 	}
 
-	if (serial_buf_cidx == serial_buf_pidx)
+	if (process_next())
 	{
-		fprintf(stderr, "Failed pidx %d cidx %d", serial_buf_cidx, serial_buf_pidx);
+		fprintf(stderr, "Failed no frame in the ring\n");
 		return 1;
 	}
 
-	process_message(&double_rx_buf[CMD_LEN * serial_buf_cidx]);
-	serial_buf_cidx = (serial_buf_cidx + 1) % NUM_ENTRIES;
-
 	i = strcmp(exp_str, test_rx_buf);
 	if (!i) {
 		fprintf(stderr,"Strings OK!\n");
@@ -74,15 +101,12 @@ int test2()
 		ret = uart_rx(test_rx_buf[i++]);
 	} while(ret);
 
-	if (serial_buf_cidx == serial_buf_pidx)
+	if (process_next())
 	{
-		fprintf(stderr, "Failed pidx %d cidx %d", serial_buf_cidx, serial_buf_pidx);
+		fprintf(stderr, "Failed no frame in the ring\n");
 		return 1;
 	}
 
-	process_message(&double_rx_buf[CMD_LEN * serial_buf_cidx]);
-	serial_buf_cidx = (serial_buf_cidx + 1) % NUM_ENTRIES;
-
 	i = strcmp(test_str, test_rx_buf);
 	if (!i) {
 		fprintf(stderr,"Strings OK: sent \"%s\", got \"%s\"\n", test_str, test_rx_buf);
@@ -104,15 +128,12 @@ int test3()
 		ret = uart_rx(msg[i++]);
 	} while(ret);
 
-	if (serial_buf_cidx == serial_buf_pidx)
+	if (process_next())
 	{
-		fprintf(stderr, "Failed pidx %d cidx %d", serial_buf_cidx, serial_buf_pidx);
+		fprintf(stderr, "Failed no frame in the ring\n");
 		return 1;
 	}
 
-	process_message(&double_rx_buf[CMD_LEN * serial_buf_cidx]);
-	serial_buf_cidx = (serial_buf_cidx + 1) % NUM_ENTRIES;
-
 	i = strcmp(test_str, test_rx_buf);
 	if (!i) {
 		fprintf(stderr,"Strings OK: sent \"%s\", got \"%s\"\n", test_str, test_rx_buf);
@@ -135,15 +156,12 @@ int test4()
 		ret = uart_rx(msg[i++]);
 	} while(ret);
 
-	if (serial_buf_cidx == serial_buf_pidx)
+	if (process_next())
 	{
-		fprintf(stderr, "Failed pidx %d cidx %d", serial_buf_cidx, serial_buf_pidx);
+		fprintf(stderr, "Failed no frame in the ring\n");
 		return 1;
 	}
 
-	process_message(&double_rx_buf[CMD_LEN * serial_buf_cidx]);
-	serial_buf_cidx = (serial_buf_cidx + 1) % NUM_ENTRIES;
-
 	i = strcmp(test_str, test_rx_buf);
 	if (!i) {
 		fprintf(stderr,"Strings OK: sent \"%s\", got \"%s\"\n", test_str, test_rx_buf);
@@ -156,11 +174,1973 @@ int test4()
 	return 0;
 }
 
+/* uart_rx_buf() must leave the same frames in the ring as uart_rx() */
+int test5()
+{
+	char payload[] = {'a', START_CHAR, 'b', END_CHAR, ESCAPE_CHAR, 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', ESCAPE_CHAR, 'q'};
+	char frame[CMD_LEN + 4];
+	uint8_t exp_ring[SERIAL_RING_SIZE];
+	struct serial_cmd *cmd = (struct serial_cmd *)frame;
+	uint8_t stream_len;
+	int i, j;
+
+	rx_pos = 0;
+	for (i = 0; i < 3; i++)
+	{
+		cmd->seq = i;
+		cmd->cmd_type = SET_LED_COLOR;
+		cmd->cmd_len = sizeof(payload) - i;
+		cmd->parity = 0;
+		memcpy(cmd->cmd, payload + i, cmd->cmd_len);
+		for (j = 0; j < cmd->cmd_len + 4; j++)
+		{
+			cmd->parity += frame[j];
+		}
+		uart_tx(frame, cmd->cmd_len + 4);
+	}
+	stream_len = rx_pos;
+
+	rx_seq = 0;
+	serial_ring_reset();
+	memset(serial_ring, 0, sizeof(serial_ring));
+	for (i = 0; i < stream_len; i++)
+	{
+		uart_rx(test_rx_buf[i]);
+	}
+	memcpy(exp_ring, serial_ring, sizeof(serial_ring));
+
+	rx_seq = 0;
+	serial_ring_reset();
+	memset(serial_ring, 0, sizeof(serial_ring));
+	/* Odd split points, including one inside an escape sequence */
+	uart_rx_buf(test_rx_buf, 1);
+	uart_rx_buf(test_rx_buf + 1, 7);
+	uart_rx_buf(test_rx_buf + 8, stream_len - 8);
+
+	if (memcmp(exp_ring, serial_ring, sizeof(serial_ring)))
+	{
+		fprintf(stderr, "Batch decode differs from byte decode\n");
+		return 1;
+	}
+
+	for (i = 0; (cmd = serial_ring_peek()); i++)
+	{
+		if (cmd->cmd_len != sizeof(payload) - i || memcmp(cmd->cmd, payload + i, cmd->cmd_len))
+		{
+			fprintf(stderr, "Failed frame %d in the ring\n", i);
+			return 1;
+		}
+		serial_ring_pop();
+	}
+
+	if (i != 3)
+	{
+		fprintf(stderr, "Failed frames: expected 3, got %d\n", i);
+		return 1;
+	}
+
+	fprintf(stderr, "Batch decode OK\n");
+	return 0;
+}
+
+/* Generated encoder -> wire -> generated dispatch */
+int test6()
+{
+	struct msg_fan_pwm m = { 3, ESCAPE_CHAR };
+	int ret, i = 0;
+
+	rx_seq = 0;
+	rx_pos = 0;
+	test_fan = test_pwm = 0;
+	tx_seq = 0;
+
+	msg_send_fan_pwm(&m);
+
+	do {
+		ret = uart_rx(test_rx_buf[i++]);
+	} while(ret);
+
+	if (process_next())
+	{
+		fprintf(stderr, "Failed no frame in the ring\n");
+		return 1;
+	}
+
+	if (test_fan != 3 || test_pwm != ESCAPE_CHAR)
+	{
+		fprintf(stderr, "Failed fan pwm: got fan %d pwm 0x%02x\n", test_fan, test_pwm);
+		return 1;
+	}
+
+	/* One byte short, must not reach the handler */
+	test_fan = test_pwm = 0;
+	rx_pos = 0;
+	serial_send(SET_FAN_PWM_PERC, &m, sizeof(m) - 1);
+
+	i = 0;
+	do {
+		ret = uart_rx(test_rx_buf[i++]);
+	} while(ret);
+
+	process_next();
+
+	if (test_fan != 0)
+	{
+		fprintf(stderr, "Short frame reached the handler\n");
+		return 1;
+	}
+
+	fprintf(stderr, "Message table OK\n");
+	return 0;
+}
+
+/* CRC-16/CCITT-FALSE check value, then a CRC framed round trip */
+int test7()
+{
+	struct msg_fan_pwm m = { 5, END_CHAR };
+	uint16_t crc;
+	int ret, i = 0;
+
+	crc = crc16_update(CRC16_INIT, (const uint8_t *)"123456789", 9);
+	if (crc != 0x29B1)
+	{
+		fprintf(stderr, "Failed CRC check value: got 0x%04x\n", crc);
+		return 1;
+	}
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	test_fan = test_pwm = 0;
+
+	tx_check = CHECK_CRC16;
+	msg_send_fan_pwm(&m);
+	tx_check = CHECK_SUM;
+
+	do {
+		ret = uart_rx(test_rx_buf[i++]);
+	} while(ret);
+
+	if (process_next())
+	{
+		fprintf(stderr, "Failed no frame in the ring\n");
+		return 1;
+	}
+
+	if (test_fan != 5 || test_pwm != END_CHAR)
+	{
+		fprintf(stderr, "Failed CRC frame: got fan %d pwm 0x%02x\n", test_fan, test_pwm);
+		return 1;
+	}
+
+	fprintf(stderr, "CRC frames OK\n");
+	return 0;
+}
+
+/* Link layer timers run off this */
+uint32_t test_ms;
+
+uint32_t link_time_ms(void)
+{
+	return test_ms;
+}
+
+uint32_t test_us;
+
+uint32_t serial_time_us(void)
+{
+	return test_us;
+}
+
+uint32_t test_baud;
+
+void link_set_baud(uint32_t baud)
+{
+	test_baud = baud;
+}
+
+/* Loop test_rx_buf[from..to) back into the parser */
+void feed(int from, int to)
+{
+	for (; from < to; from++)
+	{
+		uart_rx(test_rx_buf[from]);
+	}
+}
+
+/* Reliable mode over loopback: lose a frame, NAK, replay, ACK */
+int test8()
+{
+	struct msg_fan_pwm m = { 0, 50 };
+	int frame[4], nak, replay, ack;
+	int i;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	test_ms = 0;
+
+	/* Our own caps coming back turn reliable mode on */
+	send_link_caps(false);
+	feed(0, rx_pos);
+	if (!link_reliable)
+	{
+		fprintf(stderr, "Failed to negotiate reliable mode\n");
+		return 1;
+	}
+
+	for (i = 0; i < 3; i++)
+	{
+		frame[i] = rx_pos;
+		m.fan = i + 1;
+		msg_send_fan_pwm(&m);
+	}
+	frame[3] = nak = rx_pos;
+
+	/* Frame 2 gets lost, 3 makes a NAK */
+	feed(frame[0], frame[1]);
+	feed(frame[2], frame[3]);
+	replay = rx_pos;
+	if (replay == nak || serial_link_stats.naks_tx != 1)
+	{
+		fprintf(stderr, "Failed no NAK on gap\n");
+		return 1;
+	}
+
+	/* NAK makes the sender replay 2 and 3, taking them makes an ACK */
+	feed(nak, replay);
+	ack = rx_pos;
+	if (serial_link_stats.retransmits != 2)
+	{
+		fprintf(stderr, "Failed replay: %d retransmits\n", serial_link_stats.retransmits);
+		return 1;
+	}
+	feed(replay, ack);
+	feed(ack, rx_pos);
+
+	for (i = 1; i <= 3; i++)
+	{
+		if (process_next())
+		{
+			fprintf(stderr, "Failed frame %d missing\n", i);
+			return 1;
+		}
+
+		if (test_fan != i)
+		{
+			fprintf(stderr, "Failed order: expected fan %d, got %d\n", i, test_fan);
+			return 1;
+		}
+	}
+
+	if (serial_ring_peek() || serial_link_stats.dups)
+	{
+		fprintf(stderr, "Failed duplicate delivered\n");
+		return 1;
+	}
+
+	/* Last frame is acked after the delay, then nothing is in flight */
+	test_ms = LINK_ACK_DELAY_MS;
+	ack = rx_pos;
+	link_poll();
+	feed(ack, rx_pos);
+
+	if (link_window_full() || rx_pos == ack || serial_link_stats.timeouts)
+	{
+		fprintf(stderr, "Failed delayed ACK\n");
+		return 1;
+	}
+
+	test_ms += LINK_RTO_MS;
+	ack = rx_pos;
+	link_poll();
+	if (rx_pos != ack)
+	{
+		fprintf(stderr, "Failed resent acked frames\n");
+		return 1;
+	}
+
+	/* Our own LINK_CREDIT came back too, it's about seqs the next tests reset */
+	link_reliable = false;
+	credit_valid = false;
+	tx_check = CHECK_SUM;
+	link_cobs = false;
+	fprintf(stderr, "Reliable link OK\n");
+	return 0;
+}
+
+/* Loop everything sent so far back in and run it */
+void loop_back()
+{
+	feed(0, rx_pos);
+	rx_pos = 0;
+
+	while (!process_next());
+}
+
+/* Packed upload of a chase program, as long as they go, lands in the shadow program as sent */
+int test9()
+{
+	uint32_t leds[NUM_STEPS_IN_PROGRAM][NUM_LEDS_IN_STRIP], got[NUM_LEDS_IN_STRIP];
+	struct msg_led_step_packed packed;
+	struct msg_led_palette pal;
+	struct led_pack_ctx ctx;
+	int s, i, pos, len, bytes = 0;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+
+	for (s = 0; s < NUM_STEPS_IN_PROGRAM; s++)
+	{
+		pos = s % (2 * NUM_LEDS_IN_STRIP);
+		pos = pos < NUM_LEDS_IN_STRIP ? pos : 2 * NUM_LEDS_IN_STRIP - 1 - pos;
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			leds[s][i] = (i / NUM_ICS_PER_DRAWER) % 2 ? COLOR_BLUE : 0;
+		}
+		leds[s][pos] = COLOR_RED;
+		if (pos)
+		{
+			leds[s][pos - 1] = 0x000040;
+		}
+	}
+
+	led_pack_reset(&ctx);
+	for (s = 0; s < NUM_STEPS_IN_PROGRAM; s++)
+	{
+		len = led_pack_palette(&ctx, leds[s], &pal);
+		if (len)
+		{
+			msg_send_led_palette(&pal, len);
+			loop_back();
+		}
+
+		len = led_pack_step(&ctx, s, leds[s], &packed);
+		if (len < 0 || len >= sizeof(struct msg_led_color))
+		{
+			fprintf(stderr, "Failed to pack step %d: %d\n", s, len);
+			return 1;
+		}
+		PUT_BE16(packed.time, 100 + s);
+		msg_send_led_step_packed(&packed, len);
+		bytes += len;
+		loop_back();
+	}
+
+	for (s = 0; s < NUM_STEPS_IN_PROGRAM; s++)
+	{
+		if (led_step_time(shadow_prg, s) != 100 + s)
+		{
+			fprintf(stderr, "Failed step %d time %d\n", s, led_step_time(shadow_prg, s));
+			return 1;
+		}
+
+		led_step_colors(shadow_prg, s, got, 0);
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			if (got[i] != leds[s][i])
+			{
+				fprintf(stderr, "Failed step %d led %d: expected 0x%06x, got 0x%06x\n",
+					s, i, leds[s][i], got[i]);
+				return 1;
+			}
+		}
+	}
+
+	fprintf(stderr, "Packed LED steps OK, %d bytes for %d raw\n", bytes,
+		(int)(NUM_STEPS_IN_PROGRAM * sizeof(struct msg_led_color)));
+	return 0;
+}
+
+/* Baud switch as the modem: offer, switch, test pattern, then fall back on errors */
+int test10()
+{
+	struct msg_link_baud m = { LINK_BAUD_ACCEPT, 0xFF };
+	int sent;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	test_ms = 0;
+	test_baud = 0;
+
+	link_baud_negotiate();
+	if (!rx_pos || !link_baud_busy())
+	{
+		fprintf(stderr, "Failed no offer sent\n");
+		return 1;
+	}
+
+	/* Play the Pico: it takes everything */
+	rx_pos = 0;
+	msg_send_link_baud(&m);
+	feed(0, rx_pos);
+	link_poll();
+	if (test_baud != 921600)
+	{
+		fprintf(stderr, "Failed switch: at %d\n", test_baud);
+		return 1;
+	}
+
+	/* Test pattern goes out after the settle time, our echo of it completes the switch */
+	sent = rx_pos;
+	test_ms += LINK_BAUD_SETTLE_MS;
+	link_poll();
+	feed(sent, rx_pos);
+	if (rx_pos == sent || link_baud_busy())
+	{
+		fprintf(stderr, "Failed test pattern\n");
+		return 1;
+	}
+
+	/* A few good frames and mostly bad ones */
+	serial_rx_stats.bad_frames += LINK_BAUD_MIN_ERRORS;
+	rx_pos = 0;
+	test_ms += LINK_BAUD_CHECK_MS;
+	link_poll();
+	if (test_baud != 115200 || !rx_pos)
+	{
+		fprintf(stderr, "Failed fallback: at %d\n", test_baud);
+		return 1;
+	}
+
+	tx_check = CHECK_SUM;
+	link_reliable = false;
+	fprintf(stderr, "Baud switch OK\n");
+	return 0;
+}
+
+/* Small frames pack tight, wrap around the end and come out in order */
+int test11()
+{
+	uint8_t frame[CMD_LEN];
+	struct serial_cmd *cmd;
+	int i, n, pushed = 0, popped = 0;
+
+	serial_ring_reset();
+
+	/* Empty frames are 4 bytes + the record header, the old ring took 3 of them */
+	for (n = 0; serial_ring_push(frame, 4, PORT_UART); n++);
+	if (n != SERIAL_RING_SIZE / SERIAL_RING_REC(4))
+	{
+		fprintf(stderr, "Failed ring capacity: %d empty frames\n", n);
+		return 1;
+	}
+	serial_ring_reset();
+
+	/* Mixed sizes, consumer a bit behind, many times around */
+	for (i = 0; i < 2000; i++)
+	{
+		frame[0] = pushed;
+		frame[1] = pushed * 7;
+		if (serial_ring_push(frame, 4 + (pushed * 37) % (CMD_LEN - 4), PORT_UART))
+		{
+			pushed++;
+		}
+
+		if (i % 3 || (cmd = serial_ring_peek()) == NULL)
+		{
+			continue;
+		}
+
+		if (((uint8_t *)cmd)[0] != (uint8_t)popped || ((uint8_t *)cmd)[1] != (uint8_t)(popped * 7))
+		{
+			fprintf(stderr, "Failed ring order: frame %d\n", popped);
+			return 1;
+		}
+		serial_ring_pop();
+		popped++;
+	}
+
+	while ((cmd = serial_ring_peek()))
+	{
+		serial_ring_pop();
+		popped++;
+	}
+
+	if (popped != pushed || pushed < 500)
+	{
+		fprintf(stderr, "Failed ring: pushed %d, popped %d\n", pushed, popped);
+		return 1;
+	}
+
+	fprintf(stderr, "Frame ring OK, %d frames\n", pushed);
+	return 0;
+}
+
+/* Queue / handler times land in the right buckets and GET_STATS dumps them */
+int test12()
+{
+	struct msg_fan_pwm m = { 1, 50 };
+	struct msg_get_stats get = { GET_STATS_RESET };
+	const struct cmd_stats *s = &cmd_stats[MSG_IDX_fan_pwm];
+	const struct msg_stats *st;
+	struct serial_cmd *cmd;
+	int n;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	serial_stats_reset();
+
+	/* In at 1000us, run at 1100us: 100us is bucket 7, [64, 128) */
+	test_us = 1000;
+	msg_send_fan_pwm(&m);
+	feed(0, rx_pos);
+	test_us = 1100;
+	process_next();
+
+	if (s->count != 1 || s->bytes != sizeof(m) || s->queue_max != 100 ||
+		s->queue_hist[7] != 1 || s->handler_hist[0] != 1)
+	{
+		fprintf(stderr, "Failed stats: count %d, queue max %d\n", s->count, s->queue_max);
+		return 1;
+	}
+
+	rx_pos = 0;
+	msg_send_get_stats(&get);
+	loop_back();
+	serial_stats_poll();
+	feed(0, rx_pos);
+
+	/* fan_pwm, then GET_STATS itself, last */
+	for (n = 0; (cmd = serial_ring_peek()); n++)
+	{
+		st = msg_decode_stats(cmd);
+		if (cmd->cmd_type != SEND_STATS || !st || GET_BE32(st->count) != 1 ||
+			st->cmd_type != (n ? GET_STATS : SET_FAN_PWM_PERC) ||
+			(st->flags & MSG_STATS_LAST) != (n ? MSG_STATS_LAST : 0))
+		{
+			fprintf(stderr, "Failed stats dump: frame %d\n", n);
+			return 1;
+		}
+
+		if (!n && (GET_BE32(st->queue_max) != 100 || GET_BE16(st->queue_hist[7]) != 1))
+		{
+			fprintf(stderr, "Failed stats encoding\n");
+			return 1;
+		}
+		serial_ring_pop();
+	}
+
+	if (n != 2 || s->count)
+	{
+		fprintf(stderr, "Failed stats dump: %d frames, %d left\n", n, s->count);
+		return 1;
+	}
+
+	test_us = 0;
+	fprintf(stderr, "Command stats OK\n");
+	return 0;
+}
+
+char test_log[1024];
+
+void log_write(const char *str)
+{
+	strncat(test_log, str, sizeof(test_log) - strlen(test_log) - 1);
+}
+
+/* LOG() records come out formatted here, and from the modem as SEND_LOG_TOKENS */
+int test13()
+{
+	uint8_t buf[CMD_LEN];
+	int i, len, n;
+
+	log_flush();
+	test_log[0] = 0;
+
+	LOG(LOG_NO_CRC);
+	LOG(LOG_BAUD_ERRORS, 5, 20, 921600, 115200);
+	log_flush();
+	if (strcmp(test_log, "CRC frame but no CRC support\n5 of 20 frames bad at 921600 baud, back to 115200\n"))
+	{
+		fprintf(stderr, "Failed log format: %s\n", test_log);
+		return 1;
+	}
+
+	/* The modem's side: packed, sent, formatted by on_log_tokens() */
+	test_log[0] = 0;
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	LOG(LOG_FAN_PWM, 2, 75);
+	LOG(LOG_PARITY, 0x12, 0xab);
+	len = log_pack(buf, sizeof(buf), &n);
+	if (n != 2 || len != 2 + 2 + 2 + 1 + 2)
+	{
+		fprintf(stderr, "Failed log pack: %d records, %d bytes\n", n, len);
+		return 1;
+	}
+	msg_send_log_tokens((const struct msg_log_tokens *)buf, len);
+	loop_back();
+	if (strcmp(test_log, "LOG: Setting fan 2 PWM to 75\nLOG: Parity failed: expected 0x12, got 0xab\n"))
+	{
+		fprintf(stderr, "Failed log tokens: %s\n", test_log);
+		return 1;
+	}
+	log_flush();
+
+	/* A full ring drops and says how many */
+	for (i = 0; i < LOG_RING_SIZE + 3; i++)
+	{
+		LOG(LOG_FAN_COUNT, i, i);
+	}
+	test_log[0] = 0;
+	log_flush();
+	if (!strstr(test_log, "FAN 31 count 31\n3 log records dropped\n"))
+	{
+		fprintf(stderr, "Failed log drops: %s\n", test_log);
+		return 1;
+	}
+
+	fprintf(stderr, "Tokenized log OK\n");
+	return 0;
+}
+
+/* Records go out in one SEND_TELEMETRY frame and come back out whole */
+int test14()
+{
+	struct msg_telemetry m;
+	const struct msg_telemetry *rx;
+	struct msg_temperature *temp;
+	struct telem_fan_pwm *pwm;
+	struct serial_cmd *cmd;
+	const uint8_t *r;
+	uint8_t type, types = 0;
+	int i, len = 0, pos = 0, size;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+
+	temp = telem_add(&m, &len, TELEM_TEMP, sizeof(*temp));
+	for (i = 0; i < NUM_TEMP_SENSORS; i++)
+	{
+		PUT_BE16(temp->temp[i], 2000 + i);
+	}
+	pwm = telem_add(&m, &len, TELEM_FAN_PWM, sizeof(*pwm));
+	memset(pwm, 40, sizeof(*pwm));
+
+	/* Room runs out before the frame does */
+	if (telem_add(&m, &len, TELEM_LINK, CMD_LEN) || len != 2 * 2 + sizeof(*temp) + sizeof(*pwm))
+	{
+		fprintf(stderr, "Failed telemetry add: %d bytes\n", len);
+		return 1;
+	}
+
+	msg_send_telemetry(&m, len);
+	feed(0, rx_pos);
+	cmd = serial_ring_peek();
+	if (!cmd || cmd->cmd_type != SEND_TELEMETRY)
+	{
+		fprintf(stderr, "Failed telemetry frame\n");
+		return 1;
+	}
+
+	rx = msg_decode_telemetry(cmd);
+	while ((r = telem_next(rx->rec, cmd->cmd_len, &pos, &type, &size)))
+	{
+		types |= 1 << type;
+		if (type == TELEM_TEMP && (size != sizeof(*temp) || GET_BE16(r + 2 * 6) != 2006))
+		{
+			fprintf(stderr, "Failed telemetry temp\n");
+			return 1;
+		}
+
+		if (type == TELEM_FAN_PWM && (size != sizeof(*pwm) || r[0] != 40))
+		{
+			fprintf(stderr, "Failed telemetry pwm\n");
+			return 1;
+		}
+	}
+	serial_ring_pop();
+
+	/* A record cut short ends the walk */
+	pos = 0;
+	for (i = 0; telem_next(m.rec, len - 1, &pos, &type, &size); i++);
+
+	if (types != (1 << TELEM_TEMP | 1 << TELEM_FAN_PWM) || pos != 2 + sizeof(*temp) || i != 1)
+	{
+		fprintf(stderr, "Failed telemetry records: 0x%x, %d\n", types, i);
+		return 1;
+	}
+
+	fprintf(stderr, "Telemetry OK\n");
+	return 0;
+}
+
+/* uart_rx() as if from the UART IRQ */
+bool test_in_irq;
+
+bool serial_in_irq(void)
+{
+	return test_in_irq;
+}
+
+/* The Pico's BULK_STATUS back through the parser: its status, -1 if none came */
+int bulk_reply(int from, uint32_t *offset)
+{
+	const struct msg_bulk_status *m;
+	struct serial_cmd *cmd;
+	int status = -1;
+
+	feed(from, rx_pos);
+	if ((cmd = serial_ring_peek()))
+	{
+		if (cmd->cmd_type == BULK_STATUS && (m = msg_decode_bulk_status(cmd)))
+		{
+			status = m->status;
+			*offset = GET_BE32(m->offset);
+		}
+		serial_ring_pop();
+	}
+
+	return status;
+}
+
+/* Whole LED program as one bulk transfer in extended frames, with a lost chunk */
+int test15()
+{
+	uint8_t blob[1 + 10 * LED_BLOB_STEP];
+	struct msg_bulk_open open = { BULK_LED_PROGRAM };
+	uint32_t leds[NUM_LEDS_IN_STRIP];
+	int i, chunk = SERIAL_EXT_MAX - 4, gap, status;
+	uint32_t offset;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	test_switches = 0;
+
+	/* Our own caps coming back allow extended frames */
+	send_link_caps(false);
+	loop_back();
+	link_reliable = false;
+	tx_check = CHECK_SUM;
+	link_cobs = false;
+	if (!link_ext)
+	{
+		fprintf(stderr, "Failed to negotiate extended frames\n");
+		return 1;
+	}
+
+	blob[0] = 10;
+	for (i = 1; i < sizeof(blob); i++)
+	{
+		blob[i] = i * 7;
+	}
+
+	PUT_BE32(open.size, sizeof(blob));
+	PUT_BE16(open.crc, crc16_update(CRC16_INIT, blob, sizeof(blob)));
+	msg_send_bulk_open(&open);
+	loop_back();
+	if ((status = bulk_reply(0, &offset)) != BULK_OK)
+	{
+		fprintf(stderr, "Failed bulk open: %d\n", status);
+		return 1;
+	}
+
+	/* First of three chunks lost on the way, the next one gets a BULK_OFFSET */
+	rx_pos = 0;
+	bulk_send_chunk(chunk, blob + chunk, chunk);
+	gap = rx_pos;
+	feed(0, gap);
+	if ((status = bulk_reply(gap, &offset)) != BULK_OFFSET || offset != 0)
+	{
+		fprintf(stderr, "Failed bulk gap: %d at %d\n", status, offset);
+		return 1;
+	}
+
+	rx_pos = 0;
+	for (i = 0; i < sizeof(blob); i += chunk)
+	{
+		bulk_send_chunk(i, blob + i, sizeof(blob) - i < chunk ? sizeof(blob) - i : chunk);
+	}
+	if (rx_pos < 2 * SERIAL_FRAME_MAX)
+	{
+		fprintf(stderr, "Failed extended frames: %d bytes\n", rx_pos);
+		return 1;
+	}
+
+	msg_send_bulk_commit();
+	loop_back();
+	if ((status = bulk_reply(0, &offset)) != BULK_OK || offset != sizeof(blob) || test_switches != 1)
+	{
+		fprintf(stderr, "Failed bulk commit: %d at %d\n", status, offset);
+		return 1;
+	}
+
+	led_step_colors(shadow_prg, 9, leds, 0);
+	if (shadow_prg->num_steps != 10 || led_step_time(shadow_prg, 9) != ((uint8_t)(1153 * 7) << 8 | (uint8_t)(1154 * 7)) ||
+		leds[41] != ((uint8_t)(1278 * 7) << 16 | (uint8_t)(1279 * 7) << 8 | (uint8_t)(1280 * 7)))
+	{
+		fprintf(stderr, "Failed bulk program: %d steps, time %d\n", shadow_prg->num_steps, led_step_time(shadow_prg, 9));
+		return 1;
+	}
+
+	/* Nothing open any more */
+	rx_pos = 0;
+	msg_send_bulk_commit();
+	loop_back();
+	if ((status = bulk_reply(0, &offset)) != BULK_NOT_OPEN)
+	{
+		fprintf(stderr, "Failed bulk close: %d\n", status);
+		return 1;
+	}
+
+	link_ext = false;
+	fprintf(stderr, "Bulk transfer OK\n");
+	return 0;
+}
+
+/* Lost END, line noise, a runaway frame and a stalled one all end at the next START */
+int test16()
+{
+	struct msg_fan_pwm m = { 2, 30 };
+	uint8_t junk[SERIAL_FRAME_MAX + 8];	/* the host parser is the Pico's */
+	struct serial_rx_stats before = serial_rx_stats;
+	int len, i, n = 0;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	msg_send_fan_pwm(&m);
+	len = rx_pos;
+
+	/* Frame without its END, then a good one */
+	feed(0, len - 1);
+	feed(0, len);
+
+	/* Noise, then a good one */
+	memset(junk, 0x33, sizeof(junk));
+	uart_rx_buf(junk, 16);
+	feed(0, len);
+
+	/* Longer than any frame, byte by byte and batched */
+	junk[0] = START_CHAR;
+	for (i = 0; i < sizeof(junk); i++)
+	{
+		uart_rx(junk[i]);
+	}
+	uart_rx(END_CHAR);
+	uart_rx_buf(junk, sizeof(junk));
+	feed(len - 1, len);
+	feed(0, len);
+
+	/* Stalls halfway, the rest comes too late */
+	feed(0, len / 2);
+	test_us += SERIAL_RX_TIMEOUT_US + 1;
+	feed(len / 2, len);
+	feed(0, len);
+	test_us = 0;
+
+	for (; !process_next(); n++)
+	{
+		if (test_fan != 2 || test_pwm != 30)
+		{
+			fprintf(stderr, "Failed resync frame %d\n", n);
+			return 1;
+		}
+	}
+
+	if (n != 4 || serial_rx_stats.resyncs - before.resyncs != 1 ||
+		serial_rx_stats.overlong - before.overlong != 2 ||
+		serial_rx_stats.timeouts - before.timeouts != 1 ||
+		serial_rx_stats.noise - before.noise < 16 ||
+		serial_rx_stats.bad_frames - before.bad_frames != 4)
+	{
+		fprintf(stderr, "Failed resync: %d frames, %d resyncs, %d overlong, %d timeouts\n", n,
+			serial_rx_stats.resyncs - before.resyncs, serial_rx_stats.overlong - before.overlong,
+			serial_rx_stats.timeouts - before.timeouts);
+		return 1;
+	}
+
+	fprintf(stderr, "Resync OK\n");
+	return 0;
+}
+
+/* Peer's answer to a LINK_TIME ping sent at t1, taken at t4 */
+void time_pong(uint32_t t1, uint32_t t2, uint32_t t3, uint32_t t4)
+{
+	struct msg_link_time m = { LINK_TIME_PONG };
+
+	PUT_BE32(m.t1, t1);
+	PUT_BE32(m.t2, t2);
+	PUT_BE32(m.t3, t3);
+	rx_pos = 0;
+	msg_send_link_time(&m);
+	test_us = t4;
+	feed(0, rx_pos);
+}
+
+/* LINK_TIME: pings get answered, the offset comes from the shortest round trip */
+int test17()
+{
+	struct serial_cmd *cmd;
+	int start;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+
+	/* Ping comes back as a pong with our own times */
+	test_us = 1000;
+	link_time_ping();
+	start = rx_pos;
+	test_us = 1500;
+	feed(0, start);
+	if (rx_pos == start || test_rx_buf[start + 3] != LINK_TIME)
+	{
+		fprintf(stderr, "Failed no pong\n");
+		return 1;
+	}
+
+	/* Peer 50ms ahead: 200us out, 50us in its handler, 250us back */
+	time_pong(1000, 51200, 51250, 1500);
+	if (link_clock.offset_us != 49975 || link_clock.rtt_us != 450 ||
+		link_peer_to_local_us(61000) != 61000 - 49975)
+	{
+		fprintf(stderr, "Failed clock: offset %d, rtt %d\n", link_clock.offset_us, link_clock.rtt_us);
+		return 1;
+	}
+
+	/* Queued on the way back, worse round trip: ignored */
+	time_pong(2000, 52200, 52250, 4500);
+	if (link_clock.offset_us != 49975 || link_clock.rtt_us != 450)
+	{
+		fprintf(stderr, "Failed clock filter: offset %d\n", link_clock.offset_us);
+		return 1;
+	}
+
+	/* Link frames stay out of the ring */
+	if ((cmd = serial_ring_peek()))
+	{
+		fprintf(stderr, "Failed LINK_TIME queued\n");
+		return 1;
+	}
+
+	test_us = 0;
+	fprintf(stderr, "Clock sync OK, %d samples\n", link_clock.samples);
+	return 0;
+}
+
+/* Transport busy with a log burst: control goes next, then telemetry, logs last, seq in wire order */
+extern volatile bool tx_busy;
+
+int test18()
+{
+	static const uint8_t order[] = { SET_FAN_PWM_PERC, SEND_FAN_PWM, SEND_LOG, SEND_LOG };
+	struct msg_fan_pwm fan = { 1, 30 };
+	struct msg_tacho tacho;
+	struct serial_cmd *cmd;
+	int i;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	memset(&tacho, 0, sizeof(tacho));
+	memset(tx_chan_stats, 0, sizeof(tx_chan_stats));
+
+	tx_busy = true;
+	send_log("first %d\n", 1);
+	send_log("second %d\n", 2);
+	msg_send_tacho(&tacho);
+	msg_send_fan_pwm(&fan);
+	if (rx_pos || tx_chan_stats[CHAN_LOG].depth != 2 || tx_chan_stats[CHAN_CONTROL].depth != 1)
+	{
+		fprintf(stderr, "Failed queued: %d bytes out\n", rx_pos);
+		return 1;
+	}
+
+	/* The frame that kept it busy is done */
+	uart_tx_done();
+	feed(0, rx_pos);
+
+	for (i = 0; i < sizeof(order); i++)
+	{
+		cmd = serial_ring_peek();
+		if (!cmd || cmd->cmd_type != order[i] || cmd->seq != i)
+		{
+			fprintf(stderr, "Failed frame %d: 0x%02x seq %d\n", i, cmd ? cmd->cmd_type : 0, cmd ? cmd->seq : 0);
+			return 1;
+		}
+		serial_ring_pop();
+	}
+
+	if (tx_chan_stats[CHAN_LOG].peak != 2 || tx_chan_stats[CHAN_LOG].depth || tx_chan_stats[CHAN_CONTROL].frames != 1)
+	{
+		fprintf(stderr, "Failed channel stats\n");
+		return 1;
+	}
+
+	fprintf(stderr, "TX channels OK\n");
+	return 0;
+}
+
+/* Peer's ring has room for credit frames from seq on */
+void give_credit(uint8_t seq, int frames, int len)
+{
+	struct msg_link_credit m;
+	uint8_t frame[2 * sizeof(m) + 8];
+	int start = rx_pos, n, i;
+
+	m.next_seq = seq;
+	PUT_BE16(m.free, frames * SERIAL_RING_REC(len));
+	m.rec_hdr = SERIAL_RING_HDR;
+	msg_send_link_credit(&m);
+
+	/* Off the wire first, what it lets go gets sent from here */
+	n = rx_pos - start;
+	memcpy(frame, &test_rx_buf[start], n);
+	rx_pos = start;
+	for (i = 0; i < n; i++)
+	{
+		uart_rx(frame[i]);
+	}
+}
+
+/* Sender stops when the peer's credit runs out and goes on with the next update, receiver advertises its ring */
+int test19()
+{
+	extern uint16_t credit_free;
+	struct msg_fan_pwm m = { 0, 40 };
+	int len = sizeof(struct serial_cmd) + sizeof(m), i, sent;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	serial_ring_reset();
+
+	give_credit(0, 2, len);
+	for (i = 0; i < 3; i++)
+	{
+		m.fan = i;
+		msg_send_fan_pwm(&m);
+	}
+
+	sent = rx_pos;
+	if (!uart_tx_held() || tx_seq != 2 || !serial_tx_stats.held)
+	{
+		fprintf(stderr, "Failed credit: %d sent\n", tx_seq);
+		return 1;
+	}
+
+	/* Both in the ring, room for one more */
+	feed(0, sent);
+	give_credit(2, 1, len);
+	if (uart_tx_held() || tx_seq != 3)
+	{
+		fprintf(stderr, "Failed credit update: %d sent\n", tx_seq);
+		return 1;
+	}
+	feed(sent, rx_pos);
+
+	/* Our side: three frames in the ring, the update says so */
+	rx_pos = 0;
+	test_ms += LINK_CREDIT_KEEPALIVE_MS;
+	link_poll();
+	feed(0, rx_pos);
+	if (!credit_valid || credit_free != SERIAL_RING_SIZE - SERIAL_RING_REC(4 + SERIAL_PAYLOAD_MAX) -
+		3 * SERIAL_RING_REC(len))
+	{
+		fprintf(stderr, "Failed advertised %d\n", credit_free);
+		return 1;
+	}
+
+	while (!process_next());
+	credit_valid = false;
+
+	fprintf(stderr, "Credit flow control OK\n");
+	return 0;
+}
+
+/* Pico side answers for test20: sensor n reads 21 + n degrees */
+int rpc_answer(uint8_t method, const uint8_t *arg, int arg_len, struct msg_telemetry *out, int *len)
+{
+	struct msg_temperature *temp;
+	int i;
+
+	if (method != RPC_GET_TEMP)
+	{
+		return RPC_NO_METHOD;
+	}
+
+	temp = telem_add(out, len, TELEM_TEMP, sizeof(*temp));
+	for (i = 0; i < NUM_TEMP_SENSORS; i++)
+	{
+		PUT_BE16(temp->temp[i], 2100 + 100 * i);
+	}
+
+	return RPC_OK;
+}
+
+/* Request looped back, the reply it got copied to r: reply length, -1 if none came */
+int rpc_round(uint8_t id, uint8_t method, struct msg_rpc_reply *r)
+{
+	struct msg_rpc_request m = { id, method };
+	struct serial_cmd *cmd;
+	int len = -1;
+
+	rx_pos = 0;
+	msg_send_rpc_request(&m, 2);
+	loop_back();
+
+	feed(0, rx_pos);
+	if ((cmd = serial_ring_peek()))
+	{
+		if (cmd->cmd_type == RPC_REPLY)
+		{
+			len = cmd->cmd_len;
+			memcpy(r, msg_decode_rpc_reply(cmd), len);
+		}
+		serial_ring_pop();
+	}
+
+	return len;
+}
+
+/* RPC: answer with its records and the caller's id, unknown methods get RPC_NO_METHOD */
+int test20()
+{
+	struct msg_rpc_reply r;
+	const uint8_t *rec;
+	uint8_t type;
+	int len, pos = 0, size, i;
+
+	rx_seq = tx_seq = 0;
+	serial_ring_reset();
+	serial_rpc_stats.calls = 0;
+
+	len = rpc_round(7, RPC_GET_TEMP, &r);
+	if (len < 3 || r.id != 7 || r.method != RPC_GET_TEMP || r.status != RPC_OK)
+	{
+		fprintf(stderr, "Failed GET_TEMP reply: len %d, id %d, status %d\n", len, r.id, r.status);
+		return 1;
+	}
+
+	rec = telem_next(r.rec, len - 3, &pos, &type, &size);
+	if (!rec || type != TELEM_TEMP || size != sizeof(struct msg_temperature))
+	{
+		fprintf(stderr, "Failed GET_TEMP record\n");
+		return 1;
+	}
+
+	for (i = 0; i < NUM_TEMP_SENSORS; i++)
+	{
+		if (GET_BE16(rec + 2 * i) != 2100 + 100 * i)
+		{
+			fprintf(stderr, "Failed sensor %d: %d\n", i, GET_BE16(rec + 2 * i));
+			return 1;
+		}
+	}
+
+	len = rpc_round(8, 0x55, &r);
+	if (len != 3 || r.id != 8 || r.status != RPC_NO_METHOD || serial_rpc_stats.calls != 2)
+	{
+		fprintf(stderr, "Failed unknown method: len %d, status %d\n", len, r.status);
+		return 1;
+	}
+
+	fprintf(stderr, "RPC OK\n");
+	return 0;
+}
+
+/* Multi-drop bus: addressed frames, skipping other nodes' frames, POLL / DONE turns */
+int test21()
+{
+	extern bool bus_on, bus_token;
+	struct msg_fan_pwm m = { 1, 10 };
+	int to_1, to_2, reply;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	test_ms = 0;
+	serial_ring_reset();
+	memset(&serial_bus_stats, 0, sizeof(serial_bus_stats));
+
+	/* Master: a frame for node 1, then its turn, which it never gives back */
+	bus_init(BUS_MASTER);
+	bus_select(1);
+	msg_send_fan_pwm(&m);
+	to_1 = rx_pos;
+	if (test_rx_buf[1] != 1 || serial_bus_stats.polls != 1 || bus_token)
+	{
+		fprintf(stderr, "Failed master frame: addr 0x%02x, %d polls\n", test_rx_buf[1], serial_bus_stats.polls);
+		return 1;
+	}
+
+	test_ms += BUS_SLOT_MS;
+	bus_check(test_ms);
+	if (!bus_token || serial_bus_stats.timeouts != 1)
+	{
+		fprintf(stderr, "Failed to take the line back\n");
+		return 1;
+	}
+
+	bus_select(2);
+	m.fan = 2;
+	m.pwm = 20;
+	msg_send_fan_pwm(&m);
+	to_2 = rx_pos;
+
+	/* Node 2: holds its frame until polled, skips node 1's */
+	bus_init(2);
+	rx_seq = tx_seq = 0;
+	tx_check = CHECK_CRC16;
+	m.fan = 3;
+	m.pwm = 30;
+	msg_send_fan_pwm(&m);
+	if (rx_pos != to_2 || !uart_tx_held())
+	{
+		fprintf(stderr, "Failed node sent without a poll\n");
+		return 1;
+	}
+
+	feed(0, to_1);
+	if (serial_ring_peek() || serial_bus_stats.other != 2 || rx_pos != to_2)
+	{
+		fprintf(stderr, "Failed skipping node 1's frames: %d skipped\n", serial_bus_stats.other);
+		return 1;
+	}
+
+	feed(to_1, to_2);
+	reply = rx_pos;
+	if (process_next() || test_fan != 2 || test_pwm != 20)
+	{
+		fprintf(stderr, "Failed node frame: fan %d pwm %d\n", test_fan, test_pwm);
+		return 1;
+	}
+
+	if (reply == to_2 || test_rx_buf[to_2 + 1] != 0x82 || bus_token)
+	{
+		fprintf(stderr, "Failed node reply: addr 0x%02x\n", test_rx_buf[to_2 + 1]);
+		return 1;
+	}
+	tx_check = CHECK_SUM;
+
+	/* Master again: node 2's reply only counts while node 2 is selected */
+	bus_init(BUS_MASTER);
+	bus_select(1);
+	feed(to_2, reply);
+	if (serial_ring_peek() || serial_bus_stats.other != 4)
+	{
+		fprintf(stderr, "Failed master took another node's frame\n");
+		return 1;
+	}
+
+	bus_select(2);
+	bus_token = false;
+	feed(to_2, reply);
+	if (process_next() || test_fan != 3 || test_pwm != 30 || !bus_token)
+	{
+		fprintf(stderr, "Failed master RX: fan %d pwm %d, token %d\n", test_fan, test_pwm, bus_token);
+		return 1;
+	}
+
+	bus_on = false;
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+
+	fprintf(stderr, "Bus OK\n");
+	return 0;
+}
+
+/* What went out the USB port */
+uint8_t test_usb_buf[2048];
+int usb_pos;
+
+int usb_tx_write(const uint8_t *buf, int len)
+{
+	memcpy(test_usb_buf + usb_pos, buf, len);
+	usb_pos += len;
+
+	return 0;
+}
+
+/* USB port: its own parser next to the UART's, replies go back out USB, no link layer */
+int test22()
+{
+	struct msg_rpc_request req = { 9, RPC_GET_TEMP };
+	struct msg_fan_pwm m = { 1, 40 };
+	struct serial_cmd *cmd;
+	uint8_t link[2] = { 0 };
+	int req_len, uart_len;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = usb_pos = 0;
+	serial_ring_reset();
+	memset(serial_port_stats, 0, sizeof(serial_port_stats));
+
+	serial_port_send(PORT_USB, RPC_REQUEST, &req, 2);
+	req_len = usb_pos;
+	msg_send_fan_pwm(&m);
+	uart_len = rx_pos;
+	if (!req_len || serial_port_stats[PORT_USB].tx_frames != 1 || !uart_len)
+	{
+		fprintf(stderr, "Failed to send: %d bytes USB, %d UART\n", req_len, uart_len);
+		return 1;
+	}
+
+	/* The UART frame comes in halfway through the USB one */
+	serial_rx_buf(PORT_USB, test_usb_buf, req_len / 2);
+	feed(0, uart_len);
+	serial_rx_buf(PORT_USB, test_usb_buf + req_len / 2, req_len - req_len / 2);
+	rx_pos = usb_pos = 0;
+
+	if (serial_ring_port() != PORT_UART || process_next() || test_fan != 1 || test_pwm != 40)
+	{
+		fprintf(stderr, "Failed UART frame: fan %d pwm %d\n", test_fan, test_pwm);
+		return 1;
+	}
+
+	if (serial_ring_port() != PORT_USB || process_next() || serial_port_stats[PORT_USB].rx_frames != 1)
+	{
+		fprintf(stderr, "Failed USB frame\n");
+		return 1;
+	}
+
+	if (rx_pos || !usb_pos)
+	{
+		fprintf(stderr, "Failed reply port: %d bytes UART, %d USB\n", rx_pos, usb_pos);
+		return 1;
+	}
+
+	/* Back in through the USB parser as the host would see it */
+	req_len = usb_pos;
+	usb_pos = 0;
+	serial_rx_buf(PORT_USB, test_usb_buf, req_len);
+	cmd = serial_ring_peek();
+	if (!cmd || cmd->cmd_type != RPC_REPLY || msg_decode_rpc_reply(cmd)->id != 9)
+	{
+		fprintf(stderr, "Failed USB reply\n");
+		return 1;
+	}
+	serial_ring_pop();
+
+	/* Link frames only mean something on the UART */
+	serial_port_send(PORT_USB, LINK_ACK, link, sizeof(link));
+	serial_rx_buf(PORT_USB, test_usb_buf, usb_pos);
+	if (serial_ring_peek())
+	{
+		fprintf(stderr, "Failed LINK frame on USB taken\n");
+		return 1;
+	}
+
+	rx_seq = tx_seq = 0;
+	rx_pos = usb_pos = 0;
+
+	fprintf(stderr, "USB port OK\n");
+	return 0;
+}
+
+/* COBS framing: no zeros between the delimiters, long blocks, mixed with escaped frames, resync */
+int test23()
+{
+	struct serial_rx_stats before = serial_rx_stats;
+	struct msg_fan_pwm m = { 0, START_CHAR };
+	struct serial_cmd *cmd;
+	uint8_t payload[252];
+	int i, legacy, cut;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	serial_ring_reset();
+
+	/* Our own caps coming back allow COBS */
+	send_link_caps(false);
+	loop_back();
+	link_reliable = false;
+	credit_valid = false;
+	tx_check = CHECK_SUM;
+	if (!link_cobs)
+	{
+		fprintf(stderr, "Failed to negotiate COBS\n");
+		return 1;
+	}
+
+	rx_seq = tx_seq = 0;
+	msg_send_fan_pwm(&m);
+	if (rx_pos != sizeof(struct serial_cmd) + sizeof(m) + 3 || test_rx_buf[0] != COBS_DELIM ||
+		test_rx_buf[rx_pos - 1] != COBS_DELIM || memchr(test_rx_buf + 1, COBS_DELIM, rx_pos - 2))
+	{
+		fprintf(stderr, "Failed COBS frame: %d bytes\n", rx_pos);
+		return 1;
+	}
+
+	test_fan = 0xFF;
+	loop_back();
+	if (test_fan != 0 || test_pwm != START_CHAR)
+	{
+		fprintf(stderr, "Failed COBS RX: fan %d pwm %d\n", test_fan, test_pwm);
+		return 1;
+	}
+
+	/* No zeros for more than a block, CRC trailer included, in one batch */
+	for (i = 0; i < sizeof(payload); i++)
+	{
+		payload[i] = i % 0xFF + 1;
+	}
+	tx_check = CHECK_CRC16;
+	serial_send(SEND_LOG, payload, sizeof(payload));
+	tx_check = CHECK_SUM;
+	if (rx_pos > sizeof(struct serial_cmd) + sizeof(payload) + 2 + 4)
+	{
+		fprintf(stderr, "Failed COBS overhead: %d bytes\n", rx_pos);
+		return 1;
+	}
+
+	uart_rx_buf(test_rx_buf, rx_pos);
+	rx_pos = 0;
+	cmd = serial_ring_peek();
+	if (!cmd || cmd->cmd_type != SEND_LOG || cmd->cmd_len != sizeof(payload) ||
+		memcmp(cmd->cmd, payload, sizeof(payload)))
+	{
+		fprintf(stderr, "Failed long COBS frame\n");
+		return 1;
+	}
+	serial_ring_pop();
+
+	/* Escaped and COBS frames back to back, a cut COBS frame resyncs on the next one */
+	link_cobs = false;
+	m.pwm = 10;
+	msg_send_fan_pwm(&m);
+	legacy = rx_pos;
+	link_cobs = true;
+	m.pwm = 20;
+	msg_send_fan_pwm(&m);
+	cut = rx_pos;
+	m.pwm = 30;
+	msg_send_fan_pwm(&m);
+
+	uart_rx_buf(test_rx_buf, legacy + (cut - legacy) / 2);
+	feed(cut, rx_pos);
+	rx_pos = 0;
+	if (process_next() || test_pwm != 10 || process_next() || test_pwm != 30 || serial_ring_peek() ||
+		serial_rx_stats.resyncs - before.resyncs != 1)
+	{
+		fprintf(stderr, "Failed mixed framing: pwm %d\n", test_pwm);
+		return 1;
+	}
+
+	link_cobs = false;
+	rx_seq = tx_seq = 0;
+
+	fprintf(stderr, "COBS OK\n");
+	return 0;
+}
+
+/* Step s's colors in test24: 42 new ones a step */
+#define TEST_LED_COLOR(s, i)	((((s) * NUM_LEDS_IN_STRIP + (i)) * 0x010203 + 1) & 0xFFFFFF)
+
+/* Steps from..to - 1 of prg, time 10 * step. Returns the first one that didn't fit */
+int led_fill(volatile struct led_programs *prg, int from, int to)
+{
+	uint32_t leds[NUM_LEDS_IN_STRIP];
+	int s, i;
+
+	for (s = from; s < to; s++)
+	{
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			leds[i] = TEST_LED_COLOR(s, i);
+		}
+		if (led_step_set(prg, s, 10 * s, leds))
+		{
+			break;
+		}
+	}
+
+	return s;
+}
+
+/* Step s of prg holds what led_fill() put there, as color set s2 */
+int led_check(volatile struct led_programs *prg, int s, int s2)
+{
+	uint32_t got[NUM_LEDS_IN_STRIP];
+	int i;
+
+	led_step_colors(prg, s, got, 8);
+	for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+	{
+		if (got[i] != (uint32_t)TEST_LED_COLOR(s2, i) << 8 || led_step_time(prg, s) != 10 * s)
+		{
+			fprintf(stderr, "Failed step %d led %d: 0x%08x\n", s, i, got[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Compact LED programs: palette steps, RGB once it's full, both programs in one pool */
+int test24()
+{
+	const int small = sizeof(struct led_step) + NUM_LEDS_IN_STRIP;
+	const int big = sizeof(struct led_step) + 3 * NUM_LEDS_IN_STRIP;
+	volatile struct led_programs *a = &led_programs[0], *b = &led_programs[1];
+	uint32_t leds[NUM_LEDS_IN_STRIP], got[NUM_LEDS_IN_STRIP];
+	int s, i, n, free_before;
+
+	led_prog_reset(a);
+	led_prog_reset(b);
+
+	/* 42 new colors a step: the palette is full after 6, the rest are RGB */
+	if (led_fill(a, 0, 8) != 8)
+	{
+		fprintf(stderr, "Failed to store 8 steps\n");
+		return 1;
+	}
+
+	if (a->palette_len != LED_PROG_PALETTE || a->used != 6 * small + 2 * big)
+	{
+		fprintf(stderr, "Failed LED store: %d colors, %d bytes\n", a->palette_len, a->used);
+		return 1;
+	}
+
+	for (s = 0; s < 8; s++)
+	{
+		if (led_check(a, s, s))
+		{
+			return 1;
+		}
+	}
+
+	/* Set again, an indexed step fits where it was */
+	for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+	{
+		leds[i] = i < 10 ? COLOR_RED : 0;
+	}
+	led_step_set(a, 7, 5, leds);
+	led_step_colors(a, 7, got, 0);
+	if (a->used != 6 * small + 2 * big || got[9] != COLOR_RED || got[10] || led_step_time(a, 7) != 5)
+	{
+		fprintf(stderr, "Failed step rewrite: %d bytes\n", a->used);
+		return 1;
+	}
+
+	/* New colors, the palette is full: step 2 goes RGB, moves, the ones after it close up */
+	for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+	{
+		leds[i] = TEST_LED_COLOR(100, i);
+	}
+	led_step_set(a, 2, 20, leds);
+	if (a->used != 5 * small + 3 * big || led_check(a, 2, 100) || led_check(a, 0, 0) ||
+		led_check(a, 3, 3) || led_check(a, 6, 6) || led_step_time(a, 7) != 5)
+	{
+		fprintf(stderr, "Failed step regrow: %d bytes\n", a->used);
+		return 1;
+	}
+
+	/* The other program takes the rest of the pool, then no more */
+	free_before = led_pool_free();
+	for (n = 0; n < NUM_STEPS_IN_PROGRAM; n++)
+	{
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			leds[i] = (n * NUM_LEDS_IN_STRIP + i) * 0x030201;
+		}
+		if (led_step_set(b, n, 1, leds))
+		{
+			break;
+		}
+	}
+	if (n != 6 + (free_before - 6 * small) / big || led_pool_free() >= big)
+	{
+		fprintf(stderr, "Failed pool: %d steps in %d bytes\n", n, free_before);
+		return 1;
+	}
+
+	if (led_check(a, 0, 0))
+	{
+		fprintf(stderr, "Failed pool: program 0 overwritten\n");
+		return 1;
+	}
+
+	/* Steps never set are off */
+	led_prog_reset(b);
+	led_step_colors(b, 3, got, 8);
+	if (led_pool_free() != LED_POOL_SIZE - a->used || got[0] || got[41] || led_step_time(b, 3))
+	{
+		fprintf(stderr, "Failed reset: %d free\n", led_pool_free());
+		return 1;
+	}
+
+	/* Regrow from the top end too */
+	led_fill(b, 0, 8);
+	for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+	{
+		leds[i] = TEST_LED_COLOR(100, i);
+	}
+	led_step_set(b, 1, 10, leds);
+	if (b->used != 5 * small + 3 * big || led_check(b, 1, 100) || led_check(b, 0, 0) ||
+		led_check(b, 2, 2) || led_check(b, 5, 5) || led_check(b, 7, 7) || led_check(a, 1, 1))
+	{
+		fprintf(stderr, "Failed program 1 regrow: %d bytes\n", b->used);
+		return 1;
+	}
+
+	fprintf(stderr, "LED store OK, %d steps of %d bytes where the fixed layout holds %d\n",
+		LED_POOL_SIZE / small, small, (int)(2 * (2 * NUM_LEDS_IN_STRIP)));
+
+	led_prog_reset(a);
+	led_prog_reset(b);
+	return 0;
+}
+
+/* A sender waiting on a full channel: time goes by, and from test_fed on what it sent comes back */
+int test_waits, test_fed = -1;
+
+void link_wait(void)
+{
+	int to = rx_pos;
+
+	test_waits++;
+	test_ms++;
+
+	if (test_fed >= 0)
+	{
+		feed(test_fed, to);
+		test_fed = to;
+		link_poll();
+	}
+}
+
+/* Full channels: telemetry drops right away, control waits for the peer's ACK, or gives up */
+int test25()
+{
+	struct msg_fan_power_state power = { 1 };
+	struct msg_temperature temp = { 0 };
+	int i, ret = 0, waits, start;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	test_ms = 0;
+	test_waits = 0;
+
+	send_link_caps(false);
+	feed(0, rx_pos);
+	start = rx_pos;
+
+	/* Nothing comes back: the window fills, then the channel */
+	for (i = 0; i < 64 && !test_waits; i++)
+	{
+		ret = msg_send_fan_power_state(&power);
+	}
+	if (!ret || i <= LINK_WINDOW || test_waits < TX_WAIT_MS)
+	{
+		fprintf(stderr, "Failed full control channel: %d frames, %d waits\n", i, test_waits);
+		return 1;
+	}
+
+	waits = test_waits;
+	for (i = 0; i < 64 && !msg_send_temperature(&temp); i++);
+	if (i == 64 || test_waits != waits)
+	{
+		fprintf(stderr, "Failed full telemetry channel: %d frames, %d waits\n", i, test_waits - waits);
+		return 1;
+	}
+
+	/* The peer is there: its ACK frees the window, the frame goes */
+	test_fed = start;
+	waits = test_waits;
+	if (msg_send_fan_power_state(&power) || test_waits - waits >= TX_WAIT_MS)
+	{
+		fprintf(stderr, "Failed control frame after ACK: %d waits\n", test_waits - waits);
+		return 1;
+	}
+	waits = test_waits - waits;
+
+	for (i = 0; i < 2 * TX_WAIT_MS && uart_tx_held(); i++)
+	{
+		link_wait();
+	}
+	while (!process_next());
+	test_fed = -1;
+
+	link_reliable = false;
+	credit_valid = false;
+	tx_check = CHECK_SUM;
+	link_cobs = false;
+	fprintf(stderr, "TX back-pressure OK, %d ms waited\n", waits);
+	return 0;
+}
+
+/* Bus master: what node 1 didn't ack yet goes again once it's selected again, node 2's frames don't */
+int test26()
+{
+	extern uint8_t tx_base;
+	extern bool tx_replaying;
+	struct tx_frame f = { 3, 0, { 1, 2, 3 } };
+	const struct tx_frame *r;
+	int n;
+
+	rx_seq = tx_seq = tx_base = 0;
+	link_reliable = true;
+	link_peers_reset();
+
+	/* Two frames out to node 1, no ACK */
+	link_tx_sent(&f);
+	f.seq = 1;
+	f.buf[0] = 9;
+	link_tx_sent(&f);
+	tx_seq = 2;
+
+	n = link_peer_switch(1, 2);
+	if (n || tx_seq || tx_base || tx_replaying)
+	{
+		fprintf(stderr, "Failed node 2 state: %d to replay, seq %d\n", n, tx_seq);
+		return 1;
+	}
+
+	f.seq = 0;
+	f.buf[0] = 5;
+	link_tx_sent(&f);
+	tx_seq = 1;
+
+	n = link_peer_switch(2, 1);
+	r = link_tx_replay();
+	if (n != 2 || !r || r->seq != 0 || r->buf[0] != 1)
+	{
+		fprintf(stderr, "Failed node 1 replay: %d frames\n", n);
+		return 1;
+	}
+
+	r = link_tx_replay();
+	if (!r || r->seq != 1 || r->buf[0] != 9 || link_tx_replay() || tx_seq != 2)
+	{
+		fprintf(stderr, "Failed node 1 second frame\n");
+		return 1;
+	}
+
+	n = link_peer_switch(1, 2);
+	r = link_tx_replay();
+	if (n != 1 || !r || r->buf[0] != 5)
+	{
+		fprintf(stderr, "Failed node 2 replay: %d frames\n", n);
+		return 1;
+	}
+
+	link_reliable = false;
+	tx_replaying = false;
+	rx_seq = tx_seq = tx_base = 0;
+	link_peers_reset();
+
+	fprintf(stderr, "Bus peer replay OK\n");
+	return 0;
+}
+
+/* A sum frame straight onto the wire, its parity over the bytes that are there */
+void feed_sum_frame(const uint8_t *hdr, int len)
+{
+	uint8_t parity = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+	{
+		parity += hdr[i];
+	}
+
+	uart_rx(START_CHAR);
+	uart_rx(parity);
+	for (i = 0; i < len; i++)
+	{
+		uart_rx(hdr[i]);
+	}
+	uart_rx(END_CHAR);
+}
+
+/* Sum frames cut short: the sum matches, the length doesn't, nothing stale gets through */
+int test27()
+{
+	uint8_t good[] = { 0, SET_FAN_PWM_PERC, sizeof(struct msg_fan_pwm), 2, 30 };
+	uint8_t cut[] = { 0, SET_FAN_PWM_PERC, sizeof(struct msg_fan_pwm), 5 };
+	uint8_t hdr[] = { 0, SET_FAN_PWM_PERC };
+	struct serial_rx_stats before;
+	int n = 0;
+
+	rx_seq = tx_seq = 0;
+	test_fan = test_pwm = 0;
+
+	feed_sum_frame(good, sizeof(good));
+	if (process_next() || test_fan != 2 || test_pwm != 30)
+	{
+		fprintf(stderr, "Failed good sum frame\n");
+		return 1;
+	}
+
+	before = serial_rx_stats;
+	cut[0] = hdr[0] = rx_seq;
+
+	/* One payload byte short, the other one is still in rx->buf from above */
+	feed_sum_frame(cut, sizeof(cut));
+
+	/* Shorter than the header, cmd_len would be the last frame's */
+	feed_sum_frame(hdr, sizeof(hdr));
+
+	for (; !process_next(); n++)
+		;
+
+	if (n || test_fan != 2 || serial_rx_stats.bad_len - before.bad_len != 2 ||
+		serial_rx_stats.bad_frames - before.bad_frames != 2)
+	{
+		fprintf(stderr, "Failed short sum frames: %d through, fan %d, %d bad length\n", n, test_fan,
+			serial_rx_stats.bad_len - before.bad_len);
+		return 1;
+	}
+
+	fprintf(stderr, "Short sum frames OK\n");
+	return 0;
+}
+
+/* LINK_CAPS again mid session keeps the unacked window and replays it, a restarted peer's doesn't */
+int test28()
+{
+	extern uint8_t tx_base;
+	extern bool tx_replaying, link_caps_sent;
+	struct msg_fan_pwm m = { 1, 20 };
+	uint32_t retransmits;
+	int caps;
+
+	rx_seq = tx_seq = tx_base = 0;
+	rx_pos = 0;
+	link_reliable = false;
+
+	send_link_caps(false);
+	feed(0, rx_pos);
+	if (!link_reliable)
+	{
+		fprintf(stderr, "Failed to negotiate reliable mode\n");
+		return 1;
+	}
+
+	/* Two frames out, no ACK yet */
+	msg_send_fan_pwm(&m);
+	msg_send_fan_pwm(&m);
+
+	retransmits = serial_link_stats.retransmits;
+	caps = rx_pos;
+	send_link_caps(false);
+	feed(caps, rx_pos);
+	if (tx_base != 0 || tx_seq != 2 || serial_link_stats.retransmits - retransmits != 2)
+	{
+		fprintf(stderr, "Failed caps mid session: base %d, seq %d, %d resent\n", tx_base, tx_seq,
+			serial_link_stats.retransmits - retransmits);
+		return 1;
+	}
+
+	/* As if we had just booted */
+	link_caps_sent = false;
+	caps = rx_pos;
+	send_link_caps(false);
+	feed(caps, rx_pos);
+	if (tx_base != tx_seq || tx_replaying || rx_seq != tx_seq)
+	{
+		fprintf(stderr, "Failed caps from a restarted peer: base %d, seq %d\n", tx_base, tx_seq);
+		return 1;
+	}
+
+	link_reliable = false;
+	rx_seq = tx_seq = tx_base = 0;
+
+	fprintf(stderr, "Caps keep the window OK\n");
+	return 0;
+}
+
+/* From the UART IRQ BULK_DATA is queued, the staging area only changes from the main loop */
+int test29()
+{
+	uint8_t blob[1 + 10 * LED_BLOB_STEP];
+	struct msg_bulk_open open = { BULK_LED_PROGRAM };
+	struct serial_cmd *cmd;
+	int i, chunk = SERIAL_EXT_MAX - 4, sent, status;
+	uint32_t offset;
+
+	rx_seq = tx_seq = 0;
+	rx_pos = 0;
+	test_switches = 0;
+	serial_ring_reset();
+
+	send_link_caps(false);
+	loop_back();
+	link_reliable = false;
+	tx_check = CHECK_SUM;
+	link_cobs = false;
+
+	blob[0] = 10;
+	for (i = 1; i < sizeof(blob); i++)
+	{
+		blob[i] = i * 3;
+	}
+
+	PUT_BE32(open.size, sizeof(blob));
+	PUT_BE16(open.crc, crc16_update(CRC16_INIT, blob, sizeof(blob)));
+	msg_send_bulk_open(&open);
+	loop_back();
+	if ((status = bulk_reply(0, &offset)) != BULK_OK)
+	{
+		fprintf(stderr, "Failed bulk open: %d\n", status);
+		return 1;
+	}
+
+	test_in_irq = true;
+	for (i = 0; i < sizeof(blob); i += chunk)
+	{
+		rx_pos = 0;
+		bulk_send_chunk(i, blob + i, sizeof(blob) - i < chunk ? sizeof(blob) - i : chunk);
+		sent = rx_pos;
+		feed(0, sent);
+
+		/* Nothing taken yet, no BULK_STATUS: the chunk waits in the ring */
+		cmd = serial_ring_peek();
+		if (!cmd || cmd->cmd_type != BULK_DATA || rx_pos != sent)
+		{
+			fprintf(stderr, "Failed to queue chunk at %d\n", i);
+			return 1;
+		}
+
+		rx_pos = 0;
+		if (process_next() || rx_pos)
+		{
+			fprintf(stderr, "Failed queued chunk at %d: %d bytes back\n", i, rx_pos);
+			return 1;
+		}
+	}
+	test_in_irq = false;
+
+	rx_pos = 0;
+	msg_send_bulk_commit();
+	loop_back();
+	if ((status = bulk_reply(0, &offset)) != BULK_OK || offset != sizeof(blob) || test_switches != 1)
+	{
+		fprintf(stderr, "Failed bulk commit from IRQ chunks: %d at %d\n", status, offset);
+		return 1;
+	}
+
+	link_ext = false;
+	fprintf(stderr, "Bulk from IRQ OK\n");
+	return 0;
+}
+
 void main() {
 	MAKE_TEST(test1);
 	MAKE_TEST(test2);
 	MAKE_TEST(test3);
 	MAKE_TEST(test4);
+	MAKE_TEST(test5);
+	MAKE_TEST(test6);
+	MAKE_TEST(test7);
+	MAKE_TEST(test8);
+	MAKE_TEST(test9);
+	MAKE_TEST(test10);
+	MAKE_TEST(test11);
+	MAKE_TEST(test12);
+	MAKE_TEST(test13);
+	MAKE_TEST(test14);
+	MAKE_TEST(test15);
+	MAKE_TEST(test16);
+	MAKE_TEST(test17);
+	MAKE_TEST(test18);
+	MAKE_TEST(test19);
+	MAKE_TEST(test20);
+	MAKE_TEST(test21);
+	MAKE_TEST(test22);
+	MAKE_TEST(test23);
+	MAKE_TEST(test24);
+	MAKE_TEST(test25);
+	MAKE_TEST(test26);
+	MAKE_TEST(test27);
+	MAKE_TEST(test28);
+	MAKE_TEST(test29);
 
 	fprintf(stderr,"ALL TEST PASS!\n");
 }
@@ -73,18 +73,42 @@
 #define COLOR_GREEN	0x00FF00
 #define COLOR_BLUE	0xFF0000
 
-struct led_program_entry {
-	uint16_t time;	/* How long to keep this before switching to the next */
-	uint32_t leds[NUM_LEDS_IN_STRIP];	/* leds array for this step */
-};
-
 #define NUM_LED_PROGRAMS		2
 
-#define NUM_STEPS_IN_PROGRAM	(2 * NUM_LEDS_IN_STRIP)
+/* Step numbers are a byte on the wire. A step only takes room once it's set */
+#define NUM_STEPS_IN_PROGRAM	255
+
+/* Colors a program's steps can refer to by index */
+#define LED_PROG_PALETTE		256
+
+/* Bytes of steps both programs share, see led_store.c */
+#ifndef LED_POOL_SIZE
+#define LED_POOL_SIZE			(24 * 1024)
+#endif
+
+#define LED_STEP_NONE			0	/* never set: all off, no time */
+
+/* What a step's leds[] hold */
+#define LED_STEP_INDEXED		0	/* a palette index per LED */
+#define LED_STEP_RGB			1	/* r, g, b per LED, the palette was full */
+
+#define LED_STEP_BYTES(fmt)	\
+	((fmt) == LED_STEP_RGB ? 3 * NUM_LEDS_IN_STRIP : NUM_LEDS_IN_STRIP)
+
+/* A step in the pool */
+struct led_step {
+	uint16_t time;	/* How long to keep this before switching to the next */
+	uint8_t fmt;	/* LED_STEP_* leds[] is in */
+	uint8_t room;	/* LED_STEP_* it was allocated for */
+	uint8_t leds[];
+};
 
 struct led_programs {
 	uint8_t num_steps;
-	struct led_program_entry led_program_entry[NUM_STEPS_IN_PROGRAM];
+	uint16_t palette_len;
+	uint16_t used;	/* pool bytes */
+	uint16_t steps[NUM_STEPS_IN_PROGRAM];	/* pool offset + 1 or LED_STEP_NONE */
+	uint8_t palette[LED_PROG_PALETTE][3];	/* r, g, b */
 };
 
 #define IS_RGBW 	0
@@ -0,0 +1,258 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "led_pack.h"
+
+/* Encoder, runs on the modem (and the host bench) */
+void led_pack_reset(struct led_pack_ctx *ctx)
+{
+	ctx->palette_len = 0;
+	ctx->have_prev = false;
+}
+
+static int palette_find(const struct led_pack_ctx *ctx, uint32_t color)
+{
+	int i;
+
+	for (i = 0; i < ctx->palette_len; i++)
+	{
+		if (ctx->palette[i] == color)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * Add the step's new colors to the palette while there's room.
+ * Returns the SET_LED_PALETTE payload length, 0 if nothing new.
+ */
+int led_pack_palette(struct led_pack_ctx *ctx, const uint32_t *leds, struct msg_led_palette *m)
+{
+	int i, n = 0;
+
+	m->first = ctx->palette_len;
+
+	for (i = 0; i < NUM_LEDS_IN_STRIP && ctx->palette_len < LED_PALETTE_SIZE; i++)
+	{
+		/* Off is free as a SKIP on a black base */
+		if (!leds[i] || palette_find(ctx, leds[i]) >= 0)
+		{
+			continue;
+		}
+
+		m->rgb[n][0] = leds[i] >> 16;
+		m->rgb[n][1] = leds[i] >> 8;
+		m->rgb[n][2] = leds[i];
+		n++;
+
+		ctx->palette[ctx->palette_len++] = leds[i];
+	}
+
+	return n ? 1 + 3 * n : 0;
+}
+
+/* Encode leds against base (NULL = all off). Returns the ops length, -1 if > max */
+static int pack_ops(const struct led_pack_ctx *ctx, const uint32_t *leds, const uint32_t *base,
+		uint8_t *out, int max)
+{
+	uint8_t *p = out, *end = out + max;
+	uint32_t color;
+	int i = 0, n, idx;
+
+#define BASE(x)		(base ? base[x] : 0)
+
+	while (i < NUM_LEDS_IN_STRIP)
+	{
+		color = leds[i];
+
+		if (color == BASE(i))
+		{
+			for (n = 1; i + n < NUM_LEDS_IN_STRIP && n < LED_OP_MAX && leds[i + n] == BASE(i + n); n++);
+
+			if (i + n == NUM_LEDS_IN_STRIP)
+			{
+				/* The rest stays as in the base anyway */
+				break;
+			}
+
+			if (p + 1 > end)
+			{
+				return -1;
+			}
+			*p++ = LED_OP_SKIP | (n - 1);
+			i += n;
+			continue;
+		}
+
+		for (n = 1; i + n < NUM_LEDS_IN_STRIP && n < LED_OP_MAX && leds[i + n] == color; n++);
+		idx = palette_find(ctx, color);
+
+		if (idx < 0)
+		{
+			if (p + 4 > end)
+			{
+				return -1;
+			}
+			*p++ = LED_OP_RGB | (n - 1);
+			*p++ = color >> 16;
+			*p++ = color >> 8;
+			*p++ = color;
+		}
+		else if (n > 1)
+		{
+			if (p + 2 > end)
+			{
+				return -1;
+			}
+			*p++ = LED_OP_RUN | (n - 1);
+			*p++ = idx;
+		}
+		else
+		{
+			/* Single changed LEDs from the palette, one byte each while they last */
+			for (n = 1; i + n < NUM_LEDS_IN_STRIP && n < LED_OP_MAX; n++)
+			{
+				if (leds[i + n] == BASE(i + n) || palette_find(ctx, leds[i + n]) < 0)
+				{
+					break;
+				}
+				/* A run is cheaper as a RUN */
+				if (i + n + 2 < NUM_LEDS_IN_STRIP && leds[i + n + 1] == leds[i + n] && leds[i + n + 2] == leds[i + n])
+				{
+					break;
+				}
+			}
+
+			if (p + 1 + n > end)
+			{
+				return -1;
+			}
+			*p++ = LED_OP_LIST | (n - 1);
+			for (idx = 0; idx < n; idx++)
+			{
+				*p++ = palette_find(ctx, leds[i + idx]);
+			}
+		}
+
+		i += n;
+	}
+
+#undef BASE
+
+	return p - out;
+}
+
+/*
+ * Pack one step, against the previous one or black, whichever is smaller.
+ * Fills in all but time. Returns the payload length, -1 if it doesn't fit
+ * (send it as SET_LED_COLOR then). Call led_pack_palette() for the step first.
+ */
+int led_pack_step(struct led_pack_ctx *ctx, uint8_t step, const uint32_t *leds, struct msg_led_step_packed *m)
+{
+	uint8_t delta_ops[sizeof(m->ops)];
+	int len, delta_len = -1;
+
+	len = pack_ops(ctx, leds, NULL, m->ops, sizeof(m->ops));
+
+	/* Delta only against what the Pico has in step - 1 */
+	if (ctx->have_prev && step && ctx->prev_step == step - 1)
+	{
+		delta_len = pack_ops(ctx, leds, ctx->prev, delta_ops, sizeof(delta_ops));
+	}
+
+	m->step = step;
+	m->flags = 0;
+	if (delta_len >= 0 && (len < 0 || delta_len < len))
+	{
+		memcpy(m->ops, delta_ops, delta_len);
+		m->flags = LED_PACKED_DELTA;
+		len = delta_len;
+	}
+
+	/* Whatever the caller sends, this is the Pico's base for the next one */
+	memcpy(ctx->prev, leds, sizeof(ctx->prev));
+	ctx->have_prev = true;
+	ctx->prev_step = step;
+
+	return len < 0 ? -1 : (int)(sizeof(*m) - sizeof(m->ops)) + len;
+}
+
+/* Decoder, runs on the Pico. Returns 0, -1 on a malformed step */
+int led_unpack_step(uint32_t *leds, const uint32_t *base, const uint32_t *palette, const uint8_t *ops, int len)
+{
+	const uint8_t *end = ops + len;
+	uint8_t op, idx;
+	uint32_t color;
+	int i, n, pos = 0;
+
+	for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+	{
+		leds[i] = base ? base[i] : 0;
+	}
+
+	while (ops < end)
+	{
+		op = *ops & LED_OP_MASK;
+		n = (*ops++ & ~LED_OP_MASK) + 1;
+
+		if (pos + n > NUM_LEDS_IN_STRIP)
+		{
+			return -1;
+		}
+
+		switch (op) {
+			case LED_OP_SKIP:
+				break;
+
+			case LED_OP_RUN:
+				if (ops >= end || *ops >= LED_PALETTE_SIZE)
+				{
+					return -1;
+				}
+				color = palette[*ops++];
+				for (i = pos; i < pos + n; i++)
+				{
+					leds[i] = color;
+				}
+				break;
+
+			case LED_OP_RGB:
+				if (ops + 3 > end)
+				{
+					return -1;
+				}
+				color = LED_RGB(ops[0], ops[1], ops[2]);
+				ops += 3;
+				for (i = pos; i < pos + n; i++)
+				{
+					leds[i] = color;
+				}
+				break;
+
+			case LED_OP_LIST:
+				if (ops + n > end)
+				{
+					return -1;
+				}
+				for (i = pos; i < pos + n; i++)
+				{
+					idx = *ops++;
+					if (idx >= LED_PALETTE_SIZE)
+					{
+						return -1;
+					}
+					leds[i] = palette[idx];
+				}
+				break;
+		}
+
+		pos += n;
+	}
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef LED_PACK_H
+#define LED_PACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "led_helpers.h"
+#include "serial_comms.h"
+
+/*
+ * Packed LED program steps (SET_LED_STEP_PACKED). A step starts as a copy
+ * of its base, either all off or the previous step (LED_PACKED_DELTA), and
+ * a list of ops rewrites it from LED 0 on. Each op is one byte, the top 2
+ * bits say what it is, the low 6 bits are the LED count - 1. LEDs past the
+ * last op keep their base value.
+ *
+ * Colors come from a palette the modem uploads first (SET_LED_PALETTE),
+ * or inline as r, g, b if the palette is full.
+ */
+#define LED_OP_SKIP		0x00	/* n LEDs as in the base */
+#define LED_OP_RUN		0x40	/* n LEDs of palette[next byte] */
+#define LED_OP_RGB		0x80	/* n LEDs of the next 3 bytes */
+#define LED_OP_LIST		0xC0	/* n palette indexes follow, one per LED */
+#define LED_OP_MASK		0xC0
+#define LED_OP_MAX		64
+
+#define LED_PACKED_DELTA	(1 << 0)	/* base is the previous step */
+
+/* Same as on_led_color() */
+#define LED_RGB(r, g, b)	(((uint32_t)(r) << 16) | ((g) << 8) | (b))
+
+/* Encoder state, one per program being uploaded */
+struct led_pack_ctx {
+	uint32_t palette[LED_PALETTE_SIZE];
+	uint8_t palette_len;
+	bool have_prev;
+	uint8_t prev_step;
+	uint32_t prev[NUM_LEDS_IN_STRIP];
+};
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+void led_pack_reset(struct led_pack_ctx *ctx);
+
+int led_pack_palette(struct led_pack_ctx *ctx, const uint32_t *leds, struct msg_led_palette *m);
+
+int led_pack_step(struct led_pack_ctx *ctx, uint8_t step, const uint32_t *leds, struct msg_led_step_packed *m);
+
+int led_unpack_step(uint32_t *leds, const uint32_t *base, const uint32_t *palette, const uint8_t *ops, int len);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LED_PACK_H */
@@ -0,0 +1,255 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "led_store.h"
+#include "led_pack.h"
+
+/*
+ * LED programs, stored compact. A step's colors are indexes into its
+ * program's palette, one byte per LED, or r, g, b per LED once the palette
+ * has no room for them. Steps are taken from led_pool as they're set,
+ * program 0 from the bottom up and program 1 from the top down, so either
+ * can use what the other doesn't. A step set again is rewritten in place
+ * if it fits, otherwise it moves to the end of its program and the steps
+ * behind it close the gap. Only the shadow program is written, the one
+ * the display isn't reading.
+ *
+ * The display unpacks the running step straight into the frame it sends,
+ * led_step_colors().
+ */
+
+#if NUM_LED_PROGRAMS != 2
+#error "led_pool is shared by two programs, one from each end"
+#endif
+
+#if LED_POOL_SIZE >= 0xFFFF
+#error "LED_POOL_SIZE must fit the 16 bit step offsets"
+#endif
+
+volatile struct led_programs led_programs[NUM_LED_PROGRAMS];
+
+/* Sane defaults */
+volatile struct led_programs *cur_prg = &led_programs[0];
+volatile struct led_programs *shadow_prg = &led_programs[1];
+
+static uint8_t led_pool[LED_POOL_SIZE] __attribute__((aligned(4)));
+
+/* Drop all steps and colors, num_steps stays */
+void led_prog_reset(volatile struct led_programs *prg)
+{
+	int s;
+
+	for (s = 0; s < NUM_STEPS_IN_PROGRAM; s++)
+	{
+		prg->steps[s] = LED_STEP_NONE;
+	}
+	prg->palette_len = 0;
+	prg->used = 0;
+}
+
+int led_pool_free(void)
+{
+	return LED_POOL_SIZE - led_programs[0].used - led_programs[1].used;
+}
+
+static struct led_step *led_step_at(const volatile struct led_programs *prg, uint8_t step)
+{
+	if (step >= NUM_STEPS_IN_PROGRAM || prg->steps[step] == LED_STEP_NONE)
+	{
+		return NULL;
+	}
+
+	return (struct led_step *)&led_pool[prg->steps[step] - 1];
+}
+
+/* Pool bytes a step allocated for fmt takes, even to keep the 16 bit time aligned */
+static int led_step_size(uint8_t fmt)
+{
+	return (sizeof(struct led_step) + LED_STEP_BYTES(fmt) + 1) & ~1;
+}
+
+static struct led_step *led_step_alloc(volatile struct led_programs *prg, uint8_t fmt)
+{
+	int size = led_step_size(fmt);
+	int off;
+
+	if (size > led_pool_free())
+	{
+		return NULL;
+	}
+
+	prg->used += size;
+	off = prg == &led_programs[0] ? prg->used - size : LED_POOL_SIZE - prg->used;
+
+	return (struct led_step *)&led_pool[off];
+}
+
+/* Give a step's room back: the steps between it and the program's free end move over it */
+static void led_step_free(volatile struct led_programs *prg, uint8_t step)
+{
+	int off = prg->steps[step] - 1;
+	int size = led_step_size(led_step_at(prg, step)->room);
+	int start, s;
+
+	if (prg == &led_programs[0])
+	{
+		memmove(&led_pool[off], &led_pool[off + size], prg->used - off - size);
+	}
+	else
+	{
+		start = LED_POOL_SIZE - prg->used;
+		memmove(&led_pool[start + size], &led_pool[start], off - start);
+	}
+
+	for (s = 0; s < NUM_STEPS_IN_PROGRAM; s++)
+	{
+		if (prg->steps[s] == LED_STEP_NONE)
+		{
+			continue;
+		}
+
+		if (prg == &led_programs[0] && prg->steps[s] - 1 > off)
+		{
+			prg->steps[s] -= size;
+		}
+		else if (prg != &led_programs[0] && prg->steps[s] - 1 < off)
+		{
+			prg->steps[s] += size;
+		}
+	}
+
+	prg->steps[step] = LED_STEP_NONE;
+	prg->used -= size;
+}
+
+/* Index of color in the palette, added if there's room. -1 if there isn't */
+static int led_palette_index(volatile struct led_programs *prg, uint32_t color)
+{
+	uint8_t r = color >> 16, g = color >> 8, b = color;
+	int i;
+
+	for (i = 0; i < prg->palette_len; i++)
+	{
+		if (prg->palette[i][0] == r && prg->palette[i][1] == g && prg->palette[i][2] == b)
+		{
+			return i;
+		}
+	}
+
+	if (prg->palette_len == LED_PROG_PALETTE)
+	{
+		return -1;
+	}
+
+	prg->palette[i][0] = r;
+	prg->palette[i][1] = g;
+	prg->palette[i][2] = b;
+	prg->palette_len++;
+
+	return i;
+}
+
+/* Store a step, leds as 0xRRGGBB. Returns 0, -1 if the pool is full */
+int led_step_set(volatile struct led_programs *prg, uint8_t step, uint16_t time, const uint32_t *leds)
+{
+	uint8_t idx[NUM_LEDS_IN_STRIP];
+	uint8_t fmt = LED_STEP_INDEXED;
+	struct led_step *st;
+	int i, k = 0;
+
+	if (step >= NUM_STEPS_IN_PROGRAM)
+	{
+		return -1;
+	}
+
+	for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+	{
+		/* Runs are common, only look up what changes */
+		if (!i || leds[i] != leds[i - 1])
+		{
+			k = led_palette_index(prg, leds[i]);
+		}
+
+		if (k < 0)
+		{
+			fmt = LED_STEP_RGB;
+			break;
+		}
+		idx[i] = k;
+	}
+
+	st = led_step_at(prg, step);
+	if (st && st->room < fmt)
+	{
+		led_step_free(prg, step);
+		st = NULL;
+	}
+
+	if (!st)
+	{
+		st = led_step_alloc(prg, fmt);
+		if (!st)
+		{
+			return -1;
+		}
+		st->room = fmt;
+		prg->steps[step] = (uint8_t *)st - led_pool + 1;
+	}
+
+	st->time = time;
+	st->fmt = fmt;
+
+	if (fmt == LED_STEP_INDEXED)
+	{
+		memcpy(st->leds, idx, sizeof(idx));
+		return 0;
+	}
+
+	for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+	{
+		st->leds[3 * i] = leds[i] >> 16;
+		st->leds[3 * i + 1] = leds[i] >> 8;
+		st->leds[3 * i + 2] = leds[i];
+	}
+
+	return 0;
+}
+
+uint16_t led_step_time(const volatile struct led_programs *prg, uint8_t step)
+{
+	const struct led_step *st = led_step_at(prg, step);
+
+	return st ? st->time : 0;
+}
+
+/* Colors of a step as 0xRRGGBB << shift, all off if it was never set */
+void led_step_colors(const volatile struct led_programs *prg, uint8_t step, uint32_t *leds, int shift)
+{
+	const struct led_step *st = led_step_at(prg, step);
+	const uint8_t *p, *c;
+	int i;
+
+	if (!st)
+	{
+		memset(leds, 0, NUM_LEDS_IN_STRIP * sizeof(leds[0]));
+		return;
+	}
+
+	p = st->leds;
+	if (st->fmt == LED_STEP_INDEXED)
+	{
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			c = (const uint8_t *)prg->palette[p[i]];
+			leds[i] = LED_RGB(c[0], c[1], c[2]) << shift;
+		}
+		return;
+	}
+
+	for (i = 0; i < NUM_LEDS_IN_STRIP; i++, p += 3)
+	{
+		leds[i] = LED_RGB(p[0], p[1], p[2]) << shift;
+	}
+}
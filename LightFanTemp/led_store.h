@@ -0,0 +1,28 @@
+#ifndef LED_STORE_H
+#define LED_STORE_H
+
+#include <stdint.h>
+
+#include "led_helpers.h"
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+extern volatile struct led_programs led_programs[NUM_LED_PROGRAMS];
+extern volatile struct led_programs *cur_prg;
+extern volatile struct led_programs *shadow_prg;
+
+void led_prog_reset(volatile struct led_programs *prg);
+
+int led_step_set(volatile struct led_programs *prg, uint8_t step, uint16_t time, const uint32_t *leds);
+
+uint16_t led_step_time(const volatile struct led_programs *prg, uint8_t step);
+
+void led_step_colors(const volatile struct led_programs *prg, uint8_t step, uint32_t *leds, int shift);
+
+int led_pool_free(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LED_STORE_H */
@@ -7,15 +7,20 @@
 
 #include "ws2812.pio.h"
 #include "serial_comms.h"
+#include "serial_proto.hpp"
+#include "led_store.h"
 #include "pin_defines.h"
 
 #include "macro_helpers.h"
 
 #include "hardware/uart.h"
 #include "hardware/irq.h"
+#include "hardware/dma.h"
 
 #include "one_wire.h"
 
+#include "tusb.h"
+
 
 #define SERIAL_COMMS_UART_ID	uart1
 #define BAUD_RATE 115200
@@ -23,6 +28,77 @@
 #define STOP_BITS 1
 #define PARITY    UART_PARITY_NONE
 
+/* 
+ * RX mode: 1 => DMA streams the UART into rx_ring and the main loop
+ * drains it in batches, 0 => one interrupt per received char
+ */
+#ifndef SERIAL_COMMS_DMA_RX
+#define SERIAL_COMMS_DMA_RX	1
+#endif
+
+/* RX ring, must be a power of 2 (DMA ring wrap). ~89 ms of line time @ 115200 */
+#define RX_RING_BITS	10
+#define RX_RING_SIZE	(1 << RX_RING_BITS)
+
+/* DMA transfer count, re-armed from the DMA IRQ when it runs out */
+#define RX_DMA_XFER_COUNT	0x80000000u
+
+/* After an overrun, this much of the ring is left for DMA to write while the rest is parsed */
+#define RX_OVERRUN_MARGIN	(RX_RING_SIZE / 4)
+
+/* TX mode: 1 => queued frames go out by DMA, 0 => put_char() busy loop */
+#ifndef SERIAL_COMMS_DMA_TX
+#define SERIAL_COMMS_DMA_TX	1
+#endif
+
+/* 
+ * RTS/CTS to the modem, only where the board wires PIN_MDM_CTS / PIN_MDM_RTS
+ * (uart1: CTS on GPIO 6/10/22/26, RTS on 7/11/23/27). It only guards the
+ * UART FIFO, the RX ring behind it is covered by LINK_CREDIT either way.
+ */
+#ifndef SERIAL_COMMS_HW_FLOW
+#define SERIAL_COMMS_HW_FLOW	0
+#endif
+
+/*
+ * Our address with SERIAL_BUS, where several Picos share the modem over
+ * RS-485 (auto direction transceivers) or a daisy chain. Node 0 is the
+ * one wired to the modem's reset.
+ */
+#ifndef BUS_NODE_ADDR
+#define BUS_NODE_ADDR	0
+#endif
+
+/*
+ * SERIAL_USB: a host on the second CDC interface speaks serial_comms at USB
+ * speed, CDC 0 stays stdio. While it's open it gets a telemetry frame
+ * every USB_TELEMETRY_MS, whatever the modem is up to.
+ */
+#define USB_CDC_PROTO		1
+
+#ifndef USB_TELEMETRY_MS
+#define USB_TELEMETRY_MS	100
+#endif
+
+/* How long a frame may wait for room in the CDC TX FIFO before it's dropped */
+#define USB_TX_TIMEOUT_US	5000
+
+/*
+ * LED mode: 1 => frames go from led_fb to the ws2812 state machine by
+ * DMA, led_frame_show() returns right away, 0 => pio_sm_put_blocking()
+ * per LED from led_frame_show()
+ */
+#ifndef LED_DMA
+#define LED_DMA	1
+#endif
+
+/*
+ * After the DMA is done the joined TX FIFO still holds up to 8 LEDs
+ * (30 us each at 800 kHz), then the strip needs its reset low (>280 us on
+ * WS2812B) before the next frame or it takes it as more LEDs.
+ */
+#define LED_LATCH_US	(8 * 30 + 300)
+
 /* FAN PWM */
 #define PWM_TOP	4999 // 125 MHz / 25 kHz - 1
 #define TACHO_SPEED_MEAS_INTERVAL 5 // s
@@ -30,7 +106,10 @@
 void fanspeed_callback(uint gpio, uint32_t events);
 
 /* timer intervals defines */
+/* The modem can ask for readings with RPC_REQUEST, so the push may go slower */
+#ifndef REPORTING_INT_MS
 #define REPORTING_INT_MS			5000
+#endif
 #define TEMP_READ_INT_MS			1000
 #define FAN_SPEED_UPDATE_INT_MS		10000
 #define LED_DISPLAY_UPDATE_INT_MS	10
@@ -40,8 +119,6 @@ void fanspeed_callback(uint gpio, uint32_t events);
 #define INVALID_TEMPERATURE	0x0bad
 #define INVALID_SPEED		0xbeef
 
-int chars_rxed;
-
 /* One wire */
 One_wire one_wire(PIN_TEMP_MEAS);
 rom_address_t address{};
@@ -59,7 +136,39 @@ bool set_fan_speeds(repeating_timer_t *rt);
 
 volatile bool do_read_temps;
 
-char double_rx_buf[CMD_LEN*NUM_ENTRIES];
+#if SERIAL_COMMS_DMA_RX
+/* Written by DMA, read by serial_comms_dma_drain() */
+uint8_t rx_ring[RX_RING_SIZE] __attribute__((aligned(RX_RING_SIZE)));
+int rx_dma_chan;
+/* Totals in bytes since boot; head is derived from the DMA transfer count */
+volatile uint32_t rx_dma_base;
+uint32_t rx_ring_tail;
+#endif
+
+/*
+ * Strip frames, already in the ws2812 program's format. The back one is
+ * filled between led_frame_begin() and led_frame_show() while the DMA
+ * sends the front one; a frame shown while one is still going out waits
+ * in the back one for the latch, a newer one replaces it.
+ */
+#define LED_WORD_SHIFT	8
+#define LED_WORD(color)	((uint32_t)(color) << LED_WORD_SHIFT)
+
+uint32_t led_fb[2][NUM_LEDS_IN_STRIP] __attribute__((aligned(4)));
+uint8_t led_back;
+volatile bool led_busy;		/* sending or latching */
+volatile bool led_pending;	/* back one shown, goes out after the latch */
+
+#if LED_DMA
+int led_dma_chan;
+#endif
+
+#if SERIAL_COMMS_DMA_TX
+int tx_dma_chan;
+#endif
+
+/* time_us_32() the last conversion finished at, goes out as TELEM_TIME */
+volatile uint32_t temperatures_us;
 
 int16_t temperatures[NUM_TEMP_SENSORS] = {
 	INVALID_TEMPERATURE,	
@@ -71,9 +180,6 @@ int16_t temperatures[NUM_TEMP_SENSORS] = {
 	INVALID_TEMPERATURE
 };
 
-extern bool wifi_connected;
-extern bool mqtt_connected;
-
 struct fans {
 	bool auto_speed[NUM_FANS];
 	uint16_t speed[NUM_FANS];
@@ -120,16 +226,98 @@ PIO pio;
 
 bool do_display;
 
-extern volatile struct led_programs *cur_prg;
-extern volatile struct led_programs *shadow_prg;
-extern volatile struct led_programs led_programs[NUM_LED_PROGRAMS];
-
 absolute_time_t next_display_step_time;
 
 uint8_t cur_step;
 
-static inline void put_pixel(uint32_t pixel_grb) {
-    pio_sm_put_blocking(pio0, 0, pixel_grb << 8u);
+/* Back frame to fill, led_frame_show() once it's done. A frame waiting for the latch is dropped */
+uint32_t *led_frame_begin(void)
+{
+	uint32_t flags = save_and_disable_interrupts();
+
+	led_pending = false;
+	restore_interrupts(flags);
+
+	return led_fb[led_back];
+}
+
+#if LED_DMA
+/* Back frame out, it's the front one from here. Interrupts off */
+static void led_frame_start(void)
+{
+	const uint32_t *frame = led_fb[led_back];
+
+	led_back ^= 1;
+	led_busy = true;
+	led_pending = false;
+	dma_channel_transfer_from_buffer_now(led_dma_chan, frame, NUM_LEDS_IN_STRIP);
+}
+
+/* Latched, the front frame is free and the next one may go */
+int64_t led_latch_done(alarm_id_t id, void *user_data)
+{
+	led_busy = false;
+	if (led_pending)
+	{
+		led_frame_start();
+	}
+
+	return 0;
+}
+
+void led_dma_irq()
+{
+	if (dma_channel_get_irq1_status(led_dma_chan))
+	{
+		dma_channel_acknowledge_irq1(led_dma_chan);
+
+		if (add_alarm_in_us(LED_LATCH_US, led_latch_done, NULL, true) < 0)
+		{
+			led_latch_done(0, NULL);
+		}
+	}
+}
+
+/* Frame from led_frame_begin() out, now or once the one going out latched. Returns right away */
+void led_frame_show(void)
+{
+	uint32_t flags = save_and_disable_interrupts();
+
+	if (led_busy)
+	{
+		led_pending = true;
+	}
+	else
+	{
+		led_frame_start();
+	}
+
+	restore_interrupts(flags);
+}
+#else
+void led_frame_show(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+	{
+		pio_sm_put_blocking(pio, 0, led_fb[led_back][i]);
+	}
+}
+#endif
+
+/* The whole strip in one color */
+void led_frame_fill(uint32_t color)
+{
+	uint32_t *fb = led_frame_begin();
+	int i;
+
+	for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+	{
+		fb[i] = LED_WORD(color);
+	}
+
+	led_frame_show();
 }
 
 static inline uint32_t urgb_u32(uint8_t r, uint8_t g, uint8_t b) {
@@ -151,10 +339,215 @@ void serial_comms_uart_rx() {
 	uart_rx(ch);
 	// for looping back what's received from modem, uncomment below
 	//uart_putc(uart0, ch);
-        chars_rxed++;
+        serial_rx_stats.bytes++;
     }
 }
 
+/* Interrupts off while the TX queue is touched, uart_tx() runs from timers too */
+uint32_t tx_lock(void)
+{
+	return save_and_disable_interrupts();
+}
+
+void tx_unlock(uint32_t flags)
+{
+	restore_interrupts(flags);
+}
+
+/* LOG() also comes from core1, IRQs off on this core alone isn't enough */
+spin_lock_t *log_spin;
+
+uint32_t log_lock(void)
+{
+	return spin_lock_blocking(log_spin);
+}
+
+void log_unlock(uint32_t flags)
+{
+	spin_unlock(log_spin, flags);
+}
+
+#if SERIAL_COMMS_DMA_RX || SERIAL_COMMS_DMA_TX
+void serial_comms_dma_irq()
+{
+#if SERIAL_COMMS_DMA_RX
+	if (dma_channel_get_irq1_status(rx_dma_chan))
+	{
+		dma_channel_acknowledge_irq1(rx_dma_chan);
+
+		/* Transfer count ran out (takes days), keep streaming into the ring */
+		rx_dma_base += RX_DMA_XFER_COUNT;
+		dma_channel_set_trans_count(rx_dma_chan, RX_DMA_XFER_COUNT, true);
+	}
+#endif
+
+#if SERIAL_COMMS_DMA_TX
+	if (dma_channel_get_irq1_status(tx_dma_chan))
+	{
+		dma_channel_acknowledge_irq1(tx_dma_chan);
+
+		/* Last byte is in the UART FIFO, the staging buffer is free again */
+		uart_tx_done();
+	}
+#endif
+}
+#endif
+
+#if SERIAL_COMMS_DMA_TX
+/* Called by serial_comms with a fully escaped frame, returns right away */
+void uart_tx_start(const uint8_t *buf, int len)
+{
+	dma_channel_transfer_from_buffer_now(tx_dma_chan, buf, len);
+}
+#endif
+
+/* Retransmit / delayed ACK timers in serial_link.c */
+uint32_t link_time_ms(void)
+{
+	return to_ms_since_boot(get_absolute_time());
+}
+
+uint32_t serial_time_us(void)
+{
+	return time_us_32();
+}
+
+/* LINK_BAUD switch, from link_poll() in the main loop so TX DMA can finish */
+void link_set_baud(uint32_t baud)
+{
+	while (!uart_tx_idle())
+	{
+		tight_loop_contents();
+	}
+	uart_tx_wait_blocking(SERIAL_COMMS_UART_ID);
+
+	uart_set_baudrate(SERIAL_COMMS_UART_ID, baud);
+}
+
+#if SERIAL_COMMS_DMA_RX
+/* Bytes DMA wrote since boot. The IRQ may re-arm in between the reads, then base moved: read again */
+static uint32_t rx_dma_head()
+{
+	uint32_t base, count;
+
+	do
+	{
+		base = rx_dma_base;
+		count = dma_channel_hw_addr(rx_dma_chan)->transfer_count;
+	} while (base != rx_dma_base);
+
+	return base + (RX_DMA_XFER_COUNT - count);
+}
+
+/* Feed everything DMA wrote since the last call to the frame parser */
+void serial_comms_dma_drain()
+{
+	uint32_t head, fill;
+
+	head = rx_dma_head();
+	fill = head - rx_ring_tail;
+
+	if (fill > serial_rx_stats.peak_fill)
+	{
+		serial_rx_stats.peak_fill = fill;
+	}
+
+	if (fill > RX_RING_SIZE)
+	{
+		/*
+		 * DMA lapped us, the oldest bytes are gone. Skip to well clear of
+		 * where DMA writes next and drop the frame they were part of
+		 */
+		serial_rx_stats.overruns++;
+		rx_ring_tail = head - RX_RING_SIZE + RX_OVERRUN_MARGIN;
+		uart_rx_resync();
+		LOG(LOG_RX_OVERRUN, head, serial_rx_stats.overruns, serial_rx_stats.peak_fill);
+	}
+
+	/* At most two contiguous spans: up to the end of the ring, then from its start */
+	while (rx_ring_tail != head)
+	{
+		uint32_t idx = rx_ring_tail & (RX_RING_SIZE - 1);
+		uint32_t span = MIN(head - rx_ring_tail, RX_RING_SIZE - idx);
+
+		uart_rx_buf(&rx_ring[idx], span);
+		rx_ring_tail += span;
+	}
+
+	serial_rx_stats.bytes = head;
+}
+#endif
+
+/* Core 1 and IRQ handlers can't wait on the link, nor touch the CDC FIFO */
+bool serial_in_irq(void)
+{
+	return __get_current_exception() != 0 || get_core_num() != 0;
+}
+
+/* A full TX channel, from the main loop: bring the ACKs in, run the timers */
+void link_wait(void)
+{
+#if SERIAL_COMMS_DMA_RX
+	serial_comms_dma_drain();
+#endif
+	link_poll();
+	tight_loop_contents();
+}
+
+/* The Pico's half of the protocol: its parser, its handlers, and a send<>() only for what it sends */
+using serial_proto::pico_handlers;
+using proto = serial_proto::endpoint<serial_proto::role::pico, serial_proto::uart, pico_handlers>;
+
+SERIAL_PROTO_C_API(proto)
+
+#if SERIAL_COMMS_DMA_RX || SERIAL_COMMS_DMA_TX
+void setup_serial_comms_dma()
+{
+	dma_channel_config c;
+
+	irq_add_shared_handler(DMA_IRQ_1, serial_comms_dma_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+	irq_set_enabled(DMA_IRQ_1, true);
+
+#if SERIAL_COMMS_DMA_TX
+	tx_dma_chan = dma_claim_unused_channel(true);
+
+	c = dma_channel_get_default_config(tx_dma_chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, uart_get_dreq(SERIAL_COMMS_UART_ID, true));
+
+	dma_channel_set_irq1_enabled(tx_dma_chan, true);
+
+	dma_channel_configure(tx_dma_chan, &c,
+		&uart_get_hw(SERIAL_COMMS_UART_ID)->dr,
+		NULL,
+		0,
+		false);
+#endif
+
+#if SERIAL_COMMS_DMA_RX
+	rx_dma_chan = dma_claim_unused_channel(true);
+
+	c = dma_channel_get_default_config(rx_dma_chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+	channel_config_set_read_increment(&c, false);
+	channel_config_set_write_increment(&c, true);
+	/* Wrap the write address on the ring size */
+	channel_config_set_ring(&c, true, RX_RING_BITS);
+	channel_config_set_dreq(&c, uart_get_dreq(SERIAL_COMMS_UART_ID, false));
+
+	dma_channel_set_irq1_enabled(rx_dma_chan, true);
+
+	dma_channel_configure(rx_dma_chan, &c,
+		rx_ring,
+		&uart_get_hw(SERIAL_COMMS_UART_ID)->dr,
+		RX_DMA_XFER_COUNT,
+		true);
+#endif
+}
+#endif
+
 void setup_serial_comms_uart()
 {
     // Set up our UART with a basic baud rate.
@@ -172,12 +565,28 @@ void setup_serial_comms_uart()
     // possible to that requested
     int __unused actual = uart_set_baudrate(SERIAL_COMMS_UART_ID, BAUD_RATE);
 
+#if SERIAL_COMMS_HW_FLOW
+    gpio_set_function(PIN_MDM_CTS, GPIO_FUNC_UART);
+    gpio_set_function(PIN_MDM_RTS, GPIO_FUNC_UART);
+    uart_set_hw_flow(SERIAL_COMMS_UART_ID, true, true);
+#else
     // Set UART flow control CTS/RTS, we don't want these, so turn them off
     uart_set_hw_flow(SERIAL_COMMS_UART_ID, false, false);
+#endif
 
     // Set our data format
     uart_set_format(SERIAL_COMMS_UART_ID, DATA_BITS, STOP_BITS, PARITY);
 
+#if SERIAL_COMMS_DMA_RX || SERIAL_COMMS_DMA_TX
+    setup_serial_comms_dma();
+#endif
+
+#if SERIAL_COMMS_DMA_RX
+    // DMA pulls chars off the FIFO into rx_ring, no per char interrupt
+    uart_set_fifo_enabled(SERIAL_COMMS_UART_ID, true);
+
+    DEBUG("Done setting up comms DMA\n");
+#else
     // Turn off FIFO's - we want to do this character by character
     uart_set_fifo_enabled(SERIAL_COMMS_UART_ID, false);
 
@@ -197,6 +606,7 @@ void setup_serial_comms_uart()
     // Lets send a basic string out, and then run a loop and wait for RX interrupts
     // The handler will count them, but also reflect the incoming data back with a slight change!
     DEBUG("Done setting up comms interrupts\n");
+#endif
 }
 
 void setup_timers()
@@ -343,6 +753,29 @@ void setup_leds()
 	offset = pio_add_program(pio, &ws2812_program);
 
     ws2812_program_init(pio, sm, offset, PIN_LED, 800000, IS_RGBW);
+
+#if LED_DMA
+	dma_channel_config c;
+
+	led_dma_chan = dma_claim_unused_channel(true);
+
+	c = dma_channel_get_default_config(led_dma_chan);
+	channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+	channel_config_set_read_increment(&c, true);
+	channel_config_set_write_increment(&c, false);
+	channel_config_set_dreq(&c, pio_get_dreq(pio, sm, true));
+
+	dma_channel_set_irq1_enabled(led_dma_chan, true);
+
+	dma_channel_configure(led_dma_chan, &c,
+		&pio->txf[sm],
+		NULL,
+		0,
+		false);
+
+	irq_add_shared_handler(DMA_IRQ_1, led_dma_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+	irq_set_enabled(DMA_IRQ_1, true);
+#endif
 }
 
 /*
@@ -415,7 +848,7 @@ void core1_entry()
 			for (int i = 0; i < NUM_FANS; i++)
 			{
 				fans.speed[i] = fans.fan_count[i] * 6; // = 60 /  2 / TACHO_SPEED_MEAS_INTERVAL; // 2 ticks per revoluion
-				ERROR("FAN %d count %d\n", i, fans.fan_count[i]);
+				LOG(LOG_FAN_COUNT, i, fans.fan_count[i]);
 				fans.fan_count[i] = 0;
 			}
 			next_fan_speed_measurement_time = delayed_by_ms(get_absolute_time(), TACHO_SPEED_MEAS_INTERVAL * 1000);
@@ -427,6 +860,7 @@ void core1_entry()
 			int count = one_wire.find_and_count_devices_on_bus();
 			rom_address_t null_address{};
 			one_wire.convert_temperature(null_address, true, true);
+			temperatures_us = time_us_32();
 			for (int i = 0; i < count; i++) {
 				auto address = One_wire::get_address(i);
 #ifdef DEBUG_SENSORS
@@ -450,18 +884,94 @@ void core1_entry()
 
 void reset_modem(void)
 {
+	/* It comes back on the boot rate */
+	link_baud_reset();
+
 	gpio_clr_mask(1 << ESP8266_RST);
 	sleep_ms(500);
 	gpio_set_mask(1 << ESP8266_RST);
 }
+#if SERIAL_USB
+bool telem_add_temp(struct msg_telemetry *m, int *len);
+bool telem_add_rpm(struct msg_telemetry *m, int *len);
+bool telem_add_fan_pwm(struct msg_telemetry *m, int *len);
+bool telem_add_link(struct msg_telemetry *m, int *len);
+bool telem_add_time(struct msg_telemetry *m, int *len);
+
+int usb_tx_write(const uint8_t *buf, int len)
+{
+	absolute_time_t timeout = make_timeout_time_us(USB_TX_TIMEOUT_US);
+
+	if (!tud_cdc_n_connected(USB_CDC_PROTO))
+	{
+		return -1;
+	}
+
+	/* stdio_usb's background task moves the FIFO out meanwhile */
+	while ((int)tud_cdc_n_write_available(USB_CDC_PROTO) < len)
+	{
+		if (time_reached(timeout))
+		{
+			return -1;
+		}
+		tight_loop_contents();
+	}
+
+	tud_cdc_n_write(USB_CDC_PROTO, buf, len);
+	tud_cdc_n_write_flush(USB_CDC_PROTO);
+
+	return 0;
+}
+
+void usb_poll(void)
+{
+	static absolute_time_t next_telemetry;
+	uint8_t buf[64];
+	struct msg_telemetry m;
+	int len;
+
+	while (tud_cdc_n_available(USB_CDC_PROTO))
+	{
+		len = tud_cdc_n_read(USB_CDC_PROTO, buf, sizeof(buf));
+		serial_rx_buf(PORT_USB, buf, len);
+	}
+
+	if (!tud_cdc_n_connected(USB_CDC_PROTO) || !time_reached(next_telemetry))
+	{
+		return;
+	}
+	next_telemetry = make_timeout_time_ms(USB_TELEMETRY_MS);
+
+	len = 0;
+	telem_add_temp(&m, &len);
+	telem_add_rpm(&m, &len);
+	telem_add_fan_pwm(&m, &len);
+	telem_add_link(&m, &len);
+	telem_add_time(&m, &len);
+
+	serial_port_send(PORT_USB, SEND_TELEMETRY, &m, len);
+}
+#endif
+
 int main()
 {
-	int i;
+	uint32_t *fb;
+	log_spin = spin_lock_init(spin_lock_claim_unused(true));
+	/*
+	 * We link tinyusb_device, so stdio_usb expects TinyUSB up before
+	 * stdio_init_all(). From then on its background task is the only one
+	 * calling tud_task(), SERIAL_USB only uses tud_cdc_n_*() on CDC 1
+	 */
+	tusb_init();
 	stdio_init_all();
 	setup_serial_comms_uart();
 
 	setup_gpios();
-	
+
+#if SERIAL_BUS
+	bus_init(BUS_NODE_ADDR);
+	if (BUS_NODE_ADDR == 0)
+#endif
 	reset_modem();
 
 	setup_timers();
@@ -472,20 +982,26 @@ int main()
 	
 	while(1)
 	{
-		if (serial_buf_pidx != serial_buf_cidx)
-		{
-			process_message(&double_rx_buf[CMD_LEN * serial_buf_cidx]);
-			serial_buf_cidx = (serial_buf_cidx + 1) % NUM_ENTRIES;
-		}
+#if SERIAL_COMMS_DMA_RX
+		serial_comms_dma_drain();
+#endif
+		link_poll();
+#if SERIAL_USB
+		usb_poll();
+#endif
+
+		serial_process_next();
+		serial_stats_poll();
+		log_flush();
 
 		if (do_display)
 		{
 			if (get_absolute_time() >= next_display_step_time)
 			{
-				for (i = 0; i < NUM_LEDS_IN_STRIP; i++) 
-				{
-					put_pixel(cur_prg->led_program_entry[cur_step].leds[i]);
-				}
+				/* Unpacked from the program straight into the frame */
+				fb = led_frame_begin();
+				led_step_colors(cur_prg, cur_step, fb, LED_WORD_SHIFT);
+				led_frame_show();
 
 				if (++cur_step == cur_prg->num_steps)
 				{
@@ -493,24 +1009,201 @@ int main()
 				}
 
 				next_display_step_time = delayed_by_ms(get_absolute_time(),
-					cur_prg->led_program_entry[cur_step].time);
+					led_step_time(cur_prg, cur_step));
 			}
 		}
 	    tight_loop_contents();
 	}
 }
 
+/* Telemetry records, for the periodic report and RPC replies alike. False once m is full */
+bool telem_add_temp(struct msg_telemetry *m, int *len)
+{
+	struct msg_temperature *temp;
+	int i;
+
+	if (!(temp = (struct msg_temperature *)telem_add(m, len, TELEM_TEMP, sizeof(*temp))))
+	{
+		return false;
+	}
+
+	for (i = 0; i < NUM_TEMP_SENSORS; i++)
+	{
+		PUT_BE16(temp->temp[i], temperatures[i]);
+	}
+
+	return true;
+}
+
+bool telem_add_rpm(struct msg_telemetry *m, int *len)
+{
+	struct msg_tacho *tacho;
+	int i;
+
+	if (!(tacho = (struct msg_tacho *)telem_add(m, len, TELEM_RPM, sizeof(*tacho))))
+	{
+		return false;
+	}
+
+	for (i = 0; i < NUM_FANS; i++)
+	{
+		PUT_BE16(tacho->rpm[i], fans.speed[i]);
+	}
+
+	return true;
+}
+
+bool telem_add_fan_pwm(struct msg_telemetry *m, int *len)
+{
+	struct telem_fan_pwm *pwm;
+	int i;
+
+	if (!(pwm = (struct telem_fan_pwm *)telem_add(m, len, TELEM_FAN_PWM, sizeof(*pwm))))
+	{
+		return false;
+	}
+
+	pwm->auto_mask = 0;
+	for (i = 0; i < NUM_FANS; i++)
+	{
+		pwm->pwm[i] = fans.pwm[i];
+		pwm->auto_mask |= fans.auto_speed[i] << i;
+	}
+
+	return true;
+}
+
+bool telem_add_link(struct msg_telemetry *m, int *len)
+{
+	struct telem_link *link;
+
+	if (!(link = (struct telem_link *)telem_add(m, len, TELEM_LINK, sizeof(*link))))
+	{
+		return false;
+	}
+
+	PUT_BE32(link->rx_frames, serial_rx_stats.frames);
+	PUT_BE32(link->rx_bad, serial_rx_stats.bad_frames);
+	PUT_BE32(link->rx_ring_full, serial_rx_stats.ring_full);
+	PUT_BE32(link->tx_drops, serial_tx_stats.drops);
+	PUT_BE32(link->retransmits, serial_link_stats.retransmits);
+
+	return true;
+}
+
+bool telem_add_time(struct msg_telemetry *m, int *len)
+{
+	struct telem_time *sampled;
+
+	if (!(sampled = (struct telem_time *)telem_add(m, len, TELEM_TIME, sizeof(*sampled))))
+	{
+		return false;
+	}
+
+	PUT_BE32(sampled->sampled_us, temperatures_us);
+
+	return true;
+}
+
+/* Program prg of led_programs, step only means something for the running one */
+bool telem_add_led(struct msg_telemetry *m, int *len, int prg)
+{
+	struct telem_led *led;
+
+	if (!(led = (struct telem_led *)telem_add(m, len, TELEM_LED, sizeof(*led))))
+	{
+		return false;
+	}
+
+	led->displaying = do_display;
+	led->program = prg;
+	led->step = &led_programs[prg] == cur_prg ? cur_step : 0;
+	led->num_steps = led_programs[prg].num_steps;
+
+	return true;
+}
+
+/* RPC_REQUEST from the main loop: only what we already have, nothing gets read here */
+int rpc_answer(uint8_t method, const uint8_t *arg, int arg_len, struct msg_telemetry *out, int *len)
+{
+	int prg = cur_prg - led_programs;
+	bool ok;
+
+	switch (method)
+	{
+	case RPC_GET_TEMP:
+		ok = telem_add_temp(out, len) && telem_add_time(out, len);
+		break;
+	case RPC_GET_FAN_STATE:
+		ok = telem_add_rpm(out, len) && telem_add_fan_pwm(out, len);
+		break;
+	case RPC_GET_LED_PROGRAM_INFO:
+		if (arg_len)
+		{
+			if (arg[0] >= NUM_LED_PROGRAMS)
+			{
+				return RPC_BAD_ARG;
+			}
+			prg = arg[0];
+		}
+		ok = telem_add_led(out, len, prg);
+		break;
+	case RPC_GET_STATS:
+		ok = telem_add_link(out, len);
+		break;
+	default:
+		return RPC_NO_METHOD;
+	}
+
+	return ok ? RPC_OK : RPC_NO_ROOM;
+}
+
+#if SERIAL_TELEMETRY
+/* Everything the modem publishes in one frame, one TX IRQ and one MQTT publish */
+bool reporting_callback(repeating_timer_t *rt)
+{
+	struct msg_telemetry m;
+	int len = 0;
+
+	if (!pico_handlers::wifi_connected || !pico_handlers::mqtt_connected)
+	{
+		return true;
+	}
+
+	telem_add_temp(&m, &len);
+	telem_add_rpm(&m, &len);
+	telem_add_fan_pwm(&m, &len);
+	telem_add_link(&m, &len);
+	telem_add_time(&m, &len);
+
+	proto::send<SEND_TELEMETRY>(m, len);
+
+	return true;
+}
+#else
 bool reporting_callback(repeating_timer_t *rt)
 {
-	if (wifi_connected && mqtt_connected)
+	struct msg_temperature temp;
+	struct msg_tacho tacho;
+	int i;
+
+	if (pico_handlers::wifi_connected && pico_handlers::mqtt_connected)
 	{
-		// Code to actually read the temperatures...
-		send_temperature(temperatures);
-		// Code to actually read the fan speed..
-		send_tacho(fans.speed);
+		for (i = 0; i < NUM_TEMP_SENSORS; i++)
+		{
+			PUT_BE16(temp.temp[i], temperatures[i]);
+		}
+		proto::send<SEND_TEMP>(temp);
+
+		for (i = 0; i < NUM_FANS; i++)
+		{
+			PUT_BE16(tacho.rpm[i], fans.speed[i]);
+		}
+		proto::send<SEND_FAN_PWM>(tacho);
 	}
 	return true;
 }
+#endif
 
 bool read_temp_callback(repeating_timer_t *rt)
 {
@@ -535,7 +1228,7 @@ void set_fan_pwm(uint8_t fan, uint8_t pwm)
 	if (pwm > 100)
 	{
 		fans.auto_speed[fan] = true;
-		ERROR("Setting fan %d PWM to auto\n", fan);
+		LOG(LOG_FAN_PWM_AUTO, fan);
 	}
 	else
 	{
@@ -545,7 +1238,7 @@ void set_fan_pwm(uint8_t fan, uint8_t pwm)
 			pwm = PWM_LOW_THRESHOLD;
 		}
 		fans.pwm[fan] = pwm;
-		ERROR("Setting fan %d PWM to %d\n", fan, pwm);
+		LOG(LOG_FAN_PWM, fan, pwm);
 		pwm_set_gpio_level(fans.pins[fan], (pwm / 100.f) * (PWM_TOP + 1));
 	}
 }
@@ -593,7 +1286,7 @@ bool set_fan_speeds(repeating_timer_t *rt)
 				{
 					//set_fan_pwm(i, temp_vs_pwm_curve[row][2]);
 					fans.pwm[i] = temp_vs_pwm_curve[row][2];
-					ERROR("Setting fan %d Auto PWM to %d\n", i, fans.pwm[i]);
+					LOG(LOG_FAN_AUTO_PWM, i, fans.pwm[i]);
 					pwm_set_gpio_level(fans.pins[i], (fans.pwm[i] / 100.f) * (PWM_TOP + 1));
 
 					break;
@@ -607,23 +1300,14 @@ bool set_fan_speeds(repeating_timer_t *rt)
 
 void clear_strip()
 {
-	int i;
-	for (i = 0; i < NUM_LEDS_IN_STRIP; i++) 
-	{
-		put_pixel(0);
-		sleep_ms(10);
-	}
+	led_frame_fill(0);
 }
 
 void set_strip_intensity(uint32_t color)
 {
 	do_display = false;
-	
-	int i;
-	for (i = 0; i < NUM_LEDS_IN_STRIP; i++) 
-	{
-		put_pixel(color);
-	}
+
+	led_frame_fill(color);
 }
 
 void switch_programs()
@@ -655,22 +1339,24 @@ void resume_animation()
 
 void light_drawer(uint8_t drawer, uint32_t color)
 {
+	uint32_t *fb;
 	int i;
 	do_display = false;
-	
-	clear_strip();
 
+	fb = led_frame_begin();
 	for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
 	{
 		if ((i >= LED_START_OFFSET(drawer)) && (i < LED_END_OFFSET(drawer)))
 		{
-			put_pixel(color);
+			fb[i] = LED_WORD(color);
 		}
 		else
 		{
-			put_pixel(0);
+			fb[i] = 0;
 		}
 	}
+
+	led_frame_show();
 }
 
 #else
@@ -0,0 +1,232 @@
+#include "serial_proto.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAKE_TEST(func)	\
+	if (func()) { 				\
+		fprintf(stderr, "Test " # func " failed\n"); \
+		exit(-1); \
+	}
+
+using namespace serial_proto;
+
+/* What the endpoints under test sent */
+uint8_t sent_type;
+int sent_len;
+uint8_t sent_buf[SERIAL_PAYLOAD_MAX];
+
+struct test_transport
+{
+	static int send(uint8_t cmd_type, const void *payload, int len)
+	{
+		sent_type = cmd_type;
+		sent_len = len;
+		memcpy(sent_buf, payload, len);
+		return 0;
+	}
+};
+
+/* Pico side handlers, only a few messages: the rest of the role's are below */
+int got_fan = -1, got_pwm = -1, got_palette = -1, got_switch;
+
+struct pico_checked
+{
+	static void on(tag<SET_FAN_PWM_PERC>, const struct msg_fan_pwm &m)
+	{
+		got_fan = m.fan;
+		got_pwm = m.pwm;
+	}
+
+	static void on(tag<SET_LED_PALETTE>, const struct msg_led_palette &m, int len)
+	{
+		got_palette = len;
+	}
+
+	static void on(tag<SWITCH_PROGRAMS>)
+	{
+		got_switch++;
+	}
+};
+
+int got_temp = -1;
+
+/* BULK_DATA that came through the ring, the Pico's */
+int got_bulk;
+
+void bulk_rx_data(const struct serial_cmd *cmd)
+{
+	got_bulk++;
+}
+
+struct modem_handlers
+{
+	static void on(tag<MODEM_RESET>) {}
+	static void on(tag<SEND_FAN_PWM>, const struct msg_tacho &m) {}
+	static void on(tag<SEND_TEMP>, const struct msg_temperature &m)
+	{
+		got_temp = GET_BE16(m.temp[0]);
+	}
+	static void on(tag<SEND_TELEMETRY>, const struct msg_telemetry &m, int len) {}
+	static void on(tag<RPC_REPLY>, const struct msg_rpc_reply &m, int len) {}
+	static void on(tag<SEND_STATS>, const struct msg_stats &m) {}
+	static void on(tag<BULK_STATUS>, const struct msg_bulk_status &m) {}
+};
+
+/* The Pico's other messages, nothing to check about them */
+struct pico_rest : pico_checked
+{
+	using pico_checked::on;
+
+	static void on(tag<WIFI_CONNECTED>) {}
+	static void on(tag<WIFI_DISCONNECTED>) {}
+	static void on(tag<MQTT_CONNECTED>) {}
+	static void on(tag<MQTT_DISCONNECTED>) {}
+	static void on(tag<SET_LED_COLOR>, const struct msg_led_color &m) {}
+	static void on(tag<SET_LED_PROGRAM_STEPS>, const struct msg_led_program_steps &m) {}
+	static void on(tag<SET_COLOR_INTENSITY>, const struct msg_color &m) {}
+	static void on(tag<RESUME_ANIMATION>) {}
+	static void on(tag<SET_DRAWER_LIGHT>, const struct msg_drawer_light &m) {}
+	static void on(tag<SET_LED_STEP_PACKED>, const struct msg_led_step_packed &m, int len) {}
+	static void on(tag<SET_FAN_POWER_STATE>, const struct msg_fan_power_state &m) {}
+	static void on(tag<RPC_REQUEST>, const struct msg_rpc_request &m, int len) {}
+	static void on(tag<SEND_LOG>, const struct msg_log &m, int len) {}
+	static void on(tag<SEND_LOG_TOKENS>, const struct msg_log_tokens &m, int len) {}
+	static void on(tag<GET_STATS>, const struct msg_get_stats &m) {}
+	static void on(tag<BULK_OPEN>, const struct msg_bulk_open &m) {}
+	static void on(tag<BULK_COMMIT>) {}
+};
+
+using pico = endpoint<role::pico, test_transport, pico_rest>;
+using modem = endpoint<role::modem, test_transport, modem_handlers>;
+
+/* send<id>() is there only for what a role sends */
+template <class E, uint8_t Id, class = void>
+struct can_send : std::false_type
+{
+};
+
+template <class E, uint8_t Id>
+struct can_send<E, Id, std::void_t<decltype(E::template send<Id>(std::declval<const typename msg<Id>::type &>()))>> : std::true_type
+{
+};
+
+static_assert(can_send<pico, SEND_TEMP>::value && !can_send<modem, SEND_TEMP>::value, "SEND_TEMP is the Pico's");
+static_assert(can_send<modem, SET_FAN_PWM_PERC>::value && !can_send<pico, SET_FAN_PWM_PERC>::value, "SET_FAN_PWM_PERC is the modem's");
+static_assert(!can_send<pico, LINK_ACK>::value && !can_send<modem, LINK_ACK>::value, "LINK_* are serial_link's");
+static_assert(has_on<pico_rest, SET_FAN_PWM_PERC>::value && !has_on<pico_rest, SEND_TEMP>::value, "handler lookup");
+static_assert(parser<role::pico>::ext && parser<role::pico>::frame_max == SERIAL_FRAME_MAX, "extended frames come in on the Pico");
+static_assert(!parser<role::modem>::ext && parser<role::modem>::frame_max == SERIAL_STD_FRAME_MAX, "the modem's parser never takes them");
+static_assert(has_bulk<pico_handlers>::value && !has_bulk<c_handlers>::value, "bulk targets are the Pico's");
+
+/* A received frame as the ring hands it to dispatch() */
+uint8_t frame_buf[sizeof(struct serial_cmd) + SERIAL_PAYLOAD_MAX];
+
+const struct serial_cmd *frame(uint8_t cmd_type, const void *payload, int len)
+{
+	struct serial_cmd *c = (struct serial_cmd *)frame_buf;
+
+	c->cmd_type = cmd_type;
+	c->cmd_len = len;
+	memcpy(c->cmd, payload, len);
+
+	return c;
+}
+
+/* Each role takes its own messages, short ones are -1, the other side's 1 */
+int test1()
+{
+	struct msg_fan_pwm fan = { 2, 77 };
+	struct msg_temperature temp;
+	uint8_t pal[1 + 3 * 3] = { 0 };
+
+	if (pico::dispatch(frame(SET_FAN_PWM_PERC, &fan, sizeof(fan))) || got_fan != 2 || got_pwm != 77)
+	{
+		fprintf(stderr, "Failed fixed message: fan %d pwm %d\n", got_fan, got_pwm);
+		return 1;
+	}
+
+	if (pico::dispatch(frame(SET_LED_PALETTE, pal, sizeof(pal))) || got_palette != sizeof(pal))
+	{
+		fprintf(stderr, "Failed var message: %d bytes\n", got_palette);
+		return 1;
+	}
+
+	if (pico::dispatch(frame(SWITCH_PROGRAMS, NULL, 0)) || got_switch != 1)
+	{
+		fprintf(stderr, "Failed empty message\n");
+		return 1;
+	}
+
+	got_fan = -1;
+	if (pico::dispatch(frame(SET_FAN_PWM_PERC, &fan, 1)) != -1 || got_fan != -1)
+	{
+		fprintf(stderr, "Failed short frame\n");
+		return 1;
+	}
+
+	memset(&temp, 0, sizeof(temp));
+	PUT_BE16(temp.temp[0], 2450);
+	if (pico::dispatch(frame(SEND_TEMP, &temp, sizeof(temp))) != 1 || pico::dispatch(frame(LINK_ACK, &temp, 1)) != 1)
+	{
+		fprintf(stderr, "Failed Pico took the modem's message\n");
+		return 1;
+	}
+
+	if (modem::dispatch(frame(SEND_TEMP, &temp, sizeof(temp))) || got_temp != 2450 ||
+		modem::dispatch(frame(SET_FAN_PWM_PERC, &fan, sizeof(fan))) != 1)
+	{
+		fprintf(stderr, "Failed modem dispatch: temp %d\n", got_temp);
+		return 1;
+	}
+
+	if (pico::dispatch(frame(BULK_DATA, &temp, 4)) || got_bulk != 1 || modem::dispatch(frame(BULK_DATA, &temp, 4)) != 1)
+	{
+		fprintf(stderr, "Failed BULK_DATA: %d\n", got_bulk);
+		return 1;
+	}
+
+	fprintf(stderr, "Dispatch OK\n");
+	return 0;
+}
+
+/* Encoders hand the table's payload to the transport */
+int test2()
+{
+	struct msg_fan_pwm fan = { 1, 40 };
+	struct msg_telemetry m;
+	int len = 0;
+
+	if (modem::send<SET_FAN_PWM_PERC>(fan) || sent_type != SET_FAN_PWM_PERC || sent_len != sizeof(fan) ||
+		memcmp(sent_buf, &fan, sizeof(fan)))
+	{
+		fprintf(stderr, "Failed fixed send: type 0x%02x, %d bytes\n", sent_type, sent_len);
+		return 1;
+	}
+
+	if (modem::send<RESUME_ANIMATION>() || sent_type != RESUME_ANIMATION || sent_len)
+	{
+		fprintf(stderr, "Failed empty send\n");
+		return 1;
+	}
+
+	memset(telem_add(&m, &len, TELEM_LINK, sizeof(struct telem_link)), 0, sizeof(struct telem_link));
+	if (pico::send<SEND_TELEMETRY>(m, len) || sent_type != SEND_TELEMETRY || sent_len != len)
+	{
+		fprintf(stderr, "Failed var send: %d bytes\n", sent_len);
+		return 1;
+	}
+
+	fprintf(stderr, "Send OK\n");
+	return 0;
+}
+
+int main()
+{
+	MAKE_TEST(test1);
+	MAKE_TEST(test2);
+
+	fprintf(stderr, "ALL TEST PASS!\n");
+	return 0;
+}
@@ -0,0 +1,276 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "serial_comms.h"
+
+/*
+ * Bulk transfers, modem to Pico, for anything past one frame (a whole LED
+ * program and the like):
+ *
+ *	BULK_OPEN (target, size, CRC)	-> BULK_STATUS
+ *	BULK_DATA (offset, chunk) ...	   extended frames when the peer takes them
+ *	BULK_COMMIT			-> BULK_STATUS
+ *
+ * BULK_DATA normally skips the RX ring: uart_rx() hands it to
+ * bulk_rx_data(), which writes it straight into the target's staging
+ * area, so the receiver buffers one frame at most.
+ *
+ * bulk_rx and the staging area belong to the main loop, the same context
+ * as on_bulk_open(), on_bulk_commit() and the handlers that change the
+ * live data (SET_LED_* on the Pico). When uart_rx() runs there (DMA RX)
+ * the direct path is safe. From the UART IRQ (serial_in_irq()) BULK_DATA
+ * is queued on the RX ring like any other frame, and bulk_rx_data() runs
+ * from serial_process_next(), in order with BULK_OPEN and BULK_COMMIT.
+ * If the ring is full the chunk isn't delivered, and the link replay or
+ * a BULK_OFFSET brings it back. Chunks are only taken
+ * in order; the first one off the expected offset gets a BULK_OFFSET
+ * reply and the sender goes back to that offset. BULK_COMMIT checks size
+ * and CRC of the whole transfer and only then lets the target switch to
+ * it, a failed transfer leaves the live data alone.
+ *
+ * Both halves are built on both sides, the role's dispatch
+ * (serial_proto.hpp) only ever calls one of them.
+ */
+
+struct bulk_rx {
+	const struct bulk_target *target;	/* NULL: no transfer open */
+	uint32_t size;		/* from BULK_OPEN */
+	uint32_t done;		/* bytes taken, in order */
+	uint16_t crc;		/* from BULK_OPEN */
+	uint16_t run_crc;	/* of what was taken */
+	bool gap_sent;		/* one BULK_OFFSET / BULK_NOT_OPEN per gap */
+} bulk_rx;
+
+static void bulk_reply(uint8_t status)
+{
+	struct msg_bulk_status m;
+
+	m.status = status;
+	PUT_BE32(m.offset, bulk_rx.done);
+	msg_send_bulk_status(&m);
+}
+
+void on_bulk_open(const struct msg_bulk_open *m)
+{
+	const struct bulk_target *t = bulk_get_target(m->target);
+	uint32_t size = GET_BE32(m->size);
+
+	bulk_rx.target = NULL;
+	bulk_rx.done = 0;
+	bulk_rx.gap_sent = false;
+
+	if (!t)
+	{
+		bulk_reply(BULK_NO_TARGET);
+		return;
+	}
+
+	if (size > t->max)
+	{
+		bulk_reply(BULK_TOO_BIG);
+		return;
+	}
+
+	bulk_rx.size = size;
+	bulk_rx.crc = GET_BE16(m->crc);
+	bulk_rx.run_crc = CRC16_INIT;
+	bulk_rx.target = t;
+
+	bulk_reply(BULK_OK);
+}
+
+/* BULK_DATA that passed its check and the link's seq rules, from the main loop only */
+void bulk_rx_data(const struct serial_cmd *cmd)
+{
+	const struct msg_bulk_data *m = (const struct msg_bulk_data *)serial_cmd_payload(cmd);
+	int len = serial_cmd_len(cmd) - (int)sizeof(m->offset);
+
+	if (len < 0)
+	{
+		return;
+	}
+
+	if (!bulk_rx.target || GET_BE32(m->offset) != bulk_rx.done)
+	{
+		/* Lost chunk or nothing open: say so once, drop the rest until it's fixed */
+		if (!bulk_rx.gap_sent)
+		{
+			bulk_reply(bulk_rx.target ? BULK_OFFSET : BULK_NOT_OPEN);
+			bulk_rx.gap_sent = true;
+		}
+		return;
+	}
+	bulk_rx.gap_sent = false;
+
+	if ((uint32_t)len > bulk_rx.size - bulk_rx.done)
+	{
+		bulk_rx.target = NULL;
+		bulk_reply(BULK_TOO_BIG);
+		return;
+	}
+
+	if (!bulk_rx.target->write(bulk_rx.done, m->data, len))
+	{
+		bulk_rx.target = NULL;
+		bulk_reply(BULK_REJECTED);
+		return;
+	}
+
+	bulk_rx.run_crc = crc16_update(bulk_rx.run_crc, m->data, len);
+	bulk_rx.done += len;
+}
+
+void on_bulk_commit(void)
+{
+	const struct bulk_target *t = bulk_rx.target;
+
+	if (!t)
+	{
+		bulk_reply(BULK_NOT_OPEN);
+		return;
+	}
+
+	if (bulk_rx.done != bulk_rx.size)
+	{
+		/* The sender goes back to done, same as a BULK_OFFSET from a gap */
+		bulk_rx.gap_sent = true;
+		bulk_reply(BULK_OFFSET);
+		return;
+	}
+
+	bulk_rx.target = NULL;
+
+	if (bulk_rx.run_crc != bulk_rx.crc)
+	{
+		bulk_reply(BULK_CRC);
+		return;
+	}
+
+	bulk_reply(t->commit(bulk_rx.size) ? BULK_OK : BULK_REJECTED);
+}
+
+int bulk_send_chunk(uint32_t offset, const uint8_t *data, int len)
+{
+	struct msg_bulk_data m;
+
+	PUT_BE32(m.offset, offset);
+	memcpy(m.data, data, len);
+
+	return msg_send_bulk_data(&m, sizeof(m.offset) + len);
+}
+
+uint8_t bulk_tx_status;
+uint32_t bulk_tx_offset;
+bool bulk_tx_reply;
+
+void on_bulk_status(const struct msg_bulk_status *m)
+{
+	bulk_tx_status = m->status;
+	bulk_tx_offset = GET_BE32(m->offset);
+	bulk_tx_reply = true;
+}
+
+/* Run RX, and everything that came in, until something happens or for BULK_TIMEOUT_MS */
+static bool bulk_wait(uint32_t since)
+{
+	link_wait();
+	serial_process_next();
+
+	return link_time_ms() - since < BULK_TIMEOUT_MS;
+}
+
+/* Whole transfer, blocking. 0 once the target switched to it */
+int bulk_send(uint8_t target, const uint8_t *data, uint32_t len)
+{
+	struct msg_bulk_open open;
+	uint32_t offset = 0, since;
+	int chunk = (link_ext ? SERIAL_EXT_MAX : SERIAL_PAYLOAD_MAX) - sizeof(open.size);
+	int n, tries = 0;
+
+	open.target = target;
+	PUT_BE32(open.size, len);
+	PUT_BE16(open.crc, crc16_update(CRC16_INIT, data, len));
+
+	bulk_tx_reply = false;
+	since = link_time_ms();
+	while (msg_send_bulk_open(&open))
+	{
+		if (!bulk_wait(since))
+		{
+			return -1;
+		}
+	}
+
+	while (!bulk_tx_reply)
+	{
+		if (!bulk_wait(since))
+		{
+			return -1;
+		}
+	}
+
+	if (bulk_tx_status != BULK_OK)
+	{
+		return -1;
+	}
+
+	bulk_tx_reply = false;
+	since = link_time_ms();
+	while (tries < BULK_RETRIES)
+	{
+		if (bulk_tx_reply)
+		{
+			bulk_tx_reply = false;
+			if (bulk_tx_status == BULK_OK)
+			{
+				return 0;
+			}
+
+			if (bulk_tx_status != BULK_OFFSET || bulk_tx_offset > len)
+			{
+				return -1;
+			}
+
+			offset = bulk_tx_offset;
+			since = link_time_ms();
+			tries++;
+			continue;
+		}
+
+		if (offset < len)
+		{
+			n = len - offset < (uint32_t)chunk ? len - offset : chunk;
+			if (bulk_send_chunk(offset, data + offset, n))
+			{
+				/* TX channel full, held by the link window */
+				if (!bulk_wait(since))
+				{
+					return -1;
+				}
+				continue;
+			}
+			offset += n;
+			since = link_time_ms();
+			continue;
+		}
+
+		/* All sent, the commit answer says whether it all got there */
+		if (offset == len && msg_send_bulk_commit() == 0)
+		{
+			offset++;
+			since = link_time_ms();
+		}
+
+		if (!bulk_wait(since))
+		{
+			/* No answer, ask again */
+			offset = len;
+			since = link_time_ms();
+			tries++;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,343 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "serial_comms.h"
+
+#if SERIAL_BUS
+/*
+ * Multi-drop bus: the modem and up to BUS_NODES Picos on one half duplex
+ * line, RS-485 with auto direction transceivers or a daisy chain where
+ * every node passes on what isn't its own.
+ *
+ * Every frame carries an address byte right after START: the node's
+ * address on frames to it, 0x80 | address on frames from it. It counts
+ * in the parity and the CRC, so a frame can't be taken for another
+ * node's. A receiver skips frames that aren't its own up to their END
+ * without checking them.
+ *
+ * Only one side talks at a time. The master holds the line and hands it
+ * to one node with BUS_POLL, which says how many frames the node may send;
+ * the node sends them and gives the line back with BUS_DONE, which says
+ * how many it still has queued. Every frame the master sends is followed
+ * by a BUS_POLL, so replies and ACKs come back right away, and
+ * bus_service() polls the nodes that have something queued or weren't
+ * heard from in BUS_POLL_MS. No BUS_DONE in BUS_SLOT_MS, the master takes
+ * the line back and the node gives it up.
+ *
+ * The master talks to one node at a time, bus_select(): seq, link mode,
+ * credit, clock and unacked frames are per node, swapped by
+ * link_peer_switch().
+ */
+
+#define BUS_FROM_NODE	0x80
+
+struct serial_bus_stats serial_bus_stats;
+
+bool bus_on;
+uint8_t bus_role;
+uint8_t bus_node;
+
+/* Address bytes and the CRC seeds they give, see serial_comms.c */
+uint8_t bus_rx_addr, bus_tx_addr;
+uint16_t bus_rx_seed = CRC16_INIT, bus_tx_seed = CRC16_INIT;
+
+bool bus_token;			/* the line is ours */
+bool bus_turn;			/* master: poll the node once the queue is out */
+uint8_t bus_budget, bus_sent;	/* node: frames this turn */
+uint32_t bus_turn_ms;		/* token changed hands at */
+
+#if SERIAL_BUS_MASTER
+struct bus_peer {
+	uint32_t polled_ms;
+	uint8_t pending;	/* frames queued, its last BUS_DONE said */
+	uint8_t misses;		/* polls in a row it didn't answer */
+} bus_peers[BUS_NODES];
+
+/* A node that doesn't answer (not there, rebooting) gets polled less and less, up to 64 x BUS_POLL_MS */
+#define BUS_MISSES_MAX	6
+#endif
+
+extern volatile bool tx_busy;
+
+static inline bool bus_is_master(void)
+{
+	return SERIAL_BUS_MASTER && bus_role == BUS_MASTER;
+}
+
+static void bus_set_addr(void)
+{
+	if (bus_is_master())
+	{
+		bus_tx_addr = bus_node;
+		bus_rx_addr = bus_node | BUS_FROM_NODE;
+	}
+	else
+	{
+		bus_rx_addr = bus_node;
+		bus_tx_addr = bus_node | BUS_FROM_NODE;
+	}
+
+#if SERIAL_CRC16
+	bus_rx_seed = crc16_update(CRC16_INIT, &bus_rx_addr, 1);
+	bus_tx_seed = crc16_update(CRC16_INIT, &bus_tx_addr, 1);
+#endif
+}
+
+/* Addressed frames from now on. role is BUS_MASTER or the node's address */
+void bus_init(uint8_t role)
+{
+	bus_role = role;
+	bus_node = role == BUS_MASTER ? 0 : role;
+	bus_token = role == BUS_MASTER;
+	bus_turn = false;
+	bus_turn_ms = link_time_ms();
+
+#if SERIAL_BUS_MASTER
+	if (role == BUS_MASTER)
+	{
+		memset(bus_peers, 0, sizeof(bus_peers));
+		link_peers_reset();
+	}
+#endif
+
+	bus_set_addr();
+	bus_on = true;
+}
+
+/* May a frame go out now. Call with tx_lock() held */
+bool bus_tx_allowed(void)
+{
+	if (!bus_on)
+	{
+		return true;
+	}
+
+	return bus_token && (bus_is_master() || bus_sent < bus_budget);
+}
+
+/* A frame went out. Call with tx_lock() held */
+void bus_tx_sent(void)
+{
+	if (!bus_on)
+	{
+		return;
+	}
+
+	if (bus_is_master())
+	{
+		bus_turn = true;
+	}
+	else
+	{
+		bus_sent++;
+	}
+}
+
+/*
+ * The TX side has nothing it may send: the BUS_POLL / BUS_DONE frame that
+ * hands the line over, if it does now, in buf. Returns its length or 0.
+ * Call with tx_lock() held.
+ */
+int bus_turn_build(uint8_t *buf, int pending)
+{
+	struct serial_cmd *cmd = (struct serial_cmd *)buf;
+	struct msg_bus_turn *m = (struct msg_bus_turn *)cmd->cmd;
+
+	if (!bus_on || !bus_token)
+	{
+		return 0;
+	}
+
+	if (bus_is_master())
+	{
+		if (!bus_turn)
+		{
+			return 0;
+		}
+
+		cmd->cmd_type = BUS_POLL;
+		m->frames = BUS_BURST;
+		bus_turn = false;
+		serial_bus_stats.polls++;
+	}
+	else
+	{
+		cmd->cmd_type = BUS_DONE;
+		m->frames = pending > 0xFF ? 0xFF : pending;
+	}
+
+	cmd->cmd_len = sizeof(*m);
+	bus_token = false;
+	bus_turn_ms = link_time_ms();
+
+	return sizeof(*cmd) + sizeof(*m);
+}
+
+/* BUS_POLL / BUS_DONE for us, from link_rx_frame() */
+void bus_rx_turn(uint8_t cmd_type, const struct msg_bus_turn *m)
+{
+	if (!bus_on)
+	{
+		return;
+	}
+
+	if (cmd_type == BUS_POLL && !bus_is_master())
+	{
+		bus_budget = m->frames;
+		bus_sent = 0;
+		serial_bus_stats.polls++;
+	}
+#if SERIAL_BUS_MASTER
+	else if (cmd_type == BUS_DONE && bus_is_master())
+	{
+		bus_peers[bus_node].pending = m->frames;
+		bus_peers[bus_node].polled_ms = link_time_ms();
+		bus_peers[bus_node].misses = 0;
+	}
+#endif
+	else
+	{
+		return;
+	}
+
+	bus_token = true;
+	bus_turn_ms = link_time_ms();
+	uart_tx_kick();
+}
+
+/* The token never came back (master) or we sat on it too long (node), from link_poll() */
+void bus_check(uint32_t now)
+{
+	if (!bus_on || now - bus_turn_ms < BUS_SLOT_MS)
+	{
+		return;
+	}
+
+	if (bus_is_master() && !bus_token)
+	{
+#if SERIAL_BUS_MASTER
+		if (bus_peers[bus_node].misses < BUS_MISSES_MAX)
+		{
+			bus_peers[bus_node].misses++;
+		}
+#endif
+		serial_bus_stats.timeouts++;
+		bus_token = true;
+		bus_turn_ms = now;
+		uart_tx_kick();
+	}
+	else if (!bus_is_master() && bus_token)
+	{
+		/* The master has taken the line back by now */
+		bus_token = false;
+	}
+}
+
+#if SERIAL_BUS_MASTER
+/* The line is ours, nothing queued or unacked for the current node */
+static bool bus_settled(void)
+{
+	return bus_token && !tx_busy && !uart_tx_pending() && link_quiesce();
+}
+
+/*
+ * Talk to node from now on. What's queued for the current one gets up to
+ * two slots to go out and be acked. After that what never went out is
+ * dropped, what went out unacked stays with the node and is sent again
+ * once it's selected next. Frames from it that are in already are
+ * handled first, under its bus_node.
+ */
+int bus_select(uint8_t node)
+{
+	uint32_t start;
+
+	if (!bus_on || !bus_is_master() || node >= BUS_NODES)
+	{
+		return -1;
+	}
+
+	if (node == bus_node)
+	{
+		return 0;
+	}
+
+	start = link_time_ms();
+	while (!bus_settled() && link_time_ms() - start < 2 * BUS_SLOT_MS)
+	{
+		link_wait();
+	}
+
+	if (!bus_settled())
+	{
+		serial_bus_stats.flushed += uart_tx_flush();
+		bus_token = true;
+		bus_turn = false;
+	}
+
+	while (serial_process_next());
+
+	link_peer_switch(bus_node, node);
+
+	bus_node = node;
+	bus_set_addr();
+	serial_bus_stats.switches++;
+
+	return 0;
+}
+
+/* Polls the nodes that are due, call from the main loop */
+void bus_service(void)
+{
+	struct bus_peer *p;
+	uint32_t start;
+	uint8_t node;
+
+	if (!bus_on || !bus_is_master())
+	{
+		return;
+	}
+
+	for (node = 0; node < BUS_NODES; node++)
+	{
+		p = &bus_peers[node];
+		if (!p->pending && link_time_ms() - p->polled_ms < (BUS_POLL_MS << p->misses))
+		{
+			continue;
+		}
+
+		if (bus_select(node))
+		{
+			continue;
+		}
+
+		/* Polls it even with nothing to send */
+		bus_turn = true;
+		p->polled_ms = link_time_ms();
+		uart_tx_kick();
+
+		start = link_time_ms();
+		while (!bus_token && link_time_ms() - start < 2 * BUS_SLOT_MS)
+		{
+			link_wait();
+		}
+	}
+}
+#else
+int bus_select(uint8_t node)
+{
+	return -1;
+}
+
+void bus_service(void)
+{
+}
+#endif
+#else
+uint8_t bus_node;
+
+void bus_service(void)
+{
+}
+#endif /* SERIAL_BUS */
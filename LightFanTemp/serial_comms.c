@@ -6,656 +6,1064 @@
 
 #include "serial_comms.h"
 
-#ifndef ESP8266
-#include "led_helpers.h"
-/* Array of LEDs, used to flash status */
-volatile struct led_programs led_programs[NUM_LED_PROGRAMS];
-
-/* Sane defaults */
-volatile struct led_programs *cur_prg = &led_programs[0];
-volatile struct led_programs *shadow_prg = &led_programs[1];
-
-uint8_t current_prg_idx = 0;
-
-bool wifi_connected;
-bool mqtt_connected;
-
-#endif
 /* Globals */
 char rsp_buf[CMD_LEN];
 
-char *rx_buf = double_rx_buf;
-
-volatile uint8_t serial_buf_cidx, serial_buf_pidx;
+/* The receivers themselves are the role's, serial_proto.hpp */
+bool serial_rx_cobs[SERIAL_PORTS];
+
+/* Where serial_send() goes: the port the frame being handled came in on */
+uint8_t serial_tx_port = PORT_UART;
+struct serial_port_stats serial_port_stats[SERIAL_PORTS];
+
+/*
+ * Single producer (uart_rx(), IRQ or DMA drain) / single consumer (main
+ * loop) ring of received frames. Each record is a 16 bit length with the
+ * port in its top bits, the
+ * serial_time_us() it came in at (SERIAL_STATS only) and the frame
+ * (header + payload) right after it, never split by the end of the ring
+ * so the consumer can use it in place. Records start on even offsets.
+ * head / tail run freely and are masked on use. The producer publishes
+ * head with release after writing the record, the consumer reads it with
+ * acquire, and the same the other way for tail.
+ */
+#define RING_MASK	(SERIAL_RING_SIZE - 1)
+#define RING_WRAP	0xFFFF	/* rest of the ring unused, next record at 0 */
+#define RING_REC(len)	SERIAL_RING_REC(len)
+#define RING_LEN(hdr)	((hdr) & 0x0FFF)
+#define RING_PORT(hdr)	((hdr) >> 12)
+
+uint8_t serial_ring[SERIAL_RING_SIZE] __attribute__((aligned(2)));
+uint32_t serial_ring_head, serial_ring_tail;
+
+struct serial_rx_stats serial_rx_stats;
+struct serial_tx_stats serial_tx_stats;
+
+struct tx_chan_stats tx_chan_stats[TX_CHANNELS];
+
+/* Frame waiting on a channel: header, extended length, payload. Seq and check come at send time */
+struct tx_slot {
+	uint16_t len;
+	bool raw;		/* from uart_tx(), header already final */
+	uint8_t buf[];
+};
+
+#define TX_SLOT(frame)		((sizeof(struct tx_slot) + (frame) + 3) & ~3)
+#define TX_SLOT_STD		TX_SLOT(SERIAL_STD_FRAME_MAX)
+#define TX_SLOT_EXT		TX_SLOT(SERIAL_TX_FRAME_MAX)
+
+struct tx_queue {
+	uint8_t *pool;		/* depth slots of size bytes */
+	uint16_t size;
+	uint8_t mask;		/* depth - 1 */
+	volatile uint8_t head, tail;	/* free running */
+};
+
+static uint8_t tx_pool_link[TX_DEPTH_LINK * TX_SLOT_STD] __attribute__((aligned(4)));
+static uint8_t tx_pool_control[TX_DEPTH_CONTROL * TX_SLOT_STD] __attribute__((aligned(4)));
+static uint8_t tx_pool_telemetry[TX_DEPTH_TELEMETRY * TX_SLOT_STD] __attribute__((aligned(4)));
+static uint8_t tx_pool_bulk[TX_DEPTH_BULK * TX_SLOT_EXT] __attribute__((aligned(4)));
+static uint8_t tx_pool_log[TX_DEPTH_LOG * TX_SLOT_STD] __attribute__((aligned(4)));
+
+struct tx_queue tx_chans[TX_CHANNELS] = {
+	[CHAN_LINK]		= { tx_pool_link,	TX_SLOT_STD,	TX_DEPTH_LINK - 1 },
+	[CHAN_CONTROL]		= { tx_pool_control,	TX_SLOT_STD,	TX_DEPTH_CONTROL - 1 },
+	[CHAN_TELEMETRY]	= { tx_pool_telemetry,	TX_SLOT_STD,	TX_DEPTH_TELEMETRY - 1 },
+	[CHAN_BULK]		= { tx_pool_bulk,	TX_SLOT_EXT,	TX_DEPTH_BULK - 1 },
+	[CHAN_LOG]		= { tx_pool_log,	TX_SLOT_STD,	TX_DEPTH_LOG - 1 },
+};
+
+/* The one frame being sent by uart_tx_start(), unless it's a replay out of the link window */
+struct tx_frame tx_wire;
+uint8_t tx_wire_seq;
+volatile bool tx_busy;
+bool tx_held;		/* data frames waiting on the link window or credit */
+static bool tx_pumping;	/* in tx_pump(), see there */
+
+void (*tx_done_cb)(uint8_t seq);
 
-int pos;
-enum parser_state parser_state = MSG_START;
-enum parser_state prev_parser_state = MSG_START;
-uint8_t parity = 0;
 uint8_t rx_seq = 0;
 uint8_t tx_seq = 0;
 
+/* Check used on frames we send, upgraded by LINK_CAPS */
+uint8_t tx_check = CHECK_SUM;
+
+#if SERIAL_BUS
+/* Addressed frames: the byte after START, it counts in the parity and CRC */
+#define TX_ADDR_SUM	(bus_on ? bus_tx_addr : 0)
+#define TX_CRC_INIT	(bus_on ? bus_tx_seed : CRC16_INIT)
+#define TX_ON_BUS	bus_on
+#else
+#define TX_ADDR_SUM	0
+#define TX_CRC_INIT	CRC16_INIT
+#define TX_ON_BUS	false
+
+#define bus_tx_sent()	do { } while (0)
+#endif
+
+#if SERIAL_CRC16
+/* Slicing by 4 tables for the software CRC, filled on first use */
+uint16_t crc16_table[4][256];
+bool crc16_table_ready;
+#endif
+
 /* Funcs */
 __WEAK void put_char(unsigned char ch)
 {
 	printf("0x%02x ",ch);
 }
 
-void uart_tx(char *src, int len)
+/* Default transport: push it out char by char and complete right away */
+__WEAK void uart_tx_start(const uint8_t *buf, int len)
 {
 	int i;
 
-	/* First we put out the start char */
-	put_char(START_CHAR);
-	
 	for (i = 0; i < len; i++) {
-		if ((src[i] == START_CHAR) || (src[i] == END_CHAR) || (src[i] == ESCAPE_CHAR))
-		{
-			put_char(ESCAPE_CHAR);
-		}
-		put_char(src[i]);
+		put_char(buf[i]);
 	}
 
-	put_char(END_CHAR);
+	uart_tx_done();
 }
 
-void send_log(const char *format, ...)
+/* Single threaded users don't need to lock the TX queue */
+__WEAK uint32_t tx_lock(void)
 {
-		struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-		uint8_t calc_parity;
-		va_list arglist;
-		int i, ret;
+	return 0;
+}
 
-		rsp->cmd_type = SEND_LOG;
-		rsp->parity = calc_parity = 0;
-		rsp->seq = tx_seq;
+__WEAK void tx_unlock(uint32_t flags)
+{
+}
 
-		va_start(arglist, format);
-		ret  = vsnprintf(rsp->cmd, sizeof(rsp_buf) - 4, format, arglist);
-		va_end(arglist);
+static uint8_t *escape_to(uint8_t *p, const uint8_t *src, int len);
+static uint8_t *cobs_to(uint8_t *p, uint8_t **code, const uint8_t *src, int len);
 
-		if (ret < 0) {
-			ERROR("Log too long!\n");
-			return;
-		}
+/* Escape src into dst in one pass, dst needs TX_FRAME_MAX bytes */
+int frame_encode(uint8_t *dst, const char *src, int len)
+{
+	uint8_t *p = dst;
 
-		rsp->cmd_len  = (uint8_t)ret;
+	/* First we put out the start char */
+	*p++ = START_CHAR;
+#if SERIAL_BUS
+	if (bus_on)
+	{
+		*p++ = bus_tx_addr;
+	}
+#endif
+	p = escape_to(p, (const uint8_t *)src, len);
+	*p++ = END_CHAR;
 
-		/* Need to finish the string */
-		rsp->cmd[rsp->cmd_len++] = 0;
+	return p - dst;
+}
 
-		for(i = 0; i < rsp->cmd_len + 4; i++) {
-			calc_parity += rsp_buf[i];
-		}
-		rsp->parity = calc_parity;
+/* Same as COBS, never addressed */
+int frame_encode_cobs(uint8_t *dst, const char *src, int len)
+{
+	uint8_t *p = dst, *code;
 
-		uart_tx(rsp_buf, rsp->cmd_len + 4);
+	*p++ = COBS_DELIM;
+	code = p++;
+	p = cobs_to(p, &code, (const uint8_t *)src, len);
+	*code = p - code;
+	*p++ = COBS_DELIM;
 
-		tx_seq++;
+	return p - dst;
 }
 
-int uart_rx(unsigned char ch)
+/* Framing for what goes out of port: COBS once the UART peer or the USB host uses it */
+static inline bool tx_cobs(uint8_t port)
 {
-	struct serial_cmd *cmd = (struct serial_cmd *)rx_buf;
+#if SERIAL_COBS
+	if (port == PORT_UART)
+	{
+		return link_cobs && !TX_ON_BUS;
+	}
+#if SERIAL_USB
+	if (port == PORT_USB)
+	{
+		return serial_rx_cobs[PORT_USB];
+	}
+#endif
+#endif
 
-	DEBUG("In %s\n", __func__);
-	DEBUG("parser state = %d, ch = 0x%02x (%c)\n", parser_state, ch, ch);
+	return false;
+}
 
-	DEBUG("pos = %d, cmd_len = %d\n", pos, cmd->cmd_len);
+/* 
+ * SWITCH_PROGRAMS / RESUME_ANIMATION ride with the LED frames so they
+ * can't overtake the upload they make live.
+ */
+static int tx_chan_of(uint8_t cmd_type)
+{
+	switch (cmd_type & ~FRAME_CRC16)
+	{
+	case SEND_LOG:
+	case SEND_LOG_TOKENS:
+		return CHAN_LOG;
+	case SET_LED_COLOR:
+	case SET_LED_PROGRAM_STEPS:
+	case SET_LED_PALETTE:
+	case SET_LED_STEP_PACKED:
+	case SWITCH_PROGRAMS:
+	case RESUME_ANIMATION:
+	case BULK_OPEN:
+	case BULK_DATA:
+	case BULK_COMMIT:
+		return CHAN_BULK;
+	case SEND_FAN_PWM:
+	case SEND_TEMP:
+	case SEND_TELEMETRY:
+	case SEND_STATS:
+		return CHAN_TELEMETRY;
+	}
 
+	return IS_LINK_CMD(cmd_type & ~FRAME_CRC16) ? CHAN_LINK : CHAN_CONTROL;
+}
 
-	switch (parser_state)
-	{
-		case MSG_START:
-			DEBUG("State = MSG_START\n");
-			if (ch == START_CHAR) 
-			{
-				parser_state = MSG_PARITY_RCV;
-				pos = 0;
-				parity = 0;
-			}
-			else
-			{
-				ERROR("Invalid start char received in state 0x%02x\n", parser_state);
-				parser_state = MSG_START;
-			}
-			break;
+static inline struct tx_slot *tx_slot_at(struct tx_queue *q, uint8_t idx)
+{
+	return (struct tx_slot *)(q->pool + (idx & q->mask) * q->size);
+}
 
-		case MSG_PARITY_RCV:
-			DEBUG("State = MSG_PARITY_RCV\n");
+/* Length a queued frame takes in the peer's RX ring, 0 if it never goes there */
+static int tx_ring_len(const struct tx_slot *s)
+{
+	const struct serial_cmd *hdr = (const struct serial_cmd *)s->buf;
+	uint8_t cmd_type = hdr->cmd_type & ~FRAME_CRC16;
 
-			if (ch == ESCAPE_CHAR)
-			{
-				DEBUG("Got escape in MSG_PARITY_RCV\n");
-				parser_state = MSG_ESCAPE;
-				prev_parser_state = MSG_PARITY_RCV;
-			}
-			else
-			{
-				rx_buf[pos++] = ch;
-				parser_state = MSG_RCV;
-			}
+	if (IS_LINK_CMD(cmd_type) || cmd_type == BULK_DATA || hdr->cmd_len == FRAME_EXT_LEN)
+	{
+		return 0;
+	}
 
-			break;
+	return sizeof(*hdr) + hdr->cmd_len;
+}
 
-		case MSG_RCV:
-			DEBUG("State = MSG_RCV\n");
-			switch (ch)
-			{
-				case  ESCAPE_CHAR:
-					DEBUG("Got escape in MSG_RCV\n");
-					parser_state = MSG_ESCAPE;
-					prev_parser_state = MSG_RCV;
-					break;
-
-				case END_CHAR:
-					parser_state = MSG_END;
-					break;
-	
-				default:
-					parity += ch;
-					DEBUG("Parity = 0x%02x\n", parity);
-					rx_buf[pos++] = ch;
-			}
-			break;
+/* Parity or CRC for a frame with its seq set, escaped into out. Only the UART is on the bus */
+static void tx_seal(struct tx_frame *out, uint8_t *buf, int len, uint8_t check, uint8_t port)
+{
+	struct serial_cmd *hdr = (struct serial_cmd *)buf;
+	bool addr = port == PORT_UART;
+	uint8_t *p, *code, trailer[2];
+	uint16_t crc;
+	int i;
 
-		case MSG_ESCAPE:
-			DEBUG("State = MSG_ESCAPE\n");
-			switch (prev_parser_state)
-			{
-				case MSG_RCV:
-					parity += ch;
-					DEBUG("ESCAPE Parity = 0x%02x\n", parity);
-					rx_buf[pos++] = ch;
-					break;
-				
-				case MSG_PARITY_RCV:
-					rx_buf[pos++] = ch;
-					break;
-
-				default:
-					ERROR("Unknown prev state %d\n", prev_parser_state);
-					break;
-			}
-			parser_state = MSG_RCV;
-//			parser_state = prev_parser_state;
+	hdr->parity = addr ? TX_ADDR_SUM : 0;
 
-			break;
-	
+#if SERIAL_CRC16
+	if (check == CHECK_CRC16)
+	{
+		hdr->cmd_type |= FRAME_CRC16;
+		crc = crc16_update(addr ? TX_CRC_INIT : CRC16_INIT, buf, len);
+		PUT_BE16(trailer, crc);
 	}
-
-	if (parser_state == MSG_END) {
-		if (cmd->seq != rx_seq) {
-			ERROR("Warn: expected seq %d, got %d\n", rx_seq, cmd->seq);
-			rx_seq = cmd->seq + 1;
-		} else {
-			rx_seq++;
+	else
+#endif
+	{
+		/* seq, cmd_type, cmd_len, extended length and payload */
+		for (i = 1; i < len; i++)
+		{
+			hdr->parity += buf[i];
 		}
+	}
 
-		if (cmd->parity != parity) {
-			ERROR("Parity failed: expected 0x%02x, got 0x%02x\n", parity, cmd->parity);
-		} else {
-			DEBUG("Processing message\n");
-			//process_message(rx_buf);
-			if (((serial_buf_pidx + 1 ) % NUM_ENTRIES) == serial_buf_cidx)
-			{
-				ERROR("Serial overflow: pidx = %d, cidx = %d\n", serial_buf_pidx, serial_buf_cidx);
-			}
-			else
-			{
-				DEBUG("Serial pidx = %d, cidx = %d\n", serial_buf_pidx, serial_buf_cidx);
-				serial_buf_pidx = (serial_buf_pidx + 1) % NUM_ENTRIES;
-				rx_buf = &double_rx_buf[CMD_LEN * serial_buf_pidx];
-			}
+	p = out->buf;
+	if (tx_cobs(port))
+	{
+		*p++ = COBS_DELIM;
+		code = p++;
+		p = cobs_to(p, &code, buf, len);
+		if (hdr->cmd_type & FRAME_CRC16)
+		{
+			p = cobs_to(p, &code, trailer, sizeof(trailer));
 		}
-		parser_state = MSG_START;
-
-		return 0;
+		*code = p - code;
+		*p++ = COBS_DELIM;
+	}
+	else
+	{
+		*p++ = START_CHAR;
+#if SERIAL_BUS
+		if (bus_on && addr)
+		{
+			*p++ = bus_tx_addr;
+		}
+#endif
+		p = escape_to(p, buf, len);
+		if (hdr->cmd_type & FRAME_CRC16)
+		{
+			p = escape_to(p, trailer, sizeof(trailer));
+		}
+		*p++ = END_CHAR;
 	}
 
-	return 1;
+	out->len = p - out->buf;
+	out->seq = hdr->seq;
 }
 
-#ifndef ESP8266
-void send_modem_reset()
+/* Seq and check for a queued frame, escaped into tx_wire. Call with tx_lock() held */
+static void tx_encode(struct tx_slot *s)
 {
-		struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-		int i;
-
-		rsp->cmd_type = MODEM_RESET;
-		rsp->parity = 0;
+	struct serial_cmd *hdr = (struct serial_cmd *)s->buf;
 
-		rsp->cmd_len = 0;
-		rsp->seq = tx_seq++;
+	if (s->raw)
+	{
+		tx_wire.len = tx_cobs(PORT_UART) ? frame_encode_cobs(tx_wire.buf, (const char *)s->buf, s->len) :
+			frame_encode(tx_wire.buf, (const char *)s->buf, s->len);
+		tx_wire.seq = hdr->seq;
+		return;
+	}
 
-		for(i = 0; i < rsp->cmd_len + 4; i++) {
-			rsp->parity += rsp->cmd[i];
-		}
+	/* LINK_* frames carry the next data seq without using it up */
+	hdr->seq = IS_LINK_CMD(hdr->cmd_type) ? tx_seq : tx_seq++;
+	tx_seal(&tx_wire, s->buf, s->len, tx_check, PORT_UART);
+}
 
-		uart_tx(rsp_buf, rsp->cmd_len + 4);
+/* Frames waiting on all channels. Call with tx_lock() held */
+static int tx_queued(void)
+{
+	int chan, n = 0;
 
+	for (chan = 0; chan < TX_CHANNELS; chan++)
+	{
+		n += (uint8_t)(tx_chans[chan].head - tx_chans[chan].tail);
+	}
 
+	return n;
 }
 
-void send_temperature(int16_t *temperatures)
+/* The transport is ours from here, stats as for any frame */
+static void tx_start(void)
 {
-		struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-		uint8_t calc_parity;
-		int i;
-
-		rsp->cmd_type = SEND_TEMP;
-		rsp->parity = calc_parity = 0;
-		rsp->seq = tx_seq;
+	serial_tx_stats.frames++;
+	serial_tx_stats.bytes += tx_wire.len;
 
-		/* 1 byte for each would be enough, -127..+128...
-		 * BUT DS18B20 can do .1 degrees...
-		 * so send this as int(Temp_f * 10) */
-		rsp->cmd_len = NUM_TEMP_SENSORS * 2;
-		rsp->seq = tx_seq;
+	tx_busy = true;
+	tx_wire_seq = tx_wire.seq;
+	uart_tx_start(tx_wire.buf, tx_wire.len);
+}
 
-		for (i = 0; i < NUM_TEMP_SENSORS * 2; i+=2)
-		{
-			rsp->cmd[i] = (temperatures[i/2] >> 8) & 0xFF;
-			rsp->cmd[i + 1] = temperatures[i/2] & 0xFF;
-		}
+#if SERIAL_BUS
+/* Nothing more to send: BUS_POLL / BUS_DONE if the line changes hands now. Call with tx_lock() held */
+static bool tx_bus_turn(void)
+{
+	static uint8_t slot[TX_SLOT(sizeof(struct serial_cmd) + sizeof(struct msg_bus_turn))] __attribute__((aligned(4)));
+	struct tx_slot *s = (struct tx_slot *)slot;
 
-		for(i = 0; i < rsp->cmd_len + 4; i++) {
-			calc_parity += rsp_buf[i];
-		}
+	s->len = bus_turn_build(s->buf, tx_queued());
+	if (!s->len)
+	{
+		return false;
+	}
 
-		rsp->parity = calc_parity;
+	s->raw = false;
+	tx_encode(s);
+	tx_start();
 
-		uart_tx(rsp_buf, rsp->cmd_len + 4);
-		tx_seq++;
+	return true;
+}
+#else
+static inline bool tx_bus_turn(void)
+{
+	return false;
 }
+#endif
 
-void send_tacho(uint16_t *fan_speed)
+/* 
+ * Start the next frame if the transport is idle: link replays first, then
+ * the highest priority channel with something on it. Data frames wait
+ * while the link window is full or the peer's ring has no room for them,
+ * LINK_* ones never do. Seq is assigned here, so it follows wire order
+ * whatever channel a frame came on. True if a frame went to the
+ * transport. Call with tx_lock() held.
+ */
+static bool tx_kick(void)
 {
-		struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-		uint8_t calc_parity;
-		int i;
+	const struct tx_frame *replay;
+	struct tx_queue *q;
+	struct tx_slot *s;
+	int chan, len;
+	bool held;
 
-		rsp->cmd_type = SEND_FAN_PWM;
-		rsp->parity = calc_parity = 0;
+	if (tx_busy)
+	{
+		return false;
+	}
+
+#if SERIAL_BUS
+	/* Not our turn on the bus line, everything waits for it */
+	if (!bus_tx_allowed())
+	{
+		tx_held = true;
+		return tx_bus_turn();
+	}
+#endif
 
-		/* speed can be > 255 => 2 bytes each */
-		rsp->cmd_len = NUM_FANS * 2;
-		rsp->seq = tx_seq;
+	replay = link_tx_replay();
+	if (replay)
+	{
+		bus_tx_sent();
+		tx_busy = true;
+		tx_wire_seq = replay->seq;
+		uart_tx_start(replay->buf, replay->len);
+		return true;
+	}
 
-		for (i = 0; i < rsp->cmd_len; i+=2)
+	for (chan = 0; chan < TX_CHANNELS; chan++)
+	{
+		q = &tx_chans[chan];
+		if (q->head != q->tail)
 		{
-			rsp->cmd[i] = (fan_speed[i/2] >> 8) & 0xFF;
-			rsp->cmd[i + 1] = fan_speed[i/2] & 0xFF;
+			break;
 		}
+	}
 
-		for(i = 0; i < rsp->cmd_len + 4; i++) {
-			calc_parity += rsp_buf[i];
-		}
+	if (chan == TX_CHANNELS)
+	{
+		tx_held = false;
+		return tx_bus_turn();
+	}
+
+	s = tx_slot_at(q, q->tail);
+	len = tx_ring_len(s);
+
+	held = chan != CHAN_LINK && (link_window_full() || !link_credit_ok(len));
+	if (held && !tx_held)
+	{
+		serial_tx_stats.held++;
+	}
+	tx_held = held;
+	if (held)
+	{
+		return tx_bus_turn();
+	}
+
+	tx_encode(s);
+	q->tail++;
+
+	tx_chan_stats[chan].frames++;
+	tx_chan_stats[chan].depth = q->head - q->tail;
+
+	if (chan != CHAN_LINK)
+	{
+		link_tx_sent(&tx_wire);
+		link_credit_sent(tx_wire.seq, len);
+	}
 
-		rsp->parity = calc_parity;
+	bus_tx_sent();
+	tx_start();
 
-		uart_tx(rsp_buf, rsp->cmd_len + 4);
-		tx_seq++;
+	return true;
 }
 
-__WEAK void parse_log(uint8_t *cmd)
+/*
+ * tx_kick() until the transport is busy or there's nothing to send. A
+ * transport that is done right in uart_tx_start() (put_char(), a write
+ * that fits) calls uart_tx_done() from there; that only frees the
+ * transport and the next frame goes from this loop, not one call deeper
+ * per queued frame. Call with tx_lock() held.
+ */
+static void tx_pump(void)
 {
-	printf("LOG: %s", cmd);
+	if (tx_pumping)
+	{
+		return;
+	}
+
+	tx_pumping = true;
+	while (tx_kick() && !tx_busy);
+	tx_pumping = false;
 }
-#endif
 
-#ifdef ESP8266
-void send_wifi_status(bool status)
+/* Send whatever can go now, e.g. once an ACK opened the link window */
+void uart_tx_kick(void)
 {
-	struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-	uint8_t calc_parity;
-	int i;
+	uint32_t flags;
 
-	rsp->cmd_type = status == true ? WIFI_CONNECTED : WIFI_DISCONNECTED;
-	rsp->parity = calc_parity = 0;
+	flags = tx_lock();
+	tx_pump();
+	tx_unlock(flags);
+}
 
-	/* speed can be > 255 => 2 bytes each */
-	rsp->cmd_len = 0;
-	rsp->seq = tx_seq;
+/* Called by the transport once the buffer passed to uart_tx_start() is free */
+void uart_tx_done(void)
+{
+	tx_busy = false;
+
+	if (tx_done_cb)
+	{
+		tx_done_cb(tx_wire_seq);
+	}
 
-	for(i = 0; i < rsp->cmd_len + 4; i++) {
-		calc_parity += rsp_buf[i];
+	if (!tx_pumping)
+	{
+		uart_tx_kick();
 	}
+}
+
+/* Escape len bytes of src to p. Returns the new end of p */
+static uint8_t *escape_to(uint8_t *p, const uint8_t *src, int len)
+{
+	int i;
 
-	rsp->parity = calc_parity;
+	for (i = 0; i < len; i++) {
+		if ((src[i] == START_CHAR) || (src[i] == END_CHAR) || (src[i] == ESCAPE_CHAR))
+		{
+			*p++ = ESCAPE_CHAR;
+		}
+		*p++ = src[i];
+	}
 
-	uart_tx(rsp_buf, rsp->cmd_len + 4);
-	tx_seq++;
+	return p;
 }
 
-void send_mqtt_status(bool status)
+/*
+ * COBS encode len bytes of src to p, *code is the current block's code
+ * byte, still to be filled in. Blocks run on across calls, so a frame and
+ * its trailer go out as one. Returns the new end of p.
+ */
+static uint8_t *cobs_to(uint8_t *p, uint8_t **code, const uint8_t *src, int len)
 {
-	struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-	uint8_t calc_parity;
 	int i;
 
-	rsp->cmd_type = status == true ? MQTT_CONNECTED : MQTT_DISCONNECTED;
-	rsp->parity = calc_parity = 0;
+	for (i = 0; i < len; i++)
+	{
+		if (src[i] != COBS_DELIM)
+		{
+			*p++ = src[i];
+			if (p - *code < COBS_BLOCK)
+			{
+				continue;
+			}
+		}
+
+		/* A zero, or a full block that doesn't stand for one */
+		**code = p - *code;
+		*code = p++;
+	}
 
-	rsp->cmd_len = 0;
-	rsp->seq = tx_seq;
+	return p;
+}
+
+#if SERIAL_CRC16
+static void crc16_init_table(void)
+{
+	uint16_t crc;
+	int i, j;
 
-	for(i = 0; i < rsp->cmd_len + 4; i++) {
-		calc_parity += rsp_buf[i];
+	for (i = 0; i < 256; i++)
+	{
+		crc = i << 8;
+		for (j = 0; j < 8; j++)
+		{
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+		crc16_table[0][i] = crc;
 	}
 
-	rsp->parity = calc_parity;
+	/* Table k: byte followed by k zero bytes */
+	for (i = 0; i < 256; i++)
+	{
+		for (j = 1; j < 4; j++)
+		{
+			crc = crc16_table[j - 1][i];
+			crc16_table[j][i] = (crc << 8) ^ crc16_table[0][crc >> 8];
+		}
+	}
 
-	uart_tx(rsp_buf, rsp->cmd_len + 4);
-	tx_seq++;
+	crc16_table_ready = true;
 }
 
-void send_led_color(uint8_t *msg, uint8_t len)
+/* 
+ * CRC-16/CCITT-FALSE (poly 0x1021, MSB first), 4 bytes per step. Runs
+ * from tx_kick() in IRQ context too, so it must never wait on anything:
+ * the unescaped bytes it covers never pass a DMA channel the sniffer
+ * could watch, and a blocking mem->mem run with IRQs off costs more.
+ */
+__WEAK uint16_t crc16_update(uint16_t crc, const uint8_t *buf, int len)
 {
-	struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-	uint8_t calc_parity;
-	int i;
-
-	rsp->cmd_type = SET_LED_COLOR;
-	rsp->parity = calc_parity = 0;
+	if (!crc16_table_ready)
+	{
+		crc16_init_table();
+	}
 
-	rsp->cmd_len = len;
-	rsp->seq = tx_seq;
+	for (; len >= 4; len -= 4, buf += 4)
+	{
+		crc = crc16_table[3][(crc >> 8) ^ buf[0]] ^
+		      crc16_table[2][(crc & 0xFF) ^ buf[1]] ^
+		      crc16_table[1][buf[2]] ^
+		      crc16_table[0][buf[3]];
+	}
 
-	for (i =  0; i < len; i++)
+	for (; len; len--, buf++)
 	{
-		rsp->cmd[i] = msg[i];
+		crc = (crc << 8) ^ crc16_table[0][(crc >> 8) ^ *buf];
 	}
 
-	for(i = 0; i < rsp->cmd_len + 4; i++) {
-		calc_parity += rsp_buf[i];
+	return crc;
+}
+#endif
+
+/* Next free slot on chan, NULL if it's full. Call with tx_lock() held */
+static struct tx_slot *tx_claim(int chan)
+{
+	struct tx_queue *q = &tx_chans[chan];
+
+	if ((uint8_t)(q->head - q->tail) > q->mask)
+	{
+		return NULL;
 	}
 
-	rsp->parity = calc_parity;
+	return tx_slot_at(q, q->head);
+}
+
+/* Queue the claimed slot and send if the transport is idle. Call with tx_lock() held */
+static void tx_commit(int chan)
+{
+	struct tx_queue *q = &tx_chans[chan];
+	struct tx_chan_stats *st = &tx_chan_stats[chan];
 
-	uart_tx(rsp_buf, rsp->cmd_len + 4);
-	tx_seq++;
+	q->head++;
+	st->depth = q->head - q->tail;
+	if (st->depth > st->peak)
+	{
+		st->peak = st->depth;
+	}
 
+	tx_pump();
 }
 
-void send_led_program_steps(uint8_t num_steps)
+static void tx_drop(int chan)
 {
-	struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-	uint8_t calc_parity;
-	int i;
+	tx_chan_stats[chan].drops++;
+	serial_tx_stats.drops++;
+}
 
-	rsp->cmd_type = SET_LED_PROGRAM_STEPS;
-	rsp->parity = calc_parity = 0;
+/*
+ * Slot on chan. If it's full, waits as TX_WAIT_MS says while something
+ * will free one: the frame on the wire, or the peer's ACK / LINK_CREDIT
+ * for held frames. Call with tx_lock() held, it's let go while waiting.
+ * Link frames come from link_poll() itself and are sent again anyway.
+ */
+static struct tx_slot *tx_claim_wait(int chan, uint32_t *flags)
+{
+	struct tx_slot *s = tx_claim(chan);
+	uint32_t start;
 
-	rsp->cmd_len = 1;
-	rsp->seq = tx_seq;
+	if (s || chan == CHAN_LINK || chan == CHAN_TELEMETRY || chan == CHAN_LOG || serial_in_irq())
+	{
+		return s;
+	}
 
-	rsp->cmd[0] = num_steps;
-	for(i = 0; i < rsp->cmd_len + 4; i++) {
-		calc_parity += rsp_buf[i];
+	start = link_time_ms();
+	while (!s && (tx_busy || tx_held) && link_time_ms() - start < TX_WAIT_MS)
+	{
+		tx_unlock(*flags);
+		link_wait();
+		*flags = tx_lock();
+		s = tx_claim(chan);
 	}
 
-	rsp->parity = calc_parity;
+	if (!s && link_window_full())
+	{
+		serial_link_stats.window_full++;
+	}
 
-	uart_tx(rsp_buf, rsp->cmd_len + 4);
-	tx_seq++;
+	return s;
 }
 
-void send_fan_state(bool state)
+/* 
+ * Queue a ready made frame on its command's channel and return, the
+ * transport sends it in the background. Returns -1 if the channel
+ * stayed full (see TX_WAIT_MS) and the frame was dropped.
+ */
+int uart_tx(char *src, int len)
 {
-	struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-	uint8_t calc_parity;
-	int i;
+	int chan = tx_chan_of(((struct serial_cmd *)src)->cmd_type);
+	struct tx_slot *s;
+	uint32_t flags;
 
-	rsp->cmd_type = SET_FAN_POWER_STATE;
-	rsp->parity = calc_parity = 0;
-
-	rsp->cmd_len = 1;
-	rsp->seq = tx_seq;
+	if (sizeof(struct tx_slot) + len > tx_chans[chan].size)
+	{
+		tx_drop(chan);
+		return -1;
+	}
 
-	rsp->cmd[0] = state ? 1 : 0;
+	flags = tx_lock();
 
-	for(i = 0; i < rsp->cmd_len + 4; i++) {
-		calc_parity += rsp_buf[i];
+	s = tx_claim_wait(chan, &flags);
+	if (!s)
+	{
+		tx_drop(chan);
+		tx_unlock(flags);
+		return -1;
 	}
 
-	rsp->parity = calc_parity;
+	memcpy(s->buf, src, len);
+	s->len = len;
+	s->raw = true;
+
+	tx_commit(chan);
+	tx_unlock(flags);
 
-	uart_tx(rsp_buf, rsp->cmd_len + 4);
-	tx_seq++;
+	return 0;
 }
 
-void send_fan_pwm(uint8_t fan, uint8_t pwm)
+/* Producer side, the parser of port. False if the frame doesn't fit */
+bool serial_ring_push(const void *frame, int len, uint8_t port)
 {
-	struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-	uint8_t calc_parity;
-	int i;
+	uint32_t head = serial_ring_head;
+	uint32_t tail = __atomic_load_n(&serial_ring_tail, __ATOMIC_ACQUIRE);
+	uint32_t pos = head & RING_MASK, to_end = SERIAL_RING_SIZE - pos;
+	uint32_t need = RING_REC(len);
 
-	rsp->cmd_type = SET_FAN_PWM_PERC;
-	rsp->parity = calc_parity = 0;
+	if (need > to_end)
+	{
+		if (SERIAL_RING_SIZE - (head - tail) < to_end + need)
+		{
+			return false;
+		}
 
-	rsp->cmd_len = 2;
-	rsp->seq = tx_seq;
+		*(uint16_t *)&serial_ring[pos] = RING_WRAP;
+		head += to_end;
+		pos = 0;
+	}
+	else if (SERIAL_RING_SIZE - (head - tail) < need)
+	{
+		return false;
+	}
 
-	rsp->cmd[0] = fan;
-	rsp->cmd[1] = pwm;
+	*(uint16_t *)&serial_ring[pos] = len | port << 12;
+#if SERIAL_STATS
+	{
+		uint32_t now = serial_time_us();
 
-	for(i = 0; i < rsp->cmd_len + 4; i++) {
-		calc_parity += rsp_buf[i];
+		memcpy(&serial_ring[pos + 2], &now, sizeof(now));
 	}
+#endif
+	memcpy(&serial_ring[pos + SERIAL_RING_HDR], frame, len);
 
-	rsp->parity = calc_parity;
+	__atomic_store_n(&serial_ring_head, head + need, __ATOMIC_RELEASE);
 
-	uart_tx(rsp_buf, rsp->cmd_len + 4);
-	tx_seq++;
+	return true;
 }
 
-void send_led_program_switch()
+/* Consumer side: oldest frame, in place, NULL if none. Stays valid until serial_ring_pop() */
+struct serial_cmd *serial_ring_peek(void)
 {
-	struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-	uint8_t calc_parity;
-	int i;
+	uint32_t head = __atomic_load_n(&serial_ring_head, __ATOMIC_ACQUIRE);
+	uint32_t tail = serial_ring_tail;
+	uint32_t pos = tail & RING_MASK;
 
-	rsp->cmd_type = SWITCH_PROGRAMS;
-	rsp->parity = calc_parity = 0;
+	if (head == tail)
+	{
+		return NULL;
+	}
 
-	rsp->cmd_len = 0;
-	rsp->seq = tx_seq;
+	if (*(uint16_t *)&serial_ring[pos] == RING_WRAP)
+	{
+		tail += SERIAL_RING_SIZE - pos;
+		__atomic_store_n(&serial_ring_tail, tail, __ATOMIC_RELEASE);
 
-	for(i = 0; i < rsp->cmd_len + 4; i++) {
-		calc_parity += rsp_buf[i];
+		if (head == tail)
+		{
+			return NULL;
+		}
+		pos = 0;
 	}
 
-	rsp->parity = calc_parity;
-
-	uart_tx(rsp_buf, rsp->cmd_len + 4);
-	tx_seq++;
+	return (struct serial_cmd *)&serial_ring[pos + SERIAL_RING_HDR];
 }
 
-void send_set_color(uint8_t r, uint8_t g, uint8_t b)
+#if SERIAL_STATS
+/* When the frame serial_ring_peek() returned came in */
+uint32_t serial_ring_stamp(void)
 {
-	struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-	uint8_t calc_parity;
-	int i;
+	uint32_t stamp;
 
-	rsp->cmd_type = SET_COLOR_INTENSITY;
-	rsp->parity = calc_parity = 0;
+	memcpy(&stamp, &serial_ring[(serial_ring_tail & RING_MASK) + 2], sizeof(stamp));
 
-	rsp->cmd[0] = r;
-	rsp->cmd[1] = g;
-	rsp->cmd[2] = b;
+	return stamp;
+}
+#endif
 
-	rsp->cmd_len = 3;
-	rsp->seq = tx_seq;
+/* Port the frame serial_ring_peek() returned came in on */
+uint8_t serial_ring_port(void)
+{
+	return RING_PORT(*(uint16_t *)&serial_ring[serial_ring_tail & RING_MASK]);
+}
 
-	for(i = 0; i < rsp->cmd_len + 4; i++) {
-		calc_parity += rsp_buf[i];
-	}
+/* Done with the frame serial_ring_peek() returned */
+void serial_ring_pop(void)
+{
+	uint32_t tail = serial_ring_tail;
+	uint16_t len = RING_LEN(*(uint16_t *)&serial_ring[tail & RING_MASK]);
 
-	rsp->parity = calc_parity;
+	__atomic_store_n(&serial_ring_tail, tail + RING_REC(len), __ATOMIC_RELEASE);
+}
 
-	uart_tx(rsp_buf, rsp->cmd_len + 4);
-	tx_seq++;
+/* Drop everything, only with the producer stopped */
+void serial_ring_reset(void)
+{
+	serial_ring_head = serial_ring_tail = 0;
 }
 
-void send_resume_animation()
+/* 
+ * Nothing on its way out. Data frames the link window holds back may
+ * still be queued, tx_kick() sends everything else as soon as it can.
+ */
+bool uart_tx_idle(void)
 {
-	struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-	uint8_t calc_parity;
-	int i;
+	return !tx_busy;
+}
 
-	rsp->cmd_type = RESUME_ANIMATION;
-	rsp->parity = calc_parity = 0;
+/* Frames queued, not sent yet */
+int uart_tx_pending(void)
+{
+	uint32_t flags;
+	int n;
+
+	flags = tx_lock();
+	n = tx_queued();
+	tx_unlock(flags);
 
-	rsp->cmd_len = 0;
-	rsp->seq = tx_seq;
+	return n;
+}
+
+/* Drop everything queued, e.g. for a bus node that went away. Returns how many */
+int uart_tx_flush(void)
+{
+	struct tx_queue *q;
+	uint32_t flags;
+	int chan, n = 0;
 
-	for(i = 0; i < rsp->cmd_len + 4; i++) {
-		calc_parity += rsp_buf[i];
+	flags = tx_lock();
+	for (chan = 0; chan < TX_CHANNELS; chan++)
+	{
+		q = &tx_chans[chan];
+		for (; q->head != q->tail; q->tail++, n++)
+		{
+			tx_drop(chan);
+		}
+		tx_chan_stats[chan].depth = 0;
 	}
+	tx_held = false;
+	tx_unlock(flags);
 
-	rsp->parity = calc_parity;
+	return n;
+}
 
-	uart_tx(rsp_buf, rsp->cmd_len + 4);
-	tx_seq++;
+/* Data frames queued that can't go before an ACK or LINK_CREDIT comes in */
+bool uart_tx_held(void)
+{
+	return tx_held;
 }
 
-void send_light_drawer(uint8_t drawer, uint8_t r, uint8_t g, uint8_t b)
+/* Header, extended length and payload of a frame into buf, its length */
+static int frame_build(uint8_t *buf, uint8_t cmd_type, const void *payload, int len)
 {
-	struct serial_cmd *rsp = (struct serial_cmd *)rsp_buf;
-	uint8_t calc_parity;
-	int i;
+	struct serial_cmd *hdr = (struct serial_cmd *)buf;
+	uint8_t *p;
+
+	hdr->cmd_type = cmd_type;
+	hdr->cmd_len = len > SERIAL_PAYLOAD_MAX ? FRAME_EXT_LEN : len;
 
-	rsp->cmd_type = SET_DRAWER_LIGHT;
-	rsp->parity = calc_parity = 0;
+	p = buf + sizeof(*hdr);
+	if (hdr->cmd_len == FRAME_EXT_LEN)
+	{
+		PUT_BE16(p, len);
+		p += 2;
+	}
+	memcpy(p, payload, len);
 
-	rsp->cmd[0] = drawer;
-	rsp->cmd[1] = r;
-	rsp->cmd[2] = g;
-	rsp->cmd[3] = b;
+	return p + len - buf;
+}
 
-	rsp->cmd_len = 4;
-	rsp->seq = tx_seq;
+/* Queue a frame on its UART channel, seq and check are filled in when the scheduler sends it */
+static int uart_send(uint8_t cmd_type, const void *payload, int len)
+{
+	int chan = tx_chan_of(cmd_type);
+	struct tx_slot *s;
+	uint32_t flags;
 
-	for(i = 0; i < rsp->cmd_len + 4; i++) {
-		calc_parity += rsp_buf[i];
+	/* Past SERIAL_PAYLOAD_MAX only as an extended frame, and only if the peer takes them */
+	if (len > SERIAL_PAYLOAD_MAX && (!SERIAL_TX_EXT || !IS_EXT_CMD(cmd_type) || !link_ext || len > SERIAL_EXT_MAX))
+	{
+		return -1;
+	}
+
+	flags = tx_lock();
+
+	s = tx_claim_wait(chan, &flags);
+	if (!s)
+	{
+		tx_drop(chan);
+		tx_unlock(flags);
+		return -1;
 	}
 
-	rsp->parity = calc_parity;
+	s->len = frame_build(s->buf, cmd_type, payload, len);
+	s->raw = false;
 
-	uart_tx(rsp_buf, rsp->cmd_len + 4);
+	tx_commit(chan);
+	tx_unlock(flags);
 
-	tx_seq++;
+	return 0;
 }
 
+/* Nothing there unless the firmware has a USB CDC interface for us. 0 once it took the whole frame */
+__WEAK int usb_tx_write(const uint8_t *buf, int len)
+{
+	return -1;
+}
+
+/* Only from the main loop, IRQ handlers always go to the UART */
+__WEAK bool serial_in_irq(void)
+{
+	return false;
+}
+
+#if SERIAL_USB
+/*
+ * USB: written out right here, no queue or link window, the host side
+ * of a CDC interface reads everything in order. Always CRC, the host
+ * tools take it.
+ */
+static int usb_send(uint8_t cmd_type, const void *payload, int len)
+{
+	static uint8_t frame[SERIAL_FRAME_MAX] __attribute__((aligned(4)));
+	static struct tx_frame wire;
+	static uint8_t seq;
+	struct serial_cmd *hdr = (struct serial_cmd *)frame;
+	struct serial_port_stats *st = &serial_port_stats[PORT_USB];
+	int flen;
+
+	/* Extended ones as far as the escaped frame fits in a tx_frame */
+	if (len > SERIAL_EXT_MAX || (len > SERIAL_PAYLOAD_MAX && !IS_EXT_CMD(cmd_type)) ||
+	    2 + 2 * (6 + len + 2) > (int)sizeof(wire.buf))
+	{
+		st->tx_drops++;
+		return -1;
+	}
+
+	flen = frame_build(frame, cmd_type, payload, len);
+	hdr->seq = seq++;
+	tx_seal(&wire, frame, flen, SERIAL_CRC16 ? CHECK_CRC16 : CHECK_SUM, PORT_USB);
+
+	if (usb_tx_write(wire.buf, wire.len))
+	{
+		st->tx_drops++;
+		return -1;
+	}
+
+	st->tx_frames++;
+	st->tx_bytes += wire.len;
+
+	return 0;
+}
 #endif
-void process_message(char buf[])
+
+/* Frame out of a given port, whatever serial_tx_port says */
+int serial_port_send(uint8_t port, uint8_t cmd_type, const void *payload, int len)
 {
-	struct serial_cmd *cmd = (struct serial_cmd *)buf;
-#ifndef ESP8266
-	struct led_programs *tmp;
-	uint8_t prg_step, led, drawer;
-	uint32_t s_color;
-	int i;
+#if SERIAL_USB
+	if (port == PORT_USB)
+	{
+		return usb_send(cmd_type, payload, len);
+	}
 #endif
 
-	switch (cmd->cmd_type) {
-#ifdef ESP8266
-		case MODEM_RESET:
-			modem_reset();
+	return port == PORT_UART ? uart_send(cmd_type, payload, len) : -1;
+}
 
-			break;
+/* 
+ * Queue a frame around payload on its command's channel, seq and check
+ * are filled in when the scheduler sends it. Used by the msg_send_*()
+ * encoders from serial_msgs.h. While a frame from another port is being
+ * handled, its replies go back out there instead; LINK_* and anything
+ * sent from an IRQ stay on the UART.
+ */
+int serial_send(uint8_t cmd_type, const void *payload, int len)
+{
+	if (SERIAL_USB && serial_tx_port != PORT_UART && !IS_LINK_CMD(cmd_type) && !serial_in_irq())
+	{
+		return serial_port_send(serial_tx_port, cmd_type, payload, len);
+	}
 
-		case SEND_FAN_PWM:
-			publish_mqtt_fan_pwm(cmd->cmd_len, cmd->cmd);
-			break;
+	return uart_send(cmd_type, payload, len);
+}
 
-		case SEND_TEMP:
-			publish_mqtt_temp(cmd->cmd_len, cmd->cmd);
-			break;
+void send_log(const char *format, ...)
+{
+		va_list arglist;
+		int ret;
 
-		default:
-			send_log("Unknown command type 0x%02x, seq 0x%02x, cmd len %d, content %s\n", cmd->cmd_type, cmd->seq, cmd->cmd_len, cmd->cmd);
-			break;
-#else
-		case WIFI_CONNECTED:
-			ERROR("Wifi Connected!\n");
-			wifi_connected = true;
-			break;
+		va_start(arglist, format);
+		ret  = vsnprintf(rsp_buf, sizeof(rsp_buf), format, arglist);
+		va_end(arglist);
 
-		case WIFI_DISCONNECTED:
-			ERROR("Wifi DisConnected!\n");
-			wifi_connected = false;
-			break;
-			
-		case MQTT_CONNECTED:
-			ERROR("MQTT Connected!\n");
-			mqtt_connected = true;
-			break;
+		if (ret < 0) {
+			ERROR("Log too long!\n");
+			return;
+		}
 
-		case MQTT_DISCONNECTED:
-			ERROR("MQTT DisConnected!\n");
-			mqtt_connected = false;
-			break;
-		
-		case SET_FAN_POWER_STATE:
-			/* Kill power to all fans, 2 pins */
-			ERROR("Setting FANs power state to %d\n", cmd->cmd[0]);
-			set_fans_power_state(cmd->cmd[0]);
-			break;
+		/* Room for the NUL in a normal frame */
+		if (ret >= SERIAL_PAYLOAD_MAX) {
+			ret = SERIAL_PAYLOAD_MAX - 1;
+		}
 
-		case SET_FAN_PWM_PERC:
-			ERROR("Setting FAN %d PWM to %d\n", cmd->cmd[0], cmd->cmd[1]);
-			set_fan_pwm(cmd->cmd[0],cmd->cmd[1]);			
-			break;
+		/* Send the terminating NUL too */
+		msg_send_log((const struct msg_log *)rsp_buf, ret + 1);
+}
 
-		case SET_LED_COLOR:
-			prg_step = cmd->cmd[0];
-			shadow_prg->led_program_entry[prg_step].time = (cmd->cmd[1] << 8) | cmd->cmd[2];
-			ERROR("Setting LEDs in step %d (% d ms)\n", cmd->cmd[0], shadow_prg->led_program_entry[prg_step].time);
-			for (i = 0; i < NUM_LEDS_IN_STRIP * 3; i+=3)
-			{
-				shadow_prg->led_program_entry[prg_step].leds[i/3] = (cmd->cmd[3 + i] << 16) | (cmd->cmd[4 + i] << 8) | cmd->cmd[5 + i];
-			}
+/* Time base for SERIAL_STATS and the RX timeout, each firmware plugs in its own */
+__WEAK uint32_t serial_time_us(void)
+{
+	return 0;
+}
 
-			break;
+/* Run the oldest received frame, false if there was none */
+bool serial_process_next(void)
+{
+	struct serial_cmd *cmd = serial_ring_peek();
+#if SERIAL_STATS
+	uint32_t start;
+#endif
 
-		case SET_LED_PROGRAM_STEPS:
-			ERROR("Setting num steps to %d\n", cmd->cmd[0]);
-			shadow_prg->num_steps = cmd->cmd[0];
-			break;
-						
-		case SWITCH_PROGRAMS:
-			ERROR("Switching programs\n");
-			switch_programs();
-			break;
+	if (!cmd)
+	{
+		return false;
+	}
 
-		case SET_COLOR_INTENSITY:
-			s_color = (cmd->cmd[0] << 16) | (cmd->cmd[1] << 8) | cmd->cmd[2];
-			ERROR("Setting led strip color to 0x%08x\n", s_color);
-			set_strip_intensity(s_color);
-			break;
+	serial_tx_port = serial_ring_port();
+#if SERIAL_STATS
+	start = serial_time_us();
+	process_message((char *)cmd);
+	serial_stats_record(cmd, start - serial_ring_stamp(), serial_time_us() - start);
+#else
+	process_message((char *)cmd);
+#endif
+	serial_tx_port = PORT_UART;
+	serial_ring_pop();
 
-		case SET_DRAWER_LIGHT:
-			drawer = cmd->cmd[0];
-			s_color = (cmd->cmd[1] << 16) | (cmd->cmd[2] << 8) | cmd->cmd[3];
-			ERROR("Setting drawer %d strip color to 0x%08x\n", drawer, s_color);
-			light_drawer(drawer, s_color);
-			break;
+	return true;
+}
 
+void process_message(char buf[])
+{
+	struct serial_cmd *cmd = (struct serial_cmd *)buf;
 
-		case RESUME_ANIMATION:
-			ERROR("Resuming animation...\n");
-			resume_animation();
+	switch (serial_dispatch(cmd)) {
+		case 0:
 			break;
 
-		case SEND_LOG:
-			parse_log(cmd->cmd);
+		case -1:
+			ERROR("Short frame: command type 0x%02x, seq 0x%02x, cmd len %d\n", cmd->cmd_type, cmd->seq, cmd->cmd_len);
 			break;
 
 		default:
 			ERROR("Unknown command type 0x%02x, seq 0x%02x, cmd len %d, content %s\n", cmd->cmd_type, cmd->seq, cmd->cmd_len, cmd->cmd);
 			break;
-#endif /* ESP8266 */
-	}	
+	}
 }
@@ -3,19 +3,136 @@
 
 #include <stdint.h>
 #include <stdarg.h>
+#include <stdbool.h>
 
 #define START_CHAR	0xa5
 #define ESCAPE_CHAR	0xde
 #define END_CHAR	0x5a
 
+/*
+ * COBS framing: COBS_DELIM, the frame COBS encoded, COBS_DELIM. At most
+ * one byte in 254 on top where escaping can double a frame. Receivers
+ * take both, a frame opening with COBS_DELIM is COBS; senders use it once
+ * the peer advertised LINK_CAPS_COBS, USB replies the way the host last
+ * framed. Never on the bus, MSG_SKIP only knows END.
+ */
+#ifndef SERIAL_COBS
+#define SERIAL_COBS	1
+#endif
+
+#define COBS_DELIM	0x00
+#define COBS_BLOCK	0xFF	/* longest block: code byte + 254 data bytes */
+
 #ifndef CMD_LEN
 #define CMD_LEN		255
 #endif
 
-#ifndef NUM_ENTRIES
-#define NUM_ENTRIES	4
+/*
+ * cmd_len FRAME_EXT_LEN marks an extended frame: a BE16 payload length
+ * follows the header. Only IS_EXT_CMD() commands may use it, everything
+ * else stays below SERIAL_PAYLOAD_MAX.
+ */
+#define FRAME_EXT_LEN		0xFF
+#define SERIAL_PAYLOAD_MAX	(FRAME_EXT_LEN - 1)
+
+/* Largest extended payload: BULK_DATA offset + chunk, see serial_bulk.c */
+#ifndef SERIAL_EXT_MAX
+#define SERIAL_EXT_MAX		(4 + 512)
+#endif
+
+#if SERIAL_EXT_MAX < SERIAL_PAYLOAD_MAX || SERIAL_EXT_MAX > 0xFFFF
+#error "SERIAL_EXT_MAX must be in SERIAL_PAYLOAD_MAX .. 0xFFFF"
+#endif
+
+/* Unescaped header, extended length, payload and CRC: what rx_buf holds */
+#define SERIAL_FRAME_MAX	(4 + 2 + SERIAL_EXT_MAX + 2)
+#define SERIAL_STD_FRAME_MAX	(4 + SERIAL_PAYLOAD_MAX + 2)
+
+/*
+ * Extended frames only go modem -> Pico (BULK_DATA), so each side sizes
+ * for them only in the direction it has them: the modem's parser (its
+ * role's, serial_proto.hpp) and the Pico's TX channels / link window stay
+ * at SERIAL_STD_FRAME_MAX. Host builds (unit tests, bench) play the Pico
+ * and send BULK_DATA too. SERIAL_RX_EXT 0 turns them off on the Pico.
+ */
+#ifndef SERIAL_TX_EXT
+#if defined(ESP8266) || !defined(PICO_ON_DEVICE)
+#define SERIAL_TX_EXT		1
+#else
+#define SERIAL_TX_EXT		0
+#endif
+#endif
+
+#ifndef SERIAL_RX_EXT
+#define SERIAL_RX_EXT		1
+#endif
+
+#define SERIAL_TX_FRAME_MAX	(SERIAL_TX_EXT ? SERIAL_FRAME_MAX : SERIAL_STD_FRAME_MAX)
+
+/* Received frames, length prefixed, see serial_ring_push(). Power of 2 */
+#ifndef SERIAL_RING_SIZE
+#define SERIAL_RING_SIZE	1024
+#endif
+
+#if SERIAL_RING_SIZE & (SERIAL_RING_SIZE - 1)
+#error "SERIAL_RING_SIZE must be a power of 2"
+#endif
+
+/*
+ * TX channels, highest priority first. Frames wait unescaped on their
+ * channel and the scheduler only picks the next one once the transport
+ * is free, so a control frame waits for at most the frame on the wire.
+ * Order is kept within a channel, not across them.
+ */
+enum tx_chan {
+	CHAN_LINK,		/* LINK_*, never held back by the link window */
+	CHAN_CONTROL,		/* commands, state changes, replies */
+	CHAN_TELEMETRY,		/* periodic reports, stats dumps */
+	CHAN_BULK,		/* LED uploads and BULK_* sessions, with their SWITCH_PROGRAMS */
+	CHAN_LOG,
+	TX_CHANNELS
+};
+
+/* Frames each channel holds, powers of 2 */
+#ifndef TX_DEPTH_LINK
+#define TX_DEPTH_LINK		2
+#endif
+
+#ifndef TX_DEPTH_CONTROL
+#define TX_DEPTH_CONTROL	4
+#endif
+
+#ifndef TX_DEPTH_TELEMETRY
+#define TX_DEPTH_TELEMETRY	2
+#endif
+
+#ifndef TX_DEPTH_BULK
+#define TX_DEPTH_BULK		2
+#endif
+
+#ifndef TX_DEPTH_LOG
+#define TX_DEPTH_LOG		4
+#endif
+
+/*
+ * A full channel: telemetry and log frames are dropped (the next report
+ * has newer numbers anyway), control and bulk make the sender wait up
+ * to this long for the frame on the wire or the peer's ACK / LINK_CREDIT,
+ * from the main loop only. Sends return -1 if it didn't go, callers check.
+ */
+#ifndef TX_WAIT_MS
+#define TX_WAIT_MS		(2 * LINK_RTO_MS)
 #endif
 
+#if (TX_DEPTH_LINK & (TX_DEPTH_LINK - 1)) || (TX_DEPTH_CONTROL & (TX_DEPTH_CONTROL - 1)) || \
+    (TX_DEPTH_TELEMETRY & (TX_DEPTH_TELEMETRY - 1)) || (TX_DEPTH_BULK & (TX_DEPTH_BULK - 1)) || \
+    (TX_DEPTH_LOG & (TX_DEPTH_LOG - 1))
+#error "TX_DEPTH_* must be powers of 2"
+#endif
+
+/* START, bus address, worst case escaped frame, END */
+#define TX_FRAME_MAX	(3 + 2 * SERIAL_TX_FRAME_MAX)
+
 #define __WEAK __attribute__((weak))
 
 #ifndef ESP8266
@@ -52,25 +169,310 @@ enum cmd_type {
 		SET_COLOR_INTENSITY,
 		RESUME_ANIMATION,
 		SET_DRAWER_LIGHT,
+		SET_LED_PALETTE,
+		SET_LED_STEP_PACKED,
 
 		SET_FAN_POWER_STATE = 0x30,
 		SET_FAN_PWM_PERC,
 		SEND_FAN_PWM,
 
-		GET_TEMP = 0x40,
+		RPC_REQUEST = 0x40,
 		SEND_TEMP,
+		SEND_TELEMETRY,
+		RPC_REPLY,
 		
 		SEND_LOG = 0x50,
+		SEND_LOG_TOKENS,
+
+		LINK_CAPS = 0x60,
+		LINK_ACK,
+		LINK_NAK,
+		LINK_BAUD,
+		LINK_TIME,
+		LINK_CREDIT,
+		BUS_POLL,
+		BUS_DONE,
+
+		GET_STATS = 0x70,
+		SEND_STATS,
+
+		BULK_OPEN = 0x78,
+		BULK_DATA,
+		BULK_COMMIT,
+		BULK_STATUS,
+};
+
+/* Handled by the link layer (serial_link.c), don't use up a seq */
+#define IS_LINK_CMD(t)	(((t) & 0xF0) == LINK_CAPS)
+
+/* May be sent as an extended frame */
+#define IS_EXT_CMD(t)	((t) == BULK_DATA)
+
+/* Bulk transfers (serial_bulk.c): BULK_STATUS wait, and rewinds / commit retries before giving up */
+#ifndef BULK_TIMEOUT_MS
+#define BULK_TIMEOUT_MS	1000
+#endif
+
+#ifndef BULK_RETRIES
+#define BULK_RETRIES	8
+#endif
+
+/* RPC calls the modem has out at once, and how long one waits for its RPC_REPLY */
+#ifndef RPC_PENDING
+#define RPC_PENDING	4
+#endif
+
+#ifndef RPC_TIMEOUT_MS
+#define RPC_TIMEOUT_MS	500
+#endif
+
+/* Periodic report as one SEND_TELEMETRY frame, 0 for SEND_TEMP + SEND_FAN_PWM */
+#ifndef SERIAL_TELEMETRY
+#define SERIAL_TELEMETRY	1
+#endif
+
+/* Reliable delivery, see serial_link.c. Only used if both sides have it */
+#ifndef SERIAL_RELIABLE
+#define SERIAL_RELIABLE	1
+#endif
+
+/* Unacked frames in flight, power of 2 so seq % LINK_WINDOW survives the wrap */
+#ifndef LINK_WINDOW
+#define LINK_WINDOW	4
+#endif
+
+#if (LINK_WINDOW & (LINK_WINDOW - 1)) || LINK_WINDOW > 64
+#error "LINK_WINDOW must be a power of 2, <= 64"
+#endif
+
+#ifndef LINK_RTO_MS
+#define LINK_RTO_MS	200	/* resend if nothing got acked for this long */
+#endif
+
+#ifndef LINK_ACK_DELAY_MS
+#define LINK_ACK_DELAY_MS	20	/* hold an ACK back for more frames to ack */
+#endif
+
+/* Rates LINK_BAUD may switch to, slowest first. Both sides boot on the first */
+#ifndef LINK_BAUD_RATES
+#define LINK_BAUD_RATES		115200, 230400, 460800, 921600
+#endif
+
+/* Bit n set if this side can do the n-th of LINK_BAUD_RATES */
+#ifndef LINK_BAUD_LOCAL
+#define LINK_BAUD_LOCAL		0xFF
+#endif
+
+#ifndef LINK_BAUD_SETTLE_MS
+#define LINK_BAUD_SETTLE_MS	20	/* test pattern resent this often while switching */
+#endif
+
+#ifndef LINK_BAUD_TEST_MS
+#define LINK_BAUD_TEST_MS	200	/* no good test pattern by then, go back */
+#endif
+
+/* LINK_TIME pings, 0: only answer them. The modem is the one that needs the Pico's clock */
+#ifndef LINK_TIME_PERIOD_MS
+#ifdef ESP8266
+#define LINK_TIME_PERIOD_MS	5000
+#else
+#define LINK_TIME_PERIOD_MS	0
+#endif
+#endif
+
+/* Exchanges the clock offset is picked from, the one with the shortest round trip wins */
+#ifndef LINK_TIME_SAMPLES
+#define LINK_TIME_SAMPLES	8
+#endif
+
+/* Credit flow control: each side tells the peer how much of its RX ring is free, see serial_link.c */
+#ifndef SERIAL_CREDIT
+#define SERIAL_CREDIT		1
+#endif
+
+#ifndef LINK_CREDIT_MIN_MS
+#define LINK_CREDIT_MIN_MS	5	/* LINK_CREDIT at most this often */
+#endif
+
+#ifndef LINK_CREDIT_KEEPALIVE_MS
+#define LINK_CREDIT_KEEPALIVE_MS	500	/* and at least this often, one may get lost */
+#endif
+
+/* Data frames sent since the last LINK_CREDIT the sender keeps the cost of. Power of 2 */
+#ifndef LINK_CREDIT_HISTORY
+#define LINK_CREDIT_HISTORY	32
+#endif
+
+#if LINK_CREDIT_HISTORY & (LINK_CREDIT_HISTORY - 1)
+#error "LINK_CREDIT_HISTORY must be a power of 2"
+#endif
+
+/*
+ * Multi-drop bus, see serial_bus.c: one modem, the bus master, and up to
+ * BUS_NODES Picos on one half duplex line, used once bus_init() picked
+ * the role. Firmware builds it with SERIAL_BUS 1 (all sides) and only
+ * carries its own role's code, host builds (unit tests, bench) play both
+ * ends.
+ */
+#ifndef SERIAL_BUS
+#if !defined(ESP8266) && !defined(PICO_ON_DEVICE)
+#define SERIAL_BUS		1
+#else
+#define SERIAL_BUS		0
+#endif
+#endif
+
+#ifndef SERIAL_BUS_MASTER
+#if defined(ESP8266) || !defined(PICO_ON_DEVICE)
+#define SERIAL_BUS_MASTER	SERIAL_BUS
+#else
+#define SERIAL_BUS_MASTER	0
+#endif
+#endif
+
+/* Node addresses are 0 .. BUS_NODES - 1, on the wire they never need escaping */
+#ifndef BUS_NODES
+#define BUS_NODES		4
+#endif
+
+#if BUS_NODES > 32
+#error "BUS_NODES must be <= 32"
+#endif
+
+#ifndef BUS_BURST
+#define BUS_BURST		4	/* frames a node may send per BUS_POLL */
+#endif
+
+#ifndef BUS_POLL_MS
+#define BUS_POLL_MS		100	/* an idle node still gets polled this often */
+#endif
+
+#ifndef BUS_SLOT_MS
+#define BUS_SLOT_MS		250	/* no BUS_DONE by then, the master takes the line back */
+#endif
+
+/* More than LINK_BAUD_MAX_ERR_PCT bad frames in a LINK_BAUD_CHECK_MS window: back to the boot rate */
+#ifndef LINK_BAUD_CHECK_MS
+#define LINK_BAUD_CHECK_MS	1000
+#endif
+
+#ifndef LINK_BAUD_MAX_ERR_PCT
+#define LINK_BAUD_MAX_ERR_PCT	5
+#endif
+
+#ifndef LINK_BAUD_MIN_ERRORS
+#define LINK_BAUD_MIN_ERRORS	4	/* don't fall back over a single glitch */
+#endif
+
+/*
+ * Per command counters and log2 histograms of how long a frame waited in
+ * the RX ring and how long its handler ran, see serial_stats.c. With 0
+ * the ring records carry no timestamp and nothing is timed.
+ */
+#ifndef SERIAL_STATS
+#define SERIAL_STATS	1
+#endif
+
+/* Bucket 0 is < 1us, bucket n is [2^(n-1), 2^n) us, the last one takes the rest */
+#define STATS_BUCKETS	20
+
+/* RX ring record header: length, then the time the frame came in */
+#if SERIAL_STATS
+#define SERIAL_RING_HDR	6
+#else
+#define SERIAL_RING_HDR	2
+#endif
+
+/* Ring bytes a frame of len takes, records start on even offsets */
+#define SERIAL_RING_REC(len)	(SERIAL_RING_HDR + (((len) + 1) & ~1))
+
+/* 
+ * Frame check. Frames with FRAME_CRC16 set in cmd_type carry a BE16
+ * CRC-16/CCITT-FALSE of the unescaped header (parity = 0) and payload
+ * after the payload, otherwise parity is the 8 bit sum. Receivers take
+ * both, senders use CRC only once the peer advertised it in LINK_CAPS.
+ */
+#ifndef SERIAL_CRC16
+#define SERIAL_CRC16	1
+#endif
+
+#define FRAME_CRC16	0x80
+#define CRC16_INIT	0xFFFF
+
+enum frame_check {
+	CHECK_SUM	= 1 << 0,
+	CHECK_CRC16	= 1 << 1,
 };
 
+#if SERIAL_CRC16
+#define LOCAL_CHECKS	(CHECK_SUM | CHECK_CRC16)
+#else
+#define LOCAL_CHECKS	CHECK_SUM
+#endif
+
+/*
+ * RX resync. START is escaped inside a frame, so a bare one always starts
+ * a new frame, as COBS_DELIM does in a COBS one; a frame that goes quiet
+ * for SERIAL_RX_TIMEOUT_US between two bytes is dropped; one longer than
+ * rx_buf is dropped up to the next START. The timeout has to be above the longest the firmware leaves
+ * bytes unread (DMA drain, loop()), 0 turns it off.
+ */
+#ifndef SERIAL_RX_TIMEOUT_US
+#define SERIAL_RX_TIMEOUT_US	20000
+#endif
+
 enum parser_state {
 	MSG_START,
 	MSG_PARITY_RCV,
 	MSG_RCV,
 	MSG_ESCAPE,
+	MSG_ADDR,		/* bus address after START */
+	MSG_SKIP,		/* frame for someone else on the bus, up to its END */
+	MSG_SKIP_ESC,
+	MSG_COBS_CODE,		/* COBS: next block's length */
+	MSG_COBS_DATA,
 	MSG_END
 };
 
+/*
+ * Ports the protocol runs over. PORT_UART is the modem link, with the
+ * link layer (serial_link.c) and the bus on it. PORT_USB is a host on the
+ * Pico's own USB CDC interface, one apart from stdio's: no link layer
+ * (USB already delivers in order, LINK_* frames are dropped), frames into
+ * the same RX ring and handlers, replies back out the port the request
+ * came in on. Both run at the same time.
+ */
+enum serial_port {
+	PORT_UART,
+	PORT_USB,
+	SERIAL_PORTS
+};
+
+#ifndef SERIAL_USB
+#ifdef ESP8266
+#define SERIAL_USB	0
+#else
+#define SERIAL_USB	1
+#endif
+#endif
+
+struct serial_port_stats {
+	uint32_t rx_frames;
+	uint32_t tx_frames;	/* ports other than the UART, which has serial_tx_stats */
+	uint32_t tx_bytes;
+	uint32_t tx_drops;
+};
+
+extern struct serial_port_stats serial_port_stats[SERIAL_PORTS];
+
+extern uint8_t serial_tx_port;
+
+/* The frame being parsed on each port, or the last one, is COBS: replies go out the same way */
+extern bool serial_rx_cobs[SERIAL_PORTS];
+
+/* Our parser takes extended frames, LINK_CAPS says so. From SERIAL_PROTO_C_API() */
+extern const bool serial_rx_ext;
+
 struct serial_cmd {
 	uint8_t parity;
 	uint8_t seq;
@@ -79,72 +481,300 @@ struct serial_cmd {
 	char cmd[];
 };
 
-extern char double_rx_buf[CMD_LEN*NUM_ENTRIES];
-extern char *rx_buf;
-extern volatile uint8_t serial_buf_cidx, serial_buf_pidx;
+/* Payload length / start, extended frames carry the length in front of it */
+static inline int serial_cmd_len(const struct serial_cmd *c)
+{
+	return c->cmd_len == FRAME_EXT_LEN ? (((uint8_t)c->cmd[0] << 8) | (uint8_t)c->cmd[1]) : c->cmd_len;
+}
+
+static inline const uint8_t *serial_cmd_payload(const struct serial_cmd *c)
+{
+	return (const uint8_t *)c->cmd + (c->cmd_len == FRAME_EXT_LEN ? 2 : 0);
+}
+
+/* Receive side counters, filled in by whoever feeds uart_rx() */
+struct serial_rx_stats {
+	uint32_t bytes;		/* bytes taken off the wire */
+	uint32_t overruns;	/* times the RX ring lapped the parser */
+	uint32_t peak_fill;	/* highest RX ring fill level seen, in bytes */
+	uint32_t frames;	/* frames that passed their check */
+	uint32_t bad_frames;	/* frames that failed it, or were cut short (below) */
+	uint32_t noise;		/* bytes outside any frame */
+	uint32_t resyncs;	/* frames cut short by a START */
+	uint32_t timeouts;	/* frames cut short by SERIAL_RX_TIMEOUT_US */
+	uint32_t overlong;	/* frames longer than rx_buf */
+	uint32_t bad_len;	/* frames whose length doesn't match their header */
+	uint32_t ring_full;	/* good frames dropped, main loop too slow */
+};
+
+extern struct serial_rx_stats serial_rx_stats;
+
+struct serial_tx_stats {
+	uint32_t frames;	/* frames queued */
+	uint32_t bytes;		/* wire bytes queued, escapes included */
+	uint32_t drops;		/* frames dropped on a full TX channel */
+	uint32_t held;		/* times data frames had to wait for the link window or credit */
+};
+
+extern struct serial_tx_stats serial_tx_stats;
+
+struct tx_chan_stats {
+	uint32_t frames;	/* frames sent */
+	uint32_t drops;		/* frames dropped, channel full */
+	uint8_t depth;		/* frames waiting now */
+	uint8_t peak;		/* most ever waiting */
+};
+
+extern struct tx_chan_stats tx_chan_stats[TX_CHANNELS];
+
+struct serial_link_stats {
+	uint32_t retransmits;	/* frames sent again */
+	uint32_t timeouts;	/* retransmit timer expiries */
+	uint32_t gaps;		/* frames dropped for arriving out of order */
+	uint32_t dups;		/* frames dropped as already received */
+	uint32_t acks_tx, acks_rx;
+	uint32_t naks_tx, naks_rx;
+	uint32_t window_full;	/* sends refused on a full window */
+	uint32_t credits_tx, credits_rx;
+};
+
+extern struct serial_link_stats serial_link_stats;
+
+extern bool link_reliable;
+
+extern bool link_ext;		/* peer takes extended frames */
+
+extern bool link_cobs;		/* peer takes COBS frames */
+
+/* Peer's serial_time_us() minus ours, from LINK_TIME */
+struct link_clock {
+	int32_t offset_us;
+	uint32_t rtt_us;	/* of the exchange offset_us came from */
+	uint32_t samples;	/* exchanges so far, 0: offset_us not known yet */
+};
+
+extern struct link_clock link_clock;
+
+struct serial_bus_stats {
+	uint32_t polls;		/* BUS_POLLs sent (master) / taken (node) */
+	uint32_t timeouts;	/* master: polled node never sent BUS_DONE */
+	uint32_t other;		/* frames on the line for someone else, skipped */
+	uint32_t switches;	/* master: node changes */
+	uint32_t flushed;	/* master: frames dropped, node never took them */
+};
+
+extern struct serial_bus_stats serial_bus_stats;
+
+#if SERIAL_BUS
+extern bool bus_on;
+extern uint8_t bus_rx_addr, bus_tx_addr;
+extern uint16_t bus_rx_seed, bus_tx_seed;
+#endif
+
+#define BUS_MASTER	0xFF	/* bus_init() role, anything else is the node's address */
+
+extern uint8_t bus_node;	/* node: our address / master: the one we talk to */
+
+extern uint8_t bulk_tx_status;	/* modem: last BULK_STATUS, why bulk_send() failed */
+
+/* Where a bulk transfer lands: write() gets the data in order, commit() makes it live at once */
+struct bulk_target {
+	uint32_t max;
+	bool (*write)(uint32_t offset, const uint8_t *data, int len);
+	bool (*commit)(uint32_t len);
+};
+
+struct serial_rpc_stats {
+	uint32_t calls;		/* modem: requests sent / Pico: requests answered */
+	uint32_t timeouts;	/* modem: calls that got no reply in RPC_TIMEOUT_MS */
+	uint32_t late;		/* modem: replies to calls already timed out */
+};
+
+extern struct serial_rpc_stats serial_rpc_stats;
+
+struct cmd_stats {
+	uint32_t count;		/* frames handled */
+	uint32_t bytes;		/* payload bytes in them */
+	uint32_t queue_max;	/* us, longest from END in to the handler */
+	uint32_t handler_max;	/* us, longest handler run */
+	uint16_t queue_hist[STATS_BUCKETS];	/* saturate at 0xFFFF */
+	uint16_t handler_hist[STATS_BUCKETS];
+};
+
+/* Escaped frame as it goes on the wire */
+struct tx_frame {
+	uint16_t len;
+	uint8_t seq;
+	uint8_t buf[TX_FRAME_MAX];
+};
+
+/* Called with the seq of every frame the transport finished with */
+extern void (*tx_done_cb)(uint8_t seq);
+
+extern uint8_t serial_ring[SERIAL_RING_SIZE];
+extern uint32_t serial_ring_head, serial_ring_tail;
 
 #ifdef __cplusplus
  extern "C" {
 #endif
 int uart_rx(unsigned char ch);
 
+int uart_rx_buf(const uint8_t *buf, int len);
+
+void uart_rx_resync(void);
+
+int serial_rx_buf(uint8_t port, const uint8_t *buf, int len);
+
+int serial_port_send(uint8_t port, uint8_t cmd_type, const void *payload, int len);
+
+int usb_tx_write(const uint8_t *buf, int len);
+
+bool serial_in_irq(void);
+
+bool serial_ring_push(const void *frame, int len, uint8_t port);
+
+uint8_t serial_ring_port(void);
+
+struct serial_cmd *serial_ring_peek(void);
+
+void serial_ring_pop(void);
+
+void serial_ring_reset(void);
+
+/* Hands a frame to its role's handler, see SERIAL_PROTO_C_API(). 0 handled, -1 short, 1 not ours */
+int serial_dispatch(const struct serial_cmd *c);
+
 void process_message(char buf[]);
 
+bool serial_process_next(void);
+
+uint32_t serial_time_us(void);
+
+uint32_t serial_ring_stamp(void);
+
+void serial_stats_record(const struct serial_cmd *cmd, uint32_t queue_us, uint32_t handler_us);
+
+void serial_stats_reset(void);
+
+void serial_stats_poll(void);
+
 void send_log(const char *format,...);
 
 void put_char(unsigned char ch);
 
-#ifndef ESP8266
-void send_temperature(int16_t *temperatures);
+int frame_encode(uint8_t *dst, const char *src, int len);
 
-void send_tacho(uint16_t *fan_speed);
+int frame_encode_cobs(uint8_t *dst, const char *src, int len);
 
-void send_modem_reset(void);
+uint16_t crc16_update(uint16_t crc, const uint8_t *buf, int len);
 
-void set_fans_power_state(uint8_t state);
+void uart_tx_kick(void);
 
-void set_fan_pwm(uint8_t fan, uint8_t pwm);
+bool uart_tx_idle(void);
 
-void switch_programs();
+bool uart_tx_held(void);
 
-void resume_animation();
+void send_link_caps(bool want_reply);
 
-void set_strip_intensity(uint32_t color);
+bool link_rx_frame(struct serial_cmd *cmd);
 
-void light_drawer(uint8_t drawer, uint32_t color);
+void link_rx_delivered(struct serial_cmd *cmd);
 
-#else
-void publish_mqtt_fan_pwm(uint8_t len, uint8_t *cmd);
+bool link_window_full(void);
 
-void publish_mqtt_temp(uint8_t len, uint8_t *cmd);
+void link_tx_sent(const struct tx_frame *frame);
 
-void modem_reset(void);
+bool link_credit_ok(int len);
 
-void send_wifi_status(bool status);
+void link_credit_sent(uint8_t seq, int len);
 
-void send_mqtt_status(bool status);
+const struct tx_frame *link_tx_replay(void);
 
-void send_led_color(uint8_t *msg, uint8_t num_leds);
+void link_poll(void);
 
-void send_led_program_steps(uint8_t num_steps);
+bool link_quiesce(void);
 
-void send_fan_state(bool state);
+void link_peers_reset(void);
 
-void send_fan_pwm(uint8_t fan, uint8_t pwm);
+int link_peer_switch(uint8_t from, uint8_t to);
 
-void send_led_program_switch();
+void bus_init(uint8_t role);
 
-void send_set_color(uint8_t r, uint8_t g, uint8_t b);
+bool bus_tx_allowed(void);
 
-void send_resume_animation();
+void bus_tx_sent(void);
 
-void send_light_drawer(uint8_t drawer, uint8_t r, uint8_t g, uint8_t b);
+int bus_turn_build(uint8_t *buf, int pending);
 
+void bus_check(uint32_t now);
 
-#endif
+int bus_select(uint8_t node);
+
+void bus_service(void);
+
+int uart_tx_pending(void);
+
+int uart_tx_flush(void);
+
+uint32_t link_time_ms(void);
+
+void link_wait(void);
+
+void link_set_baud(uint32_t baud);
+
+void link_baud_negotiate(void);
+
+void link_time_ping(void);
+
+uint32_t link_peer_to_local_us(uint32_t peer_us);
+
+void bulk_rx_data(const struct serial_cmd *cmd);
+
+int bulk_send(uint8_t target, const uint8_t *data, uint32_t len);
+
+int bulk_send_chunk(uint32_t offset, const uint8_t *data, int len);
+
+const struct bulk_target *bulk_get_target(uint8_t id);
+
+int rpc_call(uint8_t method, const uint8_t *arg, int arg_len, uint32_t cookie);
+
+void rpc_poll(void);
+
+void link_baud_reset(void);
+
+bool link_baud_busy(void);
+
+int uart_tx(char *src, int len);
+
+void uart_tx_start(const uint8_t *buf, int len);
+
+void uart_tx_done(void);
+
+uint32_t tx_lock(void);
+
+void tx_unlock(uint32_t flags);
+
+/* The Pico's, for serial_proto::pico_handlers */
+void set_fans_power_state(uint8_t state);
+
+void set_fan_pwm(uint8_t fan, uint8_t pwm);
+
+void switch_programs();
+
+void resume_animation();
+
+void set_strip_intensity(uint32_t color);
+
+void light_drawer(uint8_t drawer, uint32_t color);
+
+void parse_log(uint8_t *cmd);
 
 #ifdef __cplusplus
 }
 #endif
+
+#include "serial_msgs.h"
+#include "serial_log.h"
+
 #endif /* SERIAL_COMMS_H */
 
@@ -0,0 +1,907 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "serial_comms.h"
+
+/*
+ * Link layer: LINK_* frames are handled here, straight from uart_rx(),
+ * and never reach the RX ring or use up a seq number.
+ *
+ * Reliable mode (both sides advertised LINK_CAPS_RELIABLE) is go-back-N
+ * over seq: the receiver only takes the next expected seq, sends a
+ * cumulative LINK_ACK (next seq it wants) after a short delay or half a
+ * window, and a LINK_NAK on a gap. The sender keeps the last
+ * LINK_WINDOW frames as sent and replays them from the NAKed seq, or from
+ * the oldest unacked one if no ACK came within LINK_RTO_MS. A LINK_CAPS
+ * only restarts the window when reliable mode comes on or the peer
+ * booted (LINK_CAPS_RESTART); any other one, e.g. after a baud fallback,
+ * keeps it and replays what is unacked.
+ *
+ * LINK_BAUD moves both sides off the boot rate: the modem offers its rates,
+ * the Pico answers with its own, the modem picks the fastest common one not
+ * known bad and both switch. The modem sends a test pattern at the new rate
+ * until the Pico echoes it; a side that sees no good pattern in
+ * LINK_BAUD_TEST_MS goes back. Later, too many bad frames send a side back
+ * to the boot rate, where the other one ends up too once it sees the same.
+ *
+ * LINK_TIME is an NTP style ping/pong on serial_time_us(), times taken in
+ * the RX path as frames complete. Each exchange gives the peer's clock
+ * offset and the round trip; queueing only ever adds to the round trip,
+ * so of the last LINK_TIME_SAMPLES the offset from the shortest one is
+ * used.
+ *
+ * LINK_CREDIT is the receiver's free RX ring space for data frames from
+ * a given seq on, sent from link_poll() as the ring drains. The sender
+ * keeps what each data frame since costs the ring and holds frames that
+ * wouldn't fit until the next one. Tied to a seq, an update never counts
+ * a frame twice and lost frames don't leak credit. No LINK_CREDIT from
+ * the peer yet: no limit.
+ */
+
+extern uint8_t rx_seq, tx_seq, tx_check;
+extern uint32_t serial_ring_head, serial_ring_tail;
+
+bool link_reliable;
+bool link_ext;
+bool link_cobs;
+bool link_caps_sent;		/* the first LINK_CAPS since boot carries LINK_CAPS_RESTART */
+
+struct serial_link_stats serial_link_stats;
+
+/* Sender: frames tx_base .. tx_seq - 1 are unacked, kept in tx_win */
+struct tx_frame tx_win[LINK_WINDOW];
+uint8_t tx_base;
+uint32_t tx_base_ms;
+uint8_t tx_replay;		/* next one to send again, while tx_replaying */
+bool tx_replaying;
+
+/* Receiver */
+uint8_t rx_acked;		/* last cumulative ack sent */
+uint32_t rx_ack_ms;		/* first frame not acked yet came in at */
+bool rx_nak_sent;		/* one NAK per gap */
+
+/* Clock sync */
+struct link_clock link_clock;
+
+struct time_sample {
+	int32_t offset_us;
+	uint32_t rtt_us;
+} time_samples[LINK_TIME_SAMPLES];
+
+uint32_t time_ping_ms;
+
+/* Credit, sender: the peer's ring had credit_free bytes for data frames from credit_seq on */
+bool credit_valid;
+uint8_t credit_seq;
+uint8_t credit_hdr = SERIAL_RING_HDR;
+uint16_t credit_free;
+uint16_t credit_cost[LINK_CREDIT_HISTORY];	/* ring bytes of each data frame sent, by seq */
+
+/* Receiver: what the last LINK_CREDIT said */
+uint8_t credit_adv_seq;
+uint16_t credit_adv_free;
+uint32_t credit_adv_ms;
+
+/* Baud rate negotiation */
+enum baud_state {
+	BAUD_IDLE,
+	BAUD_OFFERED,		/* waiting for the peer's rates */
+	BAUD_SWITCH,		/* switch from link_poll(), not from the RX path */
+	BAUD_TESTING,		/* on the new rate, waiting for the test pattern */
+};
+
+static const uint32_t link_bauds[] = { LINK_BAUD_RATES };
+#define NUM_BAUDS	(sizeof(link_bauds) / sizeof(link_bauds[0]))
+
+static const uint8_t link_baud_pattern[LINK_BAUD_PATTERN_LEN] = {
+	START_CHAR, END_CHAR, ESCAPE_CHAR, 0x00, 0xFF, 0x55, 0xAA, 0x0F,
+	0xF0, 0x01, 0x80, 0x7F, 0xFE, 0x33, 0xCC, START_CHAR,
+};
+
+uint8_t baud_idx, baud_prev, baud_next;
+uint8_t baud_bad;		/* rates that failed, not offered again */
+uint8_t baud_state;
+bool baud_initiator;
+uint32_t baud_ms, baud_test_ms;
+uint32_t baud_check_ms, baud_check_frames, baud_check_bad;
+
+/* Time base for the timers, each firmware plugs in its own */
+__WEAK uint32_t link_time_ms(void)
+{
+	return 0;
+}
+
+/* Called while a send waits on a full TX channel, may pump RX to get ACKs in */
+__WEAK void link_wait(void)
+{
+}
+
+/* Switch the UART once everything queued went out at the old rate */
+__WEAK void link_set_baud(uint32_t baud)
+{
+}
+
+/* Tell the peer which frame checks / link features we take */
+void send_link_caps(bool want_reply)
+{
+	struct msg_link_caps m;
+
+	m.checks = LOCAL_CHECKS;
+	m.flags = (serial_rx_ext ? LINK_CAPS_EXT : 0) | (SERIAL_COBS ? LINK_CAPS_COBS : 0) |
+		(want_reply ? LINK_CAPS_REPLY : 0) | (link_caps_sent ? 0 : LINK_CAPS_RESTART);
+#if SERIAL_RELIABLE
+	m.flags |= LINK_CAPS_RELIABLE;
+#endif
+
+	if (!msg_send_link_caps(&m))
+	{
+		link_caps_sent = true;
+	}
+}
+
+static void link_replay(uint8_t seq);
+
+static void link_set_reliable(bool on, bool restart, uint8_t peer_seq)
+{
+	bool was = link_reliable;
+
+	link_reliable = on;
+
+	/* Same session, e.g. caps again after a baud fallback: what is unacked goes again */
+	if (on && was && !restart)
+	{
+		if (tx_base != tx_seq)
+		{
+			link_replay(tx_base);
+		}
+		return;
+	}
+
+	/* Nothing in flight yet, both directions start from here */
+	tx_base = tx_seq;
+	tx_base_ms = link_time_ms();
+	tx_replaying = false;
+	rx_seq = rx_acked = peer_seq;
+	rx_nak_sent = false;
+}
+
+static void on_link_caps(const struct serial_cmd *cmd, const struct msg_link_caps *m)
+{
+	/* Our answer still goes out with the old check, the peer takes both */
+	if (m->flags & LINK_CAPS_REPLY)
+	{
+		send_link_caps(false);
+	}
+
+	tx_check = (m->checks & LOCAL_CHECKS & CHECK_CRC16) ? CHECK_CRC16 : CHECK_SUM;
+	link_ext = m->flags & LINK_CAPS_EXT;
+	link_cobs = SERIAL_COBS && (m->flags & LINK_CAPS_COBS);
+
+	/* Peer (re)started, its credit comes again */
+	credit_valid = false;
+
+#if SERIAL_RELIABLE
+	/* LINK_* frames carry the seq of the next data frame */
+	link_set_reliable(m->flags & LINK_CAPS_RELIABLE, m->flags & LINK_CAPS_RESTART, cmd->seq);
+#endif
+
+	ERROR("Link caps 0x%02x/0x%02x, using %s%s%s\n", m->checks, m->flags,
+		tx_check == CHECK_CRC16 ? "CRC16" : "sum", link_reliable ? ", reliable" : "",
+		link_cobs ? ", COBS" : "");
+}
+
+bool link_window_full(void)
+{
+	return link_reliable && (uint8_t)(tx_seq - tx_base) >= LINK_WINDOW;
+}
+
+/* Keep a copy of a data frame as sent, for replay. Called with tx_lock() held */
+void link_tx_sent(const struct tx_frame *frame)
+{
+	struct tx_frame *copy;
+
+	if (!link_reliable)
+	{
+		return;
+	}
+
+	if (frame->seq == tx_base)
+	{
+		tx_base_ms = link_time_ms();
+	}
+
+	copy = &tx_win[frame->seq % LINK_WINDOW];
+	copy->len = frame->len;
+	copy->seq = frame->seq;
+	memcpy(copy->buf, frame->buf, frame->len);
+}
+
+/* Resend everything from seq on, ahead of anything queued */
+static void link_replay(uint8_t seq)
+{
+	uint32_t flags;
+
+	flags = tx_lock();
+	tx_replay = seq;
+	tx_replaying = true;
+	tx_base_ms = link_time_ms();
+	tx_unlock(flags);
+
+	uart_tx_kick();
+}
+
+/* Scheduler: next frame to send again, NULL once the replay caught up. Called with tx_lock() held */
+const struct tx_frame *link_tx_replay(void)
+{
+	if (!tx_replaying)
+	{
+		return NULL;
+	}
+
+	/* An ACK may have overtaken the replay */
+	if ((uint8_t)(tx_replay - tx_base) > (uint8_t)(tx_seq - tx_base))
+	{
+		tx_replay = tx_base;
+	}
+
+	if (tx_replay == tx_seq)
+	{
+		tx_replaying = false;
+		return NULL;
+	}
+
+	serial_link_stats.retransmits++;
+
+	return &tx_win[tx_replay++ % LINK_WINDOW];
+}
+
+static inline uint16_t credit_rec(int len)
+{
+	return len ? credit_hdr + ((len + 1) & ~1) : 0;
+}
+
+/* Scheduler: true if a data frame of ring len (0: never goes there) fits the peer's ring. Called with tx_lock() held */
+bool link_credit_ok(int len)
+{
+	uint8_t n = tx_seq - credit_seq, i;
+	uint32_t used = 0;
+
+	if (!credit_valid || !len)
+	{
+		return true;
+	}
+
+	if (n >= LINK_CREDIT_HISTORY)
+	{
+		return false;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		used += credit_cost[(uint8_t)(credit_seq + i) % LINK_CREDIT_HISTORY];
+	}
+
+	return used + credit_rec(len) <= credit_free;
+}
+
+/* Scheduler: data frame seq went out. Called with tx_lock() held */
+void link_credit_sent(uint8_t seq, int len)
+{
+	credit_cost[seq % LINK_CREDIT_HISTORY] = credit_rec(len);
+}
+
+static void on_link_credit(const struct msg_link_credit *m)
+{
+	uint32_t flags;
+
+	serial_link_stats.credits_rx++;
+
+	flags = tx_lock();
+
+	/* Only if it's about frames we still know the cost of, e.g. not from before a seq reset */
+	credit_valid = (uint8_t)(tx_seq - m->next_seq) < LINK_CREDIT_HISTORY;
+	credit_seq = m->next_seq;
+	credit_free = GET_BE16(m->free);
+	credit_hdr = m->rec_hdr;
+
+	tx_unlock(flags);
+
+	uart_tx_kick();
+}
+
+/* RX ring space for the peer, less what a wrap may waste */
+static uint16_t link_credit_free(void)
+{
+	uint32_t used = serial_ring_head - __atomic_load_n(&serial_ring_tail, __ATOMIC_ACQUIRE);
+	uint32_t keep = SERIAL_RING_REC(4 + SERIAL_PAYLOAD_MAX);
+
+	return used + keep < SERIAL_RING_SIZE ? SERIAL_RING_SIZE - used - keep : 0;
+}
+
+static void link_credit_send(uint32_t now)
+{
+	struct msg_link_credit m;
+
+	/* seq before the ring: a frame coming in between only makes free short */
+	m.next_seq = rx_seq;
+	credit_adv_free = link_credit_free();
+	PUT_BE16(m.free, credit_adv_free);
+	m.rec_hdr = SERIAL_RING_HDR;
+
+	if (!msg_send_link_credit(&m))
+	{
+		credit_adv_seq = m.next_seq;
+		credit_adv_ms = now;
+		serial_link_stats.credits_tx++;
+	}
+}
+
+/* Once something changed, or now and then in case one got lost */
+static void link_credit_poll(uint32_t now)
+{
+	uint32_t since = now - credit_adv_ms;
+
+	if (since < LINK_CREDIT_MIN_MS)
+	{
+		return;
+	}
+
+	if (since < LINK_CREDIT_KEEPALIVE_MS && rx_seq == credit_adv_seq && link_credit_free() == credit_adv_free)
+	{
+		return;
+	}
+
+	link_credit_send(now);
+}
+
+static void link_send_ack(uint8_t cmd_type)
+{
+	struct msg_link_ack m;
+
+	m.next_seq = rx_seq;
+	serial_send(cmd_type, &m, sizeof(m));
+
+	if (cmd_type == LINK_ACK)
+	{
+		rx_acked = rx_seq;
+		serial_link_stats.acks_tx++;
+	}
+	else
+	{
+		serial_link_stats.naks_tx++;
+	}
+}
+
+/* next_seq is the first one the peer hasn't got, everything before is done */
+static void on_link_ack(const struct msg_link_ack *m)
+{
+	uint8_t acked = m->next_seq - tx_base;
+
+	serial_link_stats.acks_rx++;
+
+	/* Stale or bogus */
+	if (acked > (uint8_t)(tx_seq - tx_base))
+	{
+		return;
+	}
+
+	if (acked)
+	{
+		tx_base = m->next_seq;
+		tx_base_ms = link_time_ms();
+
+		/* Room in the window for whatever waited on it */
+		uart_tx_kick();
+	}
+}
+
+static void on_link_nak(const struct msg_link_ack *m)
+{
+	serial_link_stats.naks_rx++;
+
+	/* Implies everything before next_seq arrived */
+	on_link_ack(m);
+
+	if (tx_base != tx_seq)
+	{
+		link_replay(tx_base);
+	}
+}
+
+static uint8_t baud_local(void)
+{
+	return LINK_BAUD_LOCAL & ((1 << NUM_BAUDS) - 1) & ~baud_bad;
+}
+
+static void link_baud_send(uint8_t op, uint8_t arg)
+{
+	struct msg_link_baud m;
+
+	m.op = op;
+	m.arg = arg;
+	memcpy(m.pattern, link_baud_pattern, sizeof(m.pattern));
+
+	msg_send_link_baud(&m);
+}
+
+/* Error rate is counted from here on */
+static void link_baud_check_reset(void)
+{
+	baud_check_ms = link_time_ms();
+	baud_check_frames = serial_rx_stats.frames;
+	baud_check_bad = serial_rx_stats.bad_frames;
+}
+
+static void link_baud_apply(uint8_t idx)
+{
+	link_set_baud(link_bauds[idx]);
+	baud_idx = idx;
+	link_baud_check_reset();
+}
+
+/* Ask the peer for the fastest rate both sides can do. The modem calls this */
+void link_baud_negotiate(void)
+{
+	baud_initiator = true;
+	baud_state = BAUD_OFFERED;
+	baud_ms = link_time_ms();
+
+	link_baud_send(LINK_BAUD_OFFER, baud_local());
+}
+
+/* A switch is under way, keep calling link_poll() */
+bool link_baud_busy(void)
+{
+	return baud_state != BAUD_IDLE;
+}
+
+/* Back to the boot rate, e.g. because the peer is being reset */
+void link_baud_reset(void)
+{
+	baud_state = BAUD_IDLE;
+
+	if (baud_idx)
+	{
+		link_baud_apply(0);
+	}
+}
+
+static void on_link_baud(const struct msg_link_baud *m)
+{
+	uint8_t common;
+	int i;
+
+	switch (m->op) {
+		case LINK_BAUD_OFFER:
+			baud_initiator = false;
+			link_baud_send(LINK_BAUD_ACCEPT, baud_local());
+			break;
+
+		case LINK_BAUD_ACCEPT:
+			if (baud_state != BAUD_OFFERED)
+			{
+				break;
+			}
+
+			common = baud_local() & m->arg;
+			for (i = NUM_BAUDS - 1; i > 0 && !(common & (1 << i)); i--);
+
+			if (i == baud_idx)
+			{
+				baud_state = BAUD_IDLE;
+				break;
+			}
+
+			baud_next = i;
+			baud_state = BAUD_SWITCH;
+			link_baud_send(LINK_BAUD_SWITCH, i);
+			break;
+
+		case LINK_BAUD_SWITCH:
+			if (baud_state != BAUD_IDLE || m->arg >= NUM_BAUDS)
+			{
+				break;
+			}
+
+			baud_initiator = false;
+			baud_next = m->arg;
+			baud_state = BAUD_SWITCH;
+			break;
+
+		case LINK_BAUD_TEST:
+			if (baud_state != BAUD_TESTING || memcmp(m->pattern, link_baud_pattern, sizeof(m->pattern)))
+			{
+				break;
+			}
+
+			if (!baud_initiator)
+			{
+				link_baud_send(LINK_BAUD_TEST, baud_idx);
+			}
+
+			baud_state = BAUD_IDLE;
+			link_baud_check_reset();
+			LOG(LOG_BAUD_NOW, link_bauds[baud_idx]);
+			break;
+	}
+}
+
+static void link_baud_poll(uint32_t now)
+{
+	uint32_t frames, bad;
+
+	switch (baud_state) {
+		case BAUD_OFFERED:
+			if (now - baud_ms >= LINK_BAUD_TEST_MS)
+			{
+				/* Peer doesn't do LINK_BAUD */
+				baud_state = BAUD_IDLE;
+			}
+			break;
+
+		case BAUD_SWITCH:
+			baud_prev = baud_idx;
+			link_baud_apply(baud_next);
+			baud_state = BAUD_TESTING;
+			baud_ms = baud_test_ms = now;
+			break;
+
+		case BAUD_TESTING:
+			if (now - baud_ms >= LINK_BAUD_TEST_MS)
+			{
+				LOG(LOG_BAUD_NO_TEST, link_bauds[baud_idx], link_bauds[baud_prev]);
+				baud_bad |= 1 << baud_idx;
+				link_baud_apply(baud_prev);
+				baud_state = BAUD_IDLE;
+
+				/* Try the next one down */
+				if (baud_initiator)
+				{
+					link_baud_negotiate();
+				}
+			}
+			else if (baud_initiator && now - baud_test_ms >= LINK_BAUD_SETTLE_MS)
+			{
+				/* Resent until the peer has switched too and echoes it */
+				link_baud_send(LINK_BAUD_TEST, baud_idx);
+				baud_test_ms = now;
+			}
+			break;
+
+		case BAUD_IDLE:
+			if (now - baud_check_ms < LINK_BAUD_CHECK_MS)
+			{
+				break;
+			}
+
+			frames = serial_rx_stats.frames - baud_check_frames;
+			bad = serial_rx_stats.bad_frames - baud_check_bad;
+			link_baud_check_reset();
+
+			if (baud_idx && bad >= LINK_BAUD_MIN_ERRORS && bad * 100 >= (frames + bad) * LINK_BAUD_MAX_ERR_PCT)
+			{
+				LOG(LOG_BAUD_ERRORS, bad, frames + bad, link_bauds[baud_idx], link_bauds[0]);
+				baud_bad |= 1 << baud_idx;
+				link_baud_apply(0);
+
+				/* Peer may have been reset meanwhile, redo the rest of the handshake */
+				send_link_caps(true);
+			}
+			break;
+	}
+}
+
+void link_time_ping(void)
+{
+	struct msg_link_time m = { LINK_TIME_PING };
+
+	PUT_BE32(m.t1, serial_time_us());
+	msg_send_link_time(&m);
+}
+
+/* A peer time from LINK_TIME or telemetry, on our clock */
+uint32_t link_peer_to_local_us(uint32_t peer_us)
+{
+	return peer_us - link_clock.offset_us;
+}
+
+static void on_link_time(const struct msg_link_time *m)
+{
+	struct msg_link_time pong = { LINK_TIME_PONG };
+	struct time_sample *s, *best;
+	uint32_t t1, t2, t3, t4 = serial_time_us();
+	int i;
+
+	if (m->op == LINK_TIME_PING)
+	{
+		memcpy(pong.t1, m->t1, sizeof(pong.t1));
+		PUT_BE32(pong.t2, t4);
+		PUT_BE32(pong.t3, serial_time_us());
+		msg_send_link_time(&pong);
+		return;
+	}
+
+	if (m->op != LINK_TIME_PONG)
+	{
+		return;
+	}
+
+	t1 = GET_BE32(m->t1);
+	t2 = GET_BE32(m->t2);
+	t3 = GET_BE32(m->t3);
+
+	s = &time_samples[link_clock.samples++ % LINK_TIME_SAMPLES];
+	s->rtt_us = (t4 - t1) - (t3 - t2);
+	s->offset_us = ((int32_t)(t2 - t1) + (int32_t)(t3 - t4)) / 2;
+
+	best = s;
+	for (i = 0; i < LINK_TIME_SAMPLES && i < link_clock.samples; i++)
+	{
+		if (time_samples[i].rtt_us < best->rtt_us)
+		{
+			best = &time_samples[i];
+		}
+	}
+
+	link_clock.offset_us = best->offset_us;
+	link_clock.rtt_us = best->rtt_us;
+}
+
+/*
+ * Called by uart_rx() for every frame that passed its check. Handles
+ * LINK_* frames, does the seq accounting and returns true if the frame
+ * should go in the RX ring. link_rx_delivered() must follow if it did.
+ */
+bool link_rx_frame(struct serial_cmd *cmd)
+{
+	uint8_t ahead;
+
+	if (IS_LINK_CMD(cmd->cmd_type))
+	{
+		switch (cmd->cmd_type) {
+			case LINK_CAPS:
+				if (msg_decode_link_caps(cmd))
+				{
+					on_link_caps(cmd, msg_decode_link_caps(cmd));
+				}
+				break;
+
+			case LINK_ACK:
+				if (msg_decode_link_ack(cmd))
+				{
+					on_link_ack(msg_decode_link_ack(cmd));
+				}
+				break;
+
+			case LINK_NAK:
+				if (msg_decode_link_nak(cmd))
+				{
+					on_link_nak(msg_decode_link_nak(cmd));
+				}
+				break;
+
+			case LINK_BAUD:
+				if (msg_decode_link_baud(cmd))
+				{
+					on_link_baud(msg_decode_link_baud(cmd));
+				}
+				break;
+
+			case LINK_TIME:
+				if (msg_decode_link_time(cmd))
+				{
+					on_link_time(msg_decode_link_time(cmd));
+				}
+				break;
+
+			case LINK_CREDIT:
+				if (msg_decode_link_credit(cmd))
+				{
+					on_link_credit(msg_decode_link_credit(cmd));
+				}
+				break;
+
+#if SERIAL_BUS
+			case BUS_POLL:
+				if (msg_decode_bus_poll(cmd))
+				{
+					bus_rx_turn(cmd->cmd_type, msg_decode_bus_poll(cmd));
+				}
+				break;
+
+			case BUS_DONE:
+				if (msg_decode_bus_done(cmd))
+				{
+					bus_rx_turn(cmd->cmd_type, msg_decode_bus_done(cmd));
+				}
+				break;
+#endif
+		}
+		return false;
+	}
+
+	if (!link_reliable)
+	{
+		if (cmd->seq != rx_seq) {
+			LOG(LOG_SEQ, rx_seq, cmd->seq);
+		}
+		rx_seq = cmd->seq + 1;
+		return true;
+	}
+
+	if (cmd->seq == rx_seq)
+	{
+		return true;
+	}
+
+	ahead = cmd->seq - rx_seq;
+	if (ahead < 128)
+	{
+		/* Gap, something got lost. Ask once, the sender replays from rx_seq */
+		serial_link_stats.gaps++;
+		if (!rx_nak_sent)
+		{
+			link_send_ack(LINK_NAK);
+			rx_nak_sent = true;
+		}
+	}
+	else
+	{
+		/* Replay of something we already have, our ACK got lost */
+		serial_link_stats.dups++;
+		link_send_ack(LINK_ACK);
+	}
+
+	return false;
+}
+
+/* The frame is in the RX ring, move on to the next seq */
+void link_rx_delivered(struct serial_cmd *cmd)
+{
+	if (!link_reliable)
+	{
+		return;
+	}
+
+	if (rx_seq == rx_acked)
+	{
+		rx_ack_ms = link_time_ms();
+	}
+
+	rx_seq = cmd->seq + 1;
+	rx_nak_sent = false;
+
+	if ((uint8_t)(rx_seq - rx_acked) >= LINK_WINDOW / 2)
+	{
+		link_send_ack(LINK_ACK);
+	}
+}
+
+/* Baud switching, delayed ACKs and retransmit timer, call from the main loop */
+void link_poll(void)
+{
+	uint32_t now;
+
+	now = link_time_ms();
+
+	link_baud_poll(now);
+
+	if (LINK_TIME_PERIOD_MS && !link_baud_busy() && now - time_ping_ms >= LINK_TIME_PERIOD_MS)
+	{
+		time_ping_ms = now;
+		link_time_ping();
+	}
+
+	if (SERIAL_CREDIT && !link_baud_busy())
+	{
+		link_credit_poll(now);
+	}
+
+#if SERIAL_BUS
+	bus_check(now);
+#endif
+
+	if (!link_reliable)
+	{
+		return;
+	}
+
+	if (rx_seq != rx_acked && now - rx_ack_ms >= LINK_ACK_DELAY_MS)
+	{
+		link_send_ack(LINK_ACK);
+	}
+
+	if (tx_base != tx_seq && now - tx_base_ms >= LINK_RTO_MS)
+	{
+		serial_link_stats.timeouts++;
+		link_replay(tx_base);
+	}
+}
+
+/* Nothing unacked either way, ACKs we owe go out now. True once it's all settled */
+bool link_quiesce(void)
+{
+	if (!link_reliable)
+	{
+		return true;
+	}
+
+	if (rx_seq != rx_acked)
+	{
+		link_send_ack(LINK_ACK);
+	}
+
+	return tx_base == tx_seq && !tx_replaying;
+}
+
+#if SERIAL_BUS_MASTER
+/*
+ * The bus master talks to every node over one set of link globals: the
+ * state below is swapped in and out per node by link_peer_switch(), so
+ * the rest of this file doesn't know there's more than one peer. That
+ * includes the replay window (LINK_WINDOW * TX_FRAME_MAX per node):
+ * whatever is unacked when the master moves on is sent again when it
+ * comes back.
+ */
+#define LINK_PEER_VARS(X) \
+	X(rx_seq) X(tx_seq) X(tx_check) X(link_reliable) X(link_ext) X(link_caps_sent) \
+	X(tx_win) X(tx_base) X(tx_base_ms) X(tx_replay) X(tx_replaying) \
+	X(rx_acked) X(rx_ack_ms) X(rx_nak_sent) \
+	X(link_clock) X(time_samples) X(time_ping_ms) \
+	X(credit_valid) X(credit_seq) X(credit_hdr) X(credit_free) X(credit_cost) \
+	X(credit_adv_seq) X(credit_adv_free) X(credit_adv_ms)
+
+#define PEER_FIELD(var)		__typeof__(var) var;
+#define PEER_SAVE(var)		memcpy(&p->var, &var, sizeof(var));
+#define PEER_LOAD(var)		memcpy(&var, &p->var, sizeof(var));
+
+struct link_peer {
+	LINK_PEER_VARS(PEER_FIELD)
+};
+
+struct link_peer link_peers[BUS_NODES];
+
+/* Every node starts from the current (boot) state */
+void link_peers_reset(void)
+{
+	struct link_peer *p;
+	int i;
+
+	for (i = 0; i < BUS_NODES; i++)
+	{
+		p = &link_peers[i];
+		LINK_PEER_VARS(PEER_SAVE)
+	}
+}
+
+/* Park node from's link state, pick up node to's. Returns how many of to's frames are to be sent again */
+int link_peer_switch(uint8_t from, uint8_t to)
+{
+	struct link_peer *p;
+
+	if (from >= BUS_NODES || to >= BUS_NODES)
+	{
+		return -1;
+	}
+
+	p = &link_peers[from];
+	LINK_PEER_VARS(PEER_SAVE)
+
+	p = &link_peers[to];
+	LINK_PEER_VARS(PEER_LOAD)
+
+	/* Its ACKs had nowhere to go meanwhile, don't wait out the RTO for them */
+	if (!link_reliable || tx_base == tx_seq)
+	{
+		return 0;
+	}
+
+	tx_replay = tx_base;
+	tx_replaying = true;
+	tx_base_ms = link_time_ms();
+
+	return (uint8_t)(tx_seq - tx_base);
+}
+#endif
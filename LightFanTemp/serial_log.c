@@ -0,0 +1,237 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "serial_comms.h"
+
+/*
+ * LOG() ring, many producers (RX IRQ, timers, core1, main loop) and one
+ * consumer, log_flush() from the main loop. A producer takes a slot under
+ * log_lock(), which is only the head bump, fills it in unlocked and
+ * publishes it by writing hdr last with release. The consumer stops at
+ * the first slot not published yet, frees a slot by clearing hdr and
+ * then moves tail on with release.
+ *
+ * SEND_LOG_TOKENS records: id, nargs, then the args as LEB128.
+ */
+
+#define LOG_MASK	(LOG_RING_SIZE - 1)
+
+struct log_rec {
+	uint32_t hdr;		/* 0 free / being written, else id + 1 | nargs << 8 */
+	uint32_t args[LOG_MAX_ARGS];
+};
+
+#define LOG_FMT(id, fmt)	fmt,
+
+const char *const log_fmt[LOG_COUNT] = {
+	SERIAL_LOGS(LOG_FMT)
+};
+
+struct log_rec log_ring[LOG_RING_SIZE];
+uint32_t log_head, log_tail;
+uint32_t log_drops;
+
+/* Single threaded users don't need to lock the head */
+__WEAK uint32_t log_lock(void)
+{
+	return 0;
+}
+
+__WEAK void log_unlock(uint32_t flags)
+{
+}
+
+/* Where formatted records go on the Pico */
+__WEAK void log_write(const char *str)
+{
+	printf("%s", str);
+}
+
+void log_push(uint8_t id, uint8_t nargs, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+	struct log_rec *r;
+	uint32_t flags, head;
+
+	flags = log_lock();
+	head = log_head;
+	if (head - __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+	{
+		log_drops++;
+		log_unlock(flags);
+		return;
+	}
+	log_head = head + 1;
+	log_unlock(flags);
+
+	r = &log_ring[head & LOG_MASK];
+	r->args[0] = a0;
+	r->args[1] = a1;
+	r->args[2] = a2;
+	r->args[3] = a3;
+	__atomic_store_n(&r->hdr, (id + 1) | nargs << 8, __ATOMIC_RELEASE);
+}
+
+/* i-th record not flushed yet, NULL if it isn't (fully) there */
+static struct log_rec *log_peek(uint32_t i)
+{
+	struct log_rec *r = &log_ring[(log_tail + i) & LOG_MASK];
+
+	if (i >= LOG_RING_SIZE || !__atomic_load_n(&r->hdr, __ATOMIC_ACQUIRE))
+	{
+		return NULL;
+	}
+
+	return r;
+}
+
+static void log_pop(int n)
+{
+	for (; n > 0; n--)
+	{
+		log_ring[log_tail & LOG_MASK].hdr = 0;
+		__atomic_store_n(&log_tail, log_tail + 1, __ATOMIC_RELEASE);
+	}
+}
+
+int log_format(char *out, int len, uint8_t id, int nargs, const uint32_t *args)
+{
+	uint32_t a[LOG_MAX_ARGS] = { 0 };
+	int ret;
+
+	memcpy(a, args, nargs * sizeof(a[0]));
+	ret = snprintf(out, len, log_fmt[id], (unsigned int)a[0], (unsigned int)a[1],
+		(unsigned int)a[2], (unsigned int)a[3]);
+
+	return ret < 0 ? 0 : ret < len ? ret : len - 1;
+}
+
+static uint8_t *put_leb128(uint8_t *p, uint32_t v)
+{
+	while (v >= 0x80)
+	{
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+
+	return p;
+}
+
+/* Whole records that fit in buf, in SEND_LOG_TOKENS form. Nothing is flushed */
+int log_pack(uint8_t *buf, int len, int *records)
+{
+	uint8_t rec[2 + LOG_MAX_ARGS * 5], *p;
+	struct log_rec *r;
+	int i, n, used = 0;
+
+	for (n = 0; (r = log_peek(n)); n++)
+	{
+		p = rec;
+		*p++ = (r->hdr & 0xFF) - 1;
+		*p++ = r->hdr >> 8;
+		for (i = 0; i < rec[1]; i++)
+		{
+			p = put_leb128(p, r->args[i]);
+		}
+
+		if (used + (p - rec) > len)
+		{
+			break;
+		}
+
+		memcpy(buf + used, rec, p - rec);
+		used += p - rec;
+	}
+
+	*records = n;
+
+	return used;
+}
+
+static void log_drain(void)
+{
+#ifdef ESP8266
+	struct msg_log_tokens m;
+	int len, n;
+
+	/* Records stay queued until a frame took them */
+	while ((len = log_pack(m.rec, sizeof(m.rec), &n)) && !msg_send_log_tokens(&m, len))
+	{
+		log_pop(n);
+	}
+#else
+	char str[CMD_LEN];
+	struct log_rec *r;
+
+	while ((r = log_peek(0)))
+	{
+		log_format(str, sizeof(str), (r->hdr & 0xFF) - 1, r->hdr >> 8, r->args);
+		log_pop(1);
+		log_write(str);
+	}
+#endif
+}
+
+void log_flush(void)
+{
+	uint32_t flags, drops;
+
+	log_drain();
+
+	/* Once there's room again, say what got lost */
+	if (log_drops && log_head - log_tail < LOG_RING_SIZE)
+	{
+		flags = log_lock();
+		drops = log_drops;
+		log_drops = 0;
+		log_unlock(flags);
+
+		log_push(LOG_DROPPED, 1, drops, 0, 0, 0);
+		log_drain();
+	}
+}
+
+/* SEND_LOG text from the modem, the firmware may put it somewhere else */
+__WEAK void parse_log(uint8_t *cmd)
+{
+	printf("LOG: %s", cmd);
+}
+
+/* The modem's LOG() records */
+void on_log_tokens(const struct msg_log_tokens *m, int len)
+{
+	uint32_t args[LOG_MAX_ARGS];
+	const uint8_t *p = m->rec, *end = m->rec + len;
+	char str[CMD_LEN] = "LOG: ";
+	int i, shift;
+	uint8_t id, nargs;
+
+	while (end - p >= 2)
+	{
+		id = *p++;
+		nargs = *p++;
+		if (id >= LOG_COUNT || nargs > LOG_MAX_ARGS)
+		{
+			ERROR("Bad log record %d/%d\n", id, nargs);
+			return;
+		}
+
+		for (i = 0; i < nargs; i++)
+		{
+			args[i] = 0;
+			for (shift = 0; p < end && shift < 32; shift += 7)
+			{
+				args[i] |= (uint32_t)(*p & 0x7F) << shift;
+				if (!(*p++ & 0x80))
+				{
+					break;
+				}
+			}
+		}
+
+		log_format(str + 5, sizeof(str) - 5, id, nargs, args);
+		log_write(str);
+	}
+}
@@ -0,0 +1,91 @@
+#ifndef SERIAL_LOG_H
+#define SERIAL_LOG_H
+
+#include <stdint.h>
+
+/*
+ * Tokenized logging for the RX path, IRQs and core1. LOG(id, args...)
+ * only queues the id and up to LOG_MAX_ARGS integer args, log_flush()
+ * formats them later from the main loop (Pico) or ships them to the Pico
+ * as SEND_LOG_TOKENS records (modem), where they get formatted with the
+ * same table. Formats only take integer conversions, no %s / %f / %l.
+ *
+ * With SERIAL_LOG_TOKENS 0, LOG() is ERROR() on the format.
+ */
+#ifndef SERIAL_LOG_TOKENS
+#define SERIAL_LOG_TOKENS	1
+#endif
+
+/* Records waiting for log_flush(), power of 2 */
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE	32
+#endif
+
+#if LOG_RING_SIZE & (LOG_RING_SIZE - 1)
+#error "LOG_RING_SIZE must be a power of 2"
+#endif
+
+#define LOG_MAX_ARGS	4
+
+#define SERIAL_LOGS(X) \
+	X(LOG_DROPPED,		"%u log records dropped\n") \
+	X(LOG_BAD_STATE,	"Unknown prev state %d\n") \
+	X(LOG_PARITY,		"Parity failed: expected 0x%02x, got 0x%02x\n") \
+	X(LOG_CRC_LEN,		"CRC frame length %d, cmd len %d\n") \
+	X(LOG_FRAME_LEN,	"Frame length %d, cmd len %d\n") \
+	X(LOG_CRC,		"CRC failed: expected 0x%04x, got 0x%04x\n") \
+	X(LOG_NO_CRC,		"CRC frame but no CRC support\n") \
+	X(LOG_RING_FULL,	"Serial overflow: %u bytes queued\n") \
+	X(LOG_EXT_LEN,		"Extended frame dropped: %d bytes, command type 0x%02x\n") \
+	X(LOG_SEQ,		"Warn: expected seq %d, got %d\n") \
+	X(LOG_BAUD_NOW,		"Link now at %u baud\n") \
+	X(LOG_BAUD_NO_TEST,	"No test pattern at %u baud, back to %u\n") \
+	X(LOG_BAUD_ERRORS,	"%u of %u frames bad at %u baud, back to %u\n") \
+	X(LOG_RX_OVERRUN,	"RX ring overrun: %u bytes, %u overruns, peak fill %u\n") \
+	X(LOG_FAN_COUNT,	"FAN %d count %d\n") \
+	X(LOG_FAN_PWM_AUTO,	"Setting fan %d PWM to auto\n") \
+	X(LOG_FAN_PWM,		"Setting fan %d PWM to %d\n") \
+	X(LOG_FAN_AUTO_PWM,	"Setting fan %d Auto PWM to %d\n")
+
+#define LOG_ENUM(id, fmt)	id,
+
+enum log_id {
+	SERIAL_LOGS(LOG_ENUM)
+	LOG_COUNT
+};
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+extern const char *const log_fmt[LOG_COUNT];
+
+extern uint32_t log_drops;
+
+void log_push(uint8_t id, uint8_t nargs, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3);
+
+int log_format(char *out, int len, uint8_t id, int nargs, const uint32_t *args);
+
+int log_pack(uint8_t *buf, int len, int *records);
+
+void log_flush(void);
+
+void log_write(const char *str);
+
+uint32_t log_lock(void);
+
+void log_unlock(uint32_t flags);
+#ifdef __cplusplus
+}
+#endif
+
+#if SERIAL_LOG_TOKENS
+/* LOG(id) .. LOG(id, a0, a1, a2, a3), missing args pass as 0 */
+#define LOG_NARGS_(id, a0, a1, a2, a3, n, ...)	n
+#define LOG_PUSH_(n, id, a0, a1, a2, a3, ...) \
+	log_push(id, n, (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2), (uint32_t)(a3))
+#define LOG(...)	LOG_PUSH_(LOG_NARGS_(__VA_ARGS__, 4, 3, 2, 1, 0), __VA_ARGS__, 0, 0, 0, 0)
+#else
+#define LOG(id, ...)	ERROR(log_fmt[id], ##__VA_ARGS__)
+#endif
+
+#endif /* SERIAL_LOG_H */
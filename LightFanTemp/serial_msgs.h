@@ -0,0 +1,467 @@
+#ifndef SERIAL_MSGS_H
+#define SERIAL_MSGS_H
+
+#include <stdint.h>
+#include "macro_helpers.h"
+
+/*
+ * Message table for the Pico <-> ESP8266 link. Everything about a
+ * message lives here: the payload layout (struct msg_*), the command id
+ * and which side handles it. From it we generate:
+ *  - msg_send_<name>()	encoder, queues the payload on its TX channel
+ *  - msg_decode_<name>()	typed, in place view of a received payload
+ *  - on_<name>() prototypes for the C handlers
+ * and serial_proto.hpp the dispatch of each role, calling its handlers.
+ * Encoders/decoders are static inline, a firmware only carries the ones it uses.
+ *
+ * To add a command: add it to enum cmd_type, add its payload struct and a
+ * line below, then write the receiving side's handler: an on() in
+ * serial_proto::pico_handlers, or on_<name>() in the sketch.
+ */
+
+/* Multi byte fields are big endian on the wire */
+#define GET_BE16(x)	(((x)[0] << 8) | (x)[1])
+#define PUT_BE16(x, v)	{ (x)[0] = ((v) >> 8) & 0xFF; (x)[1] = (v) & 0xFF; }
+#define GET_BE32(x)	(((uint32_t)GET_BE16(x) << 16) | GET_BE16((x) + 2))
+#define PUT_BE32(x, v)	{ PUT_BE16(x, (v) >> 16); PUT_BE16((x) + 2, v); }
+
+/* Payloads. Only uint8_t members, so no padding on either side */
+struct msg_led_color {
+	uint8_t step;
+	uint8_t time[2];			/* ms, BE16 */
+	uint8_t rgb[NUM_LEDS_IN_STRIP][3];
+};
+
+/* Colors for SET_LED_STEP_PACKED, see led_pack.h */
+#define LED_PALETTE_SIZE	32
+
+struct msg_led_palette {
+	uint8_t first;				/* index of rgb[0] */
+	uint8_t rgb[LED_PALETTE_SIZE][3];	/* variable length */
+};
+
+struct msg_led_step_packed {
+	uint8_t step;
+	uint8_t time[2];			/* ms, BE16 */
+	uint8_t flags;				/* LED_PACKED_* */
+	uint8_t ops[NUM_LEDS_IN_STRIP * 4];	/* variable length, worst case all LED_OP_RGB */
+};
+
+struct msg_led_program_steps {
+	uint8_t num_steps;
+};
+
+struct msg_color {
+	uint8_t r, g, b;
+};
+
+struct msg_drawer_light {
+	uint8_t drawer;
+	uint8_t r, g, b;
+};
+
+struct msg_fan_power_state {
+	uint8_t state;
+};
+
+struct msg_fan_pwm {
+	uint8_t fan;
+	uint8_t pwm;				/* %, > 100 means auto */
+};
+
+struct msg_tacho {
+	uint8_t rpm[NUM_FANS][2];		/* BE16 */
+};
+
+struct msg_temperature {
+	uint8_t temp[NUM_TEMP_SENSORS][2];	/* int(T * 100), BE16 */
+};
+
+/* SEND_TELEMETRY: records back to back, each type, len, then len bytes */
+enum telem_type {
+	TELEM_TEMP = 1,				/* struct msg_temperature */
+	TELEM_RPM,				/* struct msg_tacho */
+	TELEM_FAN_PWM,				/* struct telem_fan_pwm */
+	TELEM_LINK,				/* struct telem_link */
+	TELEM_TIME,				/* struct telem_time */
+	TELEM_LED,				/* struct telem_led */
+};
+
+struct telem_fan_pwm {
+	uint8_t pwm[NUM_FANS];			/* % */
+	uint8_t auto_mask;			/* bit n: fan n follows the temperature curve */
+};
+
+struct telem_link {
+	uint8_t rx_frames[4];			/* BE32, serial_rx_stats */
+	uint8_t rx_bad[4];
+	uint8_t rx_ring_full[4];
+	uint8_t tx_drops[4];			/* serial_tx_stats */
+	uint8_t retransmits[4];			/* serial_link_stats */
+};
+
+/* When the readings were taken, sender's serial_time_us(). LINK_TIME maps it to the receiver's */
+struct telem_time {
+	uint8_t sampled_us[4];			/* BE32 */
+};
+
+struct telem_led {
+	uint8_t displaying;			/* animation running */
+	uint8_t program;			/* index in led_programs */
+	uint8_t step;				/* showing now, running program only */
+	uint8_t num_steps;
+};
+
+struct msg_telemetry {
+	uint8_t rec[SERIAL_PAYLOAD_MAX];	/* variable length */
+};
+
+/* RPC_REQUEST -> RPC_REPLY, see serial_rpc.c. Answers are telemetry records */
+enum rpc_method {
+	RPC_GET_TEMP = 1,			/* TELEM_TEMP, TELEM_TIME */
+	RPC_GET_FAN_STATE,			/* TELEM_RPM, TELEM_FAN_PWM */
+	RPC_GET_LED_PROGRAM_INFO,		/* TELEM_LED, arg: program, the running one if none */
+	RPC_GET_STATS,				/* TELEM_LINK */
+};
+
+enum rpc_status {
+	RPC_OK,
+	RPC_NO_METHOD,
+	RPC_BAD_ARG,
+	RPC_NO_ROOM,				/* answer didn't fit in a reply */
+	RPC_BUSY,				/* modem: no free call slot or TX channel, nothing sent */
+	RPC_TIMEOUT,				/* modem: no reply in RPC_TIMEOUT_MS */
+};
+
+struct msg_rpc_request {
+	uint8_t id;				/* echoed back, tells calls apart */
+	uint8_t method;				/* enum rpc_method */
+	uint8_t arg[16];			/* variable length */
+};
+
+struct msg_rpc_reply {
+	uint8_t id;
+	uint8_t method;
+	uint8_t status;				/* enum rpc_status */
+	uint8_t rec[SERIAL_PAYLOAD_MAX - 3];	/* variable length, SEND_TELEMETRY records */
+};
+
+/* Room for a size byte record at *len, NULL if the frame is full */
+static inline void *telem_add(struct msg_telemetry *m, int *len, uint8_t type, int size)
+{
+	uint8_t *p = &m->rec[*len];
+
+	if (*len + 2 + size > (int)sizeof(m->rec))
+	{
+		return 0;
+	}
+
+	p[0] = type;
+	p[1] = size;
+	*len += 2 + size;
+
+	return p + 2;
+}
+
+/* Record at *pos of len bytes of records, NULL past the last whole one. Unknown types are for the caller to skip */
+static inline const uint8_t *telem_next(const uint8_t *rec, int len, int *pos, uint8_t *type, int *size)
+{
+	const uint8_t *p = &rec[*pos];
+
+	if (len - *pos < 2 || len - *pos - 2 < p[1])
+	{
+		return 0;
+	}
+
+	*type = p[0];
+	*size = p[1];
+	*pos += 2 + p[1];
+
+	return p + 2;
+}
+
+struct msg_link_caps {
+	uint8_t checks;				/* enum frame_check bits */
+	uint8_t flags;				/* LINK_CAPS_* */
+};
+
+#define LINK_CAPS_REPLY		(1 << 0)	/* peer wants ours back */
+#define LINK_CAPS_RELIABLE	(1 << 1)	/* does ACK/NAK, see serial_link.c */
+#define LINK_CAPS_EXT		(1 << 2)	/* takes FRAME_EXT_LEN frames */
+#define LINK_CAPS_COBS		(1 << 3)	/* takes COBS frames */
+#define LINK_CAPS_RESTART	(1 << 4)	/* sender's first since boot, its seqs start over */
+
+struct msg_link_ack {
+	uint8_t next_seq;			/* all before this arrived */
+};
+
+/* LINK_BAUD ops */
+enum link_baud_op {
+	LINK_BAUD_OFFER,			/* arg: our rates, answer with yours */
+	LINK_BAUD_ACCEPT,			/* arg: our rates */
+	LINK_BAUD_SWITCH,			/* arg: rate index, both switch now */
+	LINK_BAUD_TEST,				/* sent at the new rate, echoed back */
+};
+
+#define LINK_BAUD_PATTERN_LEN	16
+
+struct msg_link_baud {
+	uint8_t op;
+	uint8_t arg;
+	uint8_t pattern[LINK_BAUD_PATTERN_LEN];	/* framing chars and bit edges */
+};
+
+/* 
+ * Receiver's RX ring: free bytes for data frames from next_seq on. A
+ * frame of len bytes (header and payload) takes rec_hdr + len rounded
+ * up to even.
+ */
+struct msg_link_credit {
+	uint8_t next_seq;
+	uint8_t free[2];			/* BE16 */
+	uint8_t rec_hdr;
+};
+
+/* BUS_POLL: frames the node may send now. BUS_DONE: frames it still has queued */
+struct msg_bus_turn {
+	uint8_t frames;
+};
+
+/* LINK_TIME ops, NTP style: offset and round trip from the four times */
+enum link_time_op {
+	LINK_TIME_PING = 1,			/* t1 set */
+	LINK_TIME_PONG,				/* t1 echoed, t2 / t3 from the answering side */
+};
+
+struct msg_link_time {
+	uint8_t op;
+	uint8_t t1[4];				/* BE32 us: ping sent, pinging side's clock */
+	uint8_t t2[4];				/* ping in, answering side's clock */
+	uint8_t t3[4];				/* pong out, answering side's clock */
+};
+
+/* One command's struct cmd_stats, SEND_STATS goes out once per command seen */
+struct msg_stats {
+	uint8_t cmd_type;
+	uint8_t flags;				/* MSG_STATS_* */
+	uint8_t count[4];			/* BE32 */
+	uint8_t bytes[4];
+	uint8_t queue_max[4];			/* us */
+	uint8_t handler_max[4];
+	uint8_t queue_hist[STATS_BUCKETS][2];	/* BE16 */
+	uint8_t handler_hist[STATS_BUCKETS][2];
+};
+
+#define MSG_STATS_LAST		(1 << 0)	/* end of this dump */
+
+struct msg_get_stats {
+	uint8_t flags;				/* GET_STATS_* */
+};
+
+#define GET_STATS_RESET		(1 << 0)	/* clear once sent */
+
+/* Bulk transfer targets, see serial_bulk.c */
+enum bulk_target_id {
+	BULK_LED_PROGRAM = 1,			/* whole shadow program, switched to on commit */
+};
+
+/* BULK_LED_PROGRAM: num_steps, then per step time (BE16 ms) and rgb[NUM_LEDS_IN_STRIP][3] */
+#define LED_BLOB_STEP		(2 + 3 * NUM_LEDS_IN_STRIP)
+#define LED_BLOB_STEPS		(2 * NUM_LEDS_IN_STRIP)	/* the modem holds the whole blob */
+#define LED_BLOB_MAX		(1 + LED_BLOB_STEPS * LED_BLOB_STEP)
+
+struct msg_bulk_open {
+	uint8_t target;				/* enum bulk_target_id */
+	uint8_t size[4];			/* BE32, whole transfer */
+	uint8_t crc[2];				/* BE16, CRC-16/CCITT-FALSE of all of it */
+};
+
+struct msg_bulk_data {
+	uint8_t offset[4];			/* BE32 */
+	uint8_t data[SERIAL_EXT_MAX - 4];	/* variable length, extended frame past SERIAL_PAYLOAD_MAX */
+};
+
+enum bulk_status {
+	BULK_OK,
+	BULK_NO_TARGET,
+	BULK_TOO_BIG,
+	BULK_NOT_OPEN,
+	BULK_OFFSET,				/* resend from offset */
+	BULK_CRC,
+	BULK_REJECTED,				/* target refused the data / commit */
+};
+
+struct msg_bulk_status {
+	uint8_t status;				/* enum bulk_status */
+	uint8_t offset[4];			/* BE32, bytes taken so far */
+};
+
+struct msg_log {
+	char str[CMD_LEN];			/* NUL terminated, variable length */
+};
+
+struct msg_log_tokens {
+	uint8_t rec[SERIAL_PAYLOAD_MAX];	/* LOG() records, see serial_log.c */
+};
+
+/*
+ * LINK entries are handled straight from uart_rx() on both sides
+ * (serial_link.c, BULK_DATA in serial_bulk.c), not process_message().
+ *
+ * EMPTY(id, name, handled by)		no payload
+ * FIXED(id, name, handled by, type)	fixed size payload
+ * VAR(id, name, handled by, type)	up to sizeof(type) payload
+ */
+#define SERIAL_MSGS(EMPTY, FIXED, VAR) \
+	EMPTY(MODEM_RESET,		modem_reset,		TO_MODEM) \
+	EMPTY(WIFI_CONNECTED,		wifi_connected,		TO_PICO) \
+	EMPTY(WIFI_DISCONNECTED,	wifi_disconnected,	TO_PICO) \
+	EMPTY(MQTT_CONNECTED,		mqtt_connected,		TO_PICO) \
+	EMPTY(MQTT_DISCONNECTED,	mqtt_disconnected,	TO_PICO) \
+	FIXED(SET_LED_COLOR,		led_color,		TO_PICO,	struct msg_led_color) \
+	FIXED(SET_LED_PROGRAM_STEPS,	led_program_steps,	TO_PICO,	struct msg_led_program_steps) \
+	EMPTY(SWITCH_PROGRAMS,		switch_programs,	TO_PICO) \
+	FIXED(SET_COLOR_INTENSITY,	color_intensity,	TO_PICO,	struct msg_color) \
+	EMPTY(RESUME_ANIMATION,		resume_animation,	TO_PICO) \
+	FIXED(SET_DRAWER_LIGHT,		drawer_light,		TO_PICO,	struct msg_drawer_light) \
+	VAR(SET_LED_PALETTE,		led_palette,		TO_PICO,	struct msg_led_palette) \
+	VAR(SET_LED_STEP_PACKED,	led_step_packed,	TO_PICO,	struct msg_led_step_packed) \
+	FIXED(SET_FAN_POWER_STATE,	fan_power_state,	TO_PICO,	struct msg_fan_power_state) \
+	FIXED(SET_FAN_PWM_PERC,		fan_pwm,		TO_PICO,	struct msg_fan_pwm) \
+	FIXED(SEND_FAN_PWM,		tacho,			TO_MODEM,	struct msg_tacho) \
+	FIXED(SEND_TEMP,		temperature,		TO_MODEM,	struct msg_temperature) \
+	VAR(SEND_TELEMETRY,		telemetry,		TO_MODEM,	struct msg_telemetry) \
+	VAR(RPC_REQUEST,		rpc_request,		TO_PICO,	struct msg_rpc_request) \
+	VAR(RPC_REPLY,			rpc_reply,		TO_MODEM,	struct msg_rpc_reply) \
+	VAR(SEND_LOG,			log,			TO_PICO,	struct msg_log) \
+	VAR(SEND_LOG_TOKENS,		log_tokens,		TO_PICO,	struct msg_log_tokens) \
+	FIXED(LINK_CAPS,		link_caps,		LINK,		struct msg_link_caps) \
+	FIXED(LINK_ACK,			link_ack,		LINK,		struct msg_link_ack) \
+	FIXED(LINK_NAK,			link_nak,		LINK,		struct msg_link_ack) \
+	FIXED(LINK_BAUD,		link_baud,		LINK,		struct msg_link_baud) \
+	FIXED(LINK_TIME,		link_time,		LINK,		struct msg_link_time) \
+	FIXED(LINK_CREDIT,		link_credit,		LINK,		struct msg_link_credit) \
+	FIXED(BUS_POLL,			bus_poll,		LINK,		struct msg_bus_turn) \
+	FIXED(BUS_DONE,			bus_done,		LINK,		struct msg_bus_turn) \
+	FIXED(GET_STATS,		get_stats,		TO_PICO,	struct msg_get_stats) \
+	FIXED(SEND_STATS,		stats,			TO_MODEM,	struct msg_stats) \
+	FIXED(BULK_OPEN,		bulk_open,		TO_PICO,	struct msg_bulk_open) \
+	VAR(BULK_DATA,			bulk_data,		LINK,		struct msg_bulk_data) \
+	EMPTY(BULK_COMMIT,		bulk_commit,		TO_PICO) \
+	FIXED(BULK_STATUS,		bulk_status,		TO_MODEM,	struct msg_bulk_status)
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+int serial_send(uint8_t cmd_type, const void *payload, int len);
+#ifdef __cplusplus
+}
+#endif
+
+/* Encoders */
+#define MSG_ENCODER_EMPTY(id, name, dir) \
+	static inline int msg_send_##name(void) \
+	{ return serial_send(id, 0, 0); }
+
+#define MSG_ENCODER_FIXED(id, name, dir, type) \
+	static inline int msg_send_##name(const type *m) \
+	{ return serial_send(id, m, sizeof(type)); }
+
+#define MSG_ENCODER_VAR(id, name, dir, type) \
+	static inline int msg_send_##name(const type *m, int len) \
+	{ return serial_send(id, m, len); }
+
+SERIAL_MSGS(MSG_ENCODER_EMPTY, MSG_ENCODER_FIXED, MSG_ENCODER_VAR)
+
+/* Decoders: NULL if the frame is too short for the payload */
+#define MSG_DECODER_EMPTY(id, name, dir)
+
+#define MSG_DECODER_FIXED(id, name, dir, type) \
+	static inline const type *msg_decode_##name(const struct serial_cmd *c) \
+	{ return c->cmd_len >= sizeof(type) ? (const type *)c->cmd : 0; }
+
+#define MSG_DECODER_VAR(id, name, dir, type) \
+	static inline const type *msg_decode_##name(const struct serial_cmd *c) \
+	{ return (const type *)c->cmd; }
+
+SERIAL_MSGS(MSG_DECODER_EMPTY, MSG_DECODER_FIXED, MSG_DECODER_VAR)
+
+/*
+ * Handlers of both sides are declared, dispatch (serial_proto.hpp) picks
+ * the role's. LINK frames never get that far.
+ */
+#define MSG_HANDLED_LINK(...)
+#define MSG_HANDLED_TO_MODEM(...)	__VA_ARGS__
+#define MSG_HANDLED_TO_PICO(...)	__VA_ARGS__
+
+#define MSG_HANDLER_EMPTY(id, name, dir) \
+	MSG_HANDLED_##dir(void on_##name(void);)
+
+#define MSG_HANDLER_FIXED(id, name, dir, type) \
+	MSG_HANDLED_##dir(void on_##name(const type *m);)
+
+#define MSG_HANDLER_VAR(id, name, dir, type) \
+	MSG_HANDLED_##dir(void on_##name(const type *m, int len);)
+
+/* What this build's side takes, for the per command tables below */
+#define MSG_ON_LINK(...)
+#ifdef ESP8266
+#define MSG_ON_TO_MODEM(...)	__VA_ARGS__
+#define MSG_ON_TO_PICO(...)
+#else
+#define MSG_ON_TO_MODEM(...)
+#define MSG_ON_TO_PICO(...)	__VA_ARGS__
+#endif
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+SERIAL_MSGS(MSG_HANDLER_EMPTY, MSG_HANDLER_FIXED, MSG_HANDLER_VAR)
+#ifdef __cplusplus
+}
+#endif
+
+/*
+ * Dense index over the messages this side takes through process_message(),
+ * for per command tables. The other side's messages don't get an entry.
+ */
+#define MSG_INDEX_EMPTY(id, name, dir)		MSG_ON_##dir(MSG_IDX_##name,)
+#define MSG_INDEX_FIXED(id, name, dir, type)	MSG_ON_##dir(MSG_IDX_##name,)
+#define MSG_INDEX_VAR(id, name, dir, type)	MSG_ON_##dir(MSG_IDX_##name,)
+
+enum msg_index {
+	SERIAL_MSGS(MSG_INDEX_EMPTY, MSG_INDEX_FIXED, MSG_INDEX_VAR)
+	MSG_COUNT
+};
+
+#define MSG_INDEX_CASE_EMPTY(id, name, dir)		MSG_ON_##dir(case id: return MSG_IDX_##name;)
+#define MSG_INDEX_CASE_FIXED(id, name, dir, type)	MSG_ON_##dir(case id: return MSG_IDX_##name;)
+#define MSG_INDEX_CASE_VAR(id, name, dir, type)		MSG_ON_##dir(case id: return MSG_IDX_##name;)
+
+/* -1 if cmd_type isn't one this side takes */
+static inline int msg_index(uint8_t cmd_type)
+{
+	switch (cmd_type) {
+		SERIAL_MSGS(MSG_INDEX_CASE_EMPTY, MSG_INDEX_CASE_FIXED, MSG_INDEX_CASE_VAR)
+	}
+
+	return -1;
+}
+
+extern struct cmd_stats cmd_stats[MSG_COUNT];
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+bool serial_stats_fill(int idx, struct msg_stats *m);
+
+int rpc_answer(uint8_t method, const uint8_t *arg, int arg_len, struct msg_telemetry *out, int *len);
+
+void rpc_done(uint8_t method, uint8_t status, uint32_t cookie, const uint8_t *rec, int len);
+
+void bus_rx_turn(uint8_t cmd_type, const struct msg_bus_turn *m);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SERIAL_MSGS_H */
@@ -0,0 +1,1262 @@
+#ifndef SERIAL_PROTO_HPP
+#define SERIAL_PROTO_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "serial_comms.h"
+#include "led_pack.h"
+#include "led_store.h"
+
+/*
+ * The receive side and the message layer of serial_msgs.h, one template
+ * per role: RX parser, decoders, dispatch, encoders and the Pico's
+ * handlers. Framing on the way out, the TX channels, the RX ring and the
+ * link layer stay in C (serial_comms.c, serial_link.c).
+ *
+ *	using proto = serial_proto::endpoint<serial_proto::role::pico,
+ *		serial_proto::uart, serial_proto::pico_handlers>;
+ *	SERIAL_PROTO_C_API(proto)
+ *
+ *	proto::send<SEND_TEMP>(temp);
+ *
+ * SERIAL_PROTO_C_API() goes in exactly one C++ file per firmware (main.cpp,
+ * the sketch, comms_host.cpp for the host tests): it defines uart_rx(),
+ * serial_dispatch() and the rest of the entry points serial_comms.h
+ * declares for the C side.
+ *
+ * What only one role has is an if constexpr on R, not an #ifdef: extended
+ * frames and the BULK_DATA path only go modem -> Pico, so the modem's
+ * parser has neither and a buffer a normal frame long. send<id>() only
+ * exists for messages the role sends, with the payload type the table
+ * gives. dispatch() only has an arm for each message the role takes,
+ * calling the Handlers::on() overload for it; one without an on() is a
+ * compile error, not a link error or a silent drop. The other side's
+ * decoders and handlers never get instantiated.
+ *
+ * Transport is anything with a static send(cmd_type, payload, len).
+ * LINK_* frames are handled straight from the parser, never dispatched.
+ */
+
+namespace serial_proto {
+/* One role, one translation unit: internal linkage, so the parser inlines like the static C one did */
+namespace {
+
+enum class role { pico, modem };
+
+/* Which side handles a message, the table's third column */
+enum class dir { TO_PICO, TO_MODEM, LINK };
+
+enum class kind { empty, fixed, var };
+
+/* What the table says about message Id */
+template <uint8_t Id>
+struct msg
+{
+	static constexpr bool known = false;
+};
+
+#define PROTO_MSG_EMPTY(id, name, to_) \
+	template <> struct msg<id> \
+	{ \
+		static constexpr bool known = true; \
+		static constexpr kind form = kind::empty; \
+		static constexpr dir to = dir::to_; \
+		using type = void; \
+	};
+
+#define PROTO_MSG_FIXED(id, name, to_, type_) \
+	template <> struct msg<id> \
+	{ \
+		static constexpr bool known = true; \
+		static constexpr kind form = kind::fixed; \
+		static constexpr dir to = dir::to_; \
+		using type = type_; \
+	};
+
+#define PROTO_MSG_VAR(id, name, to_, type_) \
+	template <> struct msg<id> \
+	{ \
+		static constexpr bool known = true; \
+		static constexpr kind form = kind::var; \
+		static constexpr dir to = dir::to_; \
+		using type = type_; \
+	};
+
+SERIAL_MSGS(PROTO_MSG_EMPTY, PROTO_MSG_FIXED, PROTO_MSG_VAR)
+
+#define PROTO_ID_EMPTY(id, name, to_)		id,
+#define PROTO_ID_FIXED(id, name, to_, type_)	id,
+#define PROTO_ID_VAR(id, name, to_, type_)	id,
+
+/* Every message in the table, dispatch() walks it at compile time */
+constexpr uint8_t ids[] = { SERIAL_MSGS(PROTO_ID_EMPTY, PROTO_ID_FIXED, PROTO_ID_VAR) };
+
+constexpr size_t num_ids = sizeof(ids) / sizeof(ids[0]);
+
+template <role R>
+constexpr dir inbound = R == role::pico ? dir::TO_PICO : dir::TO_MODEM;
+
+template <role R, uint8_t Id>
+constexpr bool takes = msg<Id>::known && msg<Id>::to == inbound<R>;
+
+template <role R, uint8_t Id>
+constexpr bool sends = msg<Id>::known && msg<Id>::to != inbound<R> && msg<Id>::to != dir::LINK;
+
+/* Payload of message Id in c, nullptr if the frame is too short for it. Only LINK frames come extended */
+template <uint8_t Id>
+const typename msg<Id>::type *decode(const struct serial_cmd *c)
+{
+	using T = typename msg<Id>::type;
+
+	if constexpr (msg<Id>::form == kind::fixed)
+	{
+		if (c->cmd_len < sizeof(T))
+		{
+			return nullptr;
+		}
+	}
+
+	return (const T *)c->cmd;
+}
+
+/* Picks the Handlers::on() overload for message Id */
+template <uint8_t Id>
+struct tag
+{
+};
+
+/* Is there a Handlers::on() that takes message Id as the table says */
+template <class H, uint8_t Id, kind K = msg<Id>::form, class = void>
+struct has_on : std::false_type
+{
+};
+
+template <class H, uint8_t Id>
+struct has_on<H, Id, kind::empty, std::void_t<decltype(H::on(tag<Id>()))>> : std::true_type
+{
+};
+
+template <class H, uint8_t Id>
+struct has_on<H, Id, kind::fixed,
+	std::void_t<decltype(H::on(tag<Id>(), std::declval<const typename msg<Id>::type &>()))>> : std::true_type
+{
+};
+
+template <class H, uint8_t Id>
+struct has_on<H, Id, kind::var,
+	std::void_t<decltype(H::on(tag<Id>(), std::declval<const typename msg<Id>::type &>(), 0))>> : std::true_type
+{
+};
+
+/* Does Handlers have bulk targets, see pico_handlers */
+template <class H, class = void>
+struct has_bulk : std::false_type
+{
+};
+
+template <class H>
+struct has_bulk<H, std::void_t<decltype(H::bulk_target(uint8_t()))>> : std::true_type
+{
+};
+
+/* serial_comms' UART, or the USB port while a frame from it is handled */
+struct uart
+{
+	static int send(uint8_t cmd_type, const void *payload, int len)
+	{
+		return serial_send(cmd_type, payload, len);
+	}
+};
+
+/* The on_<name>() functions serial_msgs.h declares, as Handlers: the sketch's, and the C library's */
+struct c_handlers
+{
+#define PROTO_ON_EMPTY(id, name, to_) \
+	MSG_HANDLED_##to_(static void on(tag<id>) { on_##name(); })
+#define PROTO_ON_FIXED(id, name, to_, type_) \
+	MSG_HANDLED_##to_(static void on(tag<id>, const type_ &m) { on_##name(&m); })
+#define PROTO_ON_VAR(id, name, to_, type_) \
+	MSG_HANDLED_##to_(static void on(tag<id>, const type_ &m, int len) { on_##name(&m, len); })
+
+	SERIAL_MSGS(PROTO_ON_EMPTY, PROTO_ON_FIXED, PROTO_ON_VAR)
+};
+
+/*
+ * The Pico's handlers for frames from the modem. Bulk, RPC, stats and
+ * log tokens keep their C handlers (serial_bulk.c and the rest).
+ */
+struct pico_handlers : c_handlers
+{
+	using c_handlers::on;
+
+	static inline bool wifi_connected;
+	static inline bool mqtt_connected;
+
+	/* Colors SET_LED_STEP_PACKED refers to */
+	static inline uint32_t led_palette[LED_PALETTE_SIZE];
+
+	static void on(tag<WIFI_CONNECTED>)
+	{
+		ERROR("Wifi Connected!\n");
+		wifi_connected = true;
+	}
+
+	static void on(tag<WIFI_DISCONNECTED>)
+	{
+		ERROR("Wifi DisConnected!\n");
+		wifi_connected = false;
+	}
+
+	static void on(tag<MQTT_CONNECTED>)
+	{
+		ERROR("MQTT Connected!\n");
+		mqtt_connected = true;
+	}
+
+	static void on(tag<MQTT_DISCONNECTED>)
+	{
+		ERROR("MQTT DisConnected!\n");
+		mqtt_connected = false;
+	}
+
+	static void on(tag<SET_FAN_POWER_STATE>, const struct msg_fan_power_state &m)
+	{
+		/* Kill power to all fans, 2 pins */
+		ERROR("Setting FANs power state to %d\n", m.state);
+		set_fans_power_state(m.state);
+	}
+
+	static void on(tag<SET_FAN_PWM_PERC>, const struct msg_fan_pwm &m)
+	{
+		ERROR("Setting FAN %d PWM to %d\n", m.fan, m.pwm);
+		set_fan_pwm(m.fan, m.pwm);
+	}
+
+	static void on(tag<SET_LED_COLOR>, const struct msg_led_color &m)
+	{
+		uint32_t leds[NUM_LEDS_IN_STRIP];
+		int i;
+
+		ERROR("Setting LEDs in step %d (% d ms)\n", m.step, GET_BE16(m.time));
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++)
+		{
+			leds[i] = LED_RGB(m.rgb[i][0], m.rgb[i][1], m.rgb[i][2]);
+		}
+
+		/* Step 0 starts a new program, same as for the modem's packer */
+		if (!m.step)
+		{
+			led_prog_reset(shadow_prg);
+		}
+
+		if (led_step_set(shadow_prg, m.step, GET_BE16(m.time), leds))
+		{
+			ERROR("No room for step %d\n", m.step);
+		}
+	}
+
+	static void on(tag<SET_LED_PALETTE>, const struct msg_led_palette &m, int len)
+	{
+		int i, n = (len - 1) / 3;
+
+		if (len < 1 || m.first + n > LED_PALETTE_SIZE)
+		{
+			ERROR("Bad palette: %d colors at %d\n", n, m.first);
+			return;
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			led_palette[m.first + i] = LED_RGB(m.rgb[i][0], m.rgb[i][1], m.rgb[i][2]);
+		}
+	}
+
+	static void on(tag<SET_LED_STEP_PACKED>, const struct msg_led_step_packed &m, int len)
+	{
+		const int hdr = sizeof(m) - sizeof(m.ops);
+		uint32_t leds[NUM_LEDS_IN_STRIP], base[NUM_LEDS_IN_STRIP];
+		bool delta = m.flags & LED_PACKED_DELTA;
+
+		if (len < hdr || m.step >= NUM_STEPS_IN_PROGRAM || (delta && !m.step))
+		{
+			ERROR("Bad packed step %d\n", m.step);
+			return;
+		}
+
+		if (delta)
+		{
+			led_step_colors(shadow_prg, m.step - 1, base, 0);
+		}
+		else if (!m.step)
+		{
+			led_prog_reset(shadow_prg);
+		}
+
+		DEBUG("Setting LEDs in step %d (%d ms), %d bytes packed\n", m.step, GET_BE16(m.time), len);
+
+		if (led_unpack_step(leds, delta ? base : NULL, led_palette, m.ops, len - hdr))
+		{
+			ERROR("Bad ops in packed step %d\n", m.step);
+			return;
+		}
+
+		if (led_step_set(shadow_prg, m.step, GET_BE16(m.time), leds))
+		{
+			ERROR("No room for step %d\n", m.step);
+		}
+	}
+
+	static void on(tag<SET_LED_PROGRAM_STEPS>, const struct msg_led_program_steps &m)
+	{
+		ERROR("Setting num steps to %d\n", m.num_steps);
+		shadow_prg->num_steps = m.num_steps;
+	}
+
+	static void on(tag<SWITCH_PROGRAMS>)
+	{
+		ERROR("Switching programs\n");
+		switch_programs();
+	}
+
+	static void on(tag<SET_COLOR_INTENSITY>, const struct msg_color &m)
+	{
+		uint32_t s_color = (m.r << 16) | (m.g << 8) | m.b;
+
+		ERROR("Setting led strip color to 0x%08x\n", s_color);
+		set_strip_intensity(s_color);
+	}
+
+	static void on(tag<SET_DRAWER_LIGHT>, const struct msg_drawer_light &m)
+	{
+		uint32_t s_color = (m.r << 16) | (m.g << 8) | m.b;
+
+		ERROR("Setting drawer %d strip color to 0x%08x\n", m.drawer, s_color);
+		light_drawer(m.drawer, s_color);
+	}
+
+	static void on(tag<RESUME_ANIMATION>)
+	{
+		ERROR("Resuming animation...\n");
+		resume_animation();
+	}
+
+	static void on(tag<SEND_LOG>, const struct msg_log &m, int len)
+	{
+		parse_log((uint8_t *)m.str);
+	}
+
+	/* BULK_LED_PROGRAM, decoded into the shadow program a step at a time, switched to on commit */
+	static inline uint8_t led_blob_steps;
+
+	/* What of the current step has come in so far */
+	static inline uint8_t led_blob_step[LED_BLOB_STEP];
+
+	static bool led_blob_store(uint32_t step)
+	{
+		uint32_t leds[NUM_LEDS_IN_STRIP];
+		const uint8_t *p = led_blob_step + 2;
+		int i;
+
+		for (i = 0; i < NUM_LEDS_IN_STRIP; i++, p += 3)
+		{
+			leds[i] = LED_RGB(p[0], p[1], p[2]);
+		}
+
+		return !led_step_set(shadow_prg, step, GET_BE16(led_blob_step), leds);
+	}
+
+	static bool led_blob_write(uint32_t offset, const uint8_t *data, int len)
+	{
+		uint32_t step, at;
+		int n;
+
+		if (!offset && len)
+		{
+			led_blob_steps = *data++;
+			offset++;
+			len--;
+			if (led_blob_steps > LED_BLOB_STEPS)
+			{
+				return false;
+			}
+			led_prog_reset(shadow_prg);
+		}
+
+		if (len <= 0)
+		{
+			return true;
+		}
+
+		/* Chunks split steps anywhere, a step is stored once its last byte is in */
+		step = (offset - 1) / LED_BLOB_STEP;
+		at = (offset - 1) % LED_BLOB_STEP;
+
+		while (len > 0)
+		{
+			n = len < (int)(LED_BLOB_STEP - at) ? len : (int)(LED_BLOB_STEP - at);
+			memcpy(led_blob_step + at, data, n);
+			data += n;
+			len -= n;
+			at += n;
+
+			if (at == LED_BLOB_STEP)
+			{
+				if (!led_blob_store(step))
+				{
+					ERROR("No room for step %d\n", (int)step);
+					return false;
+				}
+				at = 0;
+				step++;
+			}
+		}
+
+		return true;
+	}
+
+	static bool led_blob_commit(uint32_t len)
+	{
+		if (len != 1 + (uint32_t)led_blob_steps * LED_BLOB_STEP)
+		{
+			return false;
+		}
+
+		ERROR("Program of %d steps in, switching programs\n", led_blob_steps);
+		shadow_prg->num_steps = led_blob_steps;
+		switch_programs();
+
+		return true;
+	}
+
+	/* What BULK_OPEN can write to, bulk_get_target() */
+	static const struct bulk_target *bulk_target(uint8_t id)
+	{
+		static const struct bulk_target led_program_target = {
+			LED_BLOB_MAX, led_blob_write, led_blob_commit
+		};
+
+		switch (id)
+		{
+		case BULK_LED_PROGRAM:
+			return &led_program_target;
+		}
+
+		return NULL;
+	}
+};
+
+/* Number of leading bytes in p that are plain payload, none of ESCAPE_CHAR, END_CHAR and START_CHAR */
+inline int payload_run(const uint8_t *p, int len)
+{
+	int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i esc = _mm_set1_epi8((char)ESCAPE_CHAR);
+	const __m128i end = _mm_set1_epi8((char)END_CHAR);
+	const __m128i start = _mm_set1_epi8((char)START_CHAR);
+
+	for (; i + 16 <= len; i += 16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, esc),
+							  _mm_cmpeq_epi8(v, end)), _mm_cmpeq_epi8(v, start)));
+		if (mask)
+		{
+			return i + __builtin_ctz(mask);
+		}
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t esc = vdupq_n_u8(ESCAPE_CHAR);
+	const uint8x16_t end = vdupq_n_u8(END_CHAR);
+	const uint8x16_t start = vdupq_n_u8(START_CHAR);
+
+	for (; i + 16 <= len; i += 16)
+	{
+		uint8x16_t v = vld1q_u8(p + i);
+		uint8x16_t hit = vorrq_u8(vorrq_u8(vceqq_u8(v, esc), vceqq_u8(v, end)), vceqq_u8(v, start));
+		/* Narrow to 4 bits per byte so the mask fits in 64 bits */
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+					vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+		if (mask)
+		{
+			return i + (__builtin_ctzll(mask) >> 2);
+		}
+	}
+#else
+	/* Word at a time; loads must be aligned on the M0+ */
+	for (; i < len && ((uintptr_t)(p + i) & 3); i++)
+	{
+		if (p[i] == ESCAPE_CHAR || p[i] == END_CHAR || p[i] == START_CHAR)
+		{
+			return i;
+		}
+	}
+
+	for (; i + 4 <= len; i += 4)
+	{
+		uint32_t w = *(const uint32_t *)(p + i);
+		uint32_t e = w ^ (0x01010101u * ESCAPE_CHAR);
+		uint32_t n = w ^ (0x01010101u * END_CHAR);
+		uint32_t s = w ^ (0x01010101u * START_CHAR);
+
+		/* Non zero if any byte of e, n or s is zero */
+		if (((e - 0x01010101u) & ~e & 0x80808080u) |
+		    ((n - 0x01010101u) & ~n & 0x80808080u) |
+		    ((s - 0x01010101u) & ~s & 0x80808080u))
+		{
+			break;
+		}
+	}
+#endif
+
+	for (; i < len; i++)
+	{
+		if (p[i] == ESCAPE_CHAR || p[i] == END_CHAR || p[i] == START_CHAR)
+		{
+			break;
+		}
+	}
+
+	return i;
+}
+
+/* One receiver per port, the frame being parsed goes to serial_ring once it checks out */
+template <role R>
+struct parser
+{
+	/* Extended frames only go modem -> Pico (BULK_DATA), the modem's buffer stays a normal frame long */
+	static constexpr bool ext = R == role::pico && SERIAL_RX_EXT;
+	static constexpr int frame_max = ext ? SERIAL_FRAME_MAX : SERIAL_STD_FRAME_MAX;
+
+	char buf[frame_max];
+	int pos;
+	enum parser_state state, prev_state;
+	uint8_t parity;
+	uint8_t port;
+	uint8_t block;		/* COBS: data bytes left in this block */
+	bool zero;		/* COBS: the block before ended in a zero */
+	uint32_t last_us;
+
+	constexpr explicit parser(uint8_t p)
+		: buf(), pos(0), state(MSG_START), prev_state(MSG_START), parity(0), port(p),
+		  block(0), zero(false), last_us(0)
+	{
+	}
+
+	/* Byte in, 0 once it completed a frame */
+	int rx(unsigned char ch)
+	{
+		struct serial_cmd *cmd = (struct serial_cmd *)buf;
+		bool good;
+
+		DEBUG("parser state = %d, ch = 0x%02x (%c)\n", state, ch, ch);
+
+		timeout_check();
+
+		/* Only an escaped START is data, a bare one means the last frame lost its END */
+		if (ch == START_CHAR && (state == MSG_PARITY_RCV || state == MSG_RCV))
+		{
+			drop(&serial_rx_stats.resyncs);
+		}
+
+		/* Same for a COBS delimiter inside a block */
+		if (ch == COBS_DELIM && state == MSG_COBS_DATA)
+		{
+			drop(&serial_rx_stats.resyncs);
+		}
+
+		switch (state)
+		{
+			case MSG_START:
+				if (ch == START_CHAR)
+				{
+					state = MSG_PARITY_RCV;
+					pos = 0;
+					parity = 0;
+					serial_rx_cobs[port] = false;
+#if SERIAL_BUS
+					if (bus_on && port == PORT_UART)
+					{
+						state = MSG_ADDR;
+					}
+#endif
+				}
+#if SERIAL_COBS
+				else if (ch == COBS_DELIM && !on_bus())
+				{
+					state = MSG_COBS_CODE;
+					pos = 0;
+					parity = 0;
+					zero = false;
+					serial_rx_cobs[port] = true;
+				}
+#endif
+				else
+				{
+					/* Line noise or the rest of a dropped frame, not worth a log line each */
+					serial_rx_stats.noise++;
+				}
+				break;
+
+			case MSG_PARITY_RCV:
+				if (ch == ESCAPE_CHAR)
+				{
+					state = MSG_ESCAPE;
+					prev_state = MSG_PARITY_RCV;
+				}
+				else
+				{
+					state = MSG_RCV;
+					store(ch);
+				}
+				break;
+
+			case MSG_RCV:
+				switch (ch)
+				{
+					case ESCAPE_CHAR:
+						state = MSG_ESCAPE;
+						prev_state = MSG_RCV;
+						break;
+
+					case END_CHAR:
+						state = MSG_END;
+						break;
+
+					default:
+						parity += ch;
+						store(ch);
+				}
+				break;
+
+			case MSG_ESCAPE:
+				state = MSG_RCV;
+				switch (prev_state)
+				{
+					case MSG_RCV:
+						parity += ch;
+						store(ch);
+						break;
+
+					case MSG_PARITY_RCV:
+						store(ch);
+						break;
+
+					default:
+						LOG(LOG_BAD_STATE, prev_state);
+						break;
+				}
+				break;
+
+#if SERIAL_BUS
+			case MSG_ADDR:
+				if (ch == bus_rx_addr)
+				{
+					state = MSG_PARITY_RCV;
+					parity = ch;
+				}
+				else if (ch != START_CHAR)
+				{
+					state = MSG_SKIP;
+					serial_bus_stats.other++;
+				}
+				break;
+
+			/* Not ours, not even checked: only its END (or a bare START) matters */
+			case MSG_SKIP:
+				if (ch == ESCAPE_CHAR)
+				{
+					state = MSG_SKIP_ESC;
+				}
+				else if (ch == END_CHAR)
+				{
+					state = MSG_START;
+				}
+				else if (ch == START_CHAR)
+				{
+					state = MSG_ADDR;
+				}
+				break;
+
+			case MSG_SKIP_ESC:
+				state = MSG_SKIP;
+				break;
+#endif
+
+#if SERIAL_COBS
+			/* parity sums every byte here, buf[0] comes off at the end */
+			case MSG_COBS_CODE:
+				if (ch == COBS_DELIM)
+				{
+					/* Delimiters back to back are the gap between two frames */
+					if (pos || zero)
+					{
+						state = MSG_END;
+					}
+					break;
+				}
+
+				if (zero)
+				{
+					store(0);
+					if (state == MSG_START)
+					{
+						break;
+					}
+				}
+
+				block = ch - 1;
+				zero = ch != COBS_BLOCK;
+				if (block)
+				{
+					state = MSG_COBS_DATA;
+				}
+				break;
+
+			case MSG_COBS_DATA:
+				parity += ch;
+				store(ch);
+				if (state != MSG_START && !--block)
+				{
+					state = MSG_COBS_CODE;
+				}
+				break;
+#endif
+
+			default:
+				break;
+		}
+
+		if (state != MSG_END)
+		{
+			return 1;
+		}
+
+		if (serial_rx_cobs[port] && pos)
+		{
+			parity -= buf[0];
+		}
+
+		good = check_ok(cmd);
+		if (good)
+		{
+			serial_rx_stats.frames++;
+			serial_port_stats[port].rx_frames++;
+		}
+		else
+		{
+			serial_rx_stats.bad_frames++;
+		}
+
+		if (good && accept(cmd))
+		{
+			deliver(cmd);
+		}
+		state = MSG_START;
+
+		return 0;
+	}
+
+	/*
+	 * Batch version of rx(). Payload runs inside a frame are found with
+	 * payload_run() and copied in one go, everything else (framing,
+	 * escapes, frame completion) goes through rx() so frames and ring
+	 * slots end up exactly as if fed byte by byte.
+	 * Returns the number of frames completed.
+	 */
+	int rx_buf(const uint8_t *in, int len)
+	{
+		int i = 0, j, run, frames = 0;
+
+		/* The whole chunk came in at once, as far as the inter-byte timeout goes */
+		timeout_check();
+
+		while (i < len)
+		{
+#if SERIAL_COBS
+			if ((state == MSG_COBS_CODE || state == MSG_COBS_DATA) &&
+			    (run = cobs_run(in + i, len - i)))
+			{
+				i += run;
+				continue;
+			}
+#endif
+
+			if (state == MSG_RCV)
+			{
+				/* Never past buf, the byte that doesn't fit goes to rx() to be dropped */
+				run = payload_run(in + i, len - i);
+				if (run > frame_max - pos)
+				{
+					run = frame_max - pos;
+				}
+				if (run)
+				{
+					memcpy(&buf[pos], in + i, run);
+					for (j = 0; j < run; j++)
+					{
+						parity += in[i + j];
+					}
+					pos += run;
+					i += run;
+					continue;
+				}
+			}
+
+			if (!rx(in[i++]))
+			{
+				frames++;
+			}
+		}
+
+		return frames;
+	}
+
+	/* Bytes got lost before rx_buf() saw them: the frame being parsed is gone, wait for the next START */
+	void resync()
+	{
+		if (state != MSG_START)
+		{
+			drop(&serial_rx_stats.resyncs);
+		}
+	}
+
+private:
+	bool on_bus() const
+	{
+#if SERIAL_BUS
+		return bus_on && port == PORT_UART;
+#else
+		return false;
+#endif
+	}
+
+	/* Drop the frame being parsed, counted as bad and under why */
+	void drop(uint32_t *why)
+	{
+		(*why)++;
+		serial_rx_stats.bad_frames++;
+		state = MSG_START;
+	}
+
+	/* Frame byte into buf, past the longest valid frame it's dropped */
+	void store(unsigned char ch)
+	{
+		if (pos >= frame_max)
+		{
+			drop(&serial_rx_stats.overlong);
+			return;
+		}
+
+		buf[pos++] = ch;
+	}
+
+	/* A frame that went quiet for too long won't get its END any more */
+	void timeout_check()
+	{
+#if SERIAL_RX_TIMEOUT_US
+		uint32_t now = serial_time_us();
+
+		if (state != MSG_START && now - last_us > SERIAL_RX_TIMEOUT_US)
+		{
+			drop(&serial_rx_stats.timeouts);
+		}
+		last_us = now;
+#endif
+	}
+
+	/* Verify a complete frame in buf, CRC frames get the flag and trailer stripped */
+	bool check_ok(struct serial_cmd *cmd)
+	{
+		int trailer;
+
+		/* Cut short before the header was in: the rest of it is the last frame's */
+		if (pos < 4)
+		{
+			LOG(LOG_FRAME_LEN, pos, -1);
+			serial_rx_stats.bad_len++;
+			return false;
+		}
+
+		trailer = cmd->cmd_type & FRAME_CRC16 ? 2 : 0;
+
+		/* Extended frames: the length has to match, it decides where the payload ends */
+		if (cmd->cmd_len == FRAME_EXT_LEN && (!ext || pos < 6 || pos != 6 + serial_cmd_len(cmd) + trailer))
+		{
+			LOG(LOG_EXT_LEN, pos, cmd->cmd_type);
+			serial_rx_stats.bad_len++;
+			return false;
+		}
+
+		if (!(cmd->cmd_type & FRAME_CRC16))
+		{
+			/* A short frame with a matching sum would carry stale buf bytes as payload */
+			if (cmd->cmd_len != FRAME_EXT_LEN && pos != cmd->cmd_len + 4)
+			{
+				LOG(LOG_FRAME_LEN, pos, cmd->cmd_len);
+				serial_rx_stats.bad_len++;
+				return false;
+			}
+
+			if (cmd->parity != parity)
+			{
+				LOG(LOG_PARITY, parity, cmd->parity);
+				return false;
+			}
+			return true;
+		}
+
+#if SERIAL_CRC16
+		uint16_t crc;
+
+		if (cmd->cmd_len != FRAME_EXT_LEN && pos != cmd->cmd_len + 4 + 2)
+		{
+			LOG(LOG_CRC_LEN, pos, cmd->cmd_len);
+			serial_rx_stats.bad_len++;
+			return false;
+		}
+
+		crc = crc16_update(crc_init(), (const uint8_t *)buf, pos - 2);
+		if (crc != GET_BE16((uint8_t *)&buf[pos - 2]))
+		{
+			LOG(LOG_CRC, crc, GET_BE16((uint8_t *)&buf[pos - 2]));
+			return false;
+		}
+
+		cmd->cmd_type &= ~FRAME_CRC16;
+		return true;
+#else
+		LOG(LOG_NO_CRC);
+		return false;
+#endif
+	}
+
+	uint16_t crc_init() const
+	{
+#if SERIAL_BUS
+		return on_bus() ? bus_rx_seed : CRC16_INIT;
+#else
+		return CRC16_INIT;
+#endif
+	}
+
+	/* Frame checks out: only the UART has a link layer, other ports just don't take LINK_* */
+	bool accept(struct serial_cmd *cmd)
+	{
+		if (port != PORT_UART)
+		{
+			return !IS_LINK_CMD(cmd->cmd_type);
+		}
+
+		return link_rx_frame(cmd);
+	}
+
+	/* The frame in buf is delivered, one more seq for the link layer on PORT_UART */
+	void delivered(struct serial_cmd *cmd)
+	{
+		if (port == PORT_UART)
+		{
+			link_rx_delivered(cmd);
+		}
+	}
+
+	void deliver(struct serial_cmd *cmd)
+	{
+		/* From the UART IRQ BULK_DATA waits its turn in the ring too, bulk_rx is the main loop's */
+		if constexpr (R == role::pico)
+		{
+			if (cmd->cmd_type == BULK_DATA && !serial_in_irq())
+			{
+				/* Straight into the transfer's destination, never queued. BULK_STATUS goes back the same way */
+				uint8_t tx_port = serial_tx_port;
+
+				serial_tx_port = port;
+				bulk_rx_data(cmd);
+				serial_tx_port = tx_port;
+				delivered(cmd);
+				return;
+			}
+		}
+
+		if constexpr (ext)
+		{
+			if (cmd->cmd_len == FRAME_EXT_LEN && cmd->cmd_type != BULK_DATA)
+			{
+				LOG(LOG_EXT_LEN, pos, cmd->cmd_type);
+				delivered(cmd);
+				return;
+			}
+		}
+
+		if (!serial_ring_push(buf, (cmd->cmd_len == FRAME_EXT_LEN ? 2 : 0) + serial_cmd_len(cmd) + 4, port))
+		{
+			serial_rx_stats.ring_full++;
+			LOG(LOG_RING_FULL, serial_ring_head - serial_ring_tail);
+		}
+		else
+		{
+			delivered(cmd);
+		}
+	}
+
+#if SERIAL_COBS
+	/*
+	 * COBS blocks and the code bytes between them, straight into buf.
+	 * Stops at a delimiter or a byte that doesn't fit, which rx() then
+	 * ends the frame on or drops it for. Returns the bytes taken.
+	 */
+	int cobs_run(const uint8_t *p, int len)
+	{
+		uint8_t *dst = (uint8_t *)buf;
+		const uint8_t *delim;
+		uint8_t sum = parity, left = block;
+		bool z = zero, code = state == MSG_COBS_CODE;
+		int i = 0, j, run, at = pos;
+
+		while (i < len)
+		{
+			if (code)
+			{
+				if (p[i] == COBS_DELIM || (z && at >= frame_max))
+				{
+					break;
+				}
+
+				if (z)
+				{
+					dst[at++] = 0;
+				}
+				left = p[i] - 1;
+				z = p[i++] != COBS_BLOCK;
+				code = !left;
+				continue;
+			}
+
+			run = left < len - i ? left : len - i;
+			if (run > frame_max - at)
+			{
+				run = frame_max - at;
+			}
+
+			/* Short blocks (runs of zeros in LED data) aren't worth a memchr() */
+			if (run < 16)
+			{
+				for (j = 0; j < run && p[i + j] != COBS_DELIM; j++)
+				{
+					dst[at + j] = p[i + j];
+					sum += p[i + j];
+				}
+			}
+			else
+			{
+				delim = (const uint8_t *)memchr(p + i, COBS_DELIM, run);
+				j = delim ? delim - (p + i) : run;
+				memcpy(&dst[at], p + i, j);
+				for (run = 0; run < j; run++)
+				{
+					sum += p[i + run];
+				}
+			}
+
+			at += j;
+			left -= j;
+			i += j;
+			if (left)
+			{
+				break;
+			}
+			code = true;
+		}
+
+		pos = at;
+		parity = sum;
+		block = left;
+		zero = z;
+		state = code ? MSG_COBS_CODE : MSG_COBS_DATA;
+
+		return i;
+	}
+#endif
+};
+
+template <role R, class Transport, class Handlers>
+struct endpoint
+{
+	/* We take extended frames, LINK_CAPS says so */
+	static constexpr bool rx_ext = parser<R>::ext;
+
+	/* One receiver per port, the USB one only where SERIAL_USB uses it */
+	static inline parser<R> uart_parser{PORT_UART};
+	static inline parser<R> usb_parser{PORT_USB};
+
+	/* Returns what Transport::send() does, -1 if the frame didn't go */
+	template <uint8_t Id, std::enable_if_t<sends<R, Id> && msg<Id>::form == kind::empty, int> = 0>
+	static int send()
+	{
+		return Transport::send(Id, nullptr, 0);
+	}
+
+	template <uint8_t Id, std::enable_if_t<sends<R, Id> && msg<Id>::form == kind::fixed, int> = 0>
+	static int send(const typename msg<Id>::type &m)
+	{
+		return Transport::send(Id, &m, sizeof(m));
+	}
+
+	/* len: bytes of m that are used */
+	template <uint8_t Id, std::enable_if_t<sends<R, Id> && msg<Id>::form == kind::var, int> = 0>
+	static int send(const typename msg<Id>::type &m, int len)
+	{
+		return Transport::send(Id, &m, len);
+	}
+
+	/* Bytes from port, frames completed */
+	static int rx(uint8_t port, const uint8_t *buf, int len)
+	{
+		if constexpr (SERIAL_USB)
+		{
+			if (port == PORT_USB)
+			{
+				return usb_parser.rx_buf(buf, len);
+			}
+		}
+
+		return port == PORT_UART ? uart_parser.rx_buf(buf, len) : 0;
+	}
+
+	/* 0 handled, -1 shorter than its payload, 1 not one this role takes */
+	static int dispatch(const struct serial_cmd *c)
+	{
+		/* Only queued when it came in on the UART IRQ, see parser::deliver() */
+		if constexpr (R == role::pico)
+		{
+			if (c->cmd_type == BULK_DATA)
+			{
+				bulk_rx_data(c);
+				return 0;
+			}
+		}
+
+		return dispatch(c, std::make_index_sequence<num_ids>());
+	}
+
+	static const struct bulk_target *bulk_target(uint8_t id)
+	{
+		if constexpr (has_bulk<Handlers>::value)
+		{
+			return Handlers::bulk_target(id);
+		}
+
+		return NULL;
+	}
+
+private:
+	template <uint8_t Id>
+	static int handle(const struct serial_cmd *c)
+	{
+		using M = msg<Id>;
+
+		static_assert(has_on<Handlers, Id>::value, "Handlers has no on() for a message this role takes");
+
+		if constexpr (M::form == kind::empty)
+		{
+			Handlers::on(tag<Id>());
+		}
+		else
+		{
+			const typename M::type *m = decode<Id>(c);
+
+			if (!m)
+			{
+				return -1;
+			}
+
+			if constexpr (M::form == kind::fixed)
+			{
+				Handlers::on(tag<Id>(), *m);
+			}
+			else
+			{
+				Handlers::on(tag<Id>(), *m, c->cmd_len);
+			}
+		}
+
+		return 0;
+	}
+
+	/* One compare per message this role takes, the rest is gone before codegen */
+	template <uint8_t Id>
+	static bool try_handle(uint8_t cmd_type, const struct serial_cmd *c, int &ret)
+	{
+		if constexpr (takes<R, Id>)
+		{
+			if (cmd_type == Id)
+			{
+				ret = handle<Id>(c);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	template <size_t... I>
+	static int dispatch(const struct serial_cmd *c, std::index_sequence<I...>)
+	{
+		const uint8_t cmd_type = c->cmd_type;
+		int ret = 1;
+
+		(try_handle<ids[I]>(cmd_type, c, ret) || ...);
+
+		return ret;
+	}
+};
+
+} /* anonymous namespace */
+} /* namespace serial_proto */
+
+/* The entry points serial_comms.h declares for the C side, from endpoint proto. Once per firmware */
+#define SERIAL_PROTO_C_API(proto) \
+	const bool serial_rx_ext = proto::rx_ext; \
+	\
+	int uart_rx(unsigned char ch) \
+	{ \
+		return proto::uart_parser.rx(ch); \
+	} \
+	\
+	int uart_rx_buf(const uint8_t *buf, int len) \
+	{ \
+		return proto::uart_parser.rx_buf(buf, len); \
+	} \
+	\
+	void uart_rx_resync(void) \
+	{ \
+		proto::uart_parser.resync(); \
+	} \
+	\
+	int serial_rx_buf(uint8_t port, const uint8_t *buf, int len) \
+	{ \
+		return proto::rx(port, buf, len); \
+	} \
+	\
+	int serial_dispatch(const struct serial_cmd *c) \
+	{ \
+		return proto::dispatch(c); \
+	} \
+	\
+	const struct bulk_target *bulk_get_target(uint8_t id) \
+	{ \
+		return proto::bulk_target(id); \
+	}
+
+#endif /* SERIAL_PROTO_HPP */
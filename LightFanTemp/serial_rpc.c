@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "serial_comms.h"
+
+/*
+ * On demand queries, modem to Pico:
+ *
+ *	RPC_REQUEST (id, method, arg)	-> RPC_REPLY (id, method, status, records)
+ *
+ * The answer is SEND_TELEMETRY records, so the modem formats it with the
+ * same code as the periodic report. The Pico answers from what it already
+ * has (last temperature conversion, fan counts, LED state) right from the
+ * handler, it never starts a reading or waits for one, and the reply goes
+ * on the control channel ahead of telemetry and uploads. If it can't be
+ * queued the call times out on the modem, the Pico doesn't hold on to it.
+ *
+ * The modem keeps up to RPC_PENDING calls out, tells the replies apart by
+ * id and ends every call with exactly one rpc_done(): the reply, or
+ * RPC_TIMEOUT from rpc_poll(). A reply that comes in after that is
+ * dropped.
+ */
+
+struct serial_rpc_stats serial_rpc_stats;
+
+#ifndef ESP8266
+/* No methods unless the firmware has some */
+__WEAK int rpc_answer(uint8_t method, const uint8_t *arg, int arg_len, struct msg_telemetry *out, int *len)
+{
+	return RPC_NO_METHOD;
+}
+
+void on_rpc_request(const struct msg_rpc_request *m, int len)
+{
+	struct msg_rpc_reply r;
+	struct msg_telemetry t;
+	int rec_len = 0;
+
+	if (len < 2)
+	{
+		ERROR("Short RPC request, %d bytes\n", len);
+		return;
+	}
+
+	r.id = m->id;
+	r.method = m->method;
+	r.status = rpc_answer(m->method, m->arg, len - 2, &t, &rec_len);
+	if (r.status == RPC_OK && rec_len > (int)sizeof(r.rec))
+	{
+		r.status = RPC_NO_ROOM;
+	}
+
+	if (r.status != RPC_OK)
+	{
+		rec_len = 0;
+	}
+
+	memcpy(r.rec, t.rec, rec_len);
+	serial_rpc_stats.calls++;
+
+	msg_send_rpc_reply(&r, 3 + rec_len);
+}
+
+void rpc_poll(void)
+{
+}
+#else
+struct rpc_pending {
+	bool busy;
+	uint8_t id;
+	uint8_t method;
+	uint32_t sent_ms;	/* link_time_ms() */
+	uint32_t cookie;	/* the caller's, back in rpc_done() */
+} rpc_pending[RPC_PENDING];
+
+uint8_t rpc_id;
+
+/* Nobody to tell unless the firmware asks */
+__WEAK void rpc_done(uint8_t method, uint8_t status, uint32_t cookie, const uint8_t *rec, int len)
+{
+}
+
+/* RPC_OK once the request is queued, rpc_done() follows. Anything else: no call, no rpc_done() */
+int rpc_call(uint8_t method, const uint8_t *arg, int arg_len, uint32_t cookie)
+{
+	struct msg_rpc_request m;
+	struct rpc_pending *p = NULL;
+	int i;
+
+	if (arg_len < 0 || arg_len > (int)sizeof(m.arg))
+	{
+		return RPC_BAD_ARG;
+	}
+
+	for (i = 0; i < RPC_PENDING && !p; i++)
+	{
+		if (!rpc_pending[i].busy)
+		{
+			p = &rpc_pending[i];
+		}
+	}
+
+	if (!p)
+	{
+		return RPC_BUSY;
+	}
+
+	m.id = ++rpc_id;
+	m.method = method;
+	memcpy(m.arg, arg, arg_len);
+	if (msg_send_rpc_request(&m, 2 + arg_len))
+	{
+		return RPC_BUSY;
+	}
+
+	p->busy = true;
+	p->id = m.id;
+	p->method = method;
+	p->sent_ms = link_time_ms();
+	p->cookie = cookie;
+	serial_rpc_stats.calls++;
+
+	return RPC_OK;
+}
+
+void on_rpc_reply(const struct msg_rpc_reply *m, int len)
+{
+	struct rpc_pending *p;
+	int i;
+
+	if (len < 3)
+	{
+		ERROR("Short RPC reply, %d bytes\n", len);
+		return;
+	}
+
+	for (i = 0; i < RPC_PENDING; i++)
+	{
+		p = &rpc_pending[i];
+		if (p->busy && p->id == m->id)
+		{
+			/* Free first, rpc_done() may well make the next call */
+			p->busy = false;
+			rpc_done(p->method, m->status, p->cookie, m->rec, len - 3);
+			return;
+		}
+	}
+
+	serial_rpc_stats.late++;
+}
+
+/* Ends the calls that are out for longer than RPC_TIMEOUT_MS */
+void rpc_poll(void)
+{
+	struct rpc_pending *p;
+	int i;
+
+	for (i = 0; i < RPC_PENDING; i++)
+	{
+		p = &rpc_pending[i];
+		if (p->busy && link_time_ms() - p->sent_ms >= RPC_TIMEOUT_MS)
+		{
+			p->busy = false;
+			serial_rpc_stats.timeouts++;
+			rpc_done(p->method, RPC_TIMEOUT, p->cookie, NULL, 0);
+		}
+	}
+}
+#endif
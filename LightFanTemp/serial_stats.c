@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "serial_comms.h"
+
+/*
+ * Per command instrumentation, SERIAL_STATS. serial_process_next() reports
+ * every frame it ran: queue time is from the frame's END coming in
+ * (serial_ring_push(), so with RX DMA from the drain) to its handler
+ * starting, handler time is process_message() itself.
+ *
+ * The modem asks with GET_STATS, the Pico answers with one SEND_STATS per
+ * command it has seen, from serial_stats_poll() in the main loop so a dump
+ * never floods the TX queue or the link window.
+ */
+
+struct cmd_stats cmd_stats[MSG_COUNT];
+
+/* cmd_type per msg_index(), same filter */
+#define MSG_ID_EMPTY(id, name, dir)		MSG_ON_##dir(id,)
+#define MSG_ID_FIXED(id, name, dir, type)	MSG_ON_##dir(id,)
+#define MSG_ID_VAR(id, name, dir, type)		MSG_ON_##dir(id,)
+
+static const uint8_t msg_ids[MSG_COUNT] = {
+	SERIAL_MSGS(MSG_ID_EMPTY, MSG_ID_FIXED, MSG_ID_VAR)
+};
+
+static inline int stats_bucket(uint32_t us)
+{
+	int b = us ? 32 - __builtin_clz(us) : 0;
+
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+static inline void hist_add(uint16_t *hist, uint32_t us)
+{
+	uint16_t *h = &hist[stats_bucket(us)];
+
+	if (*h != 0xFFFF)
+	{
+		(*h)++;
+	}
+}
+
+void serial_stats_record(const struct serial_cmd *cmd, uint32_t queue_us, uint32_t handler_us)
+{
+	int idx = msg_index(cmd->cmd_type);
+	struct cmd_stats *s;
+
+	if (idx < 0)
+	{
+		return;
+	}
+
+	s = &cmd_stats[idx];
+	s->count++;
+	s->bytes += cmd->cmd_len;
+
+	if (queue_us > s->queue_max)
+	{
+		s->queue_max = queue_us;
+	}
+
+	if (handler_us > s->handler_max)
+	{
+		s->handler_max = handler_us;
+	}
+
+	hist_add(s->queue_hist, queue_us);
+	hist_add(s->handler_hist, handler_us);
+}
+
+void serial_stats_reset(void)
+{
+	memset(cmd_stats, 0, sizeof(cmd_stats));
+}
+
+/* Wire form of cmd_stats[idx], false if that command never came in */
+bool serial_stats_fill(int idx, struct msg_stats *m)
+{
+	const struct cmd_stats *s = &cmd_stats[idx];
+	int i;
+
+	if (!s->count)
+	{
+		return false;
+	}
+
+	memset(m, 0, sizeof(*m));
+	m->cmd_type = msg_ids[idx];
+	PUT_BE32(m->count, s->count);
+	PUT_BE32(m->bytes, s->bytes);
+	PUT_BE32(m->queue_max, s->queue_max);
+	PUT_BE32(m->handler_max, s->handler_max);
+
+	for (i = 0; i < STATS_BUCKETS; i++)
+	{
+		PUT_BE16(m->queue_hist[i], s->queue_hist[i]);
+		PUT_BE16(m->handler_hist[i], s->handler_hist[i]);
+	}
+
+	return true;
+}
+
+#ifndef ESP8266
+/* Next cmd_stats entry to send, MSG_COUNT when no dump is going */
+int stats_next = MSG_COUNT;
+bool stats_clear;
+
+void on_get_stats(const struct msg_get_stats *m)
+{
+	stats_next = 0;
+	stats_clear = m->flags & GET_STATS_RESET;
+}
+
+/* Sends what the TX side takes of a dump GET_STATS asked for */
+void serial_stats_poll(void)
+{
+	struct msg_stats m;
+	int next;
+
+	while (stats_next < MSG_COUNT)
+	{
+		if (!serial_stats_fill(stats_next, &m))
+		{
+			stats_next++;
+			continue;
+		}
+
+		for (next = stats_next + 1; next < MSG_COUNT && !cmd_stats[next].count; next++);
+
+		if (next == MSG_COUNT)
+		{
+			m.flags |= MSG_STATS_LAST;
+		}
+
+		if (msg_send_stats(&m))
+		{
+			return;
+		}
+
+		if (stats_clear)
+		{
+			memset(&cmd_stats[stats_next], 0, sizeof(cmd_stats[0]));
+		}
+		stats_next = next;
+	}
+}
+#else
+void serial_stats_poll(void)
+{
+}
+#endif
@@ -0,0 +1,36 @@
+#ifndef TUSB_CONFIG_H
+#define TUSB_CONFIG_H
+
+/*
+ * TinyUSB device setup, picked up instead of pico_stdio_usb's own since we
+ * link tinyusb_device. Two CDC interfaces: 0 is stdio, 1 is serial_comms
+ * (USB_CDC_PROTO in main.cpp), see usb_descriptors.c.
+ */
+
+#ifndef CFG_TUSB_MCU
+#define CFG_TUSB_MCU		OPT_MCU_RP2040
+#endif
+
+#define CFG_TUSB_RHPORT0_MODE	(OPT_MODE_DEVICE | OPT_MODE_FULL_SPEED)
+
+#ifndef CFG_TUSB_OS
+#define CFG_TUSB_OS		OPT_OS_PICO
+#endif
+
+#define CFG_TUSB_MEM_SECTION
+#define CFG_TUSB_MEM_ALIGN	__attribute__((aligned(4)))
+
+#define CFG_TUD_ENDPOINT0_SIZE	64
+
+#define CFG_TUD_CDC		2
+#define CFG_TUD_MSC		0
+#define CFG_TUD_HID		0
+#define CFG_TUD_MIDI		0
+#define CFG_TUD_VENDOR		0
+
+/* TX holds a worst case escaped frame (TX_FRAME_MAX), usb_tx_write() never splits one */
+#define CFG_TUD_CDC_RX_BUFSIZE	1024
+#define CFG_TUD_CDC_TX_BUFSIZE	2048
+#define CFG_TUD_CDC_EP_BUFSIZE	64
+
+#endif /* TUSB_CONFIG_H */
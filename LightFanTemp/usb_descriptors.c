@@ -0,0 +1,125 @@
+#include "tusb.h"
+#include "pico/unique_id.h"
+
+/*
+ * Composite device, two CDC ACM interfaces: stdio on the first, the
+ * serial_comms protocol on the second. Linux gives them /dev/ttyACM0 and
+ * /dev/ttyACM1 in that order.
+ */
+
+#define USB_VID		0x2E8A	/* Raspberry Pi */
+#define USB_PID		0x000A	/* Pico SDK CDC */
+#define USB_BCD		0x0200
+
+enum {
+	ITF_NUM_CDC_STDIO,
+	ITF_NUM_CDC_STDIO_DATA,
+	ITF_NUM_CDC_PROTO,
+	ITF_NUM_CDC_PROTO_DATA,
+	ITF_NUM_TOTAL
+};
+
+#define EPNUM_CDC_STDIO_NOTIF	0x81
+#define EPNUM_CDC_STDIO_OUT	0x02
+#define EPNUM_CDC_STDIO_IN	0x82
+#define EPNUM_CDC_PROTO_NOTIF	0x83
+#define EPNUM_CDC_PROTO_OUT	0x04
+#define EPNUM_CDC_PROTO_IN	0x84
+
+#define USB_CONFIG_TOTAL_LEN	(TUD_CONFIG_DESC_LEN + CFG_TUD_CDC * TUD_CDC_DESC_LEN)
+
+enum {
+	STRID_LANGID,
+	STRID_MANUFACTURER,
+	STRID_PRODUCT,
+	STRID_SERIAL,
+	STRID_CDC_STDIO,
+	STRID_CDC_PROTO,
+};
+
+static const tusb_desc_device_t desc_device = {
+	.bLength		= sizeof(tusb_desc_device_t),
+	.bDescriptorType	= TUSB_DESC_DEVICE,
+	.bcdUSB			= USB_BCD,
+	/* IAD, one function per CDC */
+	.bDeviceClass		= TUSB_CLASS_MISC,
+	.bDeviceSubClass	= MISC_SUBCLASS_COMMON,
+	.bDeviceProtocol	= MISC_PROTOCOL_IAD,
+	.bMaxPacketSize0	= CFG_TUD_ENDPOINT0_SIZE,
+	.idVendor		= USB_VID,
+	.idProduct		= USB_PID,
+	.bcdDevice		= 0x0100,
+	.iManufacturer		= STRID_MANUFACTURER,
+	.iProduct		= STRID_PRODUCT,
+	.iSerialNumber		= STRID_SERIAL,
+	.bNumConfigurations	= 1,
+};
+
+static const uint8_t desc_config[USB_CONFIG_TOTAL_LEN] = {
+	TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, USB_CONFIG_TOTAL_LEN, 0, 250),
+	TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_STDIO, STRID_CDC_STDIO, EPNUM_CDC_STDIO_NOTIF, 8,
+		EPNUM_CDC_STDIO_OUT, EPNUM_CDC_STDIO_IN, 64),
+	TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_PROTO, STRID_CDC_PROTO, EPNUM_CDC_PROTO_NOTIF, 8,
+		EPNUM_CDC_PROTO_OUT, EPNUM_CDC_PROTO_IN, 64),
+};
+
+static const char *const desc_strings[] = {
+	[STRID_MANUFACTURER]	= "ESProjects",
+	[STRID_PRODUCT]		= "LightFanTemp",
+	[STRID_CDC_STDIO]	= "LightFanTemp stdio",
+	[STRID_CDC_PROTO]	= "LightFanTemp serial_comms",
+};
+
+const uint8_t *tud_descriptor_device_cb(void)
+{
+	return (const uint8_t *)&desc_device;
+}
+
+const uint8_t *tud_descriptor_configuration_cb(uint8_t index)
+{
+	(void)index;
+
+	return desc_config;
+}
+
+/* UTF-16 string descriptors, built on demand. The serial is the flash unique id */
+const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+	static uint16_t desc[1 + 32];
+	char serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+	const char *str;
+	int len;
+
+	(void)langid;
+
+	if (index == STRID_LANGID)
+	{
+		desc[1] = 0x0409;	/* English */
+		len = 1;
+	}
+	else
+	{
+		if (index == STRID_SERIAL)
+		{
+			pico_get_unique_board_id_string(serial, sizeof(serial));
+			str = serial;
+		}
+		else if (index < sizeof(desc_strings) / sizeof(desc_strings[0]) && desc_strings[index])
+		{
+			str = desc_strings[index];
+		}
+		else
+		{
+			return NULL;
+		}
+
+		for (len = 0; str[len] && len < 32; len++)
+		{
+			desc[1 + len] = str[len];
+		}
+	}
+
+	desc[0] = (TUSB_DESC_STRING << 8) | (2 * len + 2);
+
+	return desc;
+}